@@ -0,0 +1,206 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+/*
+  Measures block allocation with many writers at once.
+
+  usage: alloc_bench [-d /path/to/scratch/dir] [-n ops] [-w max_writers]
+                     [-g groups] [-c]
+
+  For 1, 2, 4 ... max_writers processes, each one allocates and frees
+  -n times, keeping up to 64 allocations live. Most are single blocks;
+  the rest are 2 to 64 blocks. Each count of writers is run twice on
+  fresh scratch files: with every allocation in one group, as with a
+  single lock, and spread over -g groups. The log is off and the bitmap
+  is synced in the background, so only the allocator is measured.
+
+  -c has every writer check that no block it gets is held by anyone
+  else.
+*/
+
+#include "emma.h"
+#include <sys/wait.h>
+
+#define LIVE 64 // Allocations each writer keeps at once.
+
+static int* OWNERS; // Who holds each block, with -c.
+static int64_t OWNER_BLOCKS;
+
+static void scratch(const char* db_file, const char* block_bitmap_file, int groups) {
+  if (DB_FD > 0) close(DB_FD);
+  if (SHM_BLOCK_BITMAP != NULL) munmap(SHM_BLOCK_BITMAP, BLOCK_BITMAP_BYTES);
+  if (SHM_EXTENTS != NULL) munmap(SHM_EXTENTS, sizeof(struct extent_index) + EXTENT_CAPACITY * sizeof(struct extent));
+  if (BLOCK_BITMAP_FD > 0) close(BLOCK_BITMAP_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+
+  if ((BLOCK_BITMAP_FD = open(block_bitmap_file, O_RDWR | O_CREAT, 0666)) == -1 ||
+      ftruncate(BLOCK_BITMAP_FD, BLOCK_BITMAP_BYTES) == -1 ||
+      (DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
+    perror("Couldn't create the scratch files");
+    exit(-1);
+  }
+  if ((SHM_BLOCK_BITMAP = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, BLOCK_BITMAP_FD, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the block bitmap");
+    exit(-1);
+  }
+  if (extent_init(EXTENT_CAPACITY, ALLOC_BEST_FIT) == -1) exit(-1);
+  SHM_EXTENTS->groups = groups;
+}
+
+static int64_t used_blocks(void) {
+  int64_t used = 0, i;
+
+  for (i = 0; i < BLOCK_BITMAP_BYTES; i++)
+    if (SHM_BLOCK_BITMAP[i] != 0) used += __builtin_popcount((unsigned char)SHM_BLOCK_BITMAP[i]);
+  return used;
+}
+
+// Marks blocks as ours, or gives them up. Returns -1 if someone else
+// already has one of them.
+static int own(int offset, int blocks, int from, int to) {
+  int64_t i;
+
+  for (i = offset; i < offset + blocks && i < OWNER_BLOCKS; i++) {
+    int expected = from;
+    if (!__atomic_compare_exchange_n(&OWNERS[i], &expected, to, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      fprintf(stderr, "Writer %d found block %lld held by %d.\n", to ? to : from, (long long)i, expected);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int writer(int id, int64_t ops) {
+  struct block_ptr live[LIVE];
+  int64_t i;
+  int slot, blocks, bad = 0;
+
+  memset(live, '\0', sizeof(live));
+  srandom(id);
+  for (i = 0; i < ops; i++) {
+    slot = i % LIVE;
+    if (live[slot].blocks > 0) {
+      if (OWNERS != NULL && own(live[slot].block_offset, live[slot].blocks, id, 0) == -1) bad = 1;
+      release_block_reservation(live[slot].block_offset, live[slot].blocks);
+      live[slot].blocks = 0;
+    }
+    blocks = (random() % 4 == 0) ? 2 + random() % 63 : 1;
+    if ((live[slot].block_offset = create_block_reservation(blocks)) == -1) {
+      fprintf(stderr, "Writer %d couldn't allocate %d blocks.\n", id, blocks);
+      return -1;
+    }
+    live[slot].blocks = blocks;
+    if (OWNERS != NULL && own(live[slot].block_offset, blocks, 0, id) == -1) bad = 1;
+  }
+  for (slot = 0; slot < LIVE; slot++) {
+    if (live[slot].blocks == 0) continue;
+    if (OWNERS != NULL && own(live[slot].block_offset, live[slot].blocks, id, 0) == -1) bad = 1;
+    release_block_reservation(live[slot].block_offset, live[slot].blocks);
+  }
+  return bad ? -1 : 0;
+}
+
+// Runs writers at once and returns allocations and frees per second.
+static double run(int writers, int64_t ops) {
+  struct timespec start, end;
+  int i, status, failed = 0;
+  pid_t pid;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 1; i <= writers; i++) {
+    if ((pid = fork()) == -1) {
+      perror("fork failed");
+      exit(-1);
+    }
+    if (pid == 0) exit(writer(i, ops) == -1 ? 1 : 0);
+  }
+  for (i = 0; i < writers; i++) {
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (failed || used_blocks() != 0) {
+    fprintf(stderr, "%d writers left the bitmap wrong (%lld blocks still set).\n", writers, (long long)used_blocks());
+    exit(-1);
+  }
+  return 2.0 * writers * ops / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char* argv[]) {
+
+  char* dir = "/tmp";
+  char db_file[4096];
+  char block_bitmap_file[4096];
+  int64_t ops = 100000;
+  int ch, writers, max_writers = 64, groups = ALLOC_GROUPS, check = 0;
+  double one, many;
+
+  while ((ch = getopt(argc, argv, "d:n:w:g:c")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 'n': ops = atoll(optarg); break;
+      case 'w': max_writers = atoi(optarg); break;
+      case 'g': groups = atoi(optarg); break;
+      case 'c': check = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-d scratch_dir] [-n ops] [-w max_writers] [-g groups] [-c]\n", argv[0]);
+        exit(-1);
+    }
+  }
+  if (ops < 1 || max_writers < 1 || groups < 1 || groups > ALLOC_GROUPS) {
+    fprintf(stderr, "Nothing to measure.\n");
+    exit(-1);
+  }
+
+  snprintf(db_file, sizeof(db_file), "%s/bench_db", dir);
+  snprintf(block_bitmap_file, sizeof(block_bitmap_file), "%s/bench_block_bitmap", dir);
+  WAL_FD = -1; // Measure the allocator, not the log.
+  if (bitmap_sync_init(SYNC_ASYNC, 1000) == -1) exit(-1);
+
+  if (check) {
+    OWNER_BLOCKS = (int64_t)groups * ALLOC_GROUP_BLOCKS;
+    if ((OWNERS = mmap((caddr_t)0, OWNER_BLOCKS * sizeof(int), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANON | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+      perror("Problem mmapping the owner table");
+      exit(-1);
+    }
+  }
+
+  printf("%lld allocations and frees per writer, %d groups, %d online cpus%s\n", (long long)ops * 2, groups,
+         (int)sysconf(_SC_NPROCESSORS_ONLN), check ? ", checking ownership" : "");
+  printf("%8s %16s %16s %8s\n", "writers", "1 group ops/s", "groups ops/s", "speedup");
+  fflush(stdout);
+  for (writers = 1; writers <= max_writers; writers *= 2) {
+    scratch(db_file, block_bitmap_file, 1);
+    one = run(writers, ops);
+    scratch(db_file, block_bitmap_file, groups);
+    many = run(writers, ops);
+    printf("%8d %16.0f %16.0f %7.2fx\n", writers, one, many, many / one);
+    fflush(stdout);
+  }
+
+  close(DB_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+  return(0);
+}
@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Measures point lookup latency in the on-disk index.
+
+  usage: btree_bench [-d /path/to/scratch/dir] [-n keys] [-l lookups]
+                     [-m pool_mb[:resident_levels]]
+
+  Keys are inserted in a scrambled order pointing at dummy block
+  pointers, so only index nodes are written to the db file. Try
+  -n 1000000, -n 10000000 and -n 100000000 to see how lookups scale.
+  -m sizes the buffer pool as the server's -m does; -m 0 reads every
+  page from the db file.
+*/
+
+#include "emma.h"
+#include <time.h>
+
+static double now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+
+  char* dir = "/tmp";
+  char db_file[4096];
+  char block_bitmap_file[4096];
+  int64_t keys = 1000000, lookups = 100000, i, n;
+  char key[KEY_LEN];
+  struct block_ptr ptr, old;
+  double start, elapsed, *latency;
+  int ch, pool_mb = POOL_MB, resident_levels = 0;
+
+  while ((ch = getopt(argc, argv, "d:n:l:m:")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 'n': keys = atoll(optarg); break;
+      case 'l': lookups = atoll(optarg); break;
+      case 'm':
+        pool_mb = atoi(optarg);
+        resident_levels = (strchr(optarg, ':') != NULL) ? atoi(strchr(optarg, ':') + 1) : 0;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-d scratch_dir] [-n keys] [-l lookups] [-m pool_mb[:resident_levels]]\n", argv[0]);
+        exit(-1);
+    }
+  }
+
+  snprintf(db_file, sizeof(db_file), "%s/bench_db", dir);
+  snprintf(block_bitmap_file, sizeof(block_bitmap_file), "%s/bench_block_bitmap", dir);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+
+  sem_unlink("bench_index_lock");
+  if ((INDEX_LOCK = sem_open("bench_index_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    exit(-1);
+  }
+
+  if ((BLOCK_BITMAP_FD = open(block_bitmap_file, O_RDWR | O_CREAT, 0666)) == -1 ||
+      ftruncate(BLOCK_BITMAP_FD, BLOCK_BITMAP_BYTES) == -1 ||
+      (DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
+    perror("Couldn't create the scratch files");
+    exit(-1);
+  }
+  if ((SHM_BLOCK_BITMAP = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, BLOCK_BITMAP_FD, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the block bitmap");
+    exit(-1);
+  }
+  WAL_FD = -1; // Measure the index, not the log.
+  if (extent_init(EXTENT_CAPACITY, ALLOC_BEST_FIT) == -1 ||
+      bitmap_sync_init(SYNC_PER_OP, 0) == -1 ||
+      pool_init((int64_t)pool_mb * 1024 * 1024, resident_levels) == -1 ||
+      btree_open() == -1) exit(-1);
+
+  // Walk the keyspace with a stride that is coprime to it so the
+  // inserts land all over the tree.
+  start = now_usec();
+  for (i = 0; i < keys; i++) {
+    n = (i * 2654435761LL) % keys;
+    sprintf(key, "key%012lld", (long long)n);
+    ptr.block_offset = n;
+    ptr.blocks = 1;
+    if (btree_insert(key, ptr, &old) == -1) {
+      fprintf(stderr, "Insert %lld failed.\n", (long long)i);
+      exit(-1);
+    }
+  }
+  elapsed = now_usec() - start;
+  printf("keys:           %lld\n", (long long)keys);
+  printf("insert:         %.2f usec/key\n", elapsed / keys);
+
+  if ((latency = malloc(sizeof(double) * lookups)) == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+
+  srandom(42);
+  for (i = 0; i < lookups; i++) {
+    n = random() % keys;
+    sprintf(key, "key%012lld", (long long)n);
+    start = now_usec();
+    if (btree_find(key, &ptr) != 0 || ptr.block_offset != n) {
+      fprintf(stderr, "Lookup of %s failed.\n", key);
+      exit(-1);
+    }
+    latency[i] = now_usec() - start;
+  }
+
+  qsort(latency, lookups, sizeof(double), cmp_double);
+  for (elapsed = 0, i = 0; i < lookups; i++) elapsed += latency[i];
+  printf("lookups:        %lld\n", (long long)lookups);
+  printf("lookup mean:    %.2f usec\n", elapsed / lookups);
+  printf("lookup p50:     %.2f usec\n", latency[lookups / 2]);
+  printf("lookup p99:     %.2f usec\n", latency[lookups * 99 / 100]);
+  printf("lookup max:     %.2f usec\n", latency[lookups - 1]);
+  printf("db file:        %lld bytes\n", (long long)lseek(DB_FD, 0, SEEK_END));
+  pool_report();
+
+  free(latency);
+  close(DB_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+  sem_unlink("bench_index_lock");
+  return(0);
+}
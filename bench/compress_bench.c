@@ -0,0 +1,267 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Measures the value codec, and what it does to inserts and finds.
+
+  usage: compress_bench [-d /path/to/scratch/dir] [-n values] [-s bytes]
+                        [-b batch]
+
+  First lz_compress() and lz_decompress() are timed on their own over
+  JSON-like records, plain text and random bytes. Then, for each kind
+  of data, values are stored with write_values() and read back with
+  read_values(), a batch at a time as mput and mget do, with -z off and
+  with -z lz, on fresh scratch files. Throughput is in MB of values per
+  second, and the blocks column is what they took up in the db file.
+*/
+
+#include "emma.h"
+
+#define DATA_JSON 0
+#define DATA_TEXT 1
+#define DATA_RANDOM 2
+
+static const char* DATA_NAMES[] = {"json", "text", "random"};
+
+static const char* WORDS[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+                              "hotel", "india", "juliet", "kilo", "lima", "mike", "november"};
+#define WORD_COUNT ((int)(sizeof(WORDS) / sizeof(WORDS[0])))
+
+static double now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Fills len bytes at buffer with one kind of data.
+static void fill(char* buffer, uint32_t len, int kind) {
+  char record[512];
+  uint32_t i = 0;
+  int n;
+
+  while (i < len) {
+    switch (kind) {
+      case DATA_JSON:
+        n = snprintf(record, sizeof(record),
+                     "{\"id\":%ld,\"name\":\"%s_%ld\",\"email\":\"%s%ld@example.com\",\"active\":%s,"
+                     "\"tags\":[\"%s\",\"%s\"],\"score\":%ld.%02ld,\"created\":\"2019-%02ld-%02ldT%02ld:%02ld:00Z\"},",
+                     random() % 100000, WORDS[random() % WORD_COUNT], random() % 1000,
+                     WORDS[random() % WORD_COUNT], random() % 1000, random() % 2 ? "true" : "false",
+                     WORDS[random() % WORD_COUNT], WORDS[random() % WORD_COUNT], random() % 100, random() % 100,
+                     1 + random() % 12, 1 + random() % 28, random() % 24, random() % 60);
+        break;
+
+      case DATA_TEXT:
+        n = snprintf(record, sizeof(record), "%s ", WORDS[random() % WORD_COUNT]);
+        break;
+
+      default:
+        for (n = 0; n < (int)sizeof(record); n++) record[n] = random();
+    }
+    if (n > (int)(len - i)) n = len - i;
+    memcpy(buffer + i, record, n);
+    i += n;
+  }
+}
+
+static void scratch(const char* db_file, const char* block_bitmap_file) {
+  if (DB_FD > 0) close(DB_FD);
+  if (SHM_BLOCK_BITMAP != NULL) munmap(SHM_BLOCK_BITMAP, BLOCK_BITMAP_BYTES);
+  if (BLOCK_BITMAP_FD > 0) close(BLOCK_BITMAP_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+
+  if ((BLOCK_BITMAP_FD = open(block_bitmap_file, O_RDWR | O_CREAT, 0666)) == -1 ||
+      ftruncate(BLOCK_BITMAP_FD, BLOCK_BITMAP_BYTES) == -1 ||
+      (DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
+    perror("Couldn't create the scratch files");
+    exit(-1);
+  }
+  if ((SHM_BLOCK_BITMAP = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, BLOCK_BITMAP_FD, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the block bitmap");
+    exit(-1);
+  }
+  if (extent_init(EXTENT_CAPACITY, ALLOC_BEST_FIT) == -1 || bitmap_sync_init(SYNC_ASYNC, 1000) == -1) exit(-1);
+
+  // Forget the slab pages of the last file.
+  if (SHM_SLABS != NULL) munmap(SHM_SLABS, sizeof(struct slab_state));
+  if (slab_init() == -1) exit(-1);
+}
+
+static int64_t used_blocks(void) {
+  int64_t used = 0, i;
+
+  for (i = 0; i < BLOCK_BITMAP_BYTES; i++)
+    if (SHM_BLOCK_BITMAP[i] != 0) used += __builtin_popcount((unsigned char)SHM_BLOCK_BITMAP[i]);
+  return used;
+}
+
+// Times the codec by itself on len bytes of each kind of data.
+static void codec(uint32_t len, int64_t rounds) {
+  char *src, *packed, *out;
+  uint32_t packed_len = 0;
+  double start, compress_usec, decompress_usec;
+  int64_t i;
+  int kind;
+
+  src = malloc(len);
+  packed = malloc(len + len / 64 + 16);
+  out = malloc(len);
+  if (src == NULL || packed == NULL || out == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+
+  printf("%-8s %10s %14s %16s\n", "data", "ratio", "compress MB/s", "decompress MB/s");
+  for (kind = DATA_JSON; kind <= DATA_RANDOM; kind++) {
+    fill(src, len, kind);
+
+    start = now_usec();
+    for (i = 0; i < rounds; i++) packed_len = lz_compress(src, len, packed, len + len / 64 + 16);
+    compress_usec = now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < rounds; i++) {
+      if (lz_decompress(packed, packed_len, out, len) == -1 || memcmp(src, out, len) != 0) {
+        fprintf(stderr, "Round trip failed on %s data.\n", DATA_NAMES[kind]);
+        exit(-1);
+      }
+    }
+    decompress_usec = now_usec() - start;
+
+    printf("%-8s %9.2fx %14.0f %16.0f\n", DATA_NAMES[kind], (double)len / packed_len,
+           (double)len * rounds / compress_usec, (double)len * rounds / decompress_usec);
+  }
+  printf("\n");
+
+  free(src);
+  free(packed);
+  free(out);
+}
+
+// Stores values of len bytes and reads them back, with compression on
+// or off.
+static void run(int kind, int compress, int64_t values, uint32_t len, int batch) {
+  struct block_ptr* ptrs;
+  char** buffers;
+  char** read_back;
+  uint32_t* lens;
+  double start, insert_usec = 0, find_usec = 0;
+  int64_t i, j, n;
+
+  ptrs = malloc(sizeof(struct block_ptr) * values);
+  buffers = malloc(sizeof(char*) * batch);
+  read_back = malloc(sizeof(char*) * batch);
+  lens = malloc(sizeof(uint32_t) * batch);
+  if (ptrs == NULL || buffers == NULL || read_back == NULL || lens == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+
+  COMPRESS_VALUES = compress;
+  srandom(42);
+  for (i = 0; i < values; i += n) {
+    n = (values - i < batch) ? values - i : batch;
+    for (j = 0; j < n; j++) {
+      if ((buffers[j] = new_value_buffer(len)) == NULL) exit(-1);
+      fill(VALUE_DATA(buffers[j]), len, kind);
+    }
+    start = now_usec();
+    if (write_values(buffers, ptrs + i, n) == -1) {
+      fprintf(stderr, "Storing values failed.\n");
+      exit(-1);
+    }
+    insert_usec += now_usec() - start;
+    for (j = 0; j < n; j++) free(buffers[j]);
+  }
+
+  for (i = 0; i < values; i += n) {
+    n = (values - i < batch) ? values - i : batch;
+    start = now_usec();
+    if (read_values(ptrs + i, read_back, lens, n) == -1) {
+      fprintf(stderr, "Reading values failed.\n");
+      exit(-1);
+    }
+    find_usec += now_usec() - start;
+    for (j = 0; j < n; j++) {
+      if (lens[j] != len) {
+        fprintf(stderr, "Read back %u bytes, not %u.\n", lens[j], len);
+        exit(-1);
+      }
+      free(read_back[j]);
+    }
+  }
+
+  printf("%-8s %-5s %12.0f %12.0f %10lld\n", DATA_NAMES[kind], compress ? "lz" : "off",
+         (double)len * values / insert_usec, (double)len * values / find_usec, (long long)used_blocks());
+
+  free(ptrs);
+  free(buffers);
+  free(read_back);
+  free(lens);
+}
+
+int main(int argc, char* argv[]) {
+
+  char* dir = "/tmp";
+  char db_file[4096];
+  char block_bitmap_file[4096];
+  int64_t values = 20000;
+  int ch, len = 4096, batch = 64, kind, compress;
+
+  while ((ch = getopt(argc, argv, "d:n:s:b:")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 'n': values = atoll(optarg); break;
+      case 's': len = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d scratch_dir] [-n values] [-s bytes] [-b batch]\n", argv[0]);
+        exit(-1);
+    }
+  }
+  if (values < 1 || batch < 1 || len < 1 || len > MAX_VALUE_LEN) {
+    fprintf(stderr, "Nothing to measure.\n");
+    exit(-1);
+  }
+
+  snprintf(db_file, sizeof(db_file), "%s/bench_db", dir);
+  snprintf(block_bitmap_file, sizeof(block_bitmap_file), "%s/bench_block_bitmap", dir);
+  WAL_FD = -1; // Measure the values, not the log.
+
+  printf("codec, %d byte buffers\n", len);
+  codec(len, (64LL * 1024 * 1024) / len + 1);
+
+  printf("%lld values of %d bytes, %d at a time\n", (long long)values, len, batch);
+  printf("%-8s %-5s %12s %12s %10s\n", "data", "-z", "insert MB/s", "find MB/s", "blocks");
+  for (kind = DATA_JSON; kind <= DATA_RANDOM; kind++) {
+    for (compress = 0; compress <= 1; compress++) {
+      scratch(db_file, block_bitmap_file);
+      run(kind, compress, values, len, batch);
+    }
+  }
+
+  close(DB_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+  return(0);
+}
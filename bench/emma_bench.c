@@ -0,0 +1,442 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Load generator for a running server, with the kind of skew real
+  clients have.
+
+  usage: emma_bench [-h host] [-p port] [-c connections] [-t seconds]
+                    [-n ops] [-k keys] [-z theta] [-r read_percent]
+                    [-s bytes[-bytes]] [-P depth] [-b] [-N]
+
+  Each of -c connections has a thread of its own that keeps -P commands
+  in flight: as each answer comes back, the next command goes out. A
+  command is a find with -r percent odds, else an insert. Keys are
+  picked from -k of them, uniformly with -z 0 or else Zipfian with
+  skew theta (0.99, as YCSB uses, unless told otherwise), with the hot
+  keys scattered over the keyspace. Values are -s bytes, or uniformly
+  anywhere from the first number to the second. -b speaks the binary
+  protocol instead of text.
+
+  Every key is inserted once before the clock starts, so finds find
+  something, unless -N says not to. Then the load runs for -t seconds,
+  or until each connection has sent -n commands.
+
+  A command's latency runs from when it's queued to be sent to when its
+  answer has arrived, so it includes the time spent behind the commands
+  ahead of it. Throughput and latency are printed as "name: value unit"
+  lines, which make bench_compare picks up.
+*/
+
+#include "emma.h"
+#include <time.h>
+
+#define FIND 0
+#define INSERT 1
+
+struct worker {
+  int       id;
+  uint64_t  rng;
+  int64_t   next_key;        // While loading, the next key to insert...
+  int64_t   end_key;         // ...up to this one.
+  int       loading;
+  int64_t   issued;
+  int64_t   ops;
+  int64_t   errors;
+  int64_t   misses;          // Finds of keys that weren't there.
+  double*   latency;         // usec, for each command answered...
+  char*     kinds;           // ...and whether it was a FIND or an INSERT.
+  int64_t   size;
+  int       failed;
+};
+
+static char*   HOST = "127.0.0.1";
+static char*   PORT = "4080";
+static int     DEPTH = 1;
+static int     BINARY = 0;
+static int64_t KEYS = 100000;
+static double  THETA = 0.99;
+static int     READ_PCT = 90;
+static int     MIN_SIZE = 100;
+static int     MAX_SIZE = 100;
+static int64_t OPS = 0;        // Commands each connection sends, or 0 to go by time.
+static double  DEADLINE;       // When to stop sending, in usec.
+static char*   VALUE;          // MAX_SIZE bytes that go into every value.
+
+static double ZETAN, ZETA2, ALPHA, ETA; // For drawing Zipfian ranks.
+
+static double now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t next_random(struct worker* w) {
+  w->rng ^= w->rng >> 12;
+  w->rng ^= w->rng << 25;
+  w->rng ^= w->rng >> 27;
+  return w->rng * 2685821657736338717ULL;
+}
+
+static double next_uniform(struct worker* w) {
+  return (next_random(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Gray et al., "Quickly Generating Billion-Record Synthetic Databases".
+static void zipf_init(void) {
+  int64_t i;
+
+  for (ZETAN = 0, i = 1; i <= KEYS; i++) ZETAN += 1 / pow(i, THETA);
+  ZETA2 = 1 + 1 / pow(2, THETA);
+  ALPHA = 1 / (1 - THETA);
+  ETA = (1 - pow(2.0 / KEYS, 1 - THETA)) / (1 - ZETA2 / ZETAN);
+}
+
+static int64_t pick_key(struct worker* w) {
+  double u, uz;
+  uint64_t rank, h = 14695981039346656037ULL;
+  int i;
+
+  if (THETA == 0) return next_random(w) % KEYS;
+
+  u = next_uniform(w);
+  uz = u * ZETAN;
+  if (uz < 1) rank = 0;
+  else if (uz < ZETA2) rank = 1;
+  else rank = (uint64_t)(KEYS * pow(ETA * u - ETA + 1, ALPHA));
+
+  // Scatter the hot ranks with FNV-1a, so they aren't all neighbours.
+  for (i = 0; i < 8; i++, rank >>= 8) h = (h ^ (rank & 0xff)) * 1099511628211ULL;
+  return h % KEYS;
+}
+
+// Appends a command to out. Returns its length.
+static int make_command(char* out, int kind, int64_t key, int size) {
+  struct bin_request req;
+  char key_text[32];
+  int key_len = sprintf(key_text, "key:%012lld", (long long)key);
+
+  if (!BINARY) {
+    if (kind == FIND) return sprintf(out, "find %s\n", key_text);
+    key_len = sprintf(out, "insert %s ", key_text);
+    memcpy(out + key_len, VALUE, size);
+    out[key_len + size] = '\n';
+    return key_len + size + 1;
+  }
+
+  req.magic = BIN_REQUEST_MAGIC;
+  req.opcode = (kind == FIND) ? BIN_FIND : BIN_INSERT;
+  req.key_len = htole16(key_len);
+  req.value_len = htole32(kind == FIND ? 0 : size);
+  req.request_id = 0;
+  memcpy(out, &req, sizeof(req));
+  memcpy(out + sizeof(req), key_text, key_len);
+  if (kind == FIND) return sizeof(req) + key_len;
+  memcpy(out + sizeof(req) + key_len, VALUE, size);
+  return sizeof(req) + key_len + size;
+}
+
+// Takes one whole response off the front of buf. Returns the bytes it
+// used, or 0 if it hasn't all arrived, and sets ok.
+static int take_response(const char* buf, int len, int* ok) {
+  struct bin_response header;
+  const char* end;
+  int size;
+
+  if (BINARY) {
+    if (len < (int)sizeof(header)) return 0;
+    memcpy(&header, buf, sizeof(header));
+    size = sizeof(header) + le32toh(header.value_len);
+    *ok = (header.status == 0);
+    return len >= size ? size : 0;
+  }
+
+  // STATUS: ...\nSIZE: n\n followed by n bytes and \n\n.
+  if ((end = memchr(buf, '\n', len)) == NULL ||
+      (end = memchr(end + 1, '\n', len - (end + 1 - buf))) == NULL) return 0;
+  size = end + 1 - buf + atoi(strstr(buf, "SIZE: ") + 6) + 2;
+  *ok = (strncmp(buf, "STATUS: OK", 10) == 0);
+  return len >= size ? size : 0;
+}
+
+static int more_to_send(struct worker* w) {
+  if (w->loading) return w->next_key < w->end_key;
+  if (OPS > 0) return w->issued < OPS;
+  return now_usec() < DEADLINE;
+}
+
+static void record(struct worker* w, int kind, double latency) {
+  double* tmp_latency;
+  char* tmp_kinds;
+
+  if (w->ops == w->size) {
+    w->size = w->size ? w->size * 2 : 65536;
+    tmp_latency = realloc(w->latency, sizeof(double) * w->size);
+    tmp_kinds = realloc(w->kinds, w->size);
+    if (tmp_latency == NULL || tmp_kinds == NULL) {
+      perror("realloc failed in record()");
+      exit(-1);
+    }
+    w->latency = tmp_latency;
+    w->kinds = tmp_kinds;
+  }
+  w->latency[w->ops] = latency;
+  w->kinds[w->ops++] = kind;
+}
+
+// Runs one connection's share of the load, keeping DEPTH commands in
+// flight. Sends and receives go on side by side, so a deep pipeline of
+// big values can't leave us and the server both waiting to send.
+static void* run_worker(void* arg) {
+  struct worker* w = arg;
+  struct pollfd pfd;
+  double* sent_at;
+  char *kinds, *out, *in;
+  int out_len = 0, out_sent = 0, in_len = 0, in_size, out_size, head = 0, inflight = 0;
+  int n, used, ok, kind, size;
+  int64_t key;
+
+  out_size = DEPTH * (MAX_SIZE + KEY_LEN + 64);
+  in_size = 2 * MAX_SIZE + 65536;
+  sent_at = malloc(sizeof(double) * DEPTH);
+  kinds = malloc(DEPTH);
+  out = malloc(out_size);
+  in = malloc(in_size);
+  if (sent_at == NULL || kinds == NULL || out == NULL || in == NULL) {
+    perror("malloc failed in run_worker()");
+    exit(-1);
+  }
+  if ((pfd.fd = connect_to(HOST, PORT)) == -1) {
+    w->failed = 1;
+    return NULL;
+  }
+
+  while (1) {
+    while (inflight < DEPTH && more_to_send(w)) {
+      if (w->loading) {
+        kind = INSERT;
+        key = w->next_key++;
+      } else {
+        kind = ((int)(next_random(w) % 100) < READ_PCT) ? FIND : INSERT;
+        key = pick_key(w);
+      }
+      size = MIN_SIZE + (MAX_SIZE > MIN_SIZE ? next_random(w) % (MAX_SIZE - MIN_SIZE + 1) : 0);
+      if (out_sent == out_len) out_sent = out_len = 0;
+      out_len += make_command(out + out_len, kind, key, size);
+      sent_at[(head + inflight) % DEPTH] = now_usec();
+      kinds[(head + inflight++) % DEPTH] = kind;
+      w->issued++;
+    }
+    if (inflight == 0) break;
+
+    pfd.events = POLLIN | (out_sent < out_len ? POLLOUT : 0);
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("poll failed");
+      break;
+    }
+
+    if (out_sent < out_len && (n = send(pfd.fd, out + out_sent, out_len - out_sent, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+      out_sent += n;
+    else if (out_sent < out_len && n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      break;
+
+    if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+    if ((n = recv(pfd.fd, in + in_len, in_size - in_len, MSG_DONTWAIT)) == 0) break;
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+      break;
+    }
+    in_len += n;
+
+    for (used = 0; inflight > 0 && (n = take_response(in + used, in_len - used, &ok)) > 0; used += n) {
+      if (!ok && kinds[head] == FIND) w->misses++;
+      else if (!ok) w->errors++;
+      if (w->loading) w->ops++;
+      else record(w, kinds[head], now_usec() - sent_at[head]);
+      head = (head + 1) % DEPTH;
+      inflight--;
+    }
+    memmove(in, in + used, in_len - used);
+    in_len -= used;
+  }
+
+  if (inflight > 0) {
+    fprintf(stderr, "Connection %d lost %d commands in flight.\n", w->id, inflight);
+    w->failed = 1;
+  }
+  close(pfd.fd);
+  free(sent_at);
+  free(kinds);
+  free(out);
+  free(in);
+  return NULL;
+}
+
+static double run_workers(struct worker* workers, int count) {
+  pthread_t* threads;
+  double start;
+  int i;
+
+  if ((threads = calloc(count, sizeof(pthread_t))) == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+  start = now_usec();
+  for (i = 0; i < count; i++) pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+  for (i = 0; i < count; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  return (now_usec() - start) / 1e6;
+}
+
+static void print_percentiles(const char* name, double* latency, int64_t count) {
+  if (count == 0) return;
+  qsort(latency, count, sizeof(double), cmp_double);
+  printf("%s p50:%*s%.1f usec\n", name, (int)(10 - strlen(name)), "", latency[count / 2]);
+  printf("%s p99:%*s%.1f usec\n", name, (int)(10 - strlen(name)), "", latency[count * 99 / 100]);
+  printf("%s p999:%*s%.1f usec\n", name, (int)(9 - strlen(name)), "", latency[count * 999 / 1000]);
+  printf("%s max:%*s%.1f usec\n", name, (int)(10 - strlen(name)), "", latency[count - 1]);
+}
+
+int main(int argc, char* argv[]) {
+
+  int connections = 16, load = 1, seconds = 10, ch, i;
+  int64_t j, total = 0, finds = 0, inserts = 0, errors = 0, misses = 0;
+  struct worker* workers;
+  double elapsed, *latency, *find_latency, *insert_latency;
+
+  while ((ch = getopt(argc, argv, "h:p:c:t:n:k:z:r:s:P:bN")) != -1) {
+    switch (ch) {
+      case 'h': HOST = optarg; break;
+      case 'p': PORT = optarg; break;
+      case 'c': connections = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'n': OPS = atoll(optarg); break;
+      case 'k': KEYS = atoll(optarg); break;
+      case 'z': THETA = atof(optarg); break;
+      case 'r': READ_PCT = atoi(optarg); break;
+      case 's':
+        MIN_SIZE = MAX_SIZE = atoi(optarg);
+        if (strchr(optarg, '-') != NULL) MAX_SIZE = atoi(strchr(optarg, '-') + 1);
+        break;
+      case 'P': DEPTH = atoi(optarg); break;
+      case 'b': BINARY = 1; break;
+      case 'N': load = 0; break;
+      default:
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-t seconds] [-n ops] [-k keys] "
+                "[-z theta] [-r read_percent] [-s bytes[-bytes]] [-P depth] [-b] [-N]\n", argv[0]);
+        exit(-1);
+    }
+  }
+
+  if (connections < 1) connections = 1;
+  if (DEPTH < 1) DEPTH = 1;
+  if (KEYS < 2) KEYS = 2;
+  if (MIN_SIZE < 1) MIN_SIZE = 1;
+  if (MAX_SIZE < MIN_SIZE) MAX_SIZE = MIN_SIZE;
+  if (THETA < 0 || THETA >= 1) {
+    fprintf(stderr, "-z takes a skew from 0 (uniform) up to, but not including, 1.\n");
+    exit(-1);
+  }
+  if (THETA > 0) zipf_init();
+
+  // Text values can't have spaces in them.
+  if ((VALUE = malloc(MAX_SIZE)) == NULL || (workers = calloc(connections, sizeof(struct worker))) == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+  for (i = 0; i < MAX_SIZE; i++) VALUE[i] = 'a' + i % 26;
+  for (i = 0; i < connections; i++) {
+    workers[i].id = i;
+    workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+  }
+
+  printf("connections:    %d, %d in flight each, %s protocol\n", connections, DEPTH, BINARY ? "binary" : "text");
+  printf("keys:           %lld, %s", (long long)KEYS, THETA > 0 ? "zipfian" : "uniform\n");
+  if (THETA > 0) printf(" %.2f\n", THETA);
+  printf("mix:            %d%% finds, %d-%d byte values\n", READ_PCT, MIN_SIZE, MAX_SIZE);
+
+  if (load) {
+    for (i = 0; i < connections; i++) {
+      workers[i].loading = 1;
+      workers[i].next_key = KEYS * i / connections;
+      workers[i].end_key = KEYS * (i + 1) / connections;
+    }
+    elapsed = run_workers(workers, connections);
+    for (i = 0; i < connections; i++) {
+      total += workers[i].ops;
+      if (workers[i].failed) exit(-1);
+      workers[i] = (struct worker){.id = i, .rng = workers[i].rng};
+    }
+    printf("load:           %.0f inserts/s\n", total / elapsed);
+  }
+
+  DEADLINE = now_usec() + seconds * 1e6;
+  elapsed = run_workers(workers, connections);
+
+  for (total = 0, i = 0; i < connections; i++) {
+    total += workers[i].ops;
+    errors += workers[i].errors;
+    misses += workers[i].misses;
+    if (workers[i].failed) fprintf(stderr, "Connection %d failed.\n", i);
+  }
+  if (total == 0) {
+    fprintf(stderr, "No commands were answered.\n");
+    exit(-1);
+  }
+
+  latency = malloc(sizeof(double) * total);
+  find_latency = malloc(sizeof(double) * total);
+  insert_latency = malloc(sizeof(double) * total);
+  if (latency == NULL || find_latency == NULL || insert_latency == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+  for (total = 0, i = 0; i < connections; i++) {
+    for (j = 0; j < workers[i].ops; j++) {
+      latency[total++] = workers[i].latency[j];
+      if (workers[i].kinds[j] == FIND) find_latency[finds++] = workers[i].latency[j];
+      else insert_latency[inserts++] = workers[i].latency[j];
+    }
+    free(workers[i].latency);
+    free(workers[i].kinds);
+  }
+
+  printf("commands:       %lld in %.2f s, %lld finds (%lld not found), %lld inserts (%lld failed)\n",
+         (long long)total, elapsed, (long long)finds, (long long)misses, (long long)inserts, (long long)errors);
+  printf("throughput:     %.0f ops/s\n", total / elapsed);
+  print_percentiles("latency", latency, total);
+  print_percentiles("find", find_latency, finds);
+  print_percentiles("insert", insert_latency, inserts);
+
+  free(latency);
+  free(find_latency);
+  free(insert_latency);
+  free(workers);
+  free(VALUE);
+  return(errors > 0 ? -1 : 0);
+}
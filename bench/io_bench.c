@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Measures random 4 KB I/O on the db file's storage backends, fio style.
+
+  usage: io_bench [-d /path/to/scratch/dir] [-s file_mb] [-t seconds]
+                  [-q depth,depth,...] [-i pread|uring|both] [-w] [-b]
+
+  A scratch file is filled, then read (or with -w written) at random
+  block offsets for -t seconds at each queue depth, by each backend.
+  Each round submits depth requests with storage_submit() and waits for
+  all of them, the way a batch in the server does. The file is opened
+  O_DIRECT unless -b is given, so the device is measured and not the
+  page cache; make the file bigger than memory if it can't be.
+*/
+
+#define _GNU_SOURCE // For O_DIRECT.
+#include "emma.h"
+#include <time.h>
+
+static double now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void run(int backend, int depth, int writes, int64_t blocks, double seconds, char* buffers) {
+  struct storage_io ios[depth];
+  struct iovec iov[depth];
+  int64_t done = 0, rounds = 0;
+  double start, elapsed;
+  int i;
+
+  storage_init(backend);
+  if (STORAGE_BACKEND != backend) return;
+
+  start = now_usec();
+  do {
+    for (i = 0; i < depth; i++) {
+      iov[i].iov_base = buffers + (int64_t)i * BLOCK_SIZE;
+      iov[i].iov_len = BLOCK_SIZE;
+      ios[i].write = writes;
+      ios[i].offset = (random() % blocks) * BLOCK_SIZE;
+      ios[i].iov = &iov[i];
+      ios[i].iovcnt = 1;
+    }
+    if (storage_submit(ios, depth) == -1) {
+      perror("I/O failed");
+      exit(-1);
+    }
+    done += depth;
+    rounds++;
+    elapsed = now_usec() - start;
+  } while (elapsed < seconds * 1e6);
+
+  printf("%-6s %5d %10.0f %10.1f %12.1f\n", backend == STORAGE_URING ? "uring" : "pread", depth,
+         done / (elapsed / 1e6), done * (double)BLOCK_SIZE / elapsed, elapsed / rounds);
+}
+
+int main(int argc, char* argv[]) {
+
+  char* dir = "/tmp";
+  char* depths = "1,2,4,8,16,32,64";
+  char file[4096];
+  char* buffers;
+  char* d;
+  int64_t file_mb = 256, i;
+  double seconds = 2;
+  int ch, depth, writes = 0, direct = 1, pread_too = 1, uring_too = 1;
+
+  while ((ch = getopt(argc, argv, "d:s:t:q:i:wb")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 's': file_mb = atoll(optarg); break;
+      case 't': seconds = atof(optarg); break;
+      case 'q': depths = optarg; break;
+      case 'i':
+        pread_too = strcmp(optarg, "uring") != 0;
+        uring_too = strcmp(optarg, "pread") != 0;
+        break;
+      case 'w': writes = 1; break;
+      case 'b': direct = 0; break;
+      default:
+        fprintf(stderr, "usage: %s [-d scratch_dir] [-s file_mb] [-t seconds] [-q depth,...] [-i pread|uring|both] [-w] [-b]\n", argv[0]);
+        exit(-1);
+    }
+  }
+  if (file_mb < 1) file_mb = 1;
+
+  snprintf(file, sizeof(file), "%s/io_bench", dir);
+  if ((DB_FD = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1) {
+    perror("Couldn't create the scratch file");
+    exit(-1);
+  }
+  if (posix_memalign((void**)&buffers, BLOCK_SIZE, (int64_t)STORAGE_QUEUE_DEPTH * 16 * BLOCK_SIZE) != 0) {
+    perror(NULL);
+    exit(-1);
+  }
+
+  // Write every block so reads have something real to fetch.
+  memset(buffers, 'x', (int64_t)STORAGE_QUEUE_DEPTH * 16 * BLOCK_SIZE);
+  for (i = 0; i < file_mb * 1024 * 1024; i += STORAGE_QUEUE_DEPTH * 16 * BLOCK_SIZE) {
+    if (pwrite(DB_FD, buffers, STORAGE_QUEUE_DEPTH * 16 * BLOCK_SIZE, i) == -1) {
+      perror("Couldn't fill the scratch file");
+      exit(-1);
+    }
+  }
+  fsync(DB_FD);
+
+  if (direct) {
+    close(DB_FD);
+    if ((DB_FD = open(file, O_RDWR | O_DIRECT)) == -1) {
+      fprintf(stderr, "O_DIRECT isn't supported in %s. Going through the page cache.\n", dir);
+      DB_FD = open(file, O_RDWR);
+    }
+  }
+  storage_register(buffers, (int64_t)STORAGE_QUEUE_DEPTH * 16 * BLOCK_SIZE);
+
+  printf("file:           %lld MB, random %s, %s\n", (long long)file_mb, writes ? "writes" : "reads",
+         direct ? "direct" : "buffered");
+  printf("%-6s %5s %10s %10s %12s\n", "engine", "depth", "iops", "MB/s", "usec/round");
+  srandom(42);
+  for (d = depths; *d != '\0'; d = (strchr(d, ',') != NULL) ? strchr(d, ',') + 1 : d + strlen(d)) {
+    if ((depth = atoi(d)) < 1) continue;
+    if (depth > STORAGE_QUEUE_DEPTH * 16) depth = STORAGE_QUEUE_DEPTH * 16;
+    if (pread_too) run(STORAGE_PREAD, depth, writes, file_mb * 1024 * 1024 / BLOCK_SIZE, seconds, buffers);
+    if (uring_too) run(STORAGE_URING, depth, writes, file_mb * 1024 * 1024 / BLOCK_SIZE, seconds, buffers);
+  }
+
+  close(DB_FD);
+  unlink(file);
+  return 0;
+}
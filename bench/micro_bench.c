@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Times the calls under every command, in one process and without the
+  network, so a change to any of them shows up on its own.
+
+  usage: micro_bench [-d /path/to/scratch/dir] [-n ops] [-o objects]
+                     [-s object_bytes]
+
+  create_block_reservation() and release_block_reservation() are timed
+  on -n single blocks, then on -n runs of 2 to 64 blocks, with LIVE of
+  them held at a time. write_obj() and read_obj() are timed on -o
+  objects of -s bytes, read back in a scrambled order, first from the
+  db file and then from the object cache. tokenize_command() and
+  extract_command() are timed on an insert and on an mput of 100 pairs.
+
+  The log is off and the bitmap is synced in the background, as the
+  server does with the log on. Each result is a "name: value ns/op"
+  line, which make bench_compare picks up.
+*/
+
+#include "emma.h"
+#include <time.h>
+
+#define LIVE 64 // Reservations held at once.
+
+static double now_nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void result(const char* name, double nsec, int64_t ops) {
+  char label[64];
+
+  snprintf(label, sizeof(label), "%s:", name);
+  printf("%-28s %10.1f ns/op\n", label, nsec / ops);
+}
+
+// Reserves and releases ops runs of blocks, LIVE at a time, timing the
+// two apart. blocks of 0 picks 2 to 64 at random.
+static void bench_reservations(int64_t ops, int blocks, const char* reserve_name, const char* release_name) {
+  int offsets[LIVE], sizes[LIVE];
+  double reserve = 0, release = 0, start;
+  int64_t done;
+  int i;
+
+  srandom(42);
+  for (done = 0; done < ops; done += LIVE) {
+    for (i = 0; i < LIVE; i++) sizes[i] = blocks ? blocks : 2 + random() % 63;
+
+    start = now_nsec();
+    for (i = 0; i < LIVE; i++) offsets[i] = create_block_reservation(sizes[i]);
+    reserve += now_nsec() - start;
+
+    for (i = 0; i < LIVE; i++) {
+      if (offsets[i] == -1) {
+        fprintf(stderr, "A reservation failed.\n");
+        exit(-1);
+      }
+    }
+
+    start = now_nsec();
+    for (i = 0; i < LIVE; i++) release_block_reservation(offsets[i], sizes[i]);
+    release += now_nsec() - start;
+  }
+  result(reserve_name, reserve, done);
+  result(release_name, release, done);
+}
+
+// Reads every object back, in a scrambled order.
+static void bench_reads(struct block_ptr* ptrs, int64_t objects, const char* name) {
+  double start;
+  char* obj;
+  int64_t i;
+
+  start = now_nsec();
+  for (i = 0; i < objects; i++) {
+    if ((obj = read_obj(ptrs[(i * 2654435761LL) % objects])) == NULL) {
+      fprintf(stderr, "A read failed.\n");
+      exit(-1);
+    }
+    free(obj);
+  }
+  result(name, now_nsec() - start, objects);
+}
+
+static void bench_objects(int64_t objects, int size) {
+  struct block_ptr* ptrs;
+  double start;
+  char* obj;
+  int64_t i;
+
+  if ((ptrs = calloc(objects, sizeof(struct block_ptr))) == NULL || (obj = malloc(size)) == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+  memset(obj, 'o', size);
+
+  start = now_nsec();
+  for (i = 0; i < objects; i++) {
+    if (write_obj(&ptrs[i], obj, size) == -1) {
+      fprintf(stderr, "A write failed.\n");
+      exit(-1);
+    }
+  }
+  result("write_obj", now_nsec() - start, objects);
+
+  bench_reads(ptrs, objects, "read_obj");
+  if (cache_init((int64_t)(objects * ptrs[0].blocks + 64) * BLOCK_SIZE * 2) == -1) exit(-1);
+  bench_reads(ptrs, objects, "read_obj (filling cache)");
+  bench_reads(ptrs, objects, "read_obj (cached)");
+
+  for (i = 0; i < objects; i++) release_block_reservation(ptrs[i].block_offset, ptrs[i].blocks);
+  free(ptrs);
+  free(obj);
+}
+
+// Tokenizes a copy of line ops times, as run_command() does.
+static void bench_tokenize(int64_t ops, const char* line, const char* name) {
+  char* token_vector[MAX_ARGS];
+  char* msg;
+  double start;
+  int64_t i;
+  int len = strlen(line) + 1;
+
+  if ((msg = malloc(len)) == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+  start = now_nsec();
+  for (i = 0; i < ops; i++) {
+    memcpy(msg, line, len);
+    if (extract_command(token_vector, tokenize_command(msg, token_vector)) == -1) {
+      fprintf(stderr, "%s didn't parse.\n", name);
+      exit(-1);
+    }
+  }
+  result(name, now_nsec() - start, ops);
+  free(msg);
+}
+
+int main(int argc, char* argv[]) {
+
+  char* dir = "/tmp";
+  char db_file[4096];
+  char block_bitmap_file[4096];
+  char mput[100 * 40 + 8];
+  int64_t ops = 1000000, objects = 20000;
+  int ch, size = BLOCK_SIZE - 64, i, len;
+
+  while ((ch = getopt(argc, argv, "d:n:o:s:")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 'n': ops = atoll(optarg); break;
+      case 'o': objects = atoll(optarg); break;
+      case 's': size = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d scratch_dir] [-n ops] [-o objects] [-s object_bytes]\n", argv[0]);
+        exit(-1);
+    }
+  }
+  if (ops < LIVE) ops = LIVE;
+  if (objects < 1) objects = 1;
+  if (size < 1) size = 1;
+
+  snprintf(db_file, sizeof(db_file), "%s/bench_db", dir);
+  snprintf(block_bitmap_file, sizeof(block_bitmap_file), "%s/bench_block_bitmap", dir);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+
+  if (bitmap_open(block_bitmap_file) == -1) exit(-1);
+  if ((DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
+    perror("Couldn't create the scratch db file");
+    exit(-1);
+  }
+  WAL_FD = -1;
+  if (extent_init(EXTENT_CAPACITY, ALLOC_BEST_FIT) == -1 ||
+      bitmap_sync_init(SYNC_ASYNC, 1000) == -1 ||
+      storage_init(STORAGE_PREAD) == -1) exit(-1);
+
+  bench_reservations(ops, 1, "reserve 1 block", "release 1 block");
+  bench_reservations(ops, 0, "reserve 2-64 blocks", "release 2-64 blocks");
+  bench_objects(objects, size);
+
+  bench_tokenize(ops, "insert user:1234567 some-value-of-moderate-length", "tokenize insert");
+  len = sprintf(mput, "mput");
+  for (i = 0; i < 100; i++) len += sprintf(mput + len, " user:%07d value-%d", i * 7919, i);
+  bench_tokenize(ops / 10, mput, "tokenize mput of 100");
+
+  close(DB_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+  return(0);
+}
@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Measures how fast a running server takes connections and answers
+  requests, to compare the fork model (-r fork) with the event-driven
+  one (-r epoll).
+
+  usage: server_bench [-h host] [-p port] [-c clients] [-n requests] [-k]
+                      [-P depth] [-b] [-s value_size]
+
+  Each client thread alternates inserts and finds on its own keys. By
+  default every request gets a connection of its own, which is what
+  connections/sec measures. With -k each client keeps one connection
+  open for all its requests. -P also pipelines depth commands at a time
+  on it, and each command's latency is that of its whole batch.
+  -b speaks the binary protocol instead of text, and -s sets the size
+  of the values inserted. `make bench_server` runs the connection
+  variants against a scratch server in each mode, then compares the two
+  protocols.
+*/
+
+#include "emma.h"
+#include <time.h>
+
+struct client {
+  int       id;
+  int       requests;
+  int       connections;
+  double*   latency;
+};
+
+static char* HOST = "127.0.0.1";
+static char* PORT = "4080";
+static int   KEEP_ALIVE = 0;
+static int   DEPTH = 1;       // Commands sent before waiting for answers.
+static int   BINARY = 0;      // Speak the binary protocol instead of text.
+static int   VALUE_SIZE = 16;
+
+static double now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static int connect_to_server(void) {
+  struct addrinfo hints, *res;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(HOST, PORT, &hints, &res) != 0) return -1;
+  if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1 ||
+      connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+    perror("Couldn't connect to the server");
+    if (fd != -1) close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// Takes one whole response off the front of buf. Returns the bytes it
+// used, or 0 if it hasn't all arrived.
+static int take_response(const char* buf, int len) {
+  struct bin_response header;
+  const char* end;
+  int size;
+
+  if (BINARY) {
+    if (len < (int)sizeof(header)) return 0;
+    memcpy(&header, buf, sizeof(header));
+    size = sizeof(header) + le32toh(header.value_len);
+    return len >= size ? size : 0;
+  }
+
+  // STATUS: ...\nSIZE: n\n followed by n bytes and \n\n.
+  if ((end = memchr(buf, '\n', len)) == NULL ||
+      (end = memchr(end + 1, '\n', len - (end + 1 - buf))) == NULL) return 0;
+  size = end + 1 - buf + atoi(strstr(buf, "SIZE: ") + 6) + 2;
+  return len >= size ? size : 0;
+}
+
+// Sends a batch of commands in one go and reads all their responses.
+static int request(int fd, const char* cmds, int cmds_len, int count, char* buf, int buf_size) {
+  int len = 0, n, used;
+
+  if (send(fd, cmds, cmds_len, 0) == -1) return -1;
+
+  while (count > 0) {
+    if ((used = take_response(buf, len)) > 0) {
+      len -= used;
+      memmove(buf, buf + used, len);
+      count--;
+      continue;
+    }
+    if (len == buf_size) return -1;
+    if ((n = recv(fd, buf + len, buf_size - len, 0)) <= 0) return -1;
+    len += n;
+  }
+  return 0;
+}
+
+// Appends the j'th command of a client to cmds.
+static int make_command(char* cmds, int id, int j, const char* value) {
+  struct bin_request req;
+  char key[KEY_LEN];
+  int key_len = sprintf(key, "bench-%d-%d", id, j / 2 % 100);
+
+  if (!BINARY) {
+    if (j % 2 == 0) return sprintf(cmds, "insert %s %s\n", key, value);
+    return sprintf(cmds, "find %s\n", key);
+  }
+
+  req.magic = BIN_REQUEST_MAGIC;
+  req.opcode = (j % 2 == 0) ? BIN_INSERT : BIN_FIND;
+  req.key_len = htole16(key_len);
+  req.value_len = htole32((j % 2 == 0) ? VALUE_SIZE : 0);
+  req.request_id = htole64(j);
+  memcpy(cmds, &req, sizeof(req));
+  memcpy(cmds + sizeof(req), key, key_len);
+  if (j % 2 == 0) memcpy(cmds + sizeof(req) + key_len, value, VALUE_SIZE);
+  return sizeof(req) + key_len + ((j % 2 == 0) ? VALUE_SIZE : 0);
+}
+
+static void* run_client(void* arg) {
+  struct client* client = arg;
+  char *cmds, *value, *buf;
+  double start, elapsed;
+  int fd = -1, i, j, batch, len;
+  int buf_size = VALUE_SIZE + MSG_SIZE + 65536;
+
+  cmds = malloc((int64_t)DEPTH * (VALUE_SIZE + MSG_SIZE));
+  value = malloc(VALUE_SIZE + 1);
+  buf = malloc(buf_size);
+  if (cmds == NULL || value == NULL || buf == NULL) return NULL;
+  memset(value, 'v', VALUE_SIZE);
+  value[VALUE_SIZE] = '\0';
+
+  for (i = 0; i < client->requests; i += batch) {
+    batch = (client->requests - i < DEPTH) ? client->requests - i : DEPTH;
+    for (len = 0, j = i; j < i + batch; j++) len += make_command(cmds + len, client->id, j, value);
+
+    start = now_usec();
+    if (fd == -1) {
+      if ((fd = connect_to_server()) == -1) break;
+      client->connections++;
+    }
+    if (request(fd, cmds, len, batch, buf, buf_size) == -1) {
+      fprintf(stderr, "Request %d of client %d failed.\n", i, client->id);
+      close(fd);
+      fd = -1;
+      break;
+    }
+    if (!KEEP_ALIVE) {
+      close(fd);
+      fd = -1;
+    }
+    elapsed = now_usec() - start;
+    for (j = i; j < i + batch; j++) client->latency[j] = elapsed;
+  }
+  if (fd != -1) close(fd);
+  free(cmds);
+  free(value);
+  free(buf);
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+
+  int clients = 16, requests = 2000, ch, i, j, total = 0, connections = 0;
+  struct client* client;
+  pthread_t* threads;
+  double start, elapsed, *latency;
+
+  while ((ch = getopt(argc, argv, "h:p:c:n:kP:bs:")) != -1) {
+    switch (ch) {
+      case 'h': HOST = optarg; break;
+      case 'p': PORT = optarg; break;
+      case 'c': clients = atoi(optarg); break;
+      case 'n': requests = atoi(optarg); break;
+      case 'k': KEEP_ALIVE = 1; break;
+      case 'P': DEPTH = atoi(optarg); KEEP_ALIVE = 1; break;
+      case 'b': BINARY = 1; break;
+      case 's': VALUE_SIZE = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-n requests] [-k] [-P depth] [-b] [-s value_size]\n", argv[0]);
+        exit(-1);
+    }
+  }
+
+  if (DEPTH < 1) DEPTH = 1;
+  if (VALUE_SIZE < 1) VALUE_SIZE = 1;
+
+  client = calloc(clients, sizeof(struct client));
+  threads = calloc(clients, sizeof(pthread_t));
+  latency = malloc(sizeof(double) * clients * requests);
+  if (client == NULL || threads == NULL || latency == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+
+  start = now_usec();
+  for (i = 0; i < clients; i++) {
+    client[i].id = i;
+    client[i].requests = requests;
+    client[i].latency = latency + i * requests;
+    for (j = 0; j < requests; j++) client[i].latency[j] = -1;
+    pthread_create(&threads[i], NULL, run_client, &client[i]);
+  }
+  for (i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+  elapsed = (now_usec() - start) / 1e6;
+
+  // Squeeze out the requests that never finished.
+  for (i = 0; i < clients * requests; i++)
+    if (latency[i] >= 0) latency[total++] = latency[i];
+  for (i = 0; i < clients; i++) connections += client[i].connections;
+  if (total == 0) {
+    fprintf(stderr, "No requests finished.\n");
+    exit(-1);
+  }
+  qsort(latency, total, sizeof(double), cmp_double);
+
+  printf("clients:        %d%s", clients, KEEP_ALIVE ? " (keep-alive)" : "");
+  printf(DEPTH > 1 ? ", %d pipelined" : "", DEPTH);
+  printf(", %s protocol, %d byte values\n", BINARY ? "binary" : "text", VALUE_SIZE);
+  printf("requests:       %d of %d\n", total, clients * requests);
+  printf("connections/s:  %.0f\n", connections / elapsed);
+  printf("requests/s:     %.0f\n", total / elapsed);
+  printf("latency p50:    %.1f usec\n", latency[total / 2]);
+  printf("latency p99:    %.1f usec\n", latency[total * 99 / 100]);
+  printf("latency max:    %.1f usec\n", latency[total - 1]);
+
+  free(client);
+  free(threads);
+  free(latency);
+  return(0);
+}
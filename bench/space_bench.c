@@ -0,0 +1,166 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+  Reports space amplification for stored values: the bytes the db file
+  gives them against the bytes they hold.
+
+  usage: space_bench [-d /path/to/scratch/dir] [-n values] [-s min,max]
+                     [-b batch] [-x delete_percent]
+
+  Values with sizes spread evenly over min..max are stored, a batch at a
+  time as mput would, and then -x percent of them, picked at random,
+  are deleted. That's done twice on fresh scratch files: with every
+  value in blocks of its own, as before slabs, and with small values
+  packed into slabs.
+*/
+
+#include "emma.h"
+
+static void scratch(const char* db_file, const char* block_bitmap_file) {
+  if (DB_FD > 0) close(DB_FD);
+  if (SHM_BLOCK_BITMAP != NULL) munmap(SHM_BLOCK_BITMAP, BLOCK_BITMAP_BYTES);
+  if (BLOCK_BITMAP_FD > 0) close(BLOCK_BITMAP_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+
+  if ((BLOCK_BITMAP_FD = open(block_bitmap_file, O_RDWR | O_CREAT, 0666)) == -1 ||
+      ftruncate(BLOCK_BITMAP_FD, BLOCK_BITMAP_BYTES) == -1 ||
+      (DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
+    perror("Couldn't create the scratch files");
+    exit(-1);
+  }
+  if ((SHM_BLOCK_BITMAP = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, BLOCK_BITMAP_FD, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the block bitmap");
+    exit(-1);
+  }
+  if (extent_init(EXTENT_CAPACITY, ALLOC_BEST_FIT) == -1 || bitmap_sync_init(SYNC_ASYNC, 1000) == -1) exit(-1);
+}
+
+static int64_t used_blocks(void) {
+  int64_t used = 0, i;
+
+  for (i = 0; i < BLOCK_BITMAP_BYTES; i++)
+    if (SHM_BLOCK_BITMAP[i] != 0) used += __builtin_popcount((unsigned char)SHM_BLOCK_BITMAP[i]);
+  return used;
+}
+
+static void run(const char* label, int64_t values, int min, int max, int batch, int delete_percent) {
+  struct block_ptr* ptrs;
+  char** buffers;
+  uint32_t* lens;
+  struct stat st;
+  int64_t i, j, n, bytes = 0, live = 0, blocks;
+
+  ptrs = malloc(sizeof(struct block_ptr) * values);
+  lens = malloc(sizeof(uint32_t) * values);
+  buffers = malloc(sizeof(char*) * batch);
+  if (ptrs == NULL || lens == NULL || buffers == NULL) {
+    perror(NULL);
+    exit(-1);
+  }
+
+  srandom(42);
+  for (i = 0; i < values; i += n) {
+    n = (values - i < batch) ? values - i : batch;
+    for (j = 0; j < n; j++) {
+      lens[i + j] = min + random() % (max - min + 1);
+      if ((buffers[j] = new_value_buffer(lens[i + j])) == NULL) exit(-1);
+      memset(VALUE_DATA(buffers[j]), 'v', lens[i + j]);
+    }
+    if (write_values(buffers, ptrs + i, n) == -1) {
+      fprintf(stderr, "Storing values failed.\n");
+      exit(-1);
+    }
+    for (j = 0; j < n; j++) free(buffers[j]);
+  }
+
+  for (i = 0; i < values; i++) {
+    if (random() % 100 < delete_percent) {
+      delete_obj(ptrs[i]);
+      continue;
+    }
+    bytes += lens[i];
+    live++;
+  }
+
+  blocks = used_blocks();
+  fstat(DB_FD, &st);
+  printf("%-12s %10lld %12lld %10lld %12lld %8.2fx\n", label, (long long)live, (long long)bytes,
+         (long long)blocks, (long long)st.st_blocks * 512,
+         bytes > 0 ? (double)blocks * BLOCK_SIZE / bytes : 0.0);
+
+  free(ptrs);
+  free(lens);
+  free(buffers);
+}
+
+int main(int argc, char* argv[]) {
+
+  char* dir = "/tmp";
+  char db_file[4096];
+  char block_bitmap_file[4096];
+  int64_t values = 100000;
+  int ch, min = 16, max = 512, batch = 100, delete_percent = 0;
+
+  while ((ch = getopt(argc, argv, "d:n:s:b:x:")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 'n': values = atoll(optarg); break;
+      case 's':
+        min = atoi(optarg);
+        max = (strchr(optarg, ',') != NULL) ? atoi(strchr(optarg, ',') + 1) : min;
+        break;
+      case 'b': batch = atoi(optarg); break;
+      case 'x': delete_percent = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d scratch_dir] [-n values] [-s min,max] [-b batch] [-x delete_percent]\n", argv[0]);
+        exit(-1);
+    }
+  }
+  if (values < 1 || batch < 1 || min < 0 || max < min) {
+    fprintf(stderr, "Nothing to measure.\n");
+    exit(-1);
+  }
+
+  snprintf(db_file, sizeof(db_file), "%s/bench_db", dir);
+  snprintf(block_bitmap_file, sizeof(block_bitmap_file), "%s/bench_block_bitmap", dir);
+  WAL_FD = -1; // Measure the layout, not the log.
+
+  printf("values of %d to %d bytes, %d%% deleted\n", min, max, delete_percent);
+  printf("%-12s %10s %12s %10s %12s %9s\n", "layout", "values", "value bytes", "blocks", "on disk", "amplif.");
+
+  scratch(db_file, block_bitmap_file);
+  SHM_SLABS = NULL;
+  run("blocks", values, min, max, batch, delete_percent);
+
+  scratch(db_file, block_bitmap_file);
+  if (slab_init() == -1) exit(-1);
+  run("slabs", values, min, max, batch, delete_percent);
+  fflush(stdout);
+  slab_report();
+
+  close(DB_FD);
+  unlink(db_file);
+  unlink(block_bitmap_file);
+  return(0);
+}
@@ -0,0 +1,747 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Free space in the db file is tracked twice. The block bitmap is the
+  record on disk. Alongside it, in shared memory, every run of free
+  blocks is kept as an extent in two treaps: one ordered by offset, used
+  to coalesce neighbours and for next-fit, and one ordered by size, used
+  for best-fit. Both make allocation O(log n) no matter how full or
+  fragmented the file is.
+
+  The file is split into ALLOC_GROUPS groups of ALLOC_GROUP_BLOCKS, each
+  with its own lock and its own pair of treaps, so writers working in
+  different groups never wait for each other. Every worker has a home
+  group it tries first, and moves it back down whenever a lower group
+  has room, so a small file stays at the front. If home is still busy
+  after a short wait, or full, it tries the next few, and makes
+  whichever has room its new home. Only when those are
+  all busy does it queue up for each group in turn. Not trying every
+  group keeps writers from wandering to the far end of the file while a
+  checkpoint or compaction has the groups locked. Blocks are always freed
+  into the group they came from.
+
+  Single blocks, the most common request, don't take a lock at all. Each
+  group sets aside a small chunk of blocks for them, and a block is
+  claimed with a compare-and-swap on the mask of the chunk's unclaimed
+  blocks. Only refilling the chunk takes the lock. Every change to the
+  bitmap is made a word at a time with atomic operations, so claims in
+  the same word never undo each other.
+
+  A group's treaps are built from its part of the bitmap the first time
+  it's used, growing the bitmap file to cover it if need be, so startup
+  costs the same however big the file is. Groups take extents from a
+  shared pool EXTENT_CHUNK at a time. A group that can't get any more
+  stops using its treaps and scans its part of the bitmap instead.
+
+  Built groups also keep a summary: how many blocks are free in each
+  SUMMARY_BLOCKS of the file. Scans of the bitmap skip a full stretch
+  and take an empty one whole, without reading either.
+*/
+
+#define NIL 0 // Extent 0 is never used, so it can stand for "none".
+
+#define EXT(i) (SHM_EXTENTS->extents[i])
+#define GROUP(g) (SHM_EXTENTS->group[g])
+#define FULL_WORD (~(uint64_t)0)
+#define SINGLES_CHUNK 32 // Blocks a group sets aside for single-block claims.
+#define TRY_GROUPS 8     // Groups tried without waiting before queueing up.
+#define HOME_WAIT_NS 20000 // How long a busy home group is waited for before moving on.
+
+static __thread int HOME_GROUP = 0; // Where this worker allocates first.
+static __thread int64_t SCANNED = 0; // Bitmap words this worker has looked at, for stats.c.
+
+
+static unsigned int next_priority(struct alloc_group *g) {
+  unsigned int x = g->seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return (g->seed = x);
+}
+
+static void drop_extent(struct alloc_group *g, int i) {
+  EXT(i).off_left = g->free_list;
+  g->free_list = i;
+}
+
+static int new_extent(struct alloc_group *g, int offset, int blocks) {
+  int i, first;
+
+  if (g->free_list == NIL) {
+    // Take another chunk of the pool every group shares.
+    first = __atomic_fetch_add(&SHM_EXTENTS->unused, EXTENT_CHUNK, __ATOMIC_RELAXED);
+    if (first + EXTENT_CHUNK > SHM_EXTENTS->capacity) return NIL;
+    for (i = first + EXTENT_CHUNK - 1; i >= first; i--) drop_extent(g, i);
+  }
+  i = g->free_list;
+  g->free_list = EXT(i).off_left;
+  memset(&EXT(i), '\0', sizeof(struct extent));
+  EXT(i).offset = offset;
+  EXT(i).blocks = blocks;
+  EXT(i).max_blocks = blocks;
+  EXT(i).priority = next_priority(g);
+  return i;
+}
+
+
+// The offset treap. Each node also knows the largest extent beneath it.
+
+static void off_update(int t) {
+  int m = EXT(t).blocks;
+
+  if (EXT(t).off_left != NIL && EXT(EXT(t).off_left).max_blocks > m) m = EXT(EXT(t).off_left).max_blocks;
+  if (EXT(t).off_right != NIL && EXT(EXT(t).off_right).max_blocks > m) m = EXT(EXT(t).off_right).max_blocks;
+  EXT(t).max_blocks = m;
+}
+
+// Splits t into extents starting before offset and the rest.
+static void off_split(int t, int offset, int *l, int *r) {
+  if (t == NIL) {
+    *l = *r = NIL;
+  } else if (EXT(t).offset < offset) {
+    off_split(EXT(t).off_right, offset, &EXT(t).off_right, r);
+    off_update(t);
+    *l = t;
+  } else {
+    off_split(EXT(t).off_left, offset, l, &EXT(t).off_left);
+    off_update(t);
+    *r = t;
+  }
+}
+
+static int off_merge(int l, int r) {
+  if (l == NIL) return r;
+  if (r == NIL) return l;
+  if (EXT(l).priority > EXT(r).priority) {
+    EXT(l).off_right = off_merge(EXT(l).off_right, r);
+    off_update(l);
+    return l;
+  }
+  EXT(r).off_left = off_merge(l, EXT(r).off_left);
+  off_update(r);
+  return r;
+}
+
+
+// The size treap, ordered by length and then by offset.
+
+static int size_before(int t, int blocks, int offset) {
+  return EXT(t).blocks < blocks || (EXT(t).blocks == blocks && EXT(t).offset < offset);
+}
+
+static void size_split(int t, int blocks, int offset, int *l, int *r) {
+  if (t == NIL) {
+    *l = *r = NIL;
+  } else if (size_before(t, blocks, offset)) {
+    size_split(EXT(t).size_right, blocks, offset, &EXT(t).size_right, r);
+    *l = t;
+  } else {
+    size_split(EXT(t).size_left, blocks, offset, l, &EXT(t).size_left);
+    *r = t;
+  }
+}
+
+static int size_merge(int l, int r) {
+  if (l == NIL) return r;
+  if (r == NIL) return l;
+  if (EXT(l).priority > EXT(r).priority) {
+    EXT(l).size_right = size_merge(EXT(l).size_right, r);
+    return l;
+  }
+  EXT(r).size_left = size_merge(l, EXT(r).size_left);
+  return r;
+}
+
+
+static void index_extent(struct alloc_group *g, int i) {
+  int l, r;
+
+  EXT(i).off_left = EXT(i).off_right = EXT(i).size_left = EXT(i).size_right = NIL;
+  EXT(i).max_blocks = EXT(i).blocks;
+
+  off_split(g->off_root, EXT(i).offset, &l, &r);
+  g->off_root = off_merge(off_merge(l, i), r);
+
+  size_split(g->size_root, EXT(i).blocks, EXT(i).offset, &l, &r);
+  g->size_root = size_merge(size_merge(l, i), r);
+
+  g->extent_count++;
+  g->free_blocks += EXT(i).blocks;
+}
+
+static void unindex_extent(struct alloc_group *g, int i) {
+  int l, m, r;
+
+  off_split(g->off_root, EXT(i).offset, &l, &r);
+  off_split(r, EXT(i).offset + 1, &m, &r);
+  g->off_root = off_merge(l, r);
+
+  size_split(g->size_root, EXT(i).blocks, EXT(i).offset, &l, &r);
+  size_split(r, EXT(i).blocks, EXT(i).offset + 1, &m, &r);
+  g->size_root = size_merge(l, r);
+
+  g->extent_count--;
+  g->free_blocks -= EXT(i).blocks;
+}
+
+// The smallest extent that holds at least blocks.
+static int best_fit(struct alloc_group *g, int blocks) {
+  int t = g->size_root, best = NIL;
+
+  while (t != NIL) {
+    if (EXT(t).blocks >= blocks) {
+      best = t;
+      t = EXT(t).size_left;
+    } else {
+      t = EXT(t).size_right;
+    }
+  }
+  return best;
+}
+
+// The first extent at or after offset that holds at least blocks.
+static int first_fit(int t, int offset, int blocks) {
+  int found;
+
+  if (t == NIL || EXT(t).max_blocks < blocks) return NIL;
+  if (EXT(t).offset >= offset) {
+    if ((found = first_fit(EXT(t).off_left, offset, blocks)) != NIL) return found;
+    if (EXT(t).blocks >= blocks) return t;
+  }
+  return first_fit(EXT(t).off_right, offset, blocks);
+}
+
+// The extent that ends right where offset starts.
+static int extent_ending_at(struct alloc_group *g, int offset) {
+  int t = g->off_root;
+
+  while (t != NIL) {
+    if (EXT(t).offset >= offset) {
+      t = EXT(t).off_left;
+    } else if (EXT(t).offset + EXT(t).blocks == offset) {
+      return t;
+    } else {
+      t = EXT(t).off_right;
+    }
+  }
+  return NIL;
+}
+
+static int extent_starting_at(struct alloc_group *g, int offset) {
+  int t = g->off_root;
+
+  while (t != NIL && EXT(t).offset != offset)
+    t = (offset < EXT(t).offset) ? EXT(t).off_left : EXT(t).off_right;
+  return t;
+}
+
+
+// Takes blocks from the front of extent i. Returns the first of them.
+static int take_extent(struct alloc_group *g, int i, int blocks) {
+  int offset;
+
+  unindex_extent(g, i);
+  offset = EXT(i).offset;
+  if (EXT(i).blocks == blocks) {
+    drop_extent(g, i);
+  } else {
+    EXT(i).offset += blocks;
+    EXT(i).blocks -= blocks;
+    index_extent(g, i);
+  }
+  return offset;
+}
+
+// Takes blocks out of a group's treaps. Returns the first block or -1.
+static int extent_alloc(struct alloc_group *g, int blocks) {
+  int i;
+
+  if (SHM_EXTENTS->policy == ALLOC_NEXT_FIT) {
+    if ((i = first_fit(g->off_root, g->cursor, blocks)) == NIL)
+      i = first_fit(g->off_root, 0, blocks);
+  } else {
+    i = best_fit(g, blocks);
+  }
+  if (i == NIL) return -1;
+
+  g->cursor = take_extent(g, i, blocks) + blocks;
+  return g->cursor - blocks;
+}
+
+// Hands blocks back to a group's treaps, joining them up with the free
+// extents on either side. Returns -1 if there's no room left.
+static int extent_free(struct alloc_group *g, int offset, int blocks) {
+  int before = extent_ending_at(g, offset);
+  int after = extent_starting_at(g, offset + blocks);
+
+  if (before != NIL) {
+    unindex_extent(g, before);
+    EXT(before).blocks += blocks;
+    if (after != NIL) {
+      unindex_extent(g, after);
+      EXT(before).blocks += EXT(after).blocks;
+      drop_extent(g, after);
+    }
+    index_extent(g, before);
+    return 0;
+  }
+
+  if (after != NIL) {
+    unindex_extent(g, after);
+    EXT(after).offset = offset;
+    EXT(after).blocks += blocks;
+    index_extent(g, after);
+    return 0;
+  }
+
+  if ((before = new_extent(g, offset, blocks)) == NIL) return -1;
+  index_extent(g, before);
+  return 0;
+}
+
+
+// The bits of word w that fall between offset and offset + count.
+static uint64_t word_mask(int64_t w, int64_t offset, int64_t count) {
+  int64_t lo = (offset > w * 64) ? offset - w * 64 : 0;
+  int64_t hi = (offset + count < w * 64 + 64) ? offset + count - w * 64 : 64;
+
+  return (hi - lo == 64) ? FULL_WORD : (((uint64_t)1 << (hi - lo)) - 1) << lo;
+}
+
+// Adds to the free count of the summary stretch block is in, once its
+// group has been built. Until then the bitmap alone is counted on.
+static void summary_add(int64_t block, int64_t blocks) {
+  if (blocks != 0 && GROUP(block / ALLOC_GROUP_BLOCKS).built)
+    __atomic_fetch_add(&SHM_EXTENTS->chunk_free[block / SUMMARY_BLOCKS], blocks, __ATOMIC_RELAXED);
+}
+
+// Sets count bits from offset in the block bitmap. Fails, leaving the
+// bitmap as it was, if any of them is already set.
+static int claim_bits(int64_t offset, int64_t count) {
+  uint64_t *words = (uint64_t*)SHM_BLOCK_BITMAP;
+  int64_t w, first = offset / 64, last = (offset + count - 1) / 64, b, next;
+  uint64_t old, mask;
+
+  for (w = first; w <= last; w++) {
+    mask = word_mask(w, offset, count);
+    old = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+    do {
+      if (old & mask) {
+        while (--w >= first) __atomic_fetch_and(&words[w], ~word_mask(w, offset, count), __ATOMIC_SEQ_CST);
+        return -1;
+      }
+    } while (!__atomic_compare_exchange_n(&words[w], &old, old | mask, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  }
+
+  for (b = offset; b < offset + count; b = next) {
+    next = (b / SUMMARY_BLOCKS + 1) * SUMMARY_BLOCKS;
+    if (next > offset + count) next = offset + count;
+    summary_add(b, -(next - b));
+  }
+  return 0;
+}
+
+static void clear_bits(int64_t offset, int64_t count) {
+  uint64_t *words = (uint64_t*)SHM_BLOCK_BITMAP;
+  int64_t w, last = (offset + count - 1) / 64, freed = 0;
+  uint64_t mask;
+
+  for (w = offset / 64; w <= last; w++) {
+    mask = word_mask(w, offset, count);
+    freed += __builtin_popcountll(__atomic_fetch_and(&words[w], ~mask, __ATOMIC_SEQ_CST) & mask);
+    if (w == last || (w + 1) % SUMMARY_WORDS == 0) {
+      summary_add(w * 64, freed);
+      freed = 0;
+    }
+  }
+}
+
+// Looks for a run of free blocks in built group gi's part of the
+// bitmap, skipping summary stretches and whole words that are full or
+// empty. Returns the first block or -1.
+static int bitmap_find_run(int gi, int blocks) {
+  const uint64_t* words = (const uint64_t*)SHM_BLOCK_BITMAP;
+  int64_t w, end = (int64_t)(gi + 1) * ALLOC_GROUP_BLOCKS / 64;
+  int64_t run_start = 0, run = 0, left;
+  uint64_t word;
+  int bit;
+
+  for (w = (int64_t)gi * ALLOC_GROUP_BLOCKS / 64; w < end; w++, SCANNED++) {
+    if (w % SUMMARY_WORDS == 0 &&
+        ((left = __atomic_load_n(&SHM_EXTENTS->chunk_free[w / SUMMARY_WORDS], __ATOMIC_RELAXED)) == 0 || left == SUMMARY_BLOCKS)) {
+      if (left == 0) {
+        run = 0;
+      } else {
+        if (run == 0) run_start = w * 64;
+        run += SUMMARY_BLOCKS;
+      }
+      w += SUMMARY_WORDS - 1;
+      if (run >= blocks) return run_start;
+      continue;
+    }
+    word = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+    if (word == 0) {
+      if (run == 0) run_start = w * 64;
+      run += 64;
+    } else if (word == FULL_WORD) {
+      run = 0;
+    } else {
+      for (bit = 0; bit < 64; bit++) {
+        if (word & ((uint64_t)1 << bit)) {
+          run = 0;
+        } else {
+          if (run == 0) run_start = w * 64 + bit;
+          if (++run >= blocks) return run_start;
+        }
+      }
+      continue;
+    }
+    if (run >= blocks) return run_start;
+  }
+  return -1;
+}
+
+
+// Claims a block from a group's chunk of single blocks without taking
+// its lock. Returns the block or -1 if the chunk is used up.
+static int take_single(struct alloc_group *g) {
+  uint64_t old = __atomic_load_n(&g->singles, __ATOMIC_SEQ_CST), bit;
+  int block;
+
+  while ((uint32_t)old != 0) {
+    bit = old & -old; // The lowest block still unclaimed.
+    if (!__atomic_compare_exchange_n(&g->singles, &old, old & ~bit, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+
+    // Only a group that has just switched to bitmap scans can have
+    // handed the block out already. Then try the next one.
+    block = (int)(old >> 32) + __builtin_ctzll(bit);
+    if (claim_bits(block, 1) == 0) return block;
+    old = __atomic_load_n(&g->singles, __ATOMIC_SEQ_CST);
+  }
+  return -1;
+}
+
+// Sets aside a fresh chunk of single blocks. Called with the group's
+// lock held, once the last chunk is used up.
+static int refill_singles(struct alloc_group *g) {
+  int offset;
+
+  if ((offset = extent_alloc(g, SINGLES_CHUNK)) == -1) return -1;
+  __atomic_store_n(&g->singles, ((uint64_t)offset << 32) | 0xffffffffU, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+// Switches a group over to bitmap scans, where the bitmap alone says
+// which blocks are free.
+static void retire_group(int gi) {
+  GROUP(gi).valid = 0;
+  __atomic_store_n(&GROUP(gi).singles, 0, __ATOMIC_SEQ_CST);
+}
+
+static void give_extent(int gi, int offset, int blocks) {
+  if (blocks > 0 && GROUP(gi).valid && extent_free(&GROUP(gi), offset, blocks) == -1) {
+    fprintf(stderr, "Extent index is full. Group %d falls back to bitmap scans.\n", gi);
+    retire_group(gi);
+  }
+}
+
+// Builds group gi's treaps and summary from its part of the bitmap, the
+// first time it's used. Called with the group's lock held. Returns -1
+// if the bitmap file can't be grown to cover it.
+static int build_group(int gi) {
+  const uint64_t* words = (const uint64_t*)SHM_BLOCK_BITMAP;
+  struct alloc_group *g = &GROUP(gi);
+  int64_t w, first = (int64_t)gi * ALLOC_GROUP_BLOCKS / 64, end = first + ALLOC_GROUP_BLOCKS / 64;
+  int64_t run_start = 0, run = 0;
+  int32_t *chunk_free = SHM_EXTENTS->chunk_free;
+  uint64_t word;
+  int bit;
+
+  if (bitmap_cover((int64_t)(gi + 1) * ALLOC_GROUP_BLOCKS) == -1) return -1;
+  g->valid = 1;
+
+  for (w = first; w < end; w++, SCANNED++) {
+    if (w % SUMMARY_WORDS == 0) chunk_free[w / SUMMARY_WORDS] = SUMMARY_BLOCKS;
+    if ((word = words[w]) == 0) {
+      if (run == 0) run_start = w * 64;
+      run += 64;
+      continue;
+    }
+    chunk_free[w / SUMMARY_WORDS] -= __builtin_popcountll(word);
+    if (word == FULL_WORD) {
+      give_extent(gi, run_start, run);
+      run = 0;
+      continue;
+    }
+    for (bit = 0; bit < 64; bit++) {
+      if (word & ((uint64_t)1 << bit)) {
+        give_extent(gi, run_start, run);
+        run = 0;
+      } else {
+        if (run == 0) run_start = w * 64 + bit;
+        run++;
+      }
+    }
+  }
+  give_extent(gi, run_start, run);
+
+  __atomic_store_n(&g->built, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+// Finds blocks in group gi and sets them in the bitmap. Called with the
+// group's lock held. Returns the first block or -1.
+static int group_take(int gi, int blocks) {
+  struct alloc_group *g = &GROUP(gi);
+  int offset = -1;
+
+  if (!g->built && build_group(gi) == -1) return -1;
+  if (g->valid && blocks == 1 && (offset = take_single(g)) == -1 && refill_singles(g) == 0)
+    offset = take_single(g);
+
+  if (offset == -1 && g->valid && (offset = extent_alloc(g, blocks)) != -1 && claim_bits(offset, blocks) == -1) {
+    fprintf(stderr, "Group %d's extents don't match the bitmap. Falling back to bitmap scans.\n", gi);
+    retire_group(gi);
+    offset = -1;
+  }
+
+  // A single block claimed from a chunk just before the switch can
+  // beat us to a run. Just look again.
+  if (!g->valid)
+    while ((offset = bitmap_find_run(gi, blocks)) != -1 && claim_bits(offset, blocks) == -1);
+
+  return offset;
+}
+
+// Finds the lowest run of blocks in group gi that ends by limit, and
+// sets it in the bitmap. Called with the group's lock held. Returns the
+// first block or -1.
+static int group_take_below(int gi, int blocks, int limit) {
+  struct alloc_group *g = &GROUP(gi);
+  int i, offset;
+
+  if (!g->built && build_group(gi) == -1) return -1;
+  if (g->valid) {
+    if ((i = first_fit(g->off_root, 0, blocks)) == NIL || EXT(i).offset + blocks > limit) return -1;
+    if (claim_bits(offset = take_extent(g, i, blocks), blocks) == 0) return offset;
+    fprintf(stderr, "Group %d's extents don't match the bitmap. Falling back to bitmap scans.\n", gi);
+    retire_group(gi);
+  }
+  while ((offset = bitmap_find_run(gi, blocks)) != -1 && offset + blocks <= limit && claim_bits(offset, blocks) == -1);
+  return (offset != -1 && offset + blocks <= limit) ? offset : -1;
+}
+
+// Puts whatever is left of a group's chunk of single blocks back in its
+// treaps. Called with the group's lock held.
+static void drop_singles(int gi) {
+  uint64_t old = __atomic_exchange_n(&GROUP(gi).singles, 0, __ATOMIC_SEQ_CST);
+  uint64_t left = (uint32_t)old;
+  int base = (int)(old >> 32), bit, run;
+
+  for (bit = 0; left != 0; left >>= run, bit += run) {
+    if ((run = __builtin_ctzll(left)) > 0) continue; // Already claimed.
+    run = __builtin_ctzll(~left);
+    give_extent(gi, base + bit, run);
+  }
+}
+
+// Clears blocks in the bitmap and hands them back to group gi. Called
+// with the group's lock held.
+static void group_give(int gi, int offset, int blocks) {
+  clear_bits(offset, blocks);
+  give_extent(gi, offset, blocks);
+}
+
+
+// Waits for group gi's lock, adding the time it took to wait.
+static void lock_group(int gi, int64_t *wait) {
+  int64_t start = stats_clock();
+
+  sem_wait(&GROUP(gi).lock);
+  *wait += stats_clock() - start;
+}
+
+// Where to look first for blocks: the lowest group below home that the
+// treaps say has room for them, or home.
+static int lowest_group(int blocks) {
+  int gi;
+
+  for (gi = 0; gi < HOME_GROUP; gi++)
+    if (GROUP(gi).valid && __atomic_load_n(&GROUP(gi).free_blocks, __ATOMIC_RELAXED) >= blocks) return gi;
+  return HOME_GROUP;
+}
+
+// Takes group gi's lock if it comes free within HOME_WAIT_NS, adding
+// the time it took to wait. Returns -1 if it didn't.
+static int lock_home(int gi, int64_t *wait) {
+  int64_t start = stats_clock(), now = start;
+
+  while (sem_trywait(&GROUP(gi).lock) == -1) {
+    if ((now = stats_clock()) - start >= HOME_WAIT_NS) {
+      *wait += now - start;
+      return -1;
+    }
+    sched_yield();
+  }
+  *wait += now - start;
+  return 0;
+}
+
+// Finds room for blocks, sets them in the bitmap and logs it. Returns
+// the first block or -1 if there's no room.
+int group_alloc(int blocks) {
+  int n = SHM_EXTENTS->groups, gi, tries, limit, offset = -1, probes = 0, busy = 0;
+  int64_t start = stats_clock(), scanned = SCANNED, wait = 0;
+
+  if (blocks < 1 || blocks > ALLOC_GROUP_BLOCKS) return -1;
+
+  // While the file is being compacted, everything goes as low as it can.
+  if ((limit = __atomic_load_n(&SHM_EXTENTS->ceiling, __ATOMIC_RELAXED)) > 0) {
+    for (gi = 0; gi < n && gi * ALLOC_GROUP_BLOCKS < limit && offset == -1; gi++, probes++) {
+      lock_group(gi, &wait);
+      if ((offset = group_take_below(gi, blocks, limit)) != -1) wal_append(WAL_ALLOC, offset, blocks, NULL, 0);
+      sem_post(&GROUP(gi).lock);
+    }
+    if (offset != -1) {
+      HOME_GROUP = offset / ALLOC_GROUP_BLOCKS;
+      stats_alloc(start, probes, busy, wait, SCANNED - scanned, 0);
+      return offset;
+    }
+  }
+
+  // Try the groups from home on that nobody else is in right now. Home
+  // is worth a short wait, as moving on spreads a small file out.
+  HOME_GROUP = lowest_group(blocks) % n;
+  for (tries = 0; tries < n && tries < TRY_GROUPS && offset == -1; tries++, probes++) {
+    gi = (HOME_GROUP + tries) % n;
+    if (blocks == 1 && GROUP(gi).valid && (offset = take_single(&GROUP(gi))) != -1) {
+      wal_append(WAL_ALLOC, offset, 1, NULL, 0);
+    } else if (tries == 0 ? lock_home(gi, &wait) == 0 : sem_trywait(&GROUP(gi).lock) == 0) {
+      if ((offset = group_take(gi, blocks)) != -1) wal_append(WAL_ALLOC, offset, blocks, NULL, 0);
+      sem_post(&GROUP(gi).lock);
+    } else {
+      busy++;
+    }
+  }
+
+  // They were all busy or full. Wait for each in turn.
+  for (tries = 0; tries < n && offset == -1; tries++, probes++) {
+    gi = (HOME_GROUP + tries) % n;
+    lock_group(gi, &wait);
+    if ((offset = group_take(gi, blocks)) != -1) wal_append(WAL_ALLOC, offset, blocks, NULL, 0);
+    sem_post(&GROUP(gi).lock);
+  }
+
+  if (offset != -1) HOME_GROUP = gi;
+  stats_alloc(start, probes, busy, wait, SCANNED - scanned, offset == -1);
+  return offset;
+}
+
+// Logs blocks as free (unless that's been done already), clears them in
+// the bitmap and hands them back to the groups they came from.
+void group_free(int offset, int blocks, int log) {
+  int gi, n;
+
+  for (; blocks > 0; offset += n, blocks -= n) {
+    gi = offset / ALLOC_GROUP_BLOCKS;
+    n = (gi + 1) * ALLOC_GROUP_BLOCKS - offset;
+    if (n > blocks) n = blocks;
+
+    sem_wait(&GROUP(gi).lock);
+    if (log) wal_append(WAL_FREE, offset, n, NULL, 0);
+    group_give(gi, offset, n);
+    sem_post(&GROUP(gi).lock);
+  }
+}
+
+// Holds off every allocation and free that takes a lock, so a checkpoint
+// sees the bitmap and the log agree.
+void alloc_lock_all(void) {
+  for (int gi = 0; gi < ALLOC_GROUPS; gi++) sem_wait(&GROUP(gi).lock);
+}
+
+void alloc_unlock_all(void) {
+  for (int gi = ALLOC_GROUPS - 1; gi >= 0; gi--) sem_post(&GROUP(gi).lock);
+}
+
+// Asks every allocation to end by block limit if it can, or lifts that
+// with 0. Used to empty the end of the file while it is compacted.
+void alloc_set_ceiling(int limit) {
+  __atomic_store_n(&SHM_EXTENTS->ceiling, limit, __ATOMIC_SEQ_CST);
+}
+
+// Gives back every group's chunk of single blocks, so nothing past the
+// last block in use is spoken for. Called with every group locked.
+void alloc_drop_singles(void) {
+  for (int gi = 0; gi < ALLOC_GROUPS; gi++) drop_singles(gi);
+}
+
+
+// How many blocks are free in the summary stretch block is in, or -1
+// if its group hasn't been built yet.
+int64_t alloc_chunk_free(int64_t block) {
+  if (SHM_EXTENTS == NULL || block < 0 || block >= MAX_BLOCKS ||
+      !__atomic_load_n(&GROUP(block / ALLOC_GROUP_BLOCKS).built, __ATOMIC_SEQ_CST)) return -1;
+  return __atomic_load_n(&SHM_EXTENTS->chunk_free[block / SUMMARY_BLOCKS], __ATOMIC_RELAXED);
+}
+
+// Forgets every group's treaps. Each is built again from the bitmap the
+// next time it's used.
+void extent_rebuild(void) {
+  for (int gi = 0; gi < ALLOC_GROUPS; gi++) {
+    GROUP(gi).off_root = GROUP(gi).size_root = GROUP(gi).free_list = NIL;
+    GROUP(gi).extent_count = GROUP(gi).free_blocks = 0;
+    GROUP(gi).cursor = gi * ALLOC_GROUP_BLOCKS;
+    GROUP(gi).singles = 0;
+    GROUP(gi).built = GROUP(gi).valid = 0;
+  }
+  SHM_EXTENTS->unused = 1;
+}
+
+// Maps the groups and the extent pool into memory shared with every
+// process we fork.
+int extent_init(int capacity, int policy) {
+  size_t bytes = sizeof(struct extent_index) + capacity * sizeof(struct extent);
+
+  if ((SHM_EXTENTS = mmap((caddr_t)0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the extent index");
+    return -1;
+  }
+  SHM_EXTENTS->capacity = capacity;
+  SHM_EXTENTS->policy = policy;
+  SHM_EXTENTS->groups = ALLOC_GROUPS;
+
+  for (int gi = 0; gi < ALLOC_GROUPS; gi++) {
+    if (sem_init(&GROUP(gi).lock, 1, 1) == -1) {
+      perror("semaphore init failed");
+      return -1;
+    }
+    GROUP(gi).seed = 2463534242U + gi;
+  }
+
+  extent_rebuild();
+  return 0;
+}
@@ -0,0 +1,374 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Binary protocol, served on the same port as the text one.
+
+  A request is a struct bin_request followed by key_len bytes of key and
+  value_len bytes of value. A response is a struct bin_response followed
+  by value_len bytes: the value for a find, error text for a failure.
+  Header fields are little-endian. The request_id is handed back as-is,
+  so a client can match answers to pipelined requests.
+
+  BIN_REQUEST_MAGIC has its high bit set, so no text command can start
+  with it. That lets each request pick its protocol.
+
+  Keys are still strings: 1 to KEY_LEN - 1 bytes, no NULs. Values can be
+  anything up to MAX_VALUE_LEN. An insert's value is read straight into
+  a block-aligned buffer that goes to write_value() as it is.
+
+  Batches (BIN_MGET, BIN_MPUT, BIN_MDELETE) have no key of their own.
+  Their value is a list of up to MAX_BATCH entries, each a uint16 key
+  length and the key, followed for BIN_MPUT by a uint32 value length
+  and the value. The response value has one entry per key in the same
+  order: a uint8 status, a uint32 length and that many bytes.
+
+  BIN_KEYS scans keys in order (see scan.c). Its key is the prefix, the
+  start of a range or a cursor. Its value, if it has one, is a uint32
+  limit (0 for the default) followed by the end of the range, if it is
+  one. The keys come back in responses with status 2 (MORE), each a
+  list of uint16 key lengths and keys, and then a response with status
+  0 holding the cursor to go on from, which is empty if there are no
+  keys left.
+
+  BIN_SNAPSHOT takes a snapshot (see snapshot.c). It has no key. Its
+  value, if it has one, is the uint64 id of the snapshot to take what
+  changed since. The snapshot comes back in responses with status 2
+  (MORE), and then a response with status 0 holding its uint64 id.
+
+  BIN_STATS has no value. Its key, if it has one, is the format to
+  answer in, as for the text stats command.
+*/
+
+#define IS_BATCH(op) ((op) == BIN_MGET || (op) == BIN_MPUT || (op) == BIN_MDELETE)
+
+int queue_binary(struct connection* conn, uint64_t request_id, struct response_struct response) {
+  struct bin_response header;
+  int len = (response.msg_len == -1) ? strlen(response.msg) : response.msg_len;
+  int rc;
+
+  header.magic = BIN_RESPONSE_MAGIC;
+  header.status = response.status;
+  header.reserved = 0;
+  header.value_len = htole32(len);
+  header.request_id = htole64(request_id);
+  rc = queue_output(conn, &header, sizeof(header));
+  if (response.value.blocks > 0) {
+    if (rc == 0) rc = queue_value(conn, response.value, len);
+    btree_read_end(); // fetch_value() kept it from being freed until now.
+    return rc;
+  }
+  if (rc == -1) return -1;
+  return queue_output(conn, response.msg, len);
+}
+
+// Answers with an error. Hangs up afterwards if we can't tell where the
+// next request starts.
+static int fail_binary(struct connection* conn, uint64_t request_id, const char* msg, int hang_up) {
+  struct response_struct response = {.status = 1, .msg = (char*)msg, .msg_len = -1};
+
+  if (hang_up) conn->quit = 1;
+  return queue_binary(conn, request_id, response);
+}
+
+// Splits a batch's payload into keys and, for BIN_MPUT, value buffers.
+// Returns how many entries it has, or -1 if it doesn't parse.
+static int parse_batch(const char* payload, uint32_t len, int opcode, char (*keys)[KEY_LEN], char** buffers) {
+  uint32_t pos = 0, value_len;
+  uint16_t key_len;
+  int count = 0;
+
+  while (pos < len) {
+    if (count == MAX_BATCH || len - pos < sizeof(key_len)) return -1;
+    memcpy(&key_len, payload + pos, sizeof(key_len));
+    key_len = le16toh(key_len);
+    pos += sizeof(key_len);
+    if (key_len == 0 || key_len >= KEY_LEN || len - pos < key_len ||
+        memchr(payload + pos, '\0', key_len) != NULL) return -1;
+    if (keys != NULL) {
+      memcpy(keys[count], payload + pos, key_len);
+      keys[count][key_len] = '\0';
+    }
+    pos += key_len;
+
+    if (opcode == BIN_MPUT) {
+      if (len - pos < sizeof(value_len)) return -1;
+      memcpy(&value_len, payload + pos, sizeof(value_len));
+      value_len = le32toh(value_len);
+      pos += sizeof(value_len);
+      if (len - pos < value_len) return -1;
+      if (buffers != NULL) {
+        if ((buffers[count] = new_value_buffer(value_len)) == NULL) return -1;
+        memcpy(VALUE_DATA(buffers[count]), payload + pos, value_len);
+      }
+      pos += value_len;
+    }
+    count++;
+  }
+  return count;
+}
+
+// Runs a batch once its whole payload has arrived. Running out of
+// memory fails the batch, not the server.
+static int run_batch(struct connection* conn) {
+  struct response_struct response = {.status = 0, .msg = NULL, .msg_len = 0};
+  struct response_struct* responses;
+  char (*keys)[KEY_LEN];
+  char** key_ptrs;
+  char** buffers;
+  uint32_t len, wire_len;
+  int64_t total = 0;
+  int count, i, rc;
+  char* body;
+
+  if ((count = parse_batch(VALUE_DATA(conn->value), conn->value_len, conn->pending.opcode, NULL, NULL)) < 1)
+    return fail_binary(conn, conn->pending.request_id, "Bad request.", 0);
+
+  keys = malloc(sizeof(*keys) * count);
+  key_ptrs = malloc(sizeof(char*) * count);
+  buffers = calloc(count, sizeof(char*));
+  responses = malloc(sizeof(struct response_struct) * count);
+  if (keys == NULL || key_ptrs == NULL || buffers == NULL || responses == NULL ||
+      parse_batch(VALUE_DATA(conn->value), conn->value_len, conn->pending.opcode, keys, buffers) == -1) {
+    perror("malloc failed in run_batch()"); // Only an allocation can fail the second parse.
+    for (i = 0; buffers != NULL && i < count; i++) free(buffers[i]);
+    free(keys);
+    free(key_ptrs);
+    free(buffers);
+    free(responses);
+    return fail_binary(conn, conn->pending.request_id, "Out of memory.", 0);
+  }
+  for (i = 0; i < count; i++) key_ptrs[i] = keys[i];
+
+  switch (conn->pending.opcode) {
+    case BIN_MGET:
+      fetch_values(key_ptrs, count, responses);
+      break;
+
+    case BIN_MPUT:
+      store_values(key_ptrs, buffers, count, responses);
+      break;
+
+    case BIN_MDELETE:
+      remove_values(key_ptrs, count, responses);
+      break;
+  }
+
+  // fetch_values() keeps the values to MAX_BATCH_BYTES, so this fits.
+  for (i = 0; i < count; i++)
+    total += 5 + ((responses[i].msg_len == -1) ? strlen(responses[i].msg) : responses[i].msg_len);
+  if (total > INT_MAX || (response.msg = malloc(total)) == NULL) {
+    perror("malloc failed in run_batch()");
+    response.status = 1;
+    response.msg = "Out of memory.";
+    response.msg_len = -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (response.msg_len != -1) {
+      len = (responses[i].msg_len == -1) ? strlen(responses[i].msg) : responses[i].msg_len;
+      body = response.msg + response.msg_len;
+      body[0] = responses[i].status;
+      wire_len = htole32(len);
+      memcpy(body + 1, &wire_len, 4);
+      memcpy(body + 5, responses[i].msg, len);
+      response.msg_len += 5 + len;
+      if (responses[i].status != 0) response.status = 1;
+    }
+    free(responses[i].msg);
+  }
+
+  rc = queue_binary(conn, conn->pending.request_id, response);
+  if (response.msg_len != -1) free(response.msg);
+  free(keys);
+  free(key_ptrs);
+  free(buffers);
+  free(responses);
+  return rc;
+}
+
+// Runs a keys request, whose key and value start at key.
+static int run_keys(struct connection* conn, const struct bin_request* req, const char* key) {
+  struct key_scan scan;
+  char start[KEYS_CURSOR_LEN];
+  char end[KEY_LEN];
+  const char* args = key + req->key_len;
+  uint32_t limit = 0;
+
+  memcpy(start, key, req->key_len);
+  start[req->key_len] = '\0';
+  if (req->value_len > 0) {
+    memcpy(&limit, args, sizeof(limit));
+    limit = le32toh(limit);
+    memcpy(end, args + sizeof(limit), req->value_len - sizeof(limit));
+    end[req->value_len - sizeof(limit)] = '\0';
+    if (strlen(end) != req->value_len - sizeof(limit))
+      return fail_binary(conn, req->request_id, "Bad key.", 0);
+  }
+  if (limit > KEYS_MAX_LIMIT) limit = KEYS_MAX_LIMIT;
+  if (scan_init(&scan, start, req->value_len > sizeof(limit) ? end : NULL, limit) == -1)
+    return fail_binary(conn, req->request_id, "Key too long.", 0);
+  return queue_keys(conn, &scan, 1, req->request_id);
+}
+
+// Runs a snapshot request, whose value starts at args.
+static int run_snapshot(struct connection* conn, const struct bin_request* req, const char* args) {
+  uint64_t base_id = 0;
+
+  if (req->value_len > 0) {
+    memcpy(&base_id, args, sizeof(base_id));
+    base_id = le64toh(base_id);
+  }
+  return queue_snapshot(conn, base_id, 1, req->request_id);
+}
+
+// Runs a stats request, whose key, if any, is the format.
+static int run_stats(struct connection* conn, const struct bin_request* req, const char* key) {
+  struct response_struct response = {.status = 0};
+  char* text;
+  int format = STATS_SUMMARY, rc;
+
+  if (req->key_len == strlen("prometheus") && memcmp(key, "prometheus", req->key_len) == 0)
+    format = STATS_PROMETHEUS;
+  else if (req->key_len > 0)
+    return fail_binary(conn, req->request_id, "Unknown stats format.", 0);
+  if ((response.msg_len = stats_dump(format, &text)) == -1)
+    return fail_binary(conn, req->request_id, "Couldn't gather the stats.", 0);
+  response.msg = text;
+  rc = queue_binary(conn, req->request_id, response);
+  free(text);
+  return rc;
+}
+
+// Runs an insert or a batch once its whole value has arrived.
+int finish_binary(struct connection* conn) {
+  struct response_struct response;
+  int64_t started = stats_clock();
+  int rc;
+
+  if (IS_BATCH(conn->pending.opcode)) {
+    rc = run_batch(conn);
+    free(conn->value);
+  } else {
+    response = store_value(conn->pending_key, conn->value);
+    rc = queue_binary(conn, conn->pending.request_id, response);
+    free(response.msg);
+  }
+  conn->value = NULL;
+  conn->value_len = conn->value_have = 0;
+  stats_record(conn->pending.opcode, started);
+  return rc;
+}
+
+// Runs the binary request at start of the input buffer. Returns the
+// bytes it used, 0 if it hasn't all arrived yet, or -1 on error.
+int run_binary(struct connection* conn, int start) {
+  struct bin_request req;
+  struct response_struct response;
+  char* key = conn->in + start + sizeof(req);
+  int have = conn->in_len - start;
+  int64_t started = stats_clock();
+  int take, rc;
+
+  if (have < (int)sizeof(req)) return 0;
+  memcpy(&req, conn->in + start, sizeof(req));
+  req.key_len = le16toh(req.key_len);
+  req.value_len = le32toh(req.value_len);
+  req.request_id = le64toh(req.request_id);
+
+  if (req.value_len > MAX_VALUE_LEN || (req.value_len > 0 && req.opcode != BIN_INSERT && !IS_BATCH(req.opcode) &&
+      (req.opcode != BIN_KEYS || req.value_len < sizeof(uint32_t) || req.value_len >= sizeof(uint32_t) + KEY_LEN) &&
+      (req.opcode != BIN_SNAPSHOT || req.value_len != sizeof(uint64_t))))
+    return fail_binary(conn, req.request_id, "Bad request.", 1) == -1 ? -1 : have;
+  if (req.key_len >= (req.opcode == BIN_KEYS ? KEYS_CURSOR_LEN : KEY_LEN))
+    return fail_binary(conn, req.request_id, "Key too long.", 1) == -1 ? -1 : have;
+  if (have < (int)sizeof(req) + req.key_len) return 0;
+
+  if (req.opcode == BIN_QUIT) {
+    conn->quit = 1;
+    return sizeof(req) + req.key_len;
+  }
+  if (req.opcode == BIN_SNAPSHOT) {
+    if (have < (int)(sizeof(req) + req.key_len + req.value_len)) return 0;
+    rc = (req.key_len > 0) ? fail_binary(conn, req.request_id, "Bad key.", 0) : run_snapshot(conn, &req, key);
+    stats_record(req.opcode, started);
+    return rc == -1 ? -1 : sizeof(req) + req.key_len + req.value_len;
+  }
+  if (req.opcode == BIN_STATS) {
+    rc = run_stats(conn, &req, key);
+    stats_record(req.opcode, started);
+    return rc == -1 ? -1 : sizeof(req) + req.key_len;
+  }
+  if (!IS_BATCH(req.opcode) && (req.key_len == 0 || memchr(key, '\0', req.key_len) != NULL)) {
+    rc = fail_binary(conn, req.request_id, "Bad key.", req.value_len > 0);
+    return rc == -1 ? -1 : sizeof(req) + req.key_len;
+  }
+
+  // A keys request's key can be a cursor, which is longer than a key.
+  if (req.opcode == BIN_KEYS) {
+    if (have < (int)(sizeof(req) + req.key_len + req.value_len)) return 0;
+    rc = run_keys(conn, &req, key);
+    stats_record(req.opcode, started);
+    return rc == -1 ? -1 : sizeof(req) + req.key_len + req.value_len;
+  }
+
+  conn->pending = req;
+  memcpy(conn->pending_key, key, req.key_len);
+  conn->pending_key[req.key_len] = '\0';
+
+  switch (req.opcode) {
+
+    case BIN_INSERT:
+    case BIN_MGET: // Batches carry their keys in the value.
+    case BIN_MPUT:
+    case BIN_MDELETE:
+      // Take as much of the value as has come in. read_input() puts the
+      // rest straight into the buffer.
+      if ((conn->value = new_value_buffer(req.value_len)) == NULL) return -1;
+      conn->value_len = req.value_len;
+      take = have - (int)sizeof(req) - req.key_len;
+      if (take > (int)req.value_len) take = req.value_len;
+      memcpy(VALUE_DATA(conn->value), key + req.key_len, take);
+      conn->value_have = take;
+      if (conn->value_have == conn->value_len && finish_binary(conn) == -1) return -1;
+      return sizeof(req) + req.key_len + take;
+
+    case BIN_FIND:
+      response = fetch_value(conn->pending_key);
+      break;
+
+    case BIN_DELETE:
+      response = remove_value(conn->pending_key);
+      break;
+
+    default:
+      rc = fail_binary(conn, req.request_id, "Unknown command.", 0);
+      return rc == -1 ? -1 : sizeof(req) + req.key_len;
+  }
+
+  rc = queue_binary(conn, req.request_id, response);
+  free(response.msg);
+  stats_record(req.opcode, started);
+  return rc == -1 ? -1 : sizeof(req) + req.key_len;
+}
@@ -0,0 +1,1565 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  The index is a B+tree of 4 KB slotted pages kept in the db file.
+
+  A page starts with a struct btree_page_header, then the key prefix that
+  every key on the page shares, then an array of 2-byte slots giving the
+  offset of each cell. Cells are packed at the end of the page and hold
+  the rest of a key (its suffix) followed by a block pointer:
+
+    uint16_t suffix_len | suffix bytes | int64_t block_offset | int blocks |
+    uint16_t offset | uint16_t size
+
+  Leaves map keys to the block_ptr of a stored value.
+
+  Inner pages hold separator keys. The header link is the leftmost child
+  and each cell points at the child covering keys >= its separator.
+  Separators are cut down to the shortest string that still divides the
+  two leaves (suffix truncation), which keeps inner fanout high.
+
+  Lookups search the page in place. Changes unpack a page into a
+  struct btree_node, edit it there and pack it back, splitting it by
+  bytes whenever it no longer fits in a page.
+
+  The tree is copy-on-write. A change never writes over a page the tree
+  can reach: it writes a changed page to a new block, which changes the
+  parent's pointer to it, and so on up to a new root. Block 0 of the db
+  file holds a struct btree_meta that locates the root. Changes take
+  INDEX_LOCK, so there is one writer at a time, and read and write
+  pages through the buffer pool (see buffer_pool.c). When a change ends
+  its pages are written out and the new root is published in
+  SHM_INDEX, for every process to see.
+
+  Readers take no lock. Each thread claims a slot in SHM_INDEX once,
+  and a read notes in it the version of the tree it starts from, then
+  walks down from that version's root reading pages straight from
+  DB_MAP. Pages a change replaces are retired with the version that
+  dropped them, and given back only once no reader is on an older one.
+  A process that dies mid-read gets its slot cleared when a writer
+  finds itself waiting on it. If every slot is taken, a read takes
+  INDEX_LOCK instead.
+
+  Values are looked after the same way. A find that reads the value it
+  found does it all inside btree_read_begin() and btree_read_end(), and
+  a value a change drops from the tree is handed to
+  btree_retire_values(), which frees it, or lets its slab slot be
+  filled again, only once no reader is on a version that reached it.
+
+  Leaves aren't linked to each other, as relinking the leaf before a
+  copied one would copy its path too. A scan keeps the way down and
+  climbs back up it to move on to the next leaf.
+
+  Each change is bracketed in the log, with the pages it retires logged
+  as free inside it, so a crash can't leave half of one behind. Until a
+  retired page is given back, SHM_INDEX counts it as pending, and the
+  log is kept.
+*/
+
+#define PAGE_HEADER_SIZE ((int)sizeof(struct btree_page_header))
+#define CELL_PTR_SIZE ((int)(sizeof(int64_t) + sizeof(int) + 2 * sizeof(uint16_t)))
+#define MIN_FILL (BLOCK_SIZE / 4)  // Pages emptier than this get merged or topped up.
+
+static const struct block_ptr META_PTR = {.block_offset = BTREE_META_BLOCK, .blocks = 1};
+static const struct block_ptr NULL_PTR = {.block_offset = 0, .blocks = 0};
+
+#define MAX_CHANGE_PAGES 64 // Pages one change can make or retire.
+
+struct retiring_page { // A page the current change dropped from the tree.
+  struct block_ptr  ptr;
+  int               fresh;       // Made by this change, so no reader has seen it.
+};
+
+static __thread struct block_ptr FRESH_PAGES[MAX_CHANGE_PAGES]; // Made by this change, so safe to write over.
+static __thread int FRESH_COUNT = 0;
+static __thread struct retiring_page RETIRING[MAX_CHANGE_PAGES]; // Retired when the change is published.
+static __thread int RETIRING_COUNT = 0;
+static __thread int64_t NEW_ROOT = -1; // Root the current change put in the meta block.
+static __thread struct btree_meta NEW_META; // Written to block 0 when the change ends.
+static __thread int READER_SLOT = -1;  // This thread's slot in SHM_INDEX, once it has one.
+static __thread int READ_DEPTH = 0;    // Reads this thread has begun and not yet ended.
+
+struct btree_split { // Handed back up the tree when a node splits.
+  int               split;
+  char              key[KEY_LEN];
+  struct block_ptr  right;
+};
+
+
+static int common_prefix(const char *a, const char *b) {
+  int i = 0;
+  while (a[i] != '\0' && a[i] == b[i]) i++;
+  return i;
+}
+
+static int cell_size(int suffix_len) {
+  return sizeof(uint16_t) + sizeof(uint16_t) + suffix_len + CELL_PTR_SIZE;
+}
+
+// Bytes of key prefix that node would share across a page.
+static int node_prefix_len(const struct btree_node *node) {
+  if (node->key_count < 2) return 0;
+  return common_prefix(node->keys[0], node->keys[node->key_count - 1]);
+}
+
+// How many bytes node takes up once packed into a page.
+static int node_size(const struct btree_node *node) {
+  int i, prefix_len = node_prefix_len(node), size = PAGE_HEADER_SIZE + prefix_len;
+
+  for (i = 0; i < node->key_count; i++)
+    size += cell_size(strlen(node->keys[i]) - prefix_len);
+  return size;
+}
+
+static int pack_node(const struct btree_node *node, char *page) {
+
+  struct btree_page_header header;
+  uint16_t slot, suffix_len;
+  int i, prefix_len = node_prefix_len(node), offset = BLOCK_SIZE;
+  char* slots = page + PAGE_HEADER_SIZE + prefix_len;
+
+  if (node_size(node) > BLOCK_SIZE) {
+    fprintf(stderr, "Index node is too big for a page.\n");
+    return -1;
+  }
+
+  memset(page, '\0', BLOCK_SIZE);
+  for (i = 0; i < node->key_count; i++) {
+    suffix_len = strlen(node->keys[i]) - prefix_len;
+    offset -= cell_size(suffix_len) - sizeof(uint16_t);
+    slot = offset;
+    memcpy(slots + i * sizeof(uint16_t), &slot, sizeof(uint16_t));
+    memcpy(page + offset, &suffix_len, sizeof(uint16_t));
+    memcpy(page + offset + sizeof(uint16_t), node->keys[i] + prefix_len, suffix_len);
+    memcpy(page + offset + sizeof(uint16_t) + suffix_len, &node->child_ptrs[node->leaf ? i : i + 1].block_offset, sizeof(int64_t));
+    memcpy(page + offset + sizeof(uint16_t) + suffix_len + sizeof(int64_t), &node->child_ptrs[node->leaf ? i : i + 1].blocks, sizeof(int));
+    memcpy(page + offset + sizeof(uint16_t) + suffix_len + sizeof(int64_t) + sizeof(int), &node->child_ptrs[node->leaf ? i : i + 1].offset, sizeof(uint16_t));
+    memcpy(page + offset + sizeof(uint16_t) + suffix_len + sizeof(int64_t) + sizeof(int) + sizeof(uint16_t), &node->child_ptrs[node->leaf ? i : i + 1].size, sizeof(uint16_t));
+  }
+
+  header.leaf = node->leaf;
+  header.key_count = node->key_count;
+  header.prefix_len = prefix_len;
+  header.cell_start = offset;
+  header.link = node->leaf ? NULL_PTR : node->child_ptrs[0];
+  memcpy(page, &header, PAGE_HEADER_SIZE);
+  if (prefix_len > 0) memcpy(page + PAGE_HEADER_SIZE, node->keys[0], prefix_len);
+  return 0;
+}
+
+// Finds the cell for the i-th key on a page. Fills in the suffix
+// length and returns a pointer to the suffix bytes.
+static const char* page_cell(const char *page, const struct btree_page_header *header, int i, uint16_t *suffix_len) {
+  uint16_t slot;
+
+  memcpy(&slot, page + PAGE_HEADER_SIZE + header->prefix_len + i * sizeof(uint16_t), sizeof(uint16_t));
+  memcpy(suffix_len, page + slot, sizeof(uint16_t));
+  return page + slot + sizeof(uint16_t);
+}
+
+static struct block_ptr page_cell_ptr(const char *page, const struct btree_page_header *header, int i) {
+  struct block_ptr ptr;
+  uint16_t suffix_len;
+  const char* suffix = page_cell(page, header, i, &suffix_len);
+
+  memcpy(&ptr.block_offset, suffix + suffix_len, sizeof(int64_t));
+  memcpy(&ptr.blocks, suffix + suffix_len + sizeof(int64_t), sizeof(int));
+  memcpy(&ptr.offset, suffix + suffix_len + sizeof(int64_t) + sizeof(int), sizeof(uint16_t));
+  memcpy(&ptr.size, suffix + suffix_len + sizeof(int64_t) + sizeof(int) + sizeof(uint16_t), sizeof(uint16_t));
+  return ptr;
+}
+
+static void unpack_node(const char *page, struct btree_node *node) {
+
+  struct btree_page_header header;
+  const char* suffix;
+  uint16_t suffix_len;
+  int i;
+
+  memcpy(&header, page, PAGE_HEADER_SIZE);
+  node->leaf = header.leaf;
+  node->key_count = header.key_count;
+  if (!header.leaf) node->child_ptrs[0] = header.link;
+
+  for (i = 0; i < header.key_count; i++) {
+    suffix = page_cell(page, &header, i, &suffix_len);
+    memcpy(node->keys[i], page + PAGE_HEADER_SIZE, header.prefix_len);
+    memcpy(node->keys[i] + header.prefix_len, suffix, suffix_len);
+    node->keys[i][header.prefix_len + suffix_len] = '\0';
+    node->child_ptrs[header.leaf ? i : i + 1] = page_cell_ptr(page, &header, i);
+  }
+}
+
+// Returns the position of the first key on the page that is >= key,
+// and sets exact if that key is equal to it.
+static int page_search(const char *page, const struct btree_page_header *header,
+    const char *key, int key_len, int *exact) {
+
+  const char* suffix;
+  uint16_t suffix_len;
+  int lo = 0, hi = header->key_count, mid, c;
+  int prefix_len = header->prefix_len;
+
+  *exact = 0;
+
+  // Every key on the page starts with the prefix, so a key that
+  // doesn't sorts before or after all of them.
+  c = memcmp(key, page + PAGE_HEADER_SIZE, key_len < prefix_len ? key_len : prefix_len);
+  if (c < 0 || (c == 0 && key_len < prefix_len)) return 0;
+  if (c > 0) return header->key_count;
+
+  key += prefix_len;
+  key_len -= prefix_len;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    suffix = page_cell(page, header, mid, &suffix_len);
+    c = memcmp(suffix, key, suffix_len < key_len ? suffix_len : key_len);
+    if (c == 0) c = suffix_len - key_len;
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      if (c == 0) *exact = 1;
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Returns the position of the first key in the node that is >= key.
+static int lower_bound(const struct btree_node *node, const char *key) {
+  int lo = 0, hi = node->key_count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (strcmp(node->keys[mid], key) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Returns the position of the child that covers key.
+static int child_index(const struct btree_node *node, const char *key) {
+  int lo = 0, hi = node->key_count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (strcmp(node->keys[mid], key) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Builds the shortest key that is > left and <= right.
+static void make_separator(const char *left, const char *right, char *sep) {
+  int len = common_prefix(left, right) + 1;
+
+  memcpy(sep, right, len);
+  sep[len] = '\0';
+}
+
+
+static struct btree_node* new_node(int leaf) {
+  struct btree_node* node;
+
+  if ((node = malloc(sizeof(struct btree_node))) == NULL) {
+    perror("malloc failed in new_node()");
+    return NULL;
+  }
+  node->leaf = leaf;
+  node->key_count = 0;
+  node->child_ptrs[0] = NULL_PTR;
+  return node;
+}
+
+static int read_node(struct block_ptr ptr, struct btree_node *node, int depth) {
+  char* page;
+
+  if ((page = pool_pin(ptr, depth, 1)) == NULL) return -1;
+  unpack_node(page, node);
+  pool_unpin(ptr, page, 0);
+  return 0;
+}
+
+// Packs node into the page at ptr, in place.
+static int put_node(struct block_ptr ptr, const struct btree_node *node, int depth) {
+  char* page;
+  int rc;
+
+  if ((page = pool_pin(ptr, depth, 0)) == NULL) return -1;
+  rc = pack_node(node, page);
+  if (pool_unpin(ptr, page, rc == 0) == -1) rc = -1;
+  return rc;
+}
+
+static int is_fresh(struct block_ptr ptr) {
+  int i;
+
+  for (i = 0; i < FRESH_COUNT; i++)
+    if (FRESH_PAGES[i].block_offset == ptr.block_offset) return 1;
+  return 0;
+}
+
+// Drops a page from the tree. It is given back once the change is
+// published and no reader can be on it.
+static int retire_page(struct block_ptr ptr) {
+  int i;
+
+  if (RETIRING_COUNT == MAX_CHANGE_PAGES) {
+    fprintf(stderr, "Index change retires too many pages.\n");
+    return -1;
+  }
+  RETIRING[RETIRING_COUNT].ptr = ptr;
+  RETIRING[RETIRING_COUNT].fresh = 0;
+  for (i = 0; i < FRESH_COUNT; i++) {
+    if (FRESH_PAGES[i].block_offset != ptr.block_offset) continue;
+    FRESH_PAGES[i] = FRESH_PAGES[--FRESH_COUNT];
+    RETIRING[RETIRING_COUNT].fresh = 1;
+    break;
+  }
+  RETIRING_COUNT++;
+  return 0;
+}
+
+static int create_node(struct block_ptr *ptr, const struct btree_node *node, int depth) {
+  int block_offset;
+
+  if (FRESH_COUNT == MAX_CHANGE_PAGES) {
+    fprintf(stderr, "Index change makes too many pages.\n");
+    return -1;
+  }
+  if ((block_offset = create_block_reservation(1)) == -1) {
+    fprintf(stderr, "Failed to reserve space for an index page.\n");
+    return -1;
+  }
+  ptr->block_offset = block_offset;
+  ptr->blocks = 1;
+  ptr->offset = 0;
+  ptr->size = 0;
+  if (put_node(*ptr, node, depth) == -1) {
+    release_block_reservation(block_offset, 1);
+    return -1;
+  }
+  FRESH_PAGES[FRESH_COUNT++] = *ptr;
+  return 0;
+}
+
+// Writes node back. A page this change made is written over; any other
+// is copied to a new page, and ptr is pointed at it.
+static int write_node(struct block_ptr *ptr, const struct btree_node *node, int depth) {
+  struct block_ptr old = *ptr;
+
+  if (is_fresh(old)) return put_node(old, node, depth);
+  if (create_node(ptr, node, depth) == -1) return -1;
+  return retire_page(old);
+}
+
+static int read_meta(struct btree_meta *meta) {
+  char* page;
+
+  if (NEW_ROOT != -1) {
+    *meta = NEW_META;
+    return 0;
+  }
+  if ((page = pool_pin(META_PTR, 0, 1)) == NULL) return -1;
+  memcpy(meta, page, sizeof(struct btree_meta));
+  pool_unpin(META_PTR, page, 0);
+
+  if (meta->magic != BTREE_MAGIC) {
+    fprintf(stderr, "Bad magic number in the index meta block.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Holds the meta block for end_change(), which writes it once the rest
+// of the change is in place.
+static int write_meta(const struct btree_meta *meta) {
+  NEW_META = *meta;
+  NEW_ROOT = meta->root.block_offset;
+  return 0;
+}
+
+
+// Puts key at position pos. In a leaf ptr is the key's value; in an
+// inner node it is the child to the right of the key.
+static void insert_at(struct btree_node *node, int pos, const char *key, struct block_ptr ptr) {
+  int n = node->key_count, p = node->leaf ? pos : pos + 1;
+
+  memmove(node->keys[pos + 1], node->keys[pos], (n - pos) * KEY_LEN);
+  memmove(&node->child_ptrs[p + 1], &node->child_ptrs[p], (n + !node->leaf - p) * sizeof(struct block_ptr));
+  strcpy(node->keys[pos], key);
+  node->child_ptrs[p] = ptr;
+  node->key_count++;
+}
+
+// Takes out the key at position pos along with its value, or with the
+// child to its right in an inner node.
+static void remove_at(struct btree_node *node, int pos) {
+  int n = node->key_count, p = node->leaf ? pos : pos + 1;
+
+  memmove(node->keys[pos], node->keys[pos + 1], (n - pos - 1) * KEY_LEN);
+  memmove(&node->child_ptrs[p], &node->child_ptrs[p + 1], (n + !node->leaf - p - 1) * sizeof(struct block_ptr));
+  node->key_count--;
+}
+
+// Packed size of the keys of node from position from up to to, as if
+// they had a page to themselves. sums holds running totals of key length.
+static int part_size(const struct btree_node *node, int from, int to, const int *sums) {
+  int count = to - from;
+  int prefix_len = (count > 1) ? common_prefix(node->keys[from], node->keys[to - 1]) : 0;
+
+  return PAGE_HEADER_SIZE + prefix_len + count * cell_size(0) + sums[to] - sums[from] - count * prefix_len;
+}
+
+// Picks where to divide an overfull node so that both halves fit in a
+// page and carry about the same number of bytes. Prefixes can shrink a
+// lot when keys are regrouped, so every split point is sized for real.
+// Returns -1 if there is no way to divide the node.
+static int split_point(const struct btree_node *node) {
+  int sums[BTREE_MAX_KEYS + 1];
+  int i, k, left, right, best = -1, best_diff = 0;
+  int n = node->key_count, inner = !node->leaf;
+
+  for (sums[0] = 0, i = 0; i < n; i++) sums[i + 1] = sums[i] + strlen(node->keys[i]);
+
+  // In an inner node the key at k moves up, so it joins neither half.
+  for (k = 1; k < n - inner; k++) {
+    left = part_size(node, 0, k, sums);
+    right = part_size(node, k + inner, n, sums);
+    if (left > BLOCK_SIZE || right > BLOCK_SIZE) continue;
+    if (best == -1 || abs(left - right) < best_diff) {
+      best = k;
+      best_diff = abs(left - right);
+    }
+  }
+
+  if (best == -1) fprintf(stderr, "Couldn't find a place to split an index page.\n");
+  return best;
+}
+
+// Moves the keys of node from position k on into right, and puts the
+// key that should divide them in the parent into sep. In an inner node
+// the key at k moves up into sep.
+static void divide_node(struct btree_node *node, int k, struct btree_node *right, char *sep) {
+  int i, n = node->key_count;
+
+  right->leaf = node->leaf;
+  if (node->leaf) {
+    right->key_count = n - k;
+    for (i = 0; i < right->key_count; i++) {
+      strcpy(right->keys[i], node->keys[k + i]);
+      right->child_ptrs[i] = node->child_ptrs[k + i];
+    }
+    node->key_count = k;
+    make_separator(node->keys[k - 1], right->keys[0], sep);
+  } else {
+    strcpy(sep, node->keys[k]);
+    right->key_count = n - k - 1;
+    for (i = 0; i < right->key_count; i++) {
+      strcpy(right->keys[i], node->keys[k + 1 + i]);
+      right->child_ptrs[i] = node->child_ptrs[k + 1 + i];
+    }
+    right->child_ptrs[i] = node->child_ptrs[k + 1 + i];
+    node->key_count = k;
+  }
+}
+
+// Writes node back, splitting off a new right-hand page if it no
+// longer fits in one.
+static int store_node(struct block_ptr *node_ptr, struct btree_node *node, struct btree_split *split, int depth) {
+  struct btree_node* right;
+  int k, rc = 0;
+
+  if (node_size(node) <= BLOCK_SIZE) return write_node(node_ptr, node, depth);
+
+  if ((k = split_point(node)) == -1) return -1;
+  if ((right = new_node(node->leaf)) == NULL) return -1;
+  divide_node(node, k, right, split->key);
+  if (create_node(&split->right, right, depth) == -1) {
+    rc = -1;
+  } else {
+    rc = write_node(node_ptr, node, depth);
+    split->split = 1;
+  }
+  free(right);
+  return rc;
+}
+
+
+// The oldest version of the tree a reader is on, or INT64_MAX if none
+// is. With check_dead set, readers whose process has gone are cleared.
+static int64_t oldest_reader(int check_dead) {
+  struct index_reader* r;
+  int64_t generation, oldest = INT64_MAX;
+  int i, slots = __atomic_load_n(&SHM_INDEX->reader_slots, __ATOMIC_ACQUIRE);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (i = 0; i < slots; i++) {
+    r = &SHM_INDEX->readers[i];
+    if ((generation = __atomic_load_n(&r->generation, __ATOMIC_SEQ_CST)) == 0) continue;
+    if (check_dead && kill(r->pid, 0) == -1 && errno == ESRCH) {
+      __atomic_compare_exchange_n(&r->generation, &generation, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    if (generation < oldest) oldest = generation;
+  }
+  return oldest;
+}
+
+// Gives back the retired pages no reader can be on any more. Callers
+// hold INDEX_LOCK.
+static void release_pages(int check_dead) {
+  struct retired_page* r;
+  int64_t oldest;
+
+  if (SHM_INDEX->retired_count == 0) return;
+  oldest = oldest_reader(check_dead);
+  while (SHM_INDEX->retired_count > 0) {
+    r = &SHM_INDEX->retired[SHM_INDEX->retired_head];
+    if (r->generation > oldest) break;
+    release_retired_blocks(r->block, 1);
+    SHM_INDEX->retired_head = (SHM_INDEX->retired_head + 1) % INDEX_RETIRED;
+    SHM_INDEX->retired_count--;
+  }
+}
+
+// Waits up to wait_ms, or for good if it's -1, until no more than keep
+// retired pages are left. Returns how many are. Callers hold INDEX_LOCK.
+static int wait_for_readers(int keep, int wait_ms) {
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 50000};
+  int naps;
+
+  release_pages(0);
+  if (SHM_INDEX->retired_count > keep) SHM_INDEX->waits++;
+  for (naps = 1; SHM_INDEX->retired_count > keep && (wait_ms == -1 || naps * 50 <= wait_ms * 1000); naps++) {
+    nanosleep(&nap, NULL);
+    release_pages(naps % 1000 == 0); // Every 50 ms, see if a reader died.
+  }
+  return SHM_INDEX->retired_count;
+}
+
+// Moves the retired values no reader can be on any more into due, after
+// the n already there. Returns how many there are now. Callers hold
+// INDEX_LOCK.
+static int take_values(struct block_ptr *due, int n, int check_dead) {
+  struct retired_value* r;
+  int64_t oldest;
+
+  if (SHM_INDEX->value_count == 0) return n;
+  oldest = oldest_reader(check_dead);
+  while (SHM_INDEX->value_count > 0) {
+    r = &SHM_INDEX->values[SHM_INDEX->value_head];
+    if (r->generation > oldest) break;
+    due[n++] = r->ptr;
+    SHM_INDEX->value_head = (SHM_INDEX->value_head + 1) % INDEX_RETIRED_VALUES;
+    SHM_INDEX->value_count--;
+  }
+  return n;
+}
+
+// Makes room in the retired value ring, freeing the values readers have
+// moved past. Lets INDEX_LOCK go while it waits, and gives up after
+// INDEX_STALL_MS. Callers hold INDEX_LOCK.
+static int value_room(void) {
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 50000};
+  struct block_ptr* due;
+  int naps, n;
+
+  if ((due = malloc(sizeof(struct block_ptr) * INDEX_RETIRED_VALUES)) == NULL) {
+    perror("malloc failed in value_room()");
+    return -1;
+  }
+  SHM_INDEX->waits++;
+  for (naps = 1; SHM_INDEX->value_count == INDEX_RETIRED_VALUES; naps++) {
+    n = take_values(due, 0, naps % 1000 == 0); // Every 50 ms, see if a reader died.
+    sem_post(INDEX_LOCK);
+    if (n > 0) {
+      delete_objs(due, n);
+    } else if (naps * 50 >= INDEX_STALL_MS * 1000) {
+      sem_wait(INDEX_LOCK);
+      free(due);
+      return -1;
+    } else {
+      nanosleep(&nap, NULL);
+    }
+    sem_wait(INDEX_LOCK);
+  }
+  free(due);
+  return 0;
+}
+
+// Frees values a change has dropped from the tree, as delete_objs()
+// does, once no reader can still be reading them. Those a reader may be
+// on are held back, and freed by a later call. Values no reader has
+// seen can go straight to delete_objs(). If readers hold the ring full
+// for INDEX_STALL_MS, the values left over stay allocated.
+int btree_retire_values(const struct block_ptr *ptrs, int count) {
+  struct retired_value* r;
+  struct block_ptr* due;
+  int i, n, rc = 0;
+
+  if (SHM_INDEX == NULL) return delete_objs(ptrs, count);
+
+  sem_wait(INDEX_LOCK);
+  for (i = 0; i < count; i++) {
+    if (ptrs[i].blocks < 1) continue;
+    if (SHM_INDEX->value_count == INDEX_RETIRED_VALUES && value_room() == -1) {
+      fprintf(stderr, "Readers held the index up for %d ms. Leaving %d dropped values allocated.\n",
+              INDEX_STALL_MS, count - i);
+      rc = -1;
+      break;
+    }
+    r = &SHM_INDEX->values[(SHM_INDEX->value_head + SHM_INDEX->value_count++) % INDEX_RETIRED_VALUES];
+    r->ptr = ptrs[i];
+    r->generation = SHM_INDEX->generation;
+  }
+  if ((due = malloc(sizeof(struct block_ptr) * (SHM_INDEX->value_count + 1))) == NULL) {
+    perror("malloc failed in btree_retire_values()");
+    sem_post(INDEX_LOCK);
+    return -1;
+  }
+  n = take_values(due, 0, 0);
+  sem_post(INDEX_LOCK);
+
+  if (delete_objs(due, n) == -1) rc = -1;
+  free(due);
+  return rc;
+}
+
+// Frees every value still held back, readers or not. For shutdown.
+// Callers hold INDEX_LOCK.
+void btree_free_values(void) {
+  struct block_ptr* due;
+  int n;
+
+  if (SHM_INDEX == NULL || SHM_INDEX->value_count == 0) return;
+  if ((due = malloc(sizeof(struct block_ptr) * SHM_INDEX->value_count)) == NULL) {
+    perror("malloc failed in btree_free_values()");
+    return;
+  }
+  for (n = 0; SHM_INDEX->value_count > 0; n++) {
+    due[n] = SHM_INDEX->values[SHM_INDEX->value_head].ptr;
+    SHM_INDEX->value_head = (SHM_INDEX->value_head + 1) % INDEX_RETIRED_VALUES;
+    SHM_INDEX->value_count--;
+  }
+  delete_objs(due, n);
+  free(due);
+}
+
+// Gives back whatever retired pages it can, waiting up to wait_ms for
+// readers still on them. Returns how many are left. For a checkpoint,
+// which can't empty the log while any are pending.
+int btree_release_pages(int wait_ms) {
+  if (SHM_INDEX == NULL) return 0;
+  return wait_for_readers(0, wait_ms);
+}
+
+void btree_report(void) {
+  int i, readers = 0;
+
+  if (SHM_INDEX == NULL) return;
+  for (i = 0; i < SHM_INDEX->reader_slots; i++) readers += (SHM_INDEX->readers[i].pid != 0);
+  fprintf(stderr, "Index: %lld versions published, %d retired pages and %d values waiting on readers, %d reader slots claimed, %lld reads took the lock, %lld waits for readers.\n",
+          (long long)SHM_INDEX->generation - 1, SHM_INDEX->retired_count, SHM_INDEX->value_count, readers,
+          (long long)SHM_INDEX->lock_reads, (long long)SHM_INDEX->waits);
+}
+
+
+// Takes INDEX_LOCK for a change, once the retired ring has room for
+// every page the change could retire. Readers make that room as they
+// move on, so the lock is let go while waiting, and after INDEX_STALL_MS
+// the change fails rather than hold up every writer behind a reader
+// that has stopped.
+static int lock_for_change(void) {
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 50000};
+  int naps;
+
+  for (naps = 0; ; naps++) {
+    sem_wait(INDEX_LOCK);
+    release_pages(naps > 0 && naps % 1000 == 0); // Every 50 ms, see if a reader died.
+    if (INDEX_RETIRED - SHM_INDEX->retired_count >= MAX_CHANGE_PAGES) return 0;
+    if (naps == 0) SHM_INDEX->waits++;
+    sem_post(INDEX_LOCK);
+    if (naps * 50 >= INDEX_STALL_MS * 1000) {
+      fprintf(stderr, "Readers held the index up for %d ms. Giving up on a change.\n", INDEX_STALL_MS);
+      return -1;
+    }
+    nanosleep(&nap, NULL);
+  }
+}
+
+static int begin_change(void) {
+  if (lock_for_change() == -1) return -1;
+  wal_append(WAL_INDEX_BEGIN, 0, 0, NULL, 0);
+  return 0;
+}
+
+// Finishes a change. If it put a new root in the meta block, its pages
+// are written out, then the meta block is logged, the change closed and
+// the root published. The meta block itself is only written once the
+// log is synced (see pool_put()), so a crash finds either the old root
+// or the whole change in the log. The pages it replaced are retired. If
+// it didn't put in a root, or its pages couldn't be written, the pages
+// it made are let go, and the old root stays.
+static int end_change(int rc) {
+  struct retired_page* r;
+  char meta[BLOCK_SIZE];
+  int i, published = (NEW_ROOT != -1);
+
+  if (published && pool_flush_except(BTREE_META_BLOCK) == -1) published = 0;
+  if (published) {
+    memset(meta, '\0', BLOCK_SIZE);
+    memcpy(meta, &NEW_META, sizeof(struct btree_meta));
+    if (wal_append(WAL_WRITE, BTREE_META_BLOCK * BLOCK_SIZE, 0, meta, BLOCK_SIZE) == -1) published = 0;
+  }
+  if (!published && NEW_ROOT != -1) rc = -1;
+
+  if (published) {
+    for (i = 0; i < RETIRING_COUNT; i++) {
+      pool_drop(RETIRING[i].ptr);
+      wal_append(WAL_FREE, RETIRING[i].ptr.block_offset, 1, NULL, 0);
+      __atomic_add_fetch(&SHM_INDEX->pending, 1, __ATOMIC_SEQ_CST);
+      r = &SHM_INDEX->retired[(SHM_INDEX->retired_head + SHM_INDEX->retired_count++) % INDEX_RETIRED];
+      r->block = RETIRING[i].ptr.block_offset;
+      r->generation = SHM_INDEX->generation + 1;
+    }
+  }
+  wal_append(WAL_INDEX_END, 0, 0, NULL, 0);
+
+  if (published) {
+    // Past the end record the change stands. The meta block waits in
+    // the pool for a checkpoint to write it, after syncing the log.
+    if (pool_put(META_PTR, meta) == -1) fprintf(stderr, "Couldn't write the index meta block. The log has it.\n");
+    __atomic_store_n(&SHM_INDEX->root, NEW_ROOT, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&SHM_INDEX->generation, SHM_INDEX->generation + 1, __ATOMIC_SEQ_CST);
+    release_pages(0);
+  } else {
+    for (i = 0; i < FRESH_COUNT; i++) {
+      pool_drop(FRESH_PAGES[i]);
+      release_block_reservation(FRESH_PAGES[i].block_offset, 1);
+    }
+    for (i = 0; i < RETIRING_COUNT; i++) {
+      if (!RETIRING[i].fresh) continue;
+      pool_drop(RETIRING[i].ptr);
+      release_block_reservation(RETIRING[i].ptr.block_offset, 1);
+    }
+  }
+  FRESH_COUNT = 0;
+  RETIRING_COUNT = 0;
+  NEW_ROOT = -1;
+
+  sem_post(INDEX_LOCK);
+  return rc;
+}
+
+
+// A forked child starts out with no reader slot of its own.
+static void forget_reader_slot(void) {
+  READER_SLOT = -1;
+}
+
+static int claim_reader_slot(void) {
+  struct index_reader* r;
+  int i, owner, slots, pid = getpid(), pass;
+
+  // Free slots first, then those of processes that have gone.
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < INDEX_READERS; i++) {
+      r = &SHM_INDEX->readers[i];
+      owner = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+      if (owner != 0 && (pass == 0 || kill(owner, 0) == 0 || errno != ESRCH)) continue;
+      if (!__atomic_compare_exchange_n(&r->pid, &owner, pid, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+      __atomic_store_n(&r->generation, 0, __ATOMIC_SEQ_CST);
+      while ((slots = __atomic_load_n(&SHM_INDEX->reader_slots, __ATOMIC_ACQUIRE)) <= i &&
+             !__atomic_compare_exchange_n(&SHM_INDEX->reader_slots, &slots, i + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+      READER_SLOT = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Starts a read of the index and returns the block of the root to read
+// from. Until end_read() no page or value of that version of the tree is
+// given back. Reads nest: one begun inside another reads the latest
+// root, which the outer one keeps too.
+static int64_t begin_read(void) {
+  struct index_reader* r;
+
+  if (READ_DEPTH++ > 0) return __atomic_load_n(&SHM_INDEX->root, __ATOMIC_SEQ_CST);
+  if (READER_SLOT == -1 && claim_reader_slot() == -1) {
+    sem_wait(INDEX_LOCK);
+    SHM_INDEX->lock_reads++;
+    return SHM_INDEX->root;
+  }
+
+  // A writer that misses the slot being set published its root first,
+  // so we read that one or a later one.
+  r = &SHM_INDEX->readers[READER_SLOT];
+  __atomic_store_n(&r->generation, __atomic_load_n(&SHM_INDEX->generation, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&SHM_INDEX->root, __ATOMIC_SEQ_CST);
+}
+
+static void end_read(void) {
+  if (--READ_DEPTH > 0) return;
+  if (READER_SLOT == -1) sem_post(INDEX_LOCK);
+  else __atomic_store_n(&SHM_INDEX->readers[READER_SLOT].generation, 0, __ATOMIC_RELEASE);
+}
+
+// Keeps what finds between here and btree_read_end() turn up from being
+// freed, so their values can be read. May hold INDEX_LOCK throughout, so
+// nothing in between may change the index.
+void btree_read_begin(void) {
+  begin_read();
+}
+
+void btree_read_end(void) {
+  end_read();
+}
+
+// Whether this thread is inside btree_read_begin(), and so mustn't wait
+// for readers.
+int btree_reading(void) {
+  return READ_DEPTH > 0;
+}
+
+// Returns a page for a reader: where it sits in DB_MAP, or read into buf
+// if the db file isn't mapped.
+static const char* read_page(int64_t block, char *buf) {
+  if (DB_MAP != NULL) return DB_MAP + block * BLOCK_SIZE;
+  if (storage_read(buf, BLOCK_SIZE, block * BLOCK_SIZE) == -1) {
+    perror("pread failed in read_page");
+    return NULL;
+  }
+  return buf;
+}
+
+// The child of an inner page to the right of its i-th separator, 0
+// being its link.
+static int64_t child_block(const char *page, const struct btree_page_header *header, int i) {
+  return (i == 0) ? header->link.block_offset : page_cell_ptr(page, header, i - 1).block_offset;
+}
+
+
+// Sets up the index the first time we see a fresh db file, and the
+// shared state readers find its root in.
+int btree_open(void) {
+
+  struct btree_meta meta;
+  struct btree_node* root;
+  int rc = 0;
+
+  if ((SHM_INDEX = mmap((caddr_t)0, sizeof(struct index_state), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the index state");
+    SHM_INDEX = NULL;
+    return -1;
+  }
+  memset(SHM_INDEX, '\0', sizeof(struct index_state));
+  SHM_INDEX->generation = 1;
+  pthread_atfork(NULL, NULL, forget_reader_slot);
+
+  if (begin_change() == -1) return -1;
+
+  if (bit_array_test(SHM_BLOCK_BITMAP, BTREE_META_BLOCK) != 0) {
+    if ((rc = read_meta(&meta)) == 0) SHM_INDEX->root = meta.root.block_offset;
+    return end_change(rc);
+  }
+
+  // Brand new database. Claim the meta block and start with an empty leaf.
+  if (create_block_reservation(1) != BTREE_META_BLOCK) {
+    fprintf(stderr, "Couldn't reserve the index meta block.\n");
+    return end_change(-1);
+  }
+
+  if ((root = new_node(1)) == NULL) return end_change(-1);
+  memset(&meta, '\0', sizeof(meta));
+  meta.magic = BTREE_MAGIC;
+  meta.height = 1;
+
+  if (create_node(&meta.root, root, 0) == -1 || write_meta(&meta) == -1) rc = -1;
+
+  free(root);
+  return end_change(rc);
+}
+
+
+// Walks down from the root to the leaf that would hold key. Returns
+// that leaf pinned, sets leaf_ptr and depth to where it is, and sets i
+// to the position of the first key on it that is >= key, and exact if
+// that key is equal to it. Callers hold INDEX_LOCK.
+static char* pin_leaf(const char *key, struct block_ptr *leaf_ptr, int *depth, int *i, int *exact) {
+
+  struct btree_meta meta;
+  struct btree_page_header header;
+  struct block_ptr child_ptr;
+  char* page;
+  int key_len = strlen(key);
+
+  if (read_meta(&meta) == -1) return NULL;
+
+  *leaf_ptr = meta.root;
+  for (*depth = 0; ; (*depth)++) {
+    if ((page = pool_pin(*leaf_ptr, *depth, 1)) == NULL) return NULL;
+    memcpy(&header, page, PAGE_HEADER_SIZE);
+    *i = page_search(page, &header, key, key_len, exact);
+    if (header.leaf) return page;
+
+    // Follow the child for the last separator <= key.
+    if (*exact) (*i)++;
+    child_ptr = (*i == 0) ? header.link : page_cell_ptr(page, &header, *i - 1);
+    pool_unpin(*leaf_ptr, page, 0);
+    *leaf_ptr = child_ptr;
+  }
+}
+
+// Looks up key. Returns 0 and fills in ptr if the key is found,
+// 1 if it isn't, and -1 on error.
+int btree_find(const char *key, struct block_ptr *ptr) {
+
+  struct btree_page_header header;
+  char buf[BLOCK_SIZE];
+  const char* page;
+  int64_t block;
+  int i, exact, depth, key_len = strlen(key), rc = 1;
+
+  block = begin_read();
+  for (depth = 0; ; depth++) {
+    if (depth == BTREE_MAX_HEIGHT || (page = read_page(block, buf)) == NULL) {
+      rc = -1;
+      break;
+    }
+    memcpy(&header, page, PAGE_HEADER_SIZE);
+    i = page_search(page, &header, key, key_len, &exact);
+    if (header.leaf) {
+      if (exact) {
+        *ptr = page_cell_ptr(page, &header, i);
+        rc = 0;
+      }
+      break;
+    }
+
+    // Follow the child for the last separator <= key.
+    block = child_block(page, &header, exact ? i + 1 : i);
+  }
+  end_read();
+  return rc;
+}
+
+// Copies out, in order, up to max keys that are >= from (> from if
+// after is set) and < end, or every key from there on if end is empty,
+// and their pointers too unless ptrs is NULL. Keeps the way down to the
+// leaf it is on, so a scan costs one walk down the tree however many
+// leaves it reads. Returns how many keys it found, which is less than
+// max only at the end of the range, or -1 on error.
+int btree_scan(const char *from, int after, const char *end, char (*keys)[KEY_LEN], struct block_ptr *ptrs, int max) {
+
+  struct btree_page_header header;
+  int64_t blocks[BTREE_MAX_HEIGHT]; // The way down, root first.
+  int at[BTREE_MAX_HEIGHT];         // The child taken on each inner page.
+  char buf[BLOCK_SIZE];
+  const char* suffix;
+  const char* page;
+  uint16_t suffix_len;
+  int i, exact, depth = 0, key_len = strlen(from), count = 0;
+
+  blocks[0] = begin_read();
+  while (1) {
+    if ((page = read_page(blocks[depth], buf)) == NULL) {
+      end_read();
+      return -1;
+    }
+    memcpy(&header, page, PAGE_HEADER_SIZE);
+    i = page_search(page, &header, from, key_len, &exact);
+    if (header.leaf) break;
+    if (depth + 1 == BTREE_MAX_HEIGHT) {
+      end_read();
+      return -1;
+    }
+    at[depth] = exact ? i + 1 : i;
+    blocks[depth + 1] = child_block(page, &header, at[depth]);
+    depth++;
+  }
+  if (exact && after) i++;
+
+  while (count < max) {
+    for (; i < header.key_count && count < max; i++) {
+      suffix = page_cell(page, &header, i, &suffix_len);
+      memcpy(keys[count], page + PAGE_HEADER_SIZE, header.prefix_len);
+      memcpy(keys[count] + header.prefix_len, suffix, suffix_len);
+      keys[count][header.prefix_len + suffix_len] = '\0';
+      if (end[0] != '\0' && strcmp(keys[count], end) >= 0) {
+        max = count; // Past the end of the range.
+        break;
+      }
+      if (ptrs != NULL) ptrs[count] = page_cell_ptr(page, &header, i);
+      count++;
+    }
+    if (count == max) break;
+
+    // On to the next leaf: back up to the nearest page with a child
+    // further right, then down the left edge of that child.
+    while (--depth >= 0) {
+      if ((page = read_page(blocks[depth], buf)) == NULL) {
+        end_read();
+        return -1;
+      }
+      memcpy(&header, page, PAGE_HEADER_SIZE);
+      if (at[depth] < header.key_count) break;
+    }
+    if (depth < 0) break;
+    at[depth]++;
+    blocks[depth + 1] = child_block(page, &header, at[depth]);
+    for (depth++; ; depth++) {
+      if ((page = read_page(blocks[depth], buf)) == NULL) {
+        end_read();
+        return -1;
+      }
+      memcpy(&header, page, PAGE_HEADER_SIZE);
+      if (header.leaf) break;
+      at[depth] = 0;
+      blocks[depth + 1] = header.link.block_offset;
+    }
+    i = 0;
+  }
+
+  end_read();
+  return count;
+}
+
+
+// Copies the meta block of the version of the tree readers are given
+// now. Callers hold INDEX_LOCK, so no change is half done.
+int btree_root(struct btree_meta *meta) {
+  return read_meta(meta);
+}
+
+static int walk_page(int64_t block, int depth, int (*visit)(struct block_ptr ptr, int page, void *arg), void *arg) {
+  struct btree_page_header header;
+  struct block_ptr page_ptr = {.block_offset = block, .blocks = 1};
+  char buf[BLOCK_SIZE];
+  const char* page;
+  int i, rc = 0;
+
+  if (depth == BTREE_MAX_HEIGHT || (page = read_page(block, buf)) == NULL) return -1;
+  memcpy(&header, page, PAGE_HEADER_SIZE);
+  if (visit(page_ptr, 1, arg) == -1) return -1;
+  for (i = 0; rc == 0 && i < header.key_count + !header.leaf; i++)
+    rc = header.leaf ? visit(page_cell_ptr(page, &header, i), 0, arg)
+                     : walk_page(child_block(page, &header, i), depth + 1, visit, arg);
+  return rc;
+}
+
+// Calls visit on every page of the version of the tree rooted at root,
+// and on the pointer of every key in it, in key order, each page before
+// the ones under it. Takes no lock: the caller keeps that version's
+// pages from being given back, as a snapshot does (see snapshot.c).
+int btree_walk(int64_t root, int (*visit)(struct block_ptr ptr, int page, void *arg), void *arg) {
+  return walk_page(root, 0, visit, arg);
+}
+
+
+static int insert_rec(struct block_ptr *node_ptr, int depth, const char *key, struct block_ptr value,
+    struct block_ptr *old, struct btree_split *split) {
+
+  struct btree_node* node;
+  struct btree_split child_split = {.split = 0};
+  int i, rc = 0;
+
+  if ((node = new_node(1)) == NULL) return -1;
+  if (read_node(*node_ptr, node, depth) == -1) {
+    free(node);
+    return -1;
+  }
+
+  if (node->leaf) {
+    i = lower_bound(node, key);
+    if (i < node->key_count && strcmp(node->keys[i], key) == 0) { // Replace.
+      *old = node->child_ptrs[i];
+      node->child_ptrs[i] = value;
+      rc = (write_node(node_ptr, node, depth) == -1) ? -1 : 1;
+    } else {
+      insert_at(node, i, key, value);
+      rc = store_node(node_ptr, node, split, depth);
+    }
+    free(node);
+    return rc;
+  }
+
+  // The child moves whatever happens to it, so this page is written too.
+  i = child_index(node, key);
+  rc = insert_rec(&node->child_ptrs[i], depth + 1, key, value, old, &child_split);
+  if (rc != -1) {
+    if (child_split.split) insert_at(node, i, child_split.key, child_split.right);
+    if (store_node(node_ptr, node, split, depth) == -1) rc = -1;
+  }
+  free(node);
+  return rc;
+}
+
+// Adds a level above the root when the root splits.
+static int grow_tree(struct btree_meta *meta, struct btree_split *split) {
+  struct btree_node* root;
+  int rc;
+
+  if ((root = new_node(0)) == NULL) return -1;
+  root->key_count = 1;
+  strcpy(root->keys[0], split->key);
+  root->child_ptrs[0] = meta->root;
+  root->child_ptrs[1] = split->right;
+  if ((rc = create_node(&meta->root, root, 0)) != -1) meta->height++;
+  free(root);
+  return rc;
+}
+
+// Adds key to the index pointing at ptr. Returns 0 if the key is new,
+// 1 if it replaced an existing entry (whose pointer is copied to old),
+// and -1 on error.
+int btree_insert(const char *key, struct block_ptr ptr, struct block_ptr *old) {
+
+  struct btree_meta meta;
+  struct btree_split split = {.split = 0};
+  int rc;
+
+  if (strlen(key) >= KEY_LEN) {
+    fprintf(stderr, "Key too long for the index.\n");
+    return -1;
+  }
+
+  if (begin_change() == -1) return -1;
+
+  if (read_meta(&meta) == -1) return end_change(-1);
+
+  rc = insert_rec(&meta.root, 0, key, ptr, old, &split);
+  if (rc != -1 && split.split && grow_tree(&meta, &split) == -1) rc = -1;
+  if (rc != -1 && write_meta(&meta) == -1) rc = -1;
+
+  return end_change(rc);
+}
+
+// Points key at to if it still points at from. Returns 0 if it did, 1 if
+// the key has since been changed or deleted, and -1 on error. Lets a
+// value be moved with no moment where its key points at neither copy.
+int btree_swap(const char *key, struct block_ptr from, struct block_ptr to) {
+
+  struct btree_page_header header;
+  struct btree_meta meta;
+  struct btree_split split = {.split = 0};
+  struct block_ptr leaf_ptr, ptr, old;
+  char* page;
+  int i, exact, depth, rc = 1;
+
+  if (begin_change() == -1) return -1;
+
+  if ((page = pin_leaf(key, &leaf_ptr, &depth, &i, &exact)) == NULL) return end_change(-1);
+  if (exact) {
+    memcpy(&header, page, PAGE_HEADER_SIZE);
+    ptr = page_cell_ptr(page, &header, i);
+    if (ptr.block_offset == from.block_offset && ptr.blocks == from.blocks &&
+        ptr.offset == from.offset && ptr.size == from.size) rc = 0;
+  }
+  pool_unpin(leaf_ptr, page, 0);
+
+  // Replacing a key's pointer never splits a page.
+  if (rc == 0) {
+    if (read_meta(&meta) == -1 || insert_rec(&meta.root, 0, key, to, &old, &split) == -1 ||
+        write_meta(&meta) == -1) rc = -1;
+  }
+  return end_change(rc);
+}
+
+// Copies the pages on the way down to key, starting from the lowest
+// that ends past limit, to new blocks. Returns how many it copied.
+static int move_rec(struct block_ptr *node_ptr, int depth, const char *key, int limit) {
+  struct btree_node* node;
+  int moved = 0;
+
+  if ((node = new_node(1)) == NULL) return -1;
+  if (read_node(*node_ptr, node, depth) == -1) {
+    free(node);
+    return -1;
+  }
+  if (!node->leaf) moved = move_rec(&node->child_ptrs[child_index(node, key)], depth + 1, key, limit);
+  if (moved != -1 && (moved > 0 || node_ptr->block_offset + node_ptr->blocks > limit))
+    moved = (write_node(node_ptr, node, depth) == -1) ? -1 : moved + 1;
+  free(node);
+  return moved;
+}
+
+// Moves the pages on the way down to key's leaf that end past limit to
+// blocks below it. The pages above them are copied too, as a change
+// always is. Compaction walks every key through here, so a change is
+// only made if some page is past the limit. Returns how many pages were
+// copied, or -1 on error.
+int btree_move_path(const char *key, int limit) {
+
+  struct btree_page_header header;
+  struct btree_meta meta;
+  struct block_ptr ptr, child;
+  char* page;
+  int i, exact, depth, key_len = strlen(key), past = 0, moved;
+
+  if (lock_for_change() == -1) return -1;
+
+  if (read_meta(&meta) == -1) {
+    sem_post(INDEX_LOCK);
+    return -1;
+  }
+  ptr = meta.root;
+  for (depth = 0; !past; depth++) {
+    if ((page = pool_pin(ptr, depth, 1)) == NULL) {
+      sem_post(INDEX_LOCK);
+      return -1;
+    }
+    past = (ptr.block_offset + ptr.blocks > limit);
+    memcpy(&header, page, PAGE_HEADER_SIZE);
+    i = page_search(page, &header, key, key_len, &exact);
+    if (exact) i++;
+    child = (header.leaf || i == 0) ? header.link : page_cell_ptr(page, &header, i - 1);
+    pool_unpin(ptr, page, 0);
+    if (header.leaf) break;
+    ptr = child;
+  }
+  if (!past) {
+    sem_post(INDEX_LOCK);
+    return 0;
+  }
+
+  wal_append(WAL_INDEX_BEGIN, 0, 0, NULL, 0);
+  if ((moved = move_rec(&meta.root, 0, key, limit)) > 0 && write_meta(&meta) == -1) moved = -1;
+  return end_change(moved);
+}
+
+
+// Tops up the child at position pos of parent after it fell below
+// MIN_FILL. The child is joined with a sibling; if the pair still
+// doesn't fit in one page it is divided again down the middle. depth
+// is the child's.
+static int rebalance(struct btree_node *parent, int pos, struct btree_node *child, int depth) {
+
+  struct btree_node *sibling, *left, *right;
+  int i, k, n, sep, rc = 0;
+
+  if ((sibling = new_node(child->leaf)) == NULL) return -1;
+
+  // The pair's pointers are child_ptrs[sep] and child_ptrs[sep + 1].
+  if (pos > 0) {
+    sep = pos - 1;
+    left = sibling;
+    right = child;
+    rc = read_node(parent->child_ptrs[sep], left, depth);
+  } else {
+    sep = pos;
+    left = child;
+    right = sibling;
+    rc = read_node(parent->child_ptrs[sep + 1], right, depth);
+  }
+  if (rc == -1) {
+    free(sibling);
+    return -1;
+  }
+
+  // Fold right into left.
+  n = left->key_count;
+  if (left->leaf) {
+    for (i = 0; i < right->key_count; i++) {
+      strcpy(left->keys[n + i], right->keys[i]);
+      left->child_ptrs[n + i] = right->child_ptrs[i];
+    }
+    left->key_count += right->key_count;
+  } else {
+    strcpy(left->keys[n], parent->keys[sep]);
+    for (i = 0; i < right->key_count; i++) {
+      strcpy(left->keys[n + 1 + i], right->keys[i]);
+      left->child_ptrs[n + 1 + i] = right->child_ptrs[i];
+    }
+    left->child_ptrs[n + 1 + i] = right->child_ptrs[i];
+    left->key_count += right->key_count + 1;
+  }
+
+  if (node_size(left) <= BLOCK_SIZE) { // Merge.
+    if (write_node(&parent->child_ptrs[sep], left, depth) == -1 || retire_page(parent->child_ptrs[sep + 1]) == -1) rc = -1;
+    remove_at(parent, sep);
+  } else if ((k = split_point(left)) == -1) {
+    rc = -1;
+  } else { // Share the keys out again.
+    divide_node(left, k, right, parent->keys[sep]);
+    if (write_node(&parent->child_ptrs[sep], left, depth) == -1 ||
+        write_node(&parent->child_ptrs[sep + 1], right, depth) == -1) rc = -1;
+  }
+
+  free(sibling);
+  return rc;
+}
+
+// Removes key from the subtree under node_ptr. Since separators vary in
+// length, rebalancing can make a node grow, so this may split too.
+static int delete_rec(struct block_ptr *node_ptr, struct btree_node *node, int depth,
+    const char *key, struct block_ptr *value, struct btree_split *split) {
+
+  struct btree_node* child;
+  struct btree_split child_split = {.split = 0};
+  int i, rc;
+
+  if (node->leaf) {
+    i = lower_bound(node, key);
+    if (i == node->key_count || strcmp(node->keys[i], key) != 0) return 1;
+
+    *value = node->child_ptrs[i];
+    remove_at(node, i);
+    return write_node(node_ptr, node, depth);
+  }
+
+  if ((child = new_node(1)) == NULL) return -1;
+  i = child_index(node, key);
+  if (read_node(node->child_ptrs[i], child, depth + 1) == -1) {
+    free(child);
+    return -1;
+  }
+
+  rc = delete_rec(&node->child_ptrs[i], child, depth + 1, key, value, &child_split);
+  if (rc == 0) {
+    if (child_split.split) insert_at(node, i, child_split.key, child_split.right);
+    else if (node_size(child) < MIN_FILL) rc = rebalance(node, i, child, depth + 1);
+    if (rc == 0) rc = store_node(node_ptr, node, split, depth);
+  }
+
+  free(child);
+  return rc;
+}
+
+// Removes key from the index. Returns 0 and fills in ptr with the
+// pointer that was stored under key, 1 if the key wasn't there,
+// and -1 on error.
+int btree_delete(const char *key, struct block_ptr *ptr) {
+
+  struct btree_meta meta;
+  struct btree_node* root;
+  struct btree_split split = {.split = 0};
+  int rc;
+
+  if ((root = new_node(1)) == NULL) return -1;
+
+  if (begin_change() == -1) {
+    free(root);
+    return -1;
+  }
+
+  if (read_meta(&meta) == -1 || read_node(meta.root, root, 0) == -1) {
+    free(root);
+    return end_change(-1);
+  }
+
+  rc = delete_rec(&meta.root, root, 0, key, ptr, &split);
+
+  if (rc == 0 && split.split) {
+    if (grow_tree(&meta, &split) == -1) rc = -1;
+  } else if (rc == 0 && !root->leaf && root->key_count == 0) { // Shrink the tree by a level.
+    if (retire_page(meta.root) == -1) rc = -1;
+    meta.root = root->child_ptrs[0];
+    meta.height--;
+  }
+  if (rc == 0 && write_meta(&meta) == -1) rc = -1;
+
+  free(root);
+  return end_change(rc);
+}
+
+/*
+  Bulk loading. The loader hands keys over in order and the tree is
+  built from the bottom up, filling each page before starting the next,
+  so no page is ever split or read back. A page is written as soon as
+  it is full, and each level keeps only the page it is filling. Pages
+  are written straight to the db file: loading is done offline, before
+  anything else can see the tree.
+*/
+
+static struct load_level {
+  struct btree_node* node;      // The page being filled, or NULL.
+  struct block_ptr   ptr;       // Where it goes.
+  char               sep[KEY_LEN]; // Divides it from the page before, for the level above.
+  int                sum_len;   // Total length of its keys.
+  int                written;   // Pages finished on this level.
+} LOAD[BTREE_MAX_HEIGHT];
+
+// Size of node's page with key added at the end.
+static int size_with(const struct btree_node *node, int sum_len, const char *key) {
+  int count = node->key_count + 1;
+  int prefix_len = (count > 1) ? common_prefix(node->keys[0], key) : 0;
+
+  return PAGE_HEADER_SIZE + prefix_len + count * cell_size(0) + sum_len + strlen(key) - count * prefix_len;
+}
+
+static int write_page(struct block_ptr ptr, const struct btree_node *node) {
+  char page[BLOCK_SIZE];
+
+  if (pack_node(node, page) == -1) return -1;
+  if (storage_write(page, BLOCK_SIZE, ptr.block_offset * BLOCK_SIZE) != BLOCK_SIZE) {
+    perror("pwrite failed in write_page");
+    return -1;
+  }
+  return 0;
+}
+
+// Takes a block for a new index page.
+static int page_block(struct block_ptr *ptr) {
+  int block_offset;
+
+  if ((block_offset = create_block_reservation(1)) == -1) {
+    fprintf(stderr, "Failed to reserve space for an index page.\n");
+    return -1;
+  }
+  *ptr = (struct block_ptr){.block_offset = block_offset, .blocks = 1};
+  return 0;
+}
+
+// Starts a new page on a level, to go at ptr, after sep.
+static int start_page(int level, int leaf, struct block_ptr ptr, const char *sep) {
+  struct load_level* l = &LOAD[level];
+
+  if (l->node == NULL && (l->node = new_node(leaf)) == NULL) return -1;
+  l->node->leaf = leaf;
+  l->node->key_count = 0;
+  l->ptr = ptr;
+  l->sum_len = 0;
+  strcpy(l->sep, sep);
+  return 0;
+}
+
+static int push_child(int level, const char *sep, struct block_ptr child);
+
+// Writes out the page a level is filling and hands it to the level above.
+static int finish_page(int level) {
+  struct load_level* l = &LOAD[level];
+
+  if (write_page(l->ptr, l->node) == -1) return -1;
+  l->written++;
+  return push_child(level + 1, l->sep, l->ptr);
+}
+
+// Adds a child to the inner page being filled on level, after sep.
+static int push_child(int level, const char *sep, struct block_ptr child) {
+  struct load_level* l = &LOAD[level];
+  struct block_ptr ptr;
+
+  if (level == BTREE_MAX_HEIGHT) {
+    fprintf(stderr, "The index is too deep to load.\n");
+    return -1;
+  }
+  if (l->ptr.blocks > 0) {
+    if (l->node->key_count < BTREE_MAX_KEYS - 1 && size_with(l->node, l->sum_len, sep) <= BLOCK_SIZE) {
+      strcpy(l->node->keys[l->node->key_count], sep);
+      l->node->child_ptrs[++l->node->key_count] = child;
+      l->sum_len += strlen(sep);
+      return 0;
+    }
+    if (finish_page(level) == -1) return -1;
+  }
+  if (page_block(&ptr) == -1 || start_page(level, 0, ptr, sep) == -1) return -1;
+  l->node->child_ptrs[0] = child;
+  return 0;
+}
+
+// Checks the index is empty, which a load needs.
+int btree_load_begin(void) {
+  struct btree_meta meta;
+  struct btree_node* root;
+  int rc = 0;
+
+  if ((root = new_node(1)) == NULL) return -1;
+  sem_wait(INDEX_LOCK);
+  if (read_meta(&meta) == -1 || read_node(meta.root, root, 0) == -1) {
+    rc = -1;
+  } else if (meta.height != 1 || root->key_count > 0) {
+    fprintf(stderr, "Bulk loading needs an empty database.\n");
+    rc = -1;
+  }
+  sem_post(INDEX_LOCK);
+  free(root);
+
+  memset(LOAD, '\0', sizeof(LOAD));
+  return rc;
+}
+
+// Adds the next key to the leaves. Keys must come in order.
+int btree_load_add(const char *key, struct block_ptr ptr) {
+  struct load_level* l = &LOAD[0];
+  struct block_ptr next;
+  char sep[KEY_LEN];
+
+  if (l->ptr.blocks == 0) {
+    if (page_block(&next) == -1 || start_page(0, 1, next, "") == -1) return -1;
+  } else if (strcmp(l->node->keys[l->node->key_count - 1], key) >= 0) {
+    fprintf(stderr, "Bulk load keys are out of order at %s.\n", key);
+    return -1;
+  } else if (l->node->key_count == BTREE_MAX_KEYS - 1 || size_with(l->node, l->sum_len, key) > BLOCK_SIZE) {
+    make_separator(l->node->keys[l->node->key_count - 1], key, sep);
+    if (page_block(&next) == -1) return -1;
+    if (finish_page(0) == -1 || start_page(0, 1, next, sep) == -1) return -1;
+  }
+
+  strcpy(l->node->keys[l->node->key_count], key);
+  l->node->child_ptrs[l->node->key_count++] = ptr;
+  l->sum_len += strlen(key);
+  return 0;
+}
+
+// Writes out the pages still being filled and makes the new tree the
+// index, once every page of it is on disk.
+int btree_load_end(void) {
+  struct btree_meta meta;
+  struct block_ptr old_root;
+  int level, rc = 0;
+
+  // Each level's last page goes to the level above, up to a level with
+  // just the one page: the root.
+  for (level = 0; rc == 0 && LOAD[0].ptr.blocks > 0; level++) {
+    if (LOAD[level].written == 0 && (level + 1 == BTREE_MAX_HEIGHT || LOAD[level + 1].ptr.blocks == 0)) break;
+    if (finish_page(level) == -1) rc = -1;
+  }
+  if (rc == 0 && LOAD[0].ptr.blocks > 0) {
+    if (write_page(LOAD[level].ptr, LOAD[level].node) == -1 || fsync(DB_FD) == -1) {
+      perror("Couldn't write out the loaded index");
+      rc = -1;
+    } else if (begin_change() == -1) {
+      rc = -1;
+    } else {
+      if (read_meta(&meta) == -1) {
+        rc = -1;
+      } else {
+        old_root = meta.root;
+        meta.root = LOAD[level].ptr;
+        meta.height = level + 1;
+        if (retire_page(old_root) == -1 || write_meta(&meta) == -1) rc = -1;
+      }
+      rc = end_change(rc);
+    }
+  }
+
+  for (level = 0; level < BTREE_MAX_HEIGHT; level++) free(LOAD[level].node);
+  memset(LOAD, '\0', sizeof(LOAD));
+  return rc;
+}
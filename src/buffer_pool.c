@@ -0,0 +1,362 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Buffer pool for index pages.
+
+  Every 4 KB page of the B-tree, the meta block included, is read and
+  written through a pool of page frames in shared memory, so a change
+  edits the root and inner pages where they sit instead of reading and
+  copying them each time.
+
+  pool_pin() finds a page's frame, reading it in on a miss, and keeps
+  it from being evicted until pool_unpin(). A page unpinned dirty is
+  logged straight away and put on the dirty list, and pool_flush()
+  writes the list back to the db file. The index never changes a page
+  readers can reach (see btree.c), so each change flushes its pages when
+  it ends, before readers are pointed at them, and dirty frames are
+  never evicted. The meta block is the exception: it goes in with
+  pool_put() once the whole change is in the log, and stays dirty until
+  a checkpoint, which syncs the log before it flushes. The meta block
+  on disk never points at a change the log could still lose. With the
+  log off, dirty pages are written through at once.
+
+  Frames are reused in CLOCK order. With resident levels set, pages
+  that many levels from the root (and the meta block) are never
+  evicted, up to half the pool.
+
+  If there is no pool, or every frame is pinned, a page gets a private
+  copy instead, so the index works without one.
+
+  The pages are registered with the storage backend, so with io_uring
+  they are read and written as fixed buffers, and pool_flush() writes
+  every dirty page in one batch.
+
+  Only index changes use the pool, and they hold INDEX_LOCK. Readers of
+  the index go straight to the db file.
+*/
+
+#define NO_FRAME -1
+
+static int*                 POOL_BUCKETS;
+static struct pool_frame*   POOL_FRAMES;
+static int*                 POOL_DIRTY;
+static char*                POOL_DATA;
+
+#define FRAME_PAGE(f) (POOL_DATA + (int64_t)(f) * BLOCK_SIZE)
+
+static int pool_bucket(int64_t block) {
+  return (uint64_t)block * 0x9E3779B97F4A7C15ULL >> 32 & (SHM_POOL->buckets - 1);
+}
+
+static int pool_find(int64_t block) {
+  int f;
+
+  for (f = POOL_BUCKETS[pool_bucket(block)]; f != NO_FRAME; f = POOL_FRAMES[f].next)
+    if (POOL_FRAMES[f].block == block) return f;
+  return NO_FRAME;
+}
+
+// Takes a frame off the dirty list.
+static void pool_clean(int f) {
+  int i;
+
+  for (i = 0; i < SHM_POOL->dirty_count; i++) {
+    if (POOL_DIRTY[i] != f) continue;
+    POOL_DIRTY[i] = POOL_DIRTY[--SHM_POOL->dirty_count];
+    break;
+  }
+  POOL_FRAMES[f].dirty = 0;
+}
+
+static void pool_unlink(int f) {
+  int* link = &POOL_BUCKETS[pool_bucket(POOL_FRAMES[f].block)];
+
+  while (*link != f) link = &POOL_FRAMES[*link].next;
+  *link = POOL_FRAMES[f].next;
+  if (POOL_FRAMES[f].dirty) pool_clean(f);
+  if (POOL_FRAMES[f].resident) SHM_POOL->resident--;
+  memset(&POOL_FRAMES[f], '\0', sizeof(struct pool_frame));
+  POOL_FRAMES[f].block = -1;
+  POOL_FRAMES[f].next = NO_FRAME;
+}
+
+static int write_back(int f) {
+  if (storage_write(FRAME_PAGE(f), BLOCK_SIZE, POOL_FRAMES[f].block * BLOCK_SIZE) != BLOCK_SIZE) {
+    perror("pwrite failed in write_back");
+    return -1;
+  }
+  pool_clean(f);
+  SHM_POOL->writebacks++;
+  return 0;
+}
+
+// Moves the clock hand to a frame we can reuse, or returns NO_FRAME if
+// every frame is pinned or resident.
+static int pool_take(void) {
+  int f, passes;
+
+  for (passes = 0; passes < 2 * SHM_POOL->frames; passes++) {
+    f = SHM_POOL->hand;
+    SHM_POOL->hand = (f + 1) % SHM_POOL->frames;
+    if (POOL_FRAMES[f].block == -1) return f;
+    if (POOL_FRAMES[f].pins > 0 || POOL_FRAMES[f].resident || POOL_FRAMES[f].dirty) continue;
+    if (POOL_FRAMES[f].ref) {
+      POOL_FRAMES[f].ref = 0;
+      continue;
+    }
+    pool_unlink(f);
+    SHM_POOL->evictions++;
+    return f;
+  }
+  return NO_FRAME;
+}
+
+static int in_pool(const char* page) {
+  return SHM_POOL != NULL && page >= POOL_DATA && page < FRAME_PAGE(SHM_POOL->frames);
+}
+
+static char* private_page(struct block_ptr ptr, int fetch) {
+  char* page;
+
+  if ((page = malloc(BLOCK_SIZE)) == NULL) {
+    perror("malloc failed in pool_pin()");
+    return NULL;
+  }
+  if (fetch && storage_read(page, BLOCK_SIZE, ptr.block_offset * BLOCK_SIZE) == -1) {
+    perror("pread failed in pool_pin");
+    free(page);
+    return NULL;
+  }
+  return page;
+}
+
+
+int pool_init(int64_t budget, int resident_levels) {
+  int frames = budget / BLOCK_SIZE, buckets = 1, i;
+  int64_t meta;
+
+  if (frames < 8) return 0;
+  while (buckets < frames) buckets <<= 1;
+
+  meta = sizeof(struct buffer_pool) + sizeof(int) * buckets + sizeof(struct pool_frame) * frames + sizeof(int) * frames;
+  meta = (meta + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  if ((SHM_POOL = mmap((caddr_t)0, meta + (int64_t)frames * BLOCK_SIZE,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the buffer pool");
+    SHM_POOL = NULL;
+    return -1;
+  }
+  SHM_POOL->frames = frames;
+  SHM_POOL->buckets = buckets;
+  SHM_POOL->resident_levels = resident_levels;
+  POOL_BUCKETS = (int*)(SHM_POOL + 1);
+  POOL_FRAMES = (struct pool_frame*)(POOL_BUCKETS + buckets);
+  POOL_DIRTY = (int*)(POOL_FRAMES + frames);
+  POOL_DATA = (char*)SHM_POOL + meta;
+  for (i = 0; i < buckets; i++) POOL_BUCKETS[i] = NO_FRAME;
+  for (i = 0; i < frames; i++) {
+    POOL_FRAMES[i].block = -1;
+    POOL_FRAMES[i].next = NO_FRAME;
+  }
+  storage_register(POOL_DATA, (int64_t)frames * BLOCK_SIZE);
+  return 0;
+}
+
+// Returns the page at ptr, depth levels below the root, and keeps it in
+// memory until pool_unpin(). Unless fetch is set the caller is about to
+// overwrite all of it, so it isn't read in.
+char* pool_pin(struct block_ptr ptr, int depth, int fetch) {
+  int f, b;
+
+  if (SHM_POOL == NULL) return private_page(ptr, fetch);
+
+  if ((f = pool_find(ptr.block_offset)) != NO_FRAME) {
+    SHM_POOL->hits++;
+  } else {
+    SHM_POOL->misses++;
+    if ((f = pool_take()) == NO_FRAME) return private_page(ptr, fetch);
+    if (fetch && storage_read(FRAME_PAGE(f), BLOCK_SIZE, ptr.block_offset * BLOCK_SIZE) == -1) {
+      perror("pread failed in pool_pin");
+      return NULL;
+    }
+    b = pool_bucket(ptr.block_offset);
+    POOL_FRAMES[f].block = ptr.block_offset;
+    POOL_FRAMES[f].valid = fetch;
+    POOL_FRAMES[f].next = POOL_BUCKETS[b];
+    POOL_BUCKETS[b] = f;
+  }
+
+  if (!POOL_FRAMES[f].resident && depth < SHM_POOL->resident_levels &&
+      SHM_POOL->resident < SHM_POOL->frames / 2) {
+    POOL_FRAMES[f].resident = 1;
+    SHM_POOL->resident++;
+  }
+  POOL_FRAMES[f].ref = 1;
+  POOL_FRAMES[f].pins++;
+  return FRAME_PAGE(f);
+}
+
+// Lets go of a page from pool_pin(). If the caller changed it, it is
+// logged now and written back later.
+int pool_unpin(struct block_ptr ptr, char* page, int dirty) {
+  int f, rc = 0;
+
+  // Once the frame is dirty, a checkpoint writes it back itself.
+  wal_write_begin();
+  if (dirty && wal_append(WAL_WRITE, ptr.block_offset * BLOCK_SIZE, 0, page, BLOCK_SIZE) == -1) {
+    dirty = 0;
+    rc = -1;
+  }
+
+  if (!in_pool(page)) {
+    if (dirty && storage_write(page, BLOCK_SIZE, ptr.block_offset * BLOCK_SIZE) != BLOCK_SIZE) {
+      perror("pwrite failed in pool_unpin");
+      rc = -1;
+    }
+    wal_write_done();
+    free(page);
+    return rc;
+  }
+
+  f = (page - POOL_DATA) / BLOCK_SIZE;
+  POOL_FRAMES[f].pins--;
+  if (dirty) {
+    POOL_FRAMES[f].valid = 1;
+    if (!POOL_FRAMES[f].dirty) POOL_DIRTY[SHM_POOL->dirty_count++] = f;
+    POOL_FRAMES[f].dirty = 1;
+    if (WAL_FD == -1 && write_back(f) == -1) rc = -1;
+  }
+  wal_write_done();
+  if (!POOL_FRAMES[f].valid && POOL_FRAMES[f].pins == 0) pool_unlink(f);
+  return rc;
+}
+
+// Forgets a page that has been freed, without writing it back.
+void pool_drop(struct block_ptr ptr) {
+  int f;
+
+  if (SHM_POOL != NULL && (f = pool_find(ptr.block_offset)) != NO_FRAME && POOL_FRAMES[f].pins == 0)
+    pool_unlink(f);
+}
+
+// Puts a page that is already in the log in its frame, dirty, without
+// logging it again. It is written back by a flush after the log has
+// been synced. A page that gets no frame is written straight through,
+// once the log is synced.
+int pool_put(struct block_ptr ptr, const char* data) {
+  char* page;
+  int f, rc = 0;
+
+  if ((page = pool_pin(ptr, 0, 0)) == NULL) return -1;
+  memcpy(page, data, BLOCK_SIZE);
+
+  if (!in_pool(page)) {
+    if (WAL_FD != -1 && wal_sync(SHM_WAL->write_lsn) == -1) {
+      rc = -1;
+    } else if (storage_write(page, BLOCK_SIZE, ptr.block_offset * BLOCK_SIZE) != BLOCK_SIZE) {
+      perror("pwrite failed in pool_put");
+      rc = -1;
+    }
+    free(page);
+    return rc;
+  }
+
+  f = (page - POOL_DATA) / BLOCK_SIZE;
+  POOL_FRAMES[f].pins--;
+  POOL_FRAMES[f].valid = 1;
+  if (!POOL_FRAMES[f].dirty) POOL_DIRTY[SHM_POOL->dirty_count++] = f;
+  POOL_FRAMES[f].dirty = 1;
+  if (WAL_FD == -1 && write_back(f) == -1) rc = -1;
+  return rc;
+}
+
+// Writes every dirty page back to the db file but the one at block, if
+// there is one. That one can't go before the log does.
+int pool_flush_except(int64_t block) {
+  struct storage_io* ios;
+  struct iovec* iov;
+  int* dirty;
+  int f, i, n = 0, rc = 0;
+
+  if (SHM_POOL == NULL || SHM_POOL->dirty_count == 0) return 0;
+  for (i = 0; i < SHM_POOL->dirty_count; i++) n += (POOL_FRAMES[POOL_DIRTY[i]].block != block);
+  if (n == 0) return 0;
+  ios = malloc(sizeof(struct storage_io) * n);
+  iov = malloc(sizeof(struct iovec) * n);
+  dirty = malloc(sizeof(int) * n);
+  if (ios == NULL || iov == NULL || dirty == NULL) {
+    perror("malloc failed in pool_flush");
+    free(ios);
+    free(iov);
+    free(dirty);
+    return -1;
+  }
+
+  for (i = 0, n = 0; i < SHM_POOL->dirty_count; i++) {
+    if (POOL_FRAMES[POOL_DIRTY[i]].block == block) continue;
+    f = dirty[n] = POOL_DIRTY[i];
+    iov[n].iov_base = FRAME_PAGE(f);
+    iov[n].iov_len = BLOCK_SIZE;
+    ios[n].write = 1;
+    ios[n].offset = POOL_FRAMES[f].block * BLOCK_SIZE;
+    ios[n].iov = &iov[n];
+    ios[n].iovcnt = 1;
+    n++;
+  }
+  if (storage_submit(ios, n) == -1) {
+    perror("Write failed in pool_flush");
+    rc = -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (ios[i].result != BLOCK_SIZE) {
+      rc = -1;
+      continue;
+    }
+    pool_clean(dirty[i]);
+    SHM_POOL->writebacks++;
+  }
+
+  free(ios);
+  free(iov);
+  free(dirty);
+  return rc;
+}
+
+// Writes every dirty page back to the db file.
+int pool_flush(void) {
+  return pool_flush_except(-1);
+}
+
+void pool_report(void) {
+  int64_t lookups;
+
+  if (SHM_POOL == NULL) return;
+  lookups = SHM_POOL->hits + SHM_POOL->misses;
+  fprintf(stderr, "Buffer pool: %lld hits, %lld misses (%.1f%% hit), %lld evictions, %lld write-backs, %d of %d pages resident.\n",
+          (long long)SHM_POOL->hits, (long long)SHM_POOL->misses,
+          lookups > 0 ? 100.0 * SHM_POOL->hits / lookups : 0.0,
+          (long long)SHM_POOL->evictions, (long long)SHM_POOL->writebacks,
+          SHM_POOL->resident, SHM_POOL->frames);
+}
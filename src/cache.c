@@ -0,0 +1,229 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Object cache.
+
+  Recently used blocks of the db file are kept in shared memory, mapped
+  before we fork like SHM_BLOCK_BITMAP, so every connection's process or
+  thread reads from and fills the same cache. Values go through it a
+  block at a time, keyed by block offset. Index pages have a pool of
+  their own (see buffer_pool.c).
+
+  When the cache is full a CLOCK hand picks the block to give up. A hit
+  sets a block's reference bit; the hand clears set bits as it passes
+  and evicts the first block it finds clear. New blocks start clear, so
+  a one-off scan can't push out blocks that are read again and again.
+
+  Writes go through the cache, and freed blocks are dropped from it.
+  A reader that missed only fills the cache if nothing was written or
+  freed since it started reading, so a slow read can never put back
+  data a writer has just replaced.
+
+  Objects over CACHE_MAX_BLOCKS are never cached. Everything here is
+  done under CACHE_LOCK.
+*/
+
+#define NO_FRAME -1
+
+static int*                 BUCKETS;     // First frame in each hash chain.
+static struct cache_frame*  FRAMES;
+static char*                FRAME_DATA;  // BLOCK_SIZE bytes per frame.
+
+static int bucket_of(int64_t block) {
+  return (uint64_t)block * 0x9E3779B97F4A7C15ULL >> 32 & (SHM_CACHE->buckets - 1);
+}
+
+static int find_frame(int64_t block) {
+  int f;
+
+  for (f = BUCKETS[bucket_of(block)]; f != NO_FRAME; f = FRAMES[f].next)
+    if (FRAMES[f].block == block) return f;
+  return NO_FRAME;
+}
+
+static void unlink_frame(int f) {
+  int* link = &BUCKETS[bucket_of(FRAMES[f].block)];
+
+  while (*link != f) link = &FRAMES[*link].next;
+  *link = FRAMES[f].next;
+  FRAMES[f].block = -1;
+  SHM_CACHE->used--;
+}
+
+// Moves the clock hand to a frame we can reuse.
+static int take_frame(void) {
+  int f;
+
+  while (1) {
+    f = SHM_CACHE->hand;
+    SHM_CACHE->hand = (f + 1) % SHM_CACHE->frames;
+    if (FRAMES[f].block == -1) return f;
+    if (FRAMES[f].ref) {
+      FRAMES[f].ref = 0;
+      continue;
+    }
+    unlink_frame(f);
+    SHM_CACHE->evictions++;
+    return f;
+  }
+}
+
+static void put_block(int64_t block, const char* data) {
+  int f, b;
+
+  if ((f = find_frame(block)) == NO_FRAME) {
+    f = take_frame();
+    b = bucket_of(block);
+    FRAMES[f].block = block;
+    FRAMES[f].ref = 0;
+    FRAMES[f].next = BUCKETS[b];
+    BUCKETS[b] = f;
+    SHM_CACHE->used++;
+  }
+  memcpy(FRAME_DATA + (int64_t)f * BLOCK_SIZE, data, BLOCK_SIZE);
+}
+
+static int cacheable(struct block_ptr obj) {
+  return SHM_CACHE != NULL && obj.blocks > 0 && obj.blocks <= CACHE_MAX_BLOCKS &&
+         obj.blocks <= SHM_CACHE->frames / 8;
+}
+
+
+int cache_init(int64_t budget) {
+  int frames = budget / BLOCK_SIZE, buckets = 1, i;
+  int64_t meta;
+
+  if (frames < 8) return 0; // Too small to bother with.
+  while (buckets < frames) buckets <<= 1;
+
+  // Header, hash chains and frames first, then the data on a page of its own.
+  meta = sizeof(struct object_cache) + sizeof(int) * buckets + sizeof(struct cache_frame) * frames;
+  meta = (meta + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  if ((SHM_CACHE = mmap((caddr_t)0, meta + (int64_t)frames * BLOCK_SIZE,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the object cache");
+    SHM_CACHE = NULL;
+    return -1;
+  }
+  SHM_CACHE->frames = frames;
+  SHM_CACHE->buckets = buckets;
+  BUCKETS = (int*)(SHM_CACHE + 1);
+  FRAMES = (struct cache_frame*)(BUCKETS + buckets);
+  FRAME_DATA = (char*)SHM_CACHE + meta;
+  for (i = 0; i < buckets; i++) BUCKETS[i] = NO_FRAME;
+  for (i = 0; i < frames; i++) FRAMES[i].block = -1;
+
+  sem_unlink("cache_lock");
+  if ((CACHE_LOCK = sem_open("cache_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    return -1;
+  }
+  return 0;
+}
+
+// Copies obj into buffer if every block of it is cached. Returns 1 on a
+// hit and 0 on a miss.
+int cache_read(struct block_ptr obj, char* buffer) {
+  int frame[CACHE_MAX_BLOCKS];
+  int i;
+
+  if (!cacheable(obj)) return 0;
+
+  sem_wait(CACHE_LOCK);
+  for (i = 0; i < obj.blocks; i++) {
+    if ((frame[i] = find_frame(obj.block_offset + i)) == NO_FRAME) {
+      SHM_CACHE->misses++;
+      sem_post(CACHE_LOCK);
+      return 0;
+    }
+  }
+  for (i = 0; i < obj.blocks; i++) {
+    FRAMES[frame[i]].ref = 1;
+    memcpy(buffer + (int64_t)i * BLOCK_SIZE, FRAME_DATA + (int64_t)frame[i] * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  SHM_CACHE->hits++;
+  sem_post(CACHE_LOCK);
+  return 1;
+}
+
+// Marks the start of a read from disk, to hand to cache_fill().
+int64_t cache_version(void) {
+  return SHM_CACHE == NULL ? 0 : __atomic_load_n(&SHM_CACHE->version, __ATOMIC_ACQUIRE);
+}
+
+// Caches obj as read from disk, unless it may have changed since
+// cache_version() returned version.
+void cache_fill(struct block_ptr obj, const char* buffer, int64_t version) {
+  int i;
+
+  if (!cacheable(obj)) return;
+
+  sem_wait(CACHE_LOCK);
+  if (SHM_CACHE->version == version)
+    for (i = 0; i < obj.blocks; i++) put_block(obj.block_offset + i, buffer + (int64_t)i * BLOCK_SIZE);
+  sem_post(CACHE_LOCK);
+}
+
+// Tells the cache obj now holds buffer on disk, or with a NULL buffer,
+// that obj was freed.
+void cache_write(struct block_ptr obj, const char* buffer) {
+  int64_t i;
+  int f;
+
+  if (SHM_CACHE == NULL || obj.blocks < 1) return;
+
+  sem_wait(CACHE_LOCK);
+  __atomic_add_fetch(&SHM_CACHE->version, 1, __ATOMIC_RELEASE);
+  if (buffer != NULL && cacheable(obj)) {
+    for (i = 0; i < obj.blocks; i++) put_block(obj.block_offset + i, buffer + i * BLOCK_SIZE);
+  } else if (SHM_CACHE->used == 0) {
+    // Nothing to drop.
+  } else if (obj.blocks > SHM_CACHE->frames) {
+    for (f = 0; f < SHM_CACHE->frames; f++)
+      if (FRAMES[f].block >= obj.block_offset && FRAMES[f].block < obj.block_offset + obj.blocks) {
+        unlink_frame(f);
+        SHM_CACHE->invalidations++;
+      }
+  } else {
+    for (i = 0; i < obj.blocks; i++)
+      if ((f = find_frame(obj.block_offset + i)) != NO_FRAME) {
+        unlink_frame(f);
+        SHM_CACHE->invalidations++;
+      }
+  }
+  sem_post(CACHE_LOCK);
+}
+
+void cache_report(void) {
+  int64_t lookups;
+
+  if (SHM_CACHE == NULL) return;
+  lookups = SHM_CACHE->hits + SHM_CACHE->misses;
+  fprintf(stderr, "Object cache: %lld hits, %lld misses (%.1f%% hit), %lld evictions, %lld invalidations, %d of %d blocks used.\n",
+          (long long)SHM_CACHE->hits, (long long)SHM_CACHE->misses,
+          lookups > 0 ? 100.0 * SHM_CACHE->hits / lookups : 0.0,
+          (long long)SHM_CACHE->evictions, (long long)SHM_CACHE->invalidations,
+          SHM_CACHE->used, SHM_CACHE->frames);
+}
@@ -0,0 +1,415 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Online compaction.
+
+  Deletes leave holes all through the db file. Big values then can't
+  find a run long enough, and the file never gets any smaller. With -k,
+  a thread in the parent process looks at the file every so often. Once
+  more than COMPACT_TRIGGER_PCT of it, up to the last block in use, is
+  free, it packs the values down:
+
+  1. It works out where the file would end with every block in use
+     packed together, plus room to spare, and sets that as the
+     allocator's ceiling. From then on every allocation, ours and
+     everyone else's, lands below it if it can.
+  2. It walks the index in key order. The way down to each key is
+     copied below the ceiling if any page on it is past. Each value
+     with blocks past it is copied to a new home below it, and its key
+     is pointed at the copy with btree_swap(), which only happens if
+     the key still points at the old one. If a writer got there first,
+     the copy is thrown away.
+  3. Old blocks are freed once COMPACT_GRACE_MS have passed, so a reader
+     that looked the key up just before the swap can finish with them.
+     They are logged as free at the swap, like reclaim's, so the log
+     isn't checkpointed while any are waiting. A slab value's old slot
+     is freed at the swap, with its page written and logged as usual. A
+     freed slot keeps its bytes, and nothing fills slots or takes pages
+     past the ceiling, which stays up until the last grace period is
+     over.
+
+  No pass starts while a snapshot is pinned, as every block it freed
+  would be held back until the snapshot was done.
+
+  Every look ends by cutting the file back to its last block in use,
+  once the blocks past it have stayed free for a whole interval.
+
+  The thread does its work in slices and sleeps between them, so it is
+  busy no more than -k percent of the time.
+*/
+
+struct moved_value { // Old blocks waiting out their grace period.
+  struct block_ptr  ptr;
+  int64_t           due_ms;
+};
+
+static struct moved_value MOVED[COMPACT_PENDING];
+static int MOVED_HEAD, MOVED_COUNT;
+static int64_t BUSY_SINCE;
+
+
+static int64_t now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Sleeps off the time we've been busy, in proportion to the budget.
+static void throttle(void) {
+  int64_t busy = now_msec() - BUSY_SINCE, nap_ms;
+  struct timespec nap;
+
+  if (busy < COMPACT_SLICE_MS) return;
+  nap_ms = busy * (100 - SHM_COMPACT->budget_pct) / SHM_COMPACT->budget_pct;
+  nap.tv_sec = nap_ms / 1000;
+  nap.tv_nsec = (nap_ms % 1000) * 1000000L;
+  nanosleep(&nap, NULL);
+  BUSY_SINCE = now_msec();
+}
+
+// Frees the old blocks whose grace period is over, or all of them,
+// waiting if need be.
+static void free_moved(int all) {
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 10 * 1000000L};
+
+  while (MOVED_COUNT > 0) {
+    if (MOVED[MOVED_HEAD].due_ms > now_msec()) {
+      if (!all) return;
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    wal_commit(); // The swap must outlive a crash before the old copy goes.
+    release_moved_blocks(MOVED[MOVED_HEAD].ptr.block_offset, MOVED[MOVED_HEAD].ptr.blocks);
+    MOVED_HEAD = (MOVED_HEAD + 1) % COMPACT_PENDING;
+    MOVED_COUNT--;
+  }
+  BUSY_SINCE = now_msec();
+}
+
+static void free_later(struct block_ptr ptr) {
+  while (MOVED_COUNT == COMPACT_PENDING) free_moved(0);
+  MOVED[(MOVED_HEAD + MOVED_COUNT++) % COMPACT_PENDING] = (struct moved_value){.ptr = ptr, .due_ms = now_msec() + COMPACT_GRACE_MS};
+}
+
+
+// Copies a slab value into a slot wherever slab_store() finds one.
+static int copy_slab_value(struct block_ptr from, struct block_ptr *to) {
+  struct value_header header;
+  char *page, *buffer;
+  int rc;
+
+  if ((page = read_obj(from)) == NULL) return -1;
+  memcpy(&header, page + from.offset, sizeof(header));
+  if (VALUE_HEADER_SIZE + header.length > from.size || (buffer = new_value_buffer(header.length)) == NULL) {
+    free(page);
+    return -1;
+  }
+  memcpy(buffer, page + from.offset, VALUE_HEADER_SIZE + header.length); // Flags and all.
+  free(page);
+
+  rc = slab_store(&buffer, to, 1);
+  free(buffer);
+  return rc;
+}
+
+// Copies a run of blocks to new ones, COMPACT_CHUNK at a time.
+static int copy_blocks(struct block_ptr from, struct block_ptr *to) {
+  int64_t done, n, len = (int64_t)from.blocks * BLOCK_SIZE;
+  int64_t src = from.block_offset * BLOCK_SIZE, dst;
+  char* buffer;
+  int block_offset;
+
+  if ((buffer = malloc(len < COMPACT_CHUNK ? len : COMPACT_CHUNK)) == NULL) {
+    perror("malloc failed in copy_blocks()");
+    return -1;
+  }
+  if ((block_offset = create_block_reservation(from.blocks)) == -1) {
+    free(buffer);
+    return -1;
+  }
+  dst = (int64_t)block_offset * BLOCK_SIZE;
+
+  for (done = 0; done < len; done += n) {
+    n = (len - done < COMPACT_CHUNK) ? len - done : COMPACT_CHUNK;
+    wal_write_begin();
+    if (storage_read(buffer, n, src + done) != n ||
+        wal_append(WAL_WRITE, dst + done, 0, buffer, n) == -1 ||
+        storage_write(buffer, n, dst + done) != n) {
+      wal_write_done();
+      perror("Copy failed in copy_blocks");
+      release_block_reservation(block_offset, from.blocks);
+      free(buffer);
+      return -1;
+    }
+    wal_write_done();
+  }
+  free(buffer);
+
+  *to = from;
+  to->block_offset = block_offset;
+  return 0;
+}
+
+// Moves key's value below limit. Returns 0 if it moved or the key
+// changed under us, 1 if there's no room for it below limit, and -1 on
+// error.
+static int move_value(const char *key, struct block_ptr from, int limit) {
+  struct block_ptr to;
+
+  if ((from.size > 0 ? copy_slab_value(from, &to) : copy_blocks(from, &to)) == -1) return -1;
+  if (to.block_offset + to.blocks > limit) {
+    delete_obj(to);
+    return 1;
+  }
+
+  switch (btree_swap(key, from, to)) {
+    case 0:
+      if (from.size > 0) {
+        delete_obj(from);
+      } else { // Free in the log from now on, so a crash can't leak the old copy.
+        __atomic_add_fetch(&SHM_COMPACT->pending, 1, __ATOMIC_SEQ_CST);
+        wal_append(WAL_FREE, from.block_offset, from.blocks, NULL, 0);
+        free_later(from);
+      }
+      SHM_COMPACT->moved++;
+      SHM_COMPACT->moved_blocks += from.size > 0 ? 0 : from.blocks;
+      return 0;
+
+    case 1: // Written over or deleted since we looked.
+      delete_obj(to);
+      SHM_COMPACT->raced++;
+      return 0;
+
+    default:
+      delete_obj(to);
+      return -1;
+  }
+}
+
+
+// Measures how the file is laid out, up to its current size, skipping
+// stretches the allocator's summary says are empty.
+static void measure(void) {
+  const uint64_t* words = (const uint64_t*)SHM_BLOCK_BITMAP;
+  struct compact_state* c = SHM_COMPACT;
+  struct stat st;
+  int64_t w, word_count, free_run = 0, end = 0, used = 0, holes = 0, largest = 0;
+  uint64_t word;
+  int bit;
+
+  if (fstat(DB_FD, &st) == -1) return;
+  c->file_blocks = (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  word_count = (c->file_blocks + 63) / 64;
+  if (word_count > bitmap_bytes() / 8) word_count = bitmap_bytes() / 8;
+
+  for (w = 0; w < word_count; w++) {
+    if (w % SUMMARY_WORDS == 0 && w + SUMMARY_WORDS <= word_count && alloc_chunk_free(w * 64) == SUMMARY_BLOCKS) {
+      free_run += SUMMARY_BLOCKS;
+      w += SUMMARY_WORDS - 1;
+      continue;
+    }
+    if ((word = __atomic_load_n(&words[w], __ATOMIC_RELAXED)) == 0) {
+      free_run += 64;
+      continue;
+    }
+    for (bit = 0; bit < 64; bit++) {
+      if (!(word & ((uint64_t)1 << bit))) {
+        free_run++;
+        continue;
+      }
+      if (free_run > 0) { // A hole, now that something follows it.
+        holes++;
+        if (free_run > largest) largest = free_run;
+      }
+      free_run = 0;
+      used++;
+      end = w * 64 + bit + 1;
+    }
+  }
+  c->end_blocks = end;
+  c->used_blocks = used;
+  c->holes = holes;
+  c->largest_hole = largest;
+}
+
+// The end of the last block in use, past any chunk of single blocks.
+// Called with every allocation group locked.
+static int64_t last_used_block(void) {
+  const uint64_t* words = (const uint64_t*)SHM_BLOCK_BITMAP;
+  int64_t w = (SHM_COMPACT->file_blocks + 63) / 64;
+
+  if (w > bitmap_bytes() / 8) w = bitmap_bytes() / 8;
+  while (--w >= 0) {
+    if (w % SUMMARY_WORDS == SUMMARY_WORDS - 1 && alloc_chunk_free(w * 64) == SUMMARY_BLOCKS) {
+      w -= SUMMARY_WORDS - 1;
+      continue;
+    }
+    if (words[w] != 0) return w * 64 + 64 - __builtin_clzll(words[w]);
+  }
+  return 0;
+}
+
+// Cuts the file back to its last block in use, as of this look or the
+// one before, whichever is later. Blocks freed since the last look may
+// still be being sent from DB_MAP, which would fault past the end of
+// the file.
+static void truncate_tail(void) {
+  static int64_t last_end = -1;
+  struct stat st;
+  int64_t end, keep;
+
+  alloc_lock_all();
+  alloc_drop_singles(); // They're taken again as needed.
+  end = last_used_block() * BLOCK_SIZE;
+  keep = (last_end > end || last_end == -1) ? last_end : end;
+  last_end = end;
+  if (keep != -1 && fstat(DB_FD, &st) == 0 && st.st_size > keep) {
+    end = keep;
+    if (ftruncate(DB_FD, end) == -1) {
+      perror("ftruncate failed in truncate_tail");
+    } else {
+      SHM_COMPACT->truncated_blocks += (st.st_size - end) / BLOCK_SIZE;
+    }
+  }
+  alloc_unlock_all();
+}
+
+// Packs the values past limit down below it. Leaves the ceiling up.
+static void compact_pass(int limit) {
+  char (*keys)[KEY_LEN];
+  struct block_ptr* ptrs;
+  int i, n, rc = 0, after = 0;
+
+  keys = malloc(sizeof(*keys) * KEYS_CHUNK);
+  ptrs = malloc(sizeof(struct block_ptr) * KEYS_CHUNK);
+  if (keys == NULL || ptrs == NULL) {
+    perror("malloc failed in compact_pass()");
+    free(keys);
+    free(ptrs);
+    return;
+  }
+
+  SHM_COMPACT->passes++;
+  alloc_set_ceiling(limit);
+  keys[0][0] = '\0';
+  btree_move_path("", limit); // Even if the tree is empty.
+
+  do {
+    if ((n = btree_scan(keys[0], after, "", keys, ptrs, KEYS_CHUNK)) == -1) break;
+    for (i = 0; i < n && rc == 0; i++) {
+      if (btree_move_path(keys[i], limit) == -1) rc = -1;
+      else if (ptrs[i].block_offset + ptrs[i].blocks > limit) rc = move_value(keys[i], ptrs[i], limit);
+      free_moved(0);
+      throttle();
+    }
+    wal_commit(); // Nobody's waiting on the moves, but they shouldn't lag far behind.
+    if (n > 0) strcpy(keys[0], keys[n - 1]);
+    after = 1;
+  } while (n == KEYS_CHUNK && rc == 0);
+
+  free(keys);
+  free(ptrs);
+}
+
+// Takes a look at the file, packs it down if it has got too holey, and
+// gives back whatever is left at the end.
+void compact_run(void) {
+  struct compact_state* c = SHM_COMPACT;
+  int64_t limit;
+
+  if (c == NULL) return;
+  BUSY_SINCE = now_msec();
+
+  measure();
+  limit = c->used_blocks + c->used_blocks / 8 + COMPACT_MIN_BLOCKS;
+  if (!snapshot_pinned() && c->end_blocks - c->used_blocks >= COMPACT_MIN_BLOCKS &&
+      (c->end_blocks - c->used_blocks) * 100 >= c->end_blocks * COMPACT_TRIGGER_PCT && limit < c->end_blocks) {
+    compact_pass(limit);
+    free_moved(1);
+    alloc_set_ceiling(0);
+  }
+  truncate_tail();
+  measure();
+}
+
+static void* compactor(void* arg) {
+  struct timespec nap = {.tv_sec = SHM_COMPACT->interval_s, .tv_nsec = 0};
+
+  while (1) {
+    nanosleep(&nap, NULL);
+    compact_run();
+  }
+  return NULL;
+}
+
+
+int compact_init(int budget_pct, int interval_s) {
+  if (budget_pct <= 0) return 0;
+
+  if ((SHM_COMPACT = mmap((caddr_t)0, sizeof(struct compact_state), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the compaction state");
+    SHM_COMPACT = NULL;
+    return -1;
+  }
+  memset(SHM_COMPACT, '\0', sizeof(struct compact_state));
+  SHM_COMPACT->budget_pct = (budget_pct > 100) ? 100 : budget_pct;
+  SHM_COMPACT->interval_s = (interval_s > 0) ? interval_s : COMPACT_INTERVAL_S;
+  return 0;
+}
+
+// Starts the thread that looks after the file. Signals are left to the
+// threads that were already handling them.
+int compact_start(void) {
+  pthread_t thread;
+  sigset_t all, old;
+
+  if (SHM_COMPACT == NULL) return 0;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&thread, NULL, compactor, NULL) != 0) {
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fprintf(stderr, "Couldn't start the compaction thread\n");
+    return -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_detach(thread);
+  return 0;
+}
+
+// How holey the file was at the last look, and what's been done about it.
+void compact_report(void) {
+  struct compact_state* c = SHM_COMPACT;
+
+  if (c == NULL) return;
+  fprintf(stderr, "Compaction: %lld passes moved %lld values (%lld blocks), %lld raced, %lld blocks truncated. "
+          "File: %lld blocks, %lld in use, %lld free in %lld holes (%.1f%%), largest %lld.\n",
+          (long long)c->passes, (long long)c->moved, (long long)c->moved_blocks, (long long)c->raced,
+          (long long)c->truncated_blocks, (long long)c->file_blocks, (long long)c->used_blocks,
+          (long long)(c->end_blocks - c->used_blocks), (long long)c->holes,
+          c->end_blocks > 0 ? 100.0 * (c->end_blocks - c->used_blocks) / c->end_blocks : 0.0,
+          (long long)c->largest_hole);
+}
@@ -0,0 +1,248 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Compression of stored values.
+
+  With -z lz each value is run through a small LZ77 codec in the style
+  of LZ4 before it is written, and kept that way if that saves at least
+  1/LZ_MIN_SAVING of it. A compressed value has VALUE_LZ set in its
+  header, its length is what is stored, and the data starts with the
+  uint32_t length of the value it expands to. Values without the flag
+  are read back as they always were, so the switch can be flipped on a
+  database that already holds data, and back.
+
+  The stream is a run of sequences. Each starts with a token byte whose
+  high nibble is a count of literals and whose low nibble is a match
+  length less LZ_MIN_MATCH. A nibble of 15 is followed by bytes to add
+  to it, up to and including the first that isn't 255. Then come the
+  literals, then the match's distance back as two bytes, low one first.
+  The last sequence is literals only. Matches are found through a hash
+  of the next four bytes, and the search steps further ahead the longer
+  it goes without one, so incompressible data goes through quickly.
+  Big values are tried on a sample first, and skipped if that doesn't
+  shrink.
+*/
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+#define LZ_MIN_VALUE 64           // Values shorter than this are stored as they are.
+#define LZ_MIN_SAVING 8           // Compression has to save an eighth.
+#define LZ_SAMPLE (64 * 1024)     // Bigger values are tried on this much first.
+
+static uint32_t read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes what's left of a length that didn't fit in its nibble.
+static unsigned char* put_length(unsigned char* op, int64_t n) {
+  for (; n >= 255; n -= 255) *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// Writes a sequence of lit literals from anchor, then a match of mlen
+// bytes distance back if mlen isn't 0. Returns NULL if it won't fit.
+static unsigned char* put_sequence(unsigned char* op, unsigned char* oend, const unsigned char* anchor,
+                                   int64_t lit, int64_t mlen, int distance) {
+  unsigned char* token = op;
+
+  if (oend - op < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return NULL;
+  op++;
+  *token = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) op = put_length(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+  if (mlen == 0) return op;
+
+  *op++ = distance & 0xff;
+  *op++ = distance >> 8;
+  mlen -= LZ_MIN_MATCH;
+  *token |= (mlen < 15 ? mlen : 15);
+  if (mlen >= 15) op = put_length(op, mlen - 15);
+  return op;
+}
+
+// Compresses len bytes of src into dst. Returns the bytes written, or 0
+// if they would have come to more than cap.
+uint32_t lz_compress(const char* src, uint32_t len, char* dst, uint32_t cap) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  const unsigned char* in = (const unsigned char*)src;
+  const unsigned char *ip = in, *anchor = in, *ref, *end = in + len;
+  const unsigned char* limit = len > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : in;
+  unsigned char *op = (unsigned char*)dst, *oend = op + cap;
+  int64_t mlen;
+  int h;
+
+  memset(table, 0, sizeof(table));
+  while (ip < limit) {
+    h = lz_hash(read32(ip));
+    ref = in + table[h];
+    table[h] = ip - in;
+    if (ref >= ip || ip - ref > LZ_MAX_DISTANCE || read32(ref) != read32(ip)) {
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++);
+    if ((op = put_sequence(op, oend, anchor, ip - anchor, mlen, ip - ref)) == NULL) return 0;
+    ip += mlen;
+    anchor = ip;
+  }
+
+  if ((op = put_sequence(op, oend, anchor, end - anchor, 0, 0)) == NULL) return 0;
+  return op - (unsigned char*)dst;
+}
+
+// Reads what's left of a length that didn't fit in its nibble.
+static const unsigned char* get_length(const unsigned char* ip, const unsigned char* iend, int64_t* n) {
+  unsigned char b;
+
+  do {
+    if (ip >= iend) return NULL;
+    b = *ip++;
+    *n += b;
+  } while (b == 255);
+  return ip;
+}
+
+// Expands len bytes made by lz_compress() into exactly raw bytes at dst.
+// Returns -1 if the stream is damaged or doesn't come to raw bytes.
+int lz_decompress(const char* src, uint32_t len, char* dst, uint32_t raw) {
+  const unsigned char *ip = (const unsigned char*)src, *iend = ip + len;
+  unsigned char *op = (unsigned char*)dst, *oend = op + raw;
+  const unsigned char* ref;
+  int64_t lit, mlen, n;
+  int token, distance;
+
+  while (ip < iend) {
+    token = *ip++;
+    lit = token >> 4;
+    if (lit == 15 && (ip = get_length(ip, iend, &lit)) == NULL) return -1;
+    if (lit > iend - ip || lit > oend - op) return -1;
+
+    // Short copies are done a fixed 16 bytes at a time where there's
+    // room, which is cheaper than copying just what's needed.
+    if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) memcpy(op, ip, 16);
+    else memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    distance = ip[0] | (ip[1] << 8);
+    ip += 2;
+    mlen = token & 15;
+    if (mlen == 15 && (ip = get_length(ip, iend, &mlen)) == NULL) return -1;
+    mlen += LZ_MIN_MATCH;
+    if (distance == 0 || distance > op - (unsigned char*)dst || mlen > oend - op) return -1;
+
+    // A match can overlap the bytes it makes, so copy it a distance at
+    // a time.
+    ref = op - distance;
+    if (mlen <= 16 && distance >= 16 && oend - op >= 16) {
+      memcpy(op, ref, 16);
+      op += mlen;
+      continue;
+    }
+    for (; mlen > 0; mlen -= n, op += n, ref += n) {
+      n = (mlen < distance) ? mlen : distance;
+      memcpy(op, ref, n);
+    }
+  }
+  return op == oend ? 0 : -1;
+}
+
+// Makes a compressed copy of a buffer made by new_value_buffer(), ready
+// to be written in its place. Returns NULL if compression is off, or
+// wouldn't save enough to be worth it.
+char* compress_value(const char* buffer) {
+  const struct value_header* header = (const struct value_header*)buffer;
+  struct value_header* packed_header;
+  uint32_t len = header->length, raw = header->length, cap, sample, packed_len;
+  char* packed;
+
+  if (!COMPRESS_VALUES || header->flags != 0 || len < LZ_MIN_VALUE) return NULL;
+  cap = len - len / LZ_MIN_SAVING;
+
+  if (len > LZ_SAMPLE) {
+    sample = LZ_SAMPLE - LZ_SAMPLE / LZ_MIN_SAVING;
+    if ((packed = malloc(sample)) == NULL) return NULL;
+    packed_len = lz_compress(VALUE_DATA(buffer), LZ_SAMPLE, packed, sample);
+    free(packed);
+    if (packed_len == 0) return NULL;
+  }
+
+  if ((packed = new_value_buffer(cap)) == NULL) return NULL;
+  if ((packed_len = lz_compress(VALUE_DATA(buffer), len, VALUE_DATA(packed) + sizeof(raw), cap - sizeof(raw))) == 0) {
+    free(packed);
+    return NULL;
+  }
+  memcpy(VALUE_DATA(packed), &raw, sizeof(raw));
+  packed_len += sizeof(raw);
+
+  // Zero what's left of the last block, so only the value goes to disk.
+  memset(VALUE_DATA(packed) + packed_len, '\0', VALUE_BLOCKS(packed_len) * BLOCK_SIZE - VALUE_HEADER_SIZE - packed_len);
+  packed_header = (struct value_header*)packed;
+  packed_header->length = packed_len;
+  packed_header->flags = VALUE_LZ;
+  return packed;
+}
+
+// Expands the len bytes of a compressed value at data into a new buffer
+// holding just the value followed by a terminator, and frees buffer,
+// which data points into. Sets len to the value's length.
+char* expand_value(char* buffer, const char* data, uint32_t *len) {
+  uint32_t raw;
+  char* value;
+
+  if (*len < sizeof(raw)) {
+    fprintf(stderr, "Compressed value of %u bytes is too short.\n", *len);
+    free(buffer);
+    return NULL;
+  }
+  memcpy(&raw, data, sizeof(raw));
+  if (raw > MAX_VALUE_LEN || (value = malloc((size_t)raw + 1)) == NULL) {
+    fprintf(stderr, "Can't expand a compressed value to %u bytes.\n", raw);
+    free(buffer);
+    return NULL;
+  }
+  if (lz_decompress(data + sizeof(raw), *len - sizeof(raw), value, raw) == -1) {
+    fprintf(stderr, "Compressed value is damaged.\n");
+    free(buffer);
+    free(value);
+    return NULL;
+  }
+  free(buffer);
+  value[raw] = '\0';
+  *len = raw;
+  return value;
+}
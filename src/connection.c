@@ -0,0 +1,352 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Framing for the text protocol, shared by both server cores.
+
+  A connection buffers whatever it has received. Every complete command
+  in the buffer is run, in order, and the responses are queued up so
+  they go out together in as few sends as the socket allows. A partial
+  command waits for the rest of it. So a client can pipeline as many
+  commands as it likes on one socket without waiting for answers.
+
+  Each command is either a text line or a binary request (binary.c),
+  told apart by its first byte.
+*/
+
+// Makes room for at least need more bytes past len.
+static int grow_buffer(char** buf, int* size, int len, int need) {
+  char* tmp;
+  int new_size = *size ? *size : MSG_SIZE;
+
+  while (new_size - len < need) new_size += new_size;
+  if (new_size == *size) return 0;
+  if ((tmp = realloc(*buf, new_size)) == NULL) {
+    perror("realloc failed in grow_buffer()");
+    return -1;
+  }
+  *buf = tmp;
+  *size = new_size;
+  return 0;
+}
+
+void free_connection(struct connection* conn) {
+  close(conn->fd);
+  free(conn->in);
+  free(conn->value);
+  free(conn->out);
+  free(conn);
+}
+
+// Takes one recv's worth of bytes from the socket. Returns what recv
+// returned: 0 once the client has hung up, -1 on error or when there
+// is nothing more without blocking.
+int read_input(struct connection* conn, int flags) {
+  int recvlen;
+
+  // A binary insert's value goes straight into its own buffer.
+  if (conn->value != NULL && conn->value_have < conn->value_len) {
+    if ((recvlen = recv(conn->fd, VALUE_DATA(conn->value) + conn->value_have,
+        conn->value_len - conn->value_have, flags)) > 0)
+      conn->value_have += recvlen;
+    else if (recvlen == 0)
+      conn->hung_up = 1;
+    return recvlen;
+  }
+
+  if (grow_buffer(&conn->in, &conn->in_size, conn->in_len, RECV_WINDOW) == -1) return -1;
+  if ((recvlen = recv(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len, flags)) > 0)
+    conn->in_len += recvlen;
+  else if (recvlen == 0)
+    conn->hung_up = 1;
+  return recvlen;
+}
+
+int queue_output(struct connection* conn, const void* data, int len) {
+  if (grow_buffer(&conn->out, &conn->out_size, conn->out_len, len) == -1) return -1;
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+  return 0;
+}
+
+// Appends one text response to the output queue.
+static int queue_response(struct connection* conn, struct response_struct response) {
+  char status_msg[MSG_SIZE];
+  int rc;
+
+  if (response.scan != NULL) return queue_keys(conn, response.scan, 0, 0);
+  if (response.snapshot) return queue_snapshot(conn, response.base_id, 0, 0);
+
+  rc = queue_output(conn, status_msg, prepare_status(response, status_msg));
+  if (response.value.blocks > 0) {
+    if (rc == 0) rc = queue_value(conn, response.value, response.msg_len);
+    btree_read_end(); // fetch_value() kept it from being freed until now.
+  } else if (rc == 0)
+    rc = queue_output(conn, response.msg, (response.msg_len == -1) ? strlen(response.msg) : response.msg_len);
+  if (rc == 0) rc = queue_output(conn, "\n\n", 2);
+  return rc;
+}
+
+// Sends everything queued so far, with flags. Returns 0 once it has
+// all gone, 1 if a non-blocking socket filled up, -1 on error.
+static int flush_output(struct connection* conn, int flags) {
+  int sent;
+
+  while (conn->out_sent < conn->out_len) {
+    sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, flags | MSG_NOSIGNAL);
+    if (sent == -1) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+    conn->out_sent += sent;
+  }
+  conn->out_len = conn->out_sent = 0;
+  return 0;
+}
+
+// Queues the len byte value stored at ptr. Once everything ahead of it
+// is out, as much of it as the socket takes is sent straight from
+// DB_MAP, so the only copy made is the kernel's. Whatever the socket
+// won't take yet is copied into the output queue.
+//
+// It all has to happen now: once we move on to the next command, the
+// value could be deleted and its blocks zeroed or reused. That's also
+// why this isn't sendfile(), which hands the socket the file's pages
+// themselves, to be read whenever they are (re)transmitted. The caller
+// is inside a read of the index until we're done, so nothing here
+// waits on the client, even on a blocking socket.
+int queue_value(struct connection* conn, struct block_ptr ptr, uint32_t len) {
+  int64_t offset = ptr.block_offset * BLOCK_SIZE + VALUE_HEADER_SIZE;
+  uint32_t done = 0;
+  ssize_t sent;
+
+  if (DB_MAP == NULL) {
+    if (grow_buffer(&conn->out, &conn->out_size, conn->out_len, len) == -1) return -1;
+    if (storage_read(conn->out + conn->out_len, len, offset) != len) {
+      perror("pread failed in queue_value");
+      return -1;
+    }
+    conn->out_len += len;
+    return 0;
+  }
+
+  wal_commit(); // What's queued may answer changes, which must be logged first.
+  if (flush_output(conn, MSG_MORE | MSG_DONTWAIT) == 0)
+    while (done < len && (sent = send(conn->fd, DB_MAP + offset + done, len - done, MSG_NOSIGNAL | MSG_DONTWAIT)) > 0) done += sent;
+
+  return queue_output(conn, DB_MAP + offset + done, len - done);
+}
+
+// Queues the keys a scan finds, in the text protocol or the binary one.
+// They go a KEYS_CHUNK at a time, each chunk a response of its own with
+// status MORE, and each pushed out to the socket as soon as it's ready.
+// A last response says how the scan ended: OK with a cursor, or with
+// nothing if there are no keys left, or FAIL.
+//
+// Text chunks are keys each followed by a newline. Binary ones are keys
+// each after a uint16 length, as in a batch.
+int queue_keys(struct connection* conn, struct key_scan* scan, int binary, uint64_t request_id) {
+  struct response_struct response = {.status = STATUS_MORE, .msg_len = 0};
+  char (*keys)[KEY_LEN];
+  uint16_t key_len, wire_len;
+  int i, n, rc = 0;
+
+  keys = malloc(sizeof(*keys) * (KEYS_CHUNK + 1));
+  response.msg = malloc(KEYS_CHUNK * (KEY_LEN + sizeof(key_len)));
+  if (keys == NULL || response.msg == NULL) {
+    perror("malloc failed in queue_keys()");
+    free(keys);
+    free(response.msg);
+    return -1;
+  }
+
+  while (rc == 0 && (n = scan_next(scan, keys, KEYS_CHUNK)) > 0) {
+    for (response.msg_len = 0, i = 0; i < n; i++) {
+      key_len = strlen(keys[i]);
+      if (binary) {
+        wire_len = htole16(key_len);
+        memcpy(response.msg + response.msg_len, &wire_len, sizeof(wire_len));
+        response.msg_len += sizeof(wire_len);
+      }
+      memcpy(response.msg + response.msg_len, keys[i], key_len);
+      response.msg_len += key_len;
+      if (!binary) response.msg[response.msg_len++] = '\n';
+    }
+    rc = binary ? queue_binary(conn, request_id, response) : queue_response(conn, response);
+    wal_commit(); // What's queued may answer changes, which must be logged first.
+    if (rc == 0 && flush_output(conn, MSG_MORE) == -1) rc = -1;
+  }
+
+  if (n == -1) {
+    response.status = 1;
+    response.msg_len = sprintf(response.msg, "Index scan failed.");
+  } else {
+    response.status = 0;
+    response.msg_len = scan_cursor(scan, response.msg); // There's room for KEYS_CURSOR_LEN.
+  }
+  if (rc == 0) rc = binary ? queue_binary(conn, request_id, response) : queue_response(conn, response);
+
+  free(keys);
+  free(response.msg);
+  return rc;
+}
+
+struct snapshot_out { // Where a snapshot being streamed goes.
+  struct connection* conn;
+  int       binary;
+  uint64_t  request_id;
+  char*     chunk;           // SNAPSHOT_CHUNK bytes.
+  int       len;
+  int       failed;          // The client's gone.
+};
+
+// Sends a chunk of a snapshot, and waits for the socket to take it if
+// it's non-blocking, so a snapshot is held a chunk at a time however
+// slow the client is. A client that takes nothing for SNAPSHOT_SEND_MS
+// is given up on, so it can't hold the snapshot, or an epoll worker,
+// for good.
+static int send_chunk(struct snapshot_out* out) {
+  struct response_struct response = {.status = STATUS_MORE, .msg = out->chunk, .msg_len = out->len};
+  struct pollfd pfd = {.fd = out->conn->fd, .events = POLLOUT};
+  int rc, ready;
+
+  rc = out->binary ? queue_binary(out->conn, out->request_id, response) : queue_response(out->conn, response);
+  out->len = 0;
+  wal_commit(); // What's queued may answer changes, which must be logged first.
+  while (rc == 0 && (rc = flush_output(out->conn, MSG_MORE)) == 1) {
+    if ((ready = poll(&pfd, 1, SNAPSHOT_SEND_MS)) == 0) {
+      fprintf(stderr, "Client took no snapshot data for %d ms. Dropping it.\n", SNAPSHOT_SEND_MS);
+      rc = -1;
+    } else if (ready == -1 && errno != EINTR) {
+      rc = -1;
+    }
+  }
+  if (rc == -1) out->failed = 1;
+  return rc;
+}
+
+static int snapshot_sink(void *arg, const char *data, int len) {
+  struct snapshot_out* out = arg;
+  int n;
+
+  while (len > 0) {
+    n = (SNAPSHOT_CHUNK - out->len < len) ? SNAPSHOT_CHUNK - out->len : len;
+    memcpy(out->chunk + out->len, data, n);
+    out->len += n;
+    data += n;
+    len -= n;
+    if (out->len == SNAPSHOT_CHUNK && send_chunk(out) == -1) return -1;
+  }
+  return 0;
+}
+
+// Streams a snapshot (see snapshot.c), in the text protocol or the
+// binary one, as responses with status MORE, each SNAPSHOT_CHUNK bytes
+// of it. A last response is OK with the snapshot's id, in decimal or as
+// a uint64, or FAIL, in which case whatever came before it is no use.
+// The connection, and in -r epoll its worker, does nothing else until
+// it's done, or the client stops reading and is dropped.
+int queue_snapshot(struct connection* conn, int64_t base_id, int binary, uint64_t request_id) {
+  struct snapshot_out out = {.conn = conn, .binary = binary, .request_id = request_id};
+  struct response_struct response = {.status = 0};
+  char msg[MSG_SIZE];
+  int64_t id, wire_id;
+  int rc;
+
+  if ((out.chunk = malloc(SNAPSHOT_CHUNK)) == NULL) {
+    perror("malloc failed in queue_snapshot()");
+    return -1;
+  }
+
+  rc = snapshot_stream(base_id, snapshot_sink, &out, &id, msg);
+  if (rc == 0 && out.len > 0) rc = send_chunk(&out);
+  free(out.chunk);
+  if (out.failed) return -1;
+
+  response.msg = msg;
+  if (rc == -1) {
+    response.status = 1;
+    response.msg_len = -1;
+  } else if (binary) {
+    wire_id = htole64(id);
+    memcpy(msg, &wire_id, sizeof(wire_id));
+    response.msg_len = sizeof(wire_id);
+  } else {
+    response.msg_len = sprintf(msg, "%lld", (long long)id);
+  }
+  return binary ? queue_binary(conn, request_id, response) : queue_response(conn, response);
+}
+
+// Runs every complete command we've received, in order, queueing up
+// their responses. Stops at quit.
+int run_input(struct connection* conn) {
+  struct response_struct response;
+  char *line, *end, *tmp_msg;
+  int start = 0, used, rc = 0, command;
+  int64_t started;
+
+  if (conn->value != NULL) {
+    if (conn->value_have < conn->value_len) return 0;
+    if (finish_binary(conn) == -1) return -1;
+  }
+
+  while (!conn->quit && conn->value == NULL && start < conn->in_len) {
+    if ((unsigned char)conn->in[start] == BIN_REQUEST_MAGIC) {
+      if ((used = run_binary(conn, start)) == -1) {
+        rc = -1;
+        break;
+      }
+      if (used == 0) break; // Wait for the rest of it.
+      start += used;
+      continue;
+    }
+
+    if ((end = memchr(conn->in + start, '\n', conn->in_len - start)) == NULL) break;
+    line = conn->in + start;
+    *end = '\0';
+    start = end - conn->in + 1;
+
+    tmp_msg = line;
+    strsep(&tmp_msg, "\r\n");
+
+    started = stats_clock();
+    if ((command = run_command(line, &response)) == 0) {
+      conn->quit = 1;
+      break;
+    }
+    rc = queue_response(conn, response);
+    stats_record(command, started);
+    free(response.msg);
+    free(response.scan);
+    if (rc == -1) break;
+  }
+
+  // Keep any partial command for the next read.
+  memmove(conn->in, conn->in + start, conn->in_len - start);
+  conn->in_len -= start;
+  return rc;
+}
+
+// Sends as much queued output as the socket takes. Returns 0 once it
+// has all gone, 1 if a non-blocking socket filled up, -1 on error.
+int send_output(struct connection* conn) {
+  return flush_output(conn, 0);
+}
@@ -22,49 +22,279 @@ THE SOFTWARE.
 
 #include "emma.h"
 
-void release_block_reservation(int block_offset, int blocks_used) {
+/*
+  The block bitmap file only reaches as far as the allocation groups
+  that have been used, and grows a group's worth at a time as more are.
+  The mapping always has room for all of it, so a process sees the new
+  part as soon as the file has it, and a small database doesn't pay for
+  a big bitmap.
+
+  Bitmap durability. Instead of msync'ing the whole mapping after every
+  change, we only flush the pages a change touched:
+
+  SYNC_PER_OP   each reservation flushes its own pages before returning.
+  SYNC_GROUP    changes mark their pages dirty and wait. The first waiter
+                becomes the leader, gives others interval_ms to pile on,
+                then flushes every dirty page for the whole batch.
+  SYNC_ASYNC    changes mark their pages dirty and move on. Dirty pages
+                are flushed at most every interval_ms by whoever writes
+                next, and by each connection on its way out.
+*/
+
+char DATA_HOME[4096] = "/var/emma"; // Where the db files live. Set with -d.
 
-  sem_wait(BLOCK_BITMAP_LOCK);
+static __thread volatile sig_atomic_t FLUSHING = 0; // Set while this thread is flushing.
 
-  for (int j = 0; j < blocks_used; j++) 
-		bit_array_clear(SHM_BLOCK_BITMAP, block_offset + j);
+// Maps the block bitmap in file, creating it if need be. The file
+// covers at least the first group, and whole groups after that.
+int bitmap_open(const char *file) {
+  struct stat st;
+  int64_t bytes;
+
+  if ((BLOCK_BITMAP_FD = open(file, O_RDWR | O_CREAT, 0666)) == -1 || fstat(BLOCK_BITMAP_FD, &st) == -1) {
+    fprintf(stderr, "Couldn't open db block bitmap file %s\n", file);
+    perror(NULL);
+    return -1;
+  }
+  bytes = (st.st_size + BITMAP_GROW_BYTES - 1) / BITMAP_GROW_BYTES * BITMAP_GROW_BYTES;
+  if (bytes < BITMAP_GROW_BYTES) bytes = BITMAP_GROW_BYTES;
+  if (bytes > BLOCK_BITMAP_BYTES) bytes = BLOCK_BITMAP_BYTES;
+  if (bytes > st.st_size && ftruncate(BLOCK_BITMAP_FD, bytes) == -1) {
+    perror("Couldn't size the block bitmap");
+    return -1;
+  }
+
+  if ((SHM_BLOCK_BITMAP = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, BLOCK_BITMAP_FD, 0)) == MAP_FAILED ||
+      (SHM_BITMAP_FILE = mmap((caddr_t)0, sizeof(struct bitmap_file), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the block bitmap");
+    SHM_BITMAP_FILE = NULL;
+    return -1;
+  }
+  if (sem_init(&SHM_BITMAP_FILE->lock, 1, 1) == -1) {
+    perror("semaphore init failed");
+    return -1;
+  }
+  SHM_BITMAP_FILE->bytes = bytes;
+  return 0;
+}
 
-  sem_post(BLOCK_BITMAP_LOCK);
+// Grows the bitmap file, if need be, so it holds the bits for the first
+// blocks blocks. Only ever grows it, one writer at a time.
+int bitmap_cover(int64_t blocks) {
+  struct bitmap_file* f = SHM_BITMAP_FILE;
+  int64_t bytes = (blocks + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS * BITMAP_GROW_BYTES;
+  int rc = 0;
+
+  // Benchmarks map a whole bitmap of their own.
+  if (f == NULL || bytes <= __atomic_load_n(&f->bytes, __ATOMIC_ACQUIRE)) return 0;
+  if (bytes > BLOCK_BITMAP_BYTES) return -1;
+
+  sem_wait(&f->lock);
+  if (bytes > f->bytes) {
+    if (ftruncate(BLOCK_BITMAP_FD, bytes) == -1) {
+      perror("Couldn't grow the block bitmap");
+      rc = -1;
+    } else {
+      __atomic_store_n(&f->bytes, bytes, __ATOMIC_RELEASE);
+    }
+  }
+  sem_post(&f->lock);
+  return rc;
+}
 
+// How much of the bitmap can be read and written so far.
+int64_t bitmap_bytes(void) {
+  return SHM_BITMAP_FILE ? __atomic_load_n(&SHM_BITMAP_FILE->bytes, __ATOMIC_ACQUIRE) : BLOCK_BITMAP_BYTES;
 }
 
-int create_block_reservation(int blocks_needed) {
-  // Finds an area of free blocks in our database file.
+int bitmap_sync_init(int mode, int interval_ms) {
+  int page_size = sysconf(_SC_PAGESIZE);
+  int dirty_bytes = BLOCK_BITMAP_BYTES / page_size / 8;
+
+  if ((SHM_BITMAP_SYNC = mmap((caddr_t)0, sizeof(struct bitmap_sync) + dirty_bytes,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the bitmap sync state");
+    return -1;
+  }
+  SHM_BITMAP_SYNC->mode = mode;
+  SHM_BITMAP_SYNC->interval_ms = interval_ms;
+  SHM_BITMAP_SYNC->page_size = page_size;
+  SHM_BITMAP_SYNC->dirty_bytes = dirty_bytes;
+  SHM_BITMAP_SYNC->epoch = 1;
+
+  sem_unlink("bitmap_flush_lock");
+  if ((BITMAP_FLUSH_LOCK = sem_open("bitmap_flush_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    return -1;
+  }
+  return 0;
+}
+
+static int64_t now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  bool found = false;
-  int retval = -1;
-	int i, j;
+// Records which bitmap pages a change touched. Returns the epoch the
+// change belongs to. Nothing is locked: the flusher moves to the next
+// epoch before it takes the dirty bits, so a change that saw the old
+// epoch has its bits in this batch.
+static int64_t mark_bitmap_dirty(int block_offset, int blocks) {
+  struct bitmap_sync* sync = SHM_BITMAP_SYNC;
+  int first = (block_offset / 8) / sync->page_size;
+  int last = ((block_offset + blocks - 1) / 8) / sync->page_size;
 
-  sem_wait(BLOCK_BITMAP_LOCK);
+  if (sync->mode == SYNC_PER_OP) return 0;
 
-  for (j = 0; j < MAX_BLOCKS; j++) {
-    for (i = 0; i < blocks_needed; i++) {
-      if (bit_array_test(SHM_BLOCK_BITMAP, i + j) != 0) {// didn't find a contiguous block
-        j += i;
-        break;
+  for (int page = first; page <= last; page++)
+    __atomic_fetch_or(&sync->dirty[page / 8], 1 << (page % 8), __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&sync->epoch, __ATOMIC_SEQ_CST);
+}
+
+// Writes out every dirty page of the bitmap, merging neighbouring pages
+// into one msync call. Called with BITMAP_FLUSH_LOCK held.
+static void flush_dirty_pages(void) {
+  struct bitmap_sync* sync = SHM_BITMAP_SYNC;
+  unsigned char bits;
+  int i, page, run_start = -1, dirty_bytes;
+  int64_t epoch;
+
+  FLUSHING = 1;
+
+  // Start the next batch, then take this one's dirty pages. Nothing past
+  // the end of the file can be dirty.
+  epoch = __atomic_fetch_add(&sync->epoch, 1, __ATOMIC_SEQ_CST);
+  dirty_bytes = (bitmap_bytes() / sync->page_size + 7) / 8;
+  if (dirty_bytes > sync->dirty_bytes) dirty_bytes = sync->dirty_bytes;
+
+  for (i = 0; i <= dirty_bytes; i++) {
+    bits = (i < dirty_bytes && __atomic_load_n(&sync->dirty[i], __ATOMIC_RELAXED))
+        ? __atomic_exchange_n(&sync->dirty[i], 0, __ATOMIC_SEQ_CST) : 0;
+    for (page = i * 8; page < i * 8 + 8; page++) {
+      if (bits & (1 << (page % 8))) {
+        if (run_start == -1) run_start = page;
+      } else if (run_start != -1) {
+        msync(SHM_BLOCK_BITMAP + (int64_t)run_start * sync->page_size, (int64_t)(page - run_start) * sync->page_size, MS_SYNC);
+        run_start = -1;
       }
     }
-    if (i == blocks_needed) {
-      found = true;
-      break;
-    }
   }
 
-  if (found) {
-		// Found a good set of blocks. Mark them as used.
-    for (i = 0; i < blocks_needed; i++) 
-      bit_array_set(SHM_BLOCK_BITMAP, i + j);
-    retval = j;
+  sync->last_flush_ms = now_msec();
+  __atomic_store_n(&sync->flushed_epoch, epoch, __ATOMIC_RELEASE);
+  FLUSHING = 0;
+}
+
+void bitmap_flush(void) {
+  // Nothing is ever left dirty in sync mode. If we were interrupted
+  // part way through a flush, leave the rest to the next one.
+  if (SHM_BITMAP_SYNC->mode == SYNC_PER_OP || FLUSHING) return;
+
+  sem_wait(BITMAP_FLUSH_LOCK);
+  flush_dirty_pages();
+  sem_post(BITMAP_FLUSH_LOCK);
+}
+
+// Makes a change to the bitmap as durable as the sync mode asks for.
+static void commit_bitmap(int block_offset, int blocks, int64_t epoch) {
+  struct bitmap_sync* sync = SHM_BITMAP_SYNC;
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 100000};
+  struct timespec batch = {.tv_sec = sync->interval_ms / 1000, .tv_nsec = (sync->interval_ms % 1000) * 1000000L};
+  int64_t first, last;
+
+  switch (sync->mode) {
+
+    case SYNC_PER_OP:
+      first = (block_offset / 8) / sync->page_size * sync->page_size;
+      last = (block_offset + blocks - 1) / 8;
+      msync(SHM_BLOCK_BITMAP + first, last - first + 1, MS_SYNC);
+      break;
+
+    case SYNC_GROUP:
+      while (__atomic_load_n(&sync->flushed_epoch, __ATOMIC_ACQUIRE) < epoch) {
+        if (sem_trywait(BITMAP_FLUSH_LOCK) == 0) { // Lead this batch.
+          if (__atomic_load_n(&sync->flushed_epoch, __ATOMIC_ACQUIRE) < epoch) {
+            nanosleep(&batch, NULL);
+            flush_dirty_pages();
+          }
+          sem_post(BITMAP_FLUSH_LOCK);
+        } else {
+          nanosleep(&nap, NULL);
+        }
+      }
+      break;
+
+    case SYNC_ASYNC:
+      if (now_msec() - sync->last_flush_ms >= sync->interval_ms && sem_trywait(BITMAP_FLUSH_LOCK) == 0) {
+        flush_dirty_pages();
+        sem_post(BITMAP_FLUSH_LOCK);
+      }
+      break;
   }
+}
+
+// Hands blocks back to the allocator. If their WAL_FREE is already in
+// the log, pending counts them until they're free in the bitmap too.
+static void free_blocks(int block_offset, int blocks_used, int *pending) {
+
+  int64_t epoch;
+  struct block_ptr freed = {.block_offset = block_offset, .blocks = blocks_used};
+
+  // A snapshot being taken may still need them.
+  if (snapshot_defer(block_offset, blocks_used, pending, 0)) return;
 
- // commit the whole block bitmap to disk
-  msync(SHM_BLOCK_BITMAP, BLOCK_BITMAP_BYTES, MS_SYNC);
-  sem_post(BLOCK_BITMAP_LOCK);
+  // Whatever was cached for these blocks is gone.
+  cache_write(freed, NULL);
+
+  group_free(block_offset, blocks_used, pending == NULL);
+  if (pending != NULL) __atomic_sub_fetch(pending, 1, __ATOMIC_SEQ_CST);
+
+  epoch = mark_bitmap_dirty(block_offset, blocks_used);
+  commit_bitmap(block_offset, blocks_used, epoch);
+}
+
+void release_block_reservation(int block_offset, int blocks_used) {
+  free_blocks(block_offset, blocks_used, NULL);
+}
+
+// Gives back blocks reclaim_later() has finished with. Their WAL_FREE
+// went into the log when they were deleted.
+void release_reclaimed_blocks(int block_offset, int blocks_used) {
+  free_blocks(block_offset, blocks_used, &SHM_RECLAIM->pending);
+}
+
+// Gives back the old copy of a value compaction moved, which was logged
+// as free when its key was pointed at the new one.
+void release_moved_blocks(int block_offset, int blocks_used) {
+  free_blocks(block_offset, blocks_used, &SHM_COMPACT->pending);
+}
+
+// Gives back an index page no reader can be on any more. It was logged
+// as free by the change that replaced it.
+void release_retired_blocks(int block_offset, int blocks_used) {
+  free_blocks(block_offset, blocks_used, &SHM_INDEX->pending);
+}
+
+// Gives back blocks freed while a snapshot was pinned, once it's done.
+// They were logged as free when they were held back.
+void release_deferred_blocks(int block_offset, int blocks_used) {
+  free_blocks(block_offset, blocks_used, &SHM_SNAPSHOT->pending);
+}
+
+int create_block_reservation(int blocks_needed) {
+  // Finds an area of free blocks in our database file.
+
+  int retval;
+  int64_t epoch;
+
+  if (blocks_needed < 1) return 0;
+
+  if ((retval = group_alloc(blocks_needed)) != -1) {
+    epoch = mark_bitmap_dirty(retval, blocks_needed);
+    commit_bitmap(retval, blocks_needed, epoch);
+  }
 
   return(retval);
 }
@@ -78,61 +308,67 @@ char* read_obj(struct block_ptr obj) {
   int       byte_count = obj.blocks * BLOCK_SIZE;
   int64_t		byte_offset = obj.block_offset * BLOCK_SIZE;
   int       bytes_read = 0;
+  int64_t   version;
 
-  // Allocate a zero-padded buffer for the object.
   if ((buffer = malloc(byte_count)) == NULL) {
     perror("malloc failed in read_record()");
     return NULL;
   }
-  memset(buffer, '\0', byte_count);
+  if (cache_read(obj, buffer)) return buffer;
 
-	// Read the object from disk into the buffer.
-  if ((bytes_read = pread(DB_FD, (void*)buffer, byte_count, byte_offset)) == -1) {
+	// Read the object from disk into the buffer, zero-padding whatever
+	// lies past the end of the file.
+  version = cache_version();
+  if ((bytes_read = storage_read((void*)buffer, byte_count, byte_offset)) == -1) {
     perror("pread failed in read_record");
     free(buffer);
     return NULL;
   }
+  if (bytes_read < byte_count) memset(buffer + bytes_read, '\0', byte_count - bytes_read);
 
+  cache_fill(obj, buffer, version);
   return buffer;
 }
 
 
+// Deleting only changes metadata: the blocks go back to the allocator
+// with their contents left as they are, unless -e asks for them to be
+// punched out or zeroed first, which waits while a snapshot is pinned.
 int delete_obj(struct block_ptr obj) {
-  void*       buffer;
-  int         byte_count = 0;
-  int64_t     byte_offset;
+  if (obj.size > 0) return slab_free(&obj, 1);
+  if (SHM_RECLAIM != NULL) return snapshot_defer(obj.block_offset, obj.blocks, NULL, 1) ? 0 : reclaim_later(obj);
+  release_block_reservation(obj.block_offset, obj.blocks);
+  return 0;
+}
 
-  byte_count = obj.blocks * BLOCK_SIZE;
-  byte_offset = obj.block_offset * BLOCK_SIZE;
+int write_obj(struct block_ptr *ptr, const void *obj, const int s) {
 
-  // Make a buffer of zeros as big as the object to be erased.
+  void *buffer;
+	int blocks = s / BLOCK_SIZE;
+	if (s % BLOCK_SIZE != 0) blocks++;
+  int byte_count = blocks * BLOCK_SIZE;
+  int rc;
+
+	// Create a zero-padded buffer at least as big as the object.
+	// Copy the object to be stored into the buffer.
   if ((buffer = malloc(byte_count)) == NULL) {
-    perror("malloc failed in delete_record()");
+    perror("malloc failed in write_record()");
     return -1;
   }
   memset(buffer, '\0', byte_count);
+  memcpy(buffer, obj, s);
 
-	// Write over the object in the DB with the zeroed buffer.
-  int rc = pwrite(DB_FD, buffer, byte_count, byte_offset);
-	free(buffer);
-
-	if (rc == -1) {
-    perror("pwrite failed in delete_record");
-    return -1;
-  }
-
-  // Mark these blocks as usable again.
-  release_block_reservation(obj.block_offset, obj.blocks);
-  return 0;
+  rc = write_blocks(ptr, buffer, blocks);
+  free(buffer);
+  return rc;
 }
 
-int write_obj(struct block_ptr *ptr, const void *obj, const int s) {
+// Stores a buffer that is already padded out to whole blocks, without
+// copying it.
+int write_blocks(struct block_ptr *ptr, const void *buffer, int blocks) {
 
-  void *buffer;
   int block_offset;
   int64_t byte_offset;
-	int blocks = s / BLOCK_SIZE;
-	if (s % BLOCK_SIZE != 0) blocks++;
   int byte_count = blocks * BLOCK_SIZE;
 
 	// Find us some free space in the db file.
@@ -141,20 +377,16 @@ int write_obj(struct block_ptr *ptr, const void *obj, const int s) {
     return -1;
   }
 
-	// Create a zero-padded buffer at least as big as the object.
-	// Copy the object to be stored into the buffer.
-  if ((buffer = malloc(byte_count)) == NULL) {
-    perror("malloc failed in write_record()");
+  // Write the buffer to the appropriate location in our file.
+  byte_offset = (int64_t)block_offset * BLOCK_SIZE;
+  wal_write_begin();
+  if (wal_append(WAL_WRITE, byte_offset, 0, buffer, byte_count) == -1) {
+    wal_write_done();
     release_block_reservation(block_offset, blocks);
     return -1;
   }
-  memset(buffer, '\0', byte_count);
-  memcpy(buffer, obj, s);
-
-  // Write the buffer to the appropriate location in our file.
-  byte_offset = block_offset * BLOCK_SIZE;
-  int rc = pwrite(DB_FD, buffer, byte_count, byte_offset);
-	free(buffer);
+  int rc = storage_write(buffer, byte_count, byte_offset);
+  wal_write_done();
 
 	if (rc == -1) {
     perror("pwrite failed in write_record");
@@ -165,10 +397,385 @@ int write_obj(struct block_ptr *ptr, const void *obj, const int s) {
 	// Write was successful. Update the pased-in block pointer.
 	ptr->block_offset = block_offset;
 	ptr->blocks = blocks;
+  ptr->offset = 0;
+  ptr->size = 0;
+  cache_write(*ptr, buffer);
+
+  return 0;
+}
+
+
+/*
+  Values are stored behind a struct value_header that records their
+  exact length, so they can hold any bytes at all, NULs included. Small
+  ones share blocks with others in slabs (see slab.c); the rest get
+  blocks of their own. With -z lz a value may be stored compressed, and
+  is expanded again as it is read (see compress.c).
+*/
+
+// Makes a block-aligned, zero-padded buffer with room for a header and
+// len bytes of value, which go at VALUE_DATA(buffer).
+char* new_value_buffer(uint32_t len) {
+  void* buffer;
+  int64_t byte_count = VALUE_BLOCKS(len) * BLOCK_SIZE;
+
+  if (posix_memalign(&buffer, BLOCK_SIZE, byte_count) != 0) {
+    perror("posix_memalign failed in new_value_buffer()");
+    return NULL;
+  }
+  memset(buffer, '\0', sizeof(struct value_header));
+  memset((char*)buffer + byte_count - BLOCK_SIZE, '\0', BLOCK_SIZE); // The padding.
+  ((struct value_header*)buffer)->length = len;
+  return buffer;
+}
+
+// Stores a buffer made by new_value_buffer(), compressed if that's on
+// and worth it.
+int write_value(struct block_ptr *ptr, const char *buffer) {
+  char* packed = compress_value(buffer);
+  char* stored = (packed != NULL) ? packed : (char*)buffer;
+  uint32_t len = ((const struct value_header*)stored)->length;
+  int rc;
+
+  if (slab_fits(len)) {
+    rc = slab_store(&stored, ptr, 1);
+  } else {
+    ptr->offset = 0;
+    ptr->size = 0;
+    rc = write_blocks(ptr, stored, VALUE_BLOCKS(len));
+  }
+  free(packed);
+  return rc;
+}
+
+// Bytes of ptr's object a value can take up, header included.
+static int64_t value_room(struct block_ptr ptr) {
+  return ptr.size > 0 ? ptr.size : (int64_t)ptr.blocks * BLOCK_SIZE;
+}
+
+// Turns an object read from the db into just its value followed by a
+// terminator, in the same buffer. Frees the buffer if it isn't a value.
+static char* unwrap_value(char* buffer, struct block_ptr ptr, uint32_t *len) {
+  struct value_header header;
+
+  memcpy(&header, buffer + ptr.offset, sizeof(header));
+  if (VALUE_HEADER_SIZE + header.length > value_room(ptr)) {
+    fprintf(stderr, "Value at block %lld claims %u bytes.\n", (long long)ptr.block_offset, header.length);
+    free(buffer);
+    return NULL;
+  }
+  *len = header.length;
+  if (header.flags & VALUE_LZ) return expand_value(buffer, buffer + ptr.offset + sizeof(header), len);
+  memmove(buffer, buffer + ptr.offset + sizeof(header), header.length);
+  buffer[header.length] = '\0';
+  return buffer;
+}
+
+// Reads a value back. Returns a buffer the caller frees, holding just
+// the value followed by a terminator, and sets len to its length.
+char* read_value(struct block_ptr ptr, uint32_t *len) {
+  char* buffer;
+
+  if ((buffer = read_obj(ptr)) == NULL) return NULL;
+  return unwrap_value(buffer, ptr, len);
+}
+
+// Finds out how long a stored value is without reading it. The value
+// itself starts VALUE_HEADER_SIZE bytes into its first block. Returns 1
+// if it is compressed, and so has to be read with read_value().
+int read_value_length(struct block_ptr ptr, uint32_t *len) {
+  struct value_header header;
+
+  if (storage_read(&header, sizeof(header), ptr.block_offset * BLOCK_SIZE + ptr.offset) != sizeof(header)) {
+    perror("pread failed in read_value_length");
+    return -1;
+  }
+  if (VALUE_HEADER_SIZE + header.length > value_room(ptr)) {
+    fprintf(stderr, "Value at block %lld claims %u bytes.\n", (long long)ptr.block_offset, header.length);
+    return -1;
+  }
+  *len = header.length;
+  return (header.flags & VALUE_LZ) ? 1 : 0;
+}
+
+/*
+  Batches. Objects are handled in block order, and objects that sit
+  next to each other in the db file share a single preadv/pwritev/
+  pwrite, so a batch costs a few sequential I/Os and not one per key.
+  With io_uring those I/Os are submitted together.
+*/
+
+static int cmp_block_offset(const void *a, const void *b) {
+  const struct block_ptr *x = *(const struct block_ptr**)a, *y = *(const struct block_ptr**)b;
+  return (x->block_offset > y->block_offset) - (x->block_offset < y->block_offset);
+}
+
+// Fills order with pointers to ptrs, sorted by where they live.
+static const struct block_ptr** sort_by_offset(const struct block_ptr *ptrs, int count) {
+  const struct block_ptr** order;
+  int i;
+
+  if ((order = malloc(sizeof(struct block_ptr*) * (count > 0 ? count : 1))) == NULL) {
+    perror("malloc failed in sort_by_offset()");
+    return NULL;
+  }
+  for (i = 0; i < count; i++) order[i] = &ptrs[i];
+  qsort(order, count, sizeof(struct block_ptr*), cmp_block_offset);
+  return order;
+}
+
+// Number of objects from order[i] on that sit end to end in the file,
+// up to max.
+static int run_length(const struct block_ptr **order, int i, int count, int max) {
+  int n = 1;
+
+  while (i + n < count && n < max &&
+         order[i + n - 1]->block_offset + order[i + n - 1]->blocks == order[i + n]->block_offset) n++;
+  return n;
+}
+
+// Whether two slab values, next to each other in block order, share a page.
+static int same_page(const struct block_ptr *a, const struct block_ptr *b) {
+  return a->blocks > 0 && b->blocks > 0 && a->size > 0 && b->size > 0 && a->block_offset == b->block_offset;
+}
+
+// Reads many values at once. values[i] and lens[i] are filled in as
+// read_value() would for ptrs[i]; a pointer with no blocks gets NULL.
+// Returns -1 if any read failed.
+int read_values(const struct block_ptr *ptrs, char **values, uint32_t *lens, int count) {
+  const struct block_ptr** sorted;
+  const struct block_ptr** order;
+  struct iovec* iov = NULL;
+  struct storage_io* ios = NULL;
+  int i, j, n, runs, misses, rc = 0;
+  int64_t version;
+
+  for (i = 0; i < count; i++) values[i] = NULL;
+  if ((sorted = sort_by_offset(ptrs, count)) == NULL) return -1;
+  if ((order = malloc(sizeof(struct block_ptr*) * (count > 0 ? count : 1))) == NULL) {
+    perror("malloc failed in read_values()");
+    free(sorted);
+    return -1;
+  }
+
+  // Take what we can from the cache. Only the rest is read from disk,
+  // and slab values on the same page share a read.
+  for (misses = 0, i = 0; i < count; i++) {
+    if (sorted[i]->blocks < 1) continue;
+    if ((values[sorted[i] - ptrs] = malloc(sorted[i]->blocks * BLOCK_SIZE)) == NULL) {
+      perror("malloc failed in read_values()");
+      rc = -1;
+      break;
+    }
+    if (i > 0 && same_page(sorted[i - 1], sorted[i])) continue;
+    if (cache_read(*sorted[i], values[sorted[i] - ptrs])) continue;
+    order[misses++] = sorted[i];
+  }
+
+  // Every run is read in the same batch.
+  if (rc == 0 && misses > 0) {
+    iov = malloc(sizeof(struct iovec) * misses);
+    ios = malloc(sizeof(struct storage_io) * misses);
+    if (iov == NULL || ios == NULL) {
+      perror("malloc failed in read_values()");
+      rc = -1;
+    }
+  }
 
+  version = cache_version();
+  for (runs = 0, i = 0; rc == 0 && i < misses; i += n, runs++) {
+    n = run_length(order, i, misses, MAX_IOVECS);
+    for (j = 0; j < n; j++) {
+      iov[i + j].iov_len = order[i + j]->blocks * BLOCK_SIZE;
+      iov[i + j].iov_base = values[order[i + j] - ptrs];
+    }
+    ios[runs].write = 0;
+    ios[runs].offset = order[i]->block_offset * BLOCK_SIZE;
+    ios[runs].iov = &iov[i];
+    ios[runs].iovcnt = n;
+  }
+  if (rc == 0 && misses > 0) {
+    if (storage_submit(ios, runs) == -1) {
+      perror("Read failed in read_values");
+      rc = -1;
+    } else {
+      for (i = 0; i < misses; i++) cache_fill(*order[i], iov[i].iov_base, version);
+    }
+  }
+  free(iov);
+  free(ios);
+
+  for (i = 1; rc == 0 && i < count; i++)
+    if (same_page(sorted[i - 1], sorted[i]))
+      memcpy(values[sorted[i] - ptrs], values[sorted[i - 1] - ptrs], BLOCK_SIZE);
+
+  for (i = 0; i < count; i++) {
+    if (values[i] == NULL) continue;
+    if (rc == -1) {
+      free(values[i]);
+      values[i] = NULL;
+    } else if ((values[i] = unwrap_value(values[i], ptrs[i], &lens[i])) == NULL) {
+      rc = -1;
+    }
+  }
+  free(order);
+  free(sorted);
+  return rc;
+}
+
+// Stores values too big for a slab. They go into one run of blocks,
+// written with as few pwritevs as will hold them, all in one batch,
+// when there is room for that, and one at a time when there isn't.
+static int write_runs(char **buffers, struct block_ptr *ptrs, int count) {
+  struct iovec* iov;
+  struct storage_io* ios;
+  int64_t total = 0;
+  int i, j, n, runs, block_offset, rc = 0;
+
+  for (i = 0; i < count; i++) {
+    ptrs[i].blocks = VALUE_BLOCKS(((struct value_header*)buffers[i])->length);
+    ptrs[i].offset = 0;
+    ptrs[i].size = 0;
+    total += ptrs[i].blocks;
+  }
+
+  if (total > MAX_BLOCKS || (block_offset = create_block_reservation(total)) == -1) {
+    for (i = 0; i < count; i++) {
+      if (write_value(&ptrs[i], buffers[i]) == -1) {
+        for (j = 0; j < i; j++) delete_obj(ptrs[j]);
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  wal_write_begin();
+  for (i = 0; i < count; i++) {
+    ptrs[i].block_offset = block_offset;
+    block_offset += ptrs[i].blocks;
+    if (wal_append(WAL_WRITE, ptrs[i].block_offset * BLOCK_SIZE, 0, buffers[i], ptrs[i].blocks * BLOCK_SIZE) == -1) rc = -1;
+  }
+
+  iov = malloc(sizeof(struct iovec) * (count > 0 ? count : 1));
+  ios = malloc(sizeof(struct storage_io) * (count > 0 ? count : 1));
+  if (iov == NULL || ios == NULL) {
+    perror("malloc failed in write_values()");
+    rc = -1;
+  }
+  for (runs = 0, i = 0; rc == 0 && i < count; i += n, runs++) {
+    n = (count - i < MAX_IOVECS) ? count - i : MAX_IOVECS;
+    for (j = 0; j < n; j++) {
+      iov[i + j].iov_base = buffers[i + j];
+      iov[i + j].iov_len = ptrs[i + j].blocks * BLOCK_SIZE;
+    }
+    ios[runs].write = 1;
+    ios[runs].offset = ptrs[i].block_offset * BLOCK_SIZE;
+    ios[runs].iov = &iov[i];
+    ios[runs].iovcnt = n;
+  }
+  if (rc == 0 && runs > 0 && storage_submit(ios, runs) == -1) {
+    perror("Write failed in write_values");
+    rc = -1;
+  }
+  wal_write_done();
+  free(iov);
+  free(ios);
+
+  if (rc == -1) {
+    release_block_reservation(ptrs[0].block_offset, total);
+    return -1;
+  }
+  for (i = 0; i < count; i++) cache_write(ptrs[i], buffers[i]);
   return 0;
 }
 
+// Stores many buffers made by new_value_buffer() at once, filling in
+// ptrs. Small values are packed into slabs together and the rest are
+// written in runs. Each is compressed first if that's on and worth it.
+int write_values(char **buffers, struct block_ptr *ptrs, int count) {
+  char** batch;
+  char** packed;
+  struct block_ptr* stored;
+  int* which;
+  int i, small = 0, big = 0, rc = 0;
+
+  batch = malloc(sizeof(char*) * (count > 0 ? count : 1));
+  stored = malloc(sizeof(struct block_ptr) * (count > 0 ? count : 1));
+  which = malloc(sizeof(int) * (count > 0 ? count : 1));
+  packed = malloc(sizeof(char*) * (count > 0 ? count : 1));
+  if (batch == NULL || stored == NULL || which == NULL || packed == NULL) {
+    perror("malloc failed in write_values()");
+    free(batch);
+    free(stored);
+    free(which);
+    free(packed);
+    return -1;
+  }
+
+  // What each value will be stored as.
+  for (i = 0; i < count; i++)
+    if ((packed[i] = compress_value(buffers[i])) == NULL) packed[i] = buffers[i];
+
+  // Small values first, then big ones from the other end.
+  for (i = 0; i < count; i++) {
+    if (slab_fits(((struct value_header*)packed[i])->length)) which[small++] = i;
+    else which[count - ++big] = i;
+  }
+
+  for (i = 0; i < small; i++) batch[i] = packed[which[i]];
+  if (small > 0 && slab_store(batch, stored, small) == -1) rc = -1;
+  for (i = 0; rc == 0 && i < small; i++) ptrs[which[i]] = stored[i];
+
+  for (i = 0; i < big; i++) batch[small + i] = packed[which[small + i]];
+  if (rc == 0 && big > 0 && write_runs(batch + small, stored + small, big) == -1) {
+    slab_free(stored, small);
+    rc = -1;
+  }
+  for (i = 0; rc == 0 && i < big; i++) ptrs[which[small + i]] = stored[small + i];
+
+  for (i = 0; i < count; i++) if (packed[i] != buffers[i]) free(packed[i]);
+  free(batch);
+  free(stored);
+  free(which);
+  free(packed);
+  return rc;
+}
+
+// Deletes many objects at once. Neighbours are handed back to the
+// allocator together, and slab values are freed in one pass over their
+// pages.
+int delete_objs(const struct block_ptr *ptrs, int count) {
+  const struct block_ptr** order;
+  struct block_ptr* slabbed;
+  struct block_ptr run;
+  int i, j, n, whole = 0, small = 0, rc = 0;
+
+  if ((order = sort_by_offset(ptrs, count)) == NULL) return -1;
+  if ((slabbed = malloc(sizeof(struct block_ptr) * (count > 0 ? count : 1))) == NULL) {
+    perror("malloc failed in delete_objs()");
+    free(order);
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if (order[i]->blocks < 1) continue;
+    if (order[i]->size > 0) slabbed[small++] = *order[i];
+    else order[whole++] = order[i];
+  }
+  if (small > 0 && slab_free(slabbed, small) == -1) rc = -1;
+
+  for (i = 0; i < whole; i += n) {
+    n = run_length(order, i, whole, whole);
+    if (order[i]->blocks < 1) continue;
+    run.block_offset = order[i]->block_offset;
+    run.offset = 0;
+    run.size = 0;
+    for (run.blocks = 0, j = 0; j < n; j++) run.blocks += order[i + j]->blocks;
+    if (delete_obj(run) == -1) rc = -1;
+  }
+  free(order);
+  free(slabbed);
+  return rc;
+}
 
 
 int bit_array_set(char bit_array[], int bit) {
@@ -41,7 +41,17 @@ THE SOFTWARE.
 #include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <libgen.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <endian.h>
+#include <ctype.h>
+#include <poll.h>
 #include "longlong.h"
 
 /*
@@ -55,54 +65,645 @@ THE SOFTWARE.
 #define BACKLOG 25
 #define BLOCK_SIZE 4096
 #define MAX_BLOCKS 1073741824
-#define BLOCK_BITMAP_BYTES 134217728
+#define BLOCK_BITMAP_BYTES 134217728 // The most the bitmap file grows to, a bit for each of MAX_BLOCKS.
+#define BITMAP_GROW_BYTES (ALLOC_GROUP_BLOCKS / 8) // It grows a group's worth at a time.
+#define SUMMARY_BLOCKS 65536 // Blocks each free count in the allocator's summary stands for.
+#define SUMMARY_WORDS (SUMMARY_BLOCKS / 64)
+#define EXTENT_CAPACITY 4194304 // Free extents the allocator can index.
+#define ALLOC_GROUPS 2048 // Independently locked slices of the db file.
+#define ALLOC_GROUP_BLOCKS (MAX_BLOCKS / ALLOC_GROUPS) // 2 GB each, room for the biggest value.
+#define EXTENT_CHUNK 256 // Extents a group takes from the shared pool at a time.
+#define ALLOC_BEST_FIT 0
+#define ALLOC_NEXT_FIT 1
+#define SYNC_PER_OP 0
+#define SYNC_GROUP 1
+#define SYNC_ASYNC 2
+#define WAL_CHECKPOINT_BYTES (64 * 1024 * 1024)
+#define WAL_CHECKPOINT_RETRY_MS 200 // How long a checkpoint that was held off waits to try again.
+#define WAL_WRITE 1        // Bytes written to the db file.
+#define WAL_ZERO 2         // Bytes of the db file zeroed.
+#define WAL_ALLOC 3        // Blocks marked used in the bitmap.
+#define WAL_FREE 4         // Blocks marked free in the bitmap.
+#define WAL_INDEX_BEGIN 5  // An index change starts...
+#define WAL_INDEX_END 6    // ...and is complete.
+#define SERVER_FORK 0      // A process per connection.
+#define SERVER_EPOLL 1     // Worker threads multiplexing every connection.
+#define EPOLL_EVENTS 64    // Events a worker takes per epoll_wait.
+#define EPOLL_READS 16     // Recvs a connection gets each time it's ready...
+#define EPOLL_OUT_HIGH (1024 * 1024) // ...or until this many bytes of responses are waiting.
+
+#define BIN_REQUEST_MAGIC 0xB1  // First byte of a binary request. Never starts a text command.
+#define BIN_RESPONSE_MAGIC 0xB2
+#define BIN_QUIT 0         // Binary opcodes, numbered like extract_command().
+#define BIN_INSERT 1
+#define BIN_FIND 2
+#define BIN_DELETE 3
+#define BIN_KEYS 4
+#define BIN_MGET 5
+#define BIN_MPUT 6
+#define BIN_MDELETE 7
+#define BIN_SNAPSHOT 8
+#define BIN_STATS 9
+#define MAX_VALUE_LEN (1 << 30)
+#define MAX_BATCH 1024     // Keys in one mget, mput or mdelete.
+#define MAX_BATCH_BYTES MAX_VALUE_LEN // Value bytes one mget can answer with.
+#define STATUS_MORE 2      // A chunk of a keys answer, with more to follow.
+#define KEYS_LIMIT 1000    // Keys a scan answers with unless asked for some other number.
+#define KEYS_MAX_LIMIT 10000
+#define KEYS_CHUNK 256     // Keys read from the index, and sent, at a time.
+#define KEYS_CURSOR_LEN (4 * KEY_LEN)
+#define MAX_IOVECS 1024    // Buffers in one preadv/pwritev (Linux's UIO_MAXIOV).
+#define DIRECT_SEND_MIN 65536 // Values this big are sent from DB_MAP without copying them first.
+#define DB_MAP_BYTES ((int64_t)MAX_BLOCKS * BLOCK_SIZE)
+#define CACHE_MB 64        // Default size of the object cache.
+#define CACHE_MAX_BLOCKS 256 // Bigger objects bypass the cache.
+#define POOL_MB 16         // Default size of the index buffer pool.
+#define DELETE_RELEASE 0   // Deleted blocks are just handed back.
+#define DELETE_PUNCH 1     // A hole is punched over them first.
+#define DELETE_ZERO 2      // Zeros are written over them first.
+#define RECLAIM_QUEUE 4096 // Deleted objects waiting to be punched or zeroed.
+#define RECLAIM_INTERVAL_MS 10
+#define RECLAIM_ZERO_CHUNK (1024 * 1024)
+#define COMPACT_INTERVAL_S 10 // Default time between looks at the file.
+#define COMPACT_TRIGGER_PCT 25 // Free blocks, as a share of the file up to its last one in use, that start a pass.
+#define COMPACT_MIN_BLOCKS 256
+#define COMPACT_GRACE_MS 2000 // How long moved values' old copies are kept for readers.
+#define COMPACT_SLICE_MS 10
+#define COMPACT_CHUNK (1024 * 1024)
+#define COMPACT_PENDING 4096 // Old copies waiting out their grace period.
+#define LOAD_MB 256        // Default memory for sorting a dump in a bulk load.
+#define LOAD_BATCH_BYTES (8 * 1024 * 1024) // Values stored by one write_values() while loading.
+#define SLAB_CLASSES 13    // Slot sizes small values are packed into.
+#define SLAB_MAX 2040      // Biggest slot, header included. Two fit in a page.
+#define SLAB_PARTIALS 64   // Pages with free slots remembered per class.
+#define SLAB_MAGIC 0x534c4142
+#define STORAGE_PREAD 0    // Blocking pread/pwrite.
+#define STORAGE_URING 1    // Batches submitted to an io_uring.
+#define STORAGE_QUEUE_DEPTH 64 // Requests a ring keeps in flight.
+#define SNAPSHOT_MAGIC "EMMASNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_DATA 1     // An extent's blocks follow it in the file.
+#define SNAPSHOT_CHUNK (1024 * 1024) // Bytes of a snapshot sent at a time.
+#define SNAPSHOT_SEND_MS 5000 // How long a snapshot waits for the client to take a chunk.
+#define SNAPSHOT_DEFERRED (1024 * 1024) // Frees a snapshot can hold back before it gives up.
+#define STATS_COMMANDS 10  // Commands timed, numbered as in extract_command().
+#define STATS_SUB_BITS 3   // A histogram splits each power of two into 2^this buckets...
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS) << STATS_SUB_BITS) // ...so it takes this many for any int64.
+#define STATS_SUMMARY 0    // What the stats command answers with.
+#define STATS_PROMETHEUS 1
 
 #define MSG_SIZE 1024
-#define RECV_WINDOW 512
+#define RECV_WINDOW 16384 // Room kept free in a connection's input buffer for each recv.
 #define IDX_ENTRY_SIZE 256
-#define NODE_KEYS 10
 #define KEY_LEN (IDX_ENTRY_SIZE - 2*(sizeof(int)) - sizeof(int64_t))
-#define MAX_ARGS 100
+#define MAX_ARGS 1025    // Words in a text command, so mget can take 1024 keys.
+#define BTREE_MAGIC 0x656d6d6142547265LL
+#define BTREE_META_BLOCK 0
+#define BTREE_MAX_KEYS (BLOCK_SIZE / 8) // Enough for two pages' worth of the smallest cells.
+#define BTREE_MAX_HEIGHT 16
+#define INDEX_READERS 1024   // Threads that can read the index at once without INDEX_LOCK.
+#define INDEX_RETIRED 16384  // Replaced index pages that readers may still be on.
+#define INDEX_WAIT_MS 100    // How long a checkpoint waits for readers to move on.
+#define INDEX_STALL_MS 2000  // How long a writer waits on readers for room to retire into before it fails.
+#define INDEX_RETIRED_VALUES 16384 // Values dropped from the index that readers may still be reading.
+
+struct block_ptr { // Pointer to an object in the db file.
+  int64_t  block_offset;
+  int      blocks;
+  uint16_t offset;  // Where a slab value's slot starts in its block.
+  uint16_t size;    // Bytes in that slot, or 0 if the object has its blocks to itself.
+};
 
 struct response_struct {
   unsigned int status;
   char* msg;
+  int msg_len;     // Bytes in msg, or -1 if it is a string.
+  struct block_ptr value; // If it has blocks, msg is NULL and the response is
+                          // the msg_len byte value stored there.
+  struct key_scan* scan;  // If set, the response is the keys it finds.
+  int snapshot;           // If set, the response is a snapshot...
+  int64_t base_id;        // ...of what changed since this one, or all of it if 0.
 };
 
-struct block_ptr { // Pointer to an object in the db file.
-  int64_t  block_offset;
-  int      blocks;
+struct key_scan { // A keys command in progress. See scan.c.
+  char      next[KEY_LEN];  // Where the scan goes on from.
+  int       after;          // Leave next itself out.
+  char      end[KEY_LEN];   // The first key past the range, or empty for none.
+  int       limit;
+  int       sent;
+  int       more;           // Stopped at the limit with keys left over.
+  int       done;
+};
+
+struct value_header { // Starts every stored value.
+  uint32_t  length;  // Bytes of value that follow, as stored.
+  uint32_t  flags;   // VALUE_LZ if they are compressed.
+};
+
+#define VALUE_LZ 1         // The bytes are compressed (see compress.c).
+#define VALUE_HEADER_SIZE ((int64_t)sizeof(struct value_header))
+#define VALUE_BLOCKS(len) ((VALUE_HEADER_SIZE + (len) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define VALUE_DATA(buffer) ((buffer) + VALUE_HEADER_SIZE)
+
+struct slab_page_header { // Starts every block of small values.
+  uint32_t  magic;
+  uint16_t  size;    // Bytes per slot.
+  uint16_t  used;    // Slots in use.
+  uint64_t  map;     // Which ones.
+};
+
+#define SLAB_HEADER_SIZE ((int)sizeof(struct slab_page_header))
+
+struct bin_request { // Binary request header, little-endian on the wire.
+  uint8_t   magic;       // BIN_REQUEST_MAGIC
+  uint8_t   opcode;
+  uint16_t  key_len;     // Key bytes follow the header...
+  uint32_t  value_len;   // ...then value bytes.
+  uint64_t  request_id;  // Echoed back in the response.
+};
+
+struct bin_response { // Binary response header.
+  uint8_t   magic;       // BIN_RESPONSE_MAGIC
+  uint8_t   status;      // 0 OK, 1 FAIL, 2 MORE, as in STATUS_CODES.
+  uint16_t  reserved;
+  uint32_t  value_len;   // Value, or error text, that follows.
+  uint64_t  request_id;
+};
+
+struct connection { // A client socket and its buffered input and output.
+  int   fd;
+  int   quit;      // Asked to quit. Nothing after that is run.
+  int   hung_up;   // The client closed its end.
+  char* in;        // Bytes received but not yet run as commands.
+  int   in_len;
+  int   in_size;
+  char* value;     // Buffer a binary insert's value is read straight into.
+  uint32_t value_len;
+  uint32_t value_have;
+  struct bin_request pending; // The insert waiting on that value.
+  char  pending_key[KEY_LEN];
+  char* out;       // Responses not yet sent.
+  int   out_len;
+  int   out_sent;
+  int   out_size;
+};
+
+struct btree_page_header { // Start of every 4 KB index page in the db file.
+  uint16_t          leaf;
+  uint16_t          key_count;
+  uint16_t          prefix_len;  // Prefix shared by every key, stored once after the header.
+  uint16_t          cell_start;  // Cells are packed from here to the end of the page.
+  struct block_ptr  link;        // Leftmost child of an inner page. Unused in a leaf.
+};
+
+struct btree_node { // An index page unpacked into memory.
+  int               key_count;
+  int               leaf;
+  char              keys[BTREE_MAX_KEYS][KEY_LEN];
+  struct block_ptr  child_ptrs[BTREE_MAX_KEYS + 1];
+};
+
+struct btree_meta { // Lives in block 0 of the db file.
+  int64_t           magic;
+  int               height;
+  struct block_ptr  root;
+};
+
+struct index_reader { // A thread reading the index without INDEX_LOCK.
+  int               pid;         // Process the slot belongs to, or 0 if it's free.
+  int64_t           generation;  // Version of the tree it is reading, or 0 between reads.
+};
+
+struct retired_page { // An index page a change replaced.
+  int64_t           block;
+  int64_t           generation;  // First version of the tree that can't reach it.
+};
+
+struct retired_value { // A value a change dropped from the index.
+  struct block_ptr  ptr;
+  int64_t           generation;  // First version of the tree that can't reach it.
+};
+
+struct index_state { // Shared by every process. See btree.c.
+  int64_t           root;        // Block of the root page readers start from.
+  int64_t           generation;  // Bumped each time a change is published.
+  int               pending;     // Retired pages logged as free but still set in the bitmap.
+  int               retired_head;
+  int               retired_count;
+  int               reader_slots; // Slots ever claimed, so writers look no further.
+  int64_t           lock_reads;  // Reads that found no slot free and took INDEX_LOCK.
+  int64_t           waits;       // Times a writer waited for readers to move on.
+  struct index_reader readers[INDEX_READERS];
+  struct retired_page retired[INDEX_RETIRED];
+  int               value_head;
+  int               value_count;
+  struct retired_value values[INDEX_RETIRED_VALUES];
+};
+
+
+struct extent { // A run of free blocks in the db file.
+  int           offset;
+  int           blocks;
+  int           max_blocks; // Largest extent under this one in the offset tree.
+  unsigned int  priority;
+  int           off_left;
+  int           off_right;
+  int           size_left;
+  int           size_right;
+};
+
+struct alloc_group { // A slice of the db file with its own lock and treaps.
+  sem_t         lock;
+  int           built;      // The treaps and summary have been built from the bitmap.
+  int           valid;      // The treaps are in use. If not, the bitmap is scanned.
+  int           cursor;     // Where the next next-fit search starts.
+  int           free_list;
+  int           off_root;
+  int           size_root;
+  unsigned int  seed;
+  uint64_t      singles;    // Chunk of single blocks: first block << 32 | unclaimed mask.
+  int64_t       extent_count;
+  int64_t       free_blocks;
 };
 
-struct btree_node { 
-  char keys[NODE_KEYS][KEY_LEN]; 
-  struct block_ptr child_ptrs[NODE_KEYS + 1]; 
-}; 
+struct extent_index { // Free space index shared by every process.
+  int           policy;
+  int           capacity;
+  int           groups;     // Groups allocations look in. Only benchmarks use fewer.
+  int           unused;     // First extent no group has taken yet.
+  int           ceiling;    // While compacting, allocations end by this block if they can. Else 0.
+  struct alloc_group group[ALLOC_GROUPS];
+  int32_t       chunk_free[MAX_BLOCKS / SUMMARY_BLOCKS]; // Free blocks in each SUMMARY_BLOCKS, in built groups.
+  struct extent extents[];
+};
+
+struct bitmap_file { // How much of the block bitmap the file holds so far.
+  sem_t         lock;            // Held while it grows.
+  int64_t       bytes;
+};
+
+struct bitmap_sync { // Which pages of the block bitmap still need flushing.
+  int           mode;
+  int           interval_ms;
+  int           page_size;
+  int           dirty_bytes;
+  int64_t       epoch;           // Batch that changes made now belong to.
+  int64_t       flushed_epoch;   // Every batch up to this one is on disk.
+  int64_t       last_flush_ms;
+  unsigned char dirty[];         // A bit per page of the bitmap.
+};
+
+struct cache_frame { // A block held in the object cache.
+  int64_t       block;           // Its offset in the db file, or -1 if the frame is free.
+  int           next;            // Next frame in the same hash chain.
+  int           ref;             // Read since the clock hand last passed.
+};
+
+struct object_cache { // Shared by every process. Hash chains, frames and data follow.
+  int           frames;
+  int           buckets;
+  int           hand;
+  int           used;
+  int64_t       version;         // Bumped by every write and free.
+  int64_t       hits;
+  int64_t       misses;
+  int64_t       evictions;
+  int64_t       invalidations;
+};
+
+struct pool_frame { // An index page held in the buffer pool.
+  int64_t       block;           // Its offset in the db file, or -1 if the frame is free.
+  int           next;            // Next frame in the same hash chain.
+  int           pins;            // Callers using the page right now.
+  int           ref;             // Used since the clock hand last passed.
+  int           valid;           // Holds the page, not just room for it.
+  int           dirty;           // Changed since it was last written back.
+  int           resident;        // Near enough the root to never be evicted.
+};
+
+struct buffer_pool { // Shared by every process. Hash chains, frames, the dirty list and pages follow.
+  int           frames;
+  int           buckets;
+  int           hand;
+  int           dirty_count;     // Frames on the dirty list.
+  int           resident_levels; // Levels below the root that stay in memory.
+  int           resident;
+  int64_t       hits;
+  int64_t       misses;
+  int64_t       evictions;
+  int64_t       writebacks;
+};
+
+struct storage_io { // One read or write of the db file.
+  int           write;
+  int64_t       offset;
+  struct iovec* iov;
+  int           iovcnt;
+  int64_t       result;          // Bytes moved, or -errno.
+};
+
+struct slab_class { // Slab pages holding one size of slot.
+  int           size;
+  int           partial_count;
+  int64_t       partial[SLAB_PARTIALS]; // Pages known to have free slots.
+  int64_t       pages;           // Taken since we started, less those given back.
+  int64_t       objects;
+  int64_t       bytes;           // Headers included.
+};
+
+struct slab_state { // Shared by every process.
+  struct slab_class classes[SLAB_CLASSES];
+};
+
+struct reclaim_entry { // A deleted object waiting to be punched or zeroed.
+  int64_t       lsn;             // The log must be on disk up to here first.
+  int           block_offset;
+  int           blocks;
+};
+
+struct reclaim_queue { // Shared by every process. Entries follow.
+  int           policy;
+  int           capacity;
+  int           head;
+  int           count;
+  int           pending;         // Logged as free but still set in the bitmap.
+  int64_t       reclaimed;
+  int64_t       reclaimed_blocks;
+  int64_t       overflows;
+};
+
+struct compact_state { // Shared by every process, for the reports.
+  int           budget_pct;      // Most of the time the compactor may be busy.
+  int           interval_s;
+  int           pending;         // Old copies logged as free but still set in the bitmap.
+  int64_t       passes;
+  int64_t       moved;
+  int64_t       moved_blocks;
+  int64_t       raced;           // Moves given up because the key changed.
+  int64_t       truncated_blocks;
+  int64_t       file_blocks;     // As of the last look.
+  int64_t       end_blocks;      // Up to the last one in use.
+  int64_t       used_blocks;
+  int64_t       holes;
+  int64_t       largest_hole;
+};
+
+struct snapshot_header { // Starts a snapshot file. Little-endian, as is the rest.
+  char          magic[8];        // SNAPSHOT_MAGIC
+  uint32_t      version;
+  uint32_t      reserved;
+  int64_t       id;
+  int64_t       base_id;         // Snapshot an incremental one builds on, or 0.
+  int64_t       file_blocks;     // Length of the db file it was taken from.
+};
+
+struct snapshot_extent { // Blocks in use in a snapshot, and maybe their bytes.
+  int64_t       block;           // -1 ends the file.
+  uint32_t      blocks;
+  uint32_t      flags;           // SNAPSHOT_DATA if the bytes follow.
+};
+
+struct deferred_free { // Blocks freed while a snapshot was pinned.
+  int           block_offset;
+  int           blocks;
+  int           reclaim;         // A deleted value, to be punched or zeroed as -e says.
+};
+
+struct snapshot_state { // Shared by every process. See snapshot.c.
+  int           pid;             // Process taking a snapshot, or 0 if none is pinned.
+  int           pending;         // Frees held back, logged but still set in the bitmap.
+  int           overflowed;      // More frees than could be held back.
+  int           deferred_count;
+  int           released;        // Of those, how many have been given back.
+  int           base;            // Map of blocks the last snapshot holds, or -1.
+  int64_t       base_id;         // That snapshot.
+  int64_t       taken;
+  int64_t       incremental;
+  int64_t       blocks;          // In every snapshot taken...
+  int64_t       data_blocks;     // ...and those sent with their bytes.
+  int64_t       deferred_total;
+  struct deferred_free deferred[SNAPSHOT_DEFERRED];
+};
+
+struct stats_histogram { // Values in buckets that grow with them. See stats.c.
+  int64_t       count;
+  int64_t       sum;
+  int64_t       max;
+  int64_t       buckets[STATS_BUCKETS];
+};
+
+struct stats_state { // Shared by every process.
+  int64_t       started;         // When the server started, in seconds.
+  struct stats_histogram commands[STATS_COMMANDS]; // Time to run each command, in ns.
+  struct stats_histogram alloc;  // Time to allocate blocks...
+  struct stats_histogram alloc_wait; // ...and of that, waiting for group locks...
+  struct stats_histogram alloc_probes; // ...and the groups looked in.
+  int64_t       alloc_busy;      // Groups passed over because they were locked.
+  int64_t       bitmap_words;    // Scanned in groups without treaps.
+  int64_t       alloc_failures;
+  struct stats_histogram io[2];  // Time to read, and to write, the db file...
+  int64_t       io_bytes[2];     // ...and the bytes moved.
+};
+
+struct wal_state { // Shared by every process appending to the log.
+  int           mode;
+  int           interval_ms;
+  int64_t       base_lsn;        // Log position of byte 0 of the log file.
+  int64_t       write_lsn;       // End of the log.
+  int64_t       flushed_lsn;     // The log is on disk up to here.
+  int64_t       last_sync_ms;
+  int64_t       writing;         // Writes logged but not yet made. Holds off checkpoints.
+  int64_t       next_checkpoint_ms; // No checkpoint is tried before this.
+};
 
 
 // Globals
-sem_t*          BLOCK_BITMAP_LOCK;
+sem_t*          RECLAIM_LOCK;
+sem_t*          INDEX_LOCK;
+sem_t*          BITMAP_FLUSH_LOCK;
+sem_t*          WAL_LOCK;
+sem_t*          WAL_SYNC_LOCK;
+sem_t*          CACHE_LOCK;
+sem_t*          SLAB_LOCK;
+sem_t*          SNAPSHOT_LOCK;
 char            *SHM_BLOCK_BITMAP;
+char            *DB_MAP;        // The whole db file, read-only.
+struct extent_index *SHM_EXTENTS;
+struct bitmap_file *SHM_BITMAP_FILE;
+struct bitmap_sync *SHM_BITMAP_SYNC;
+struct wal_state *SHM_WAL;
+struct object_cache *SHM_CACHE;
+struct buffer_pool *SHM_POOL;
+struct reclaim_queue *SHM_RECLAIM;
+struct compact_state *SHM_COMPACT;
+struct index_state *SHM_INDEX;
+struct slab_state *SHM_SLABS;
+struct snapshot_state *SHM_SNAPSHOT;
+struct stats_state *SHM_STATS;
+int             WAL_FD;
 int             BLOCK_BITMAP_FD;
 int             DB_FD;
+int             STORAGE_BACKEND;
+int             COMPRESS_VALUES; // Try compressing values before they are stored.
+int             STOP_PIPE[2]; // SIGTERM wakes the accept loop through this.
+extern char     DATA_HOME[4096];
 
 
 // Function signatures
 int       start_listening(char* host, char* port, int backlog);
+int       connect_to(char* host, char* port);
 void      sigchld_handler(int s);
 void      sigterm_handler_parent(int s);
 void      sigterm_handler_child(int s);
+void      shutdown_server(void);
 int       srv(int accept_fd, int listen_fd);
+int       run_reactor(int listen_fd, int workers);
+int       run_command(char* msg, struct response_struct* response);
+int       read_input(struct connection* conn, int flags);
+int       run_input(struct connection* conn);
+int       send_output(struct connection* conn);
+void      free_connection(struct connection* conn);
 int       extract_command(char *token_vector[], int token_count);
 int       tokenize_command(char* msg, char* token_vector[]);
 int       bit_array_set(char bit_array[], int bit);
 int       bit_array_test(const char bit_array[], int bit);
 int       bit_array_clear(char bit_array[], int bit);
 int       create_block_reservation(int blocks_needed);
+void      release_block_reservation(int block_offset, int blocks_used);
+void      release_reclaimed_blocks(int block_offset, int blocks_used);
+void      release_moved_blocks(int block_offset, int blocks_used);
+void      release_retired_blocks(int block_offset, int blocks_used);
+void      release_deferred_blocks(int block_offset, int blocks_used);
+int       bitmap_open(const char *file);
+int       bitmap_cover(int64_t blocks);
+int64_t   bitmap_bytes(void);
+int       bitmap_sync_init(int mode, int interval_ms);
+void      bitmap_flush(void);
+int       wal_replay(const char *wal_file);
+int       wal_init(const char *wal_file, int mode, int interval_ms);
+int       wal_append(int type, int64_t offset, int64_t count, const void *data, uint32_t data_len);
+void      wal_commit(void);
+void      wal_write_begin(void);
+void      wal_write_done(void);
+int       wal_sync(int64_t lsn);
+int       reclaim_init(int policy);
+int       reclaim_start(void);
+int       reclaim_later(struct block_ptr obj);
+void      reclaim_run(void);
+void      reclaim_report(void);
+int       compact_init(int budget_pct, int interval_s);
+int       compact_start(void);
+void      compact_run(void);
+void      compact_report(void);
+int       storage_init(int backend);
+void      storage_register(void* base, size_t len);
+int       storage_submit(struct storage_io* ios, int count);
+ssize_t   storage_read(void* buf, size_t len, int64_t offset);
+ssize_t   storage_write(const void* buf, size_t len, int64_t offset);
+uint32_t  lz_compress(const char* src, uint32_t len, char* dst, uint32_t cap);
+int       lz_decompress(const char* src, uint32_t len, char* dst, uint32_t raw);
+char*     compress_value(const char* buffer);
+char*     expand_value(char* buffer, const char* data, uint32_t *len);
+int       cache_init(int64_t budget);
+int       cache_read(struct block_ptr obj, char* buffer);
+int64_t   cache_version(void);
+void      cache_fill(struct block_ptr obj, const char* buffer, int64_t version);
+void      cache_write(struct block_ptr obj, const char* buffer);
+void      cache_report(void);
+int       slab_init(void);
+int       slab_fits(uint32_t len);
+int       slab_store(char **buffers, struct block_ptr *ptrs, int count);
+int       slab_free(const struct block_ptr *ptrs, int count);
+void      slab_report(void);
+int       pool_init(int64_t budget, int resident_levels);
+char*     pool_pin(struct block_ptr ptr, int depth, int fetch);
+int       pool_unpin(struct block_ptr ptr, char* page, int dirty);
+void      pool_drop(struct block_ptr ptr);
+int       pool_put(struct block_ptr ptr, const char* data);
+int       pool_flush_except(int64_t block);
+int       pool_flush(void);
+void      pool_report(void);
+int       extent_init(int capacity, int policy);
+void      extent_rebuild(void);
+int       group_alloc(int blocks);
+void      group_free(int offset, int blocks, int log);
+void      alloc_lock_all(void);
+void      alloc_unlock_all(void);
+void      alloc_set_ceiling(int limit);
+void      alloc_drop_singles(void);
+int64_t   alloc_chunk_free(int64_t block);
 void      cleanup_and_exit(int retval);
 void      usage(char *argv);
 struct response_struct insert_command(char* token_vector[], int token_count);
 struct response_struct find_command(char* token_vector[], int token_count);
 struct response_struct delete_command(char* token_vector[], int token_count);
 struct response_struct keys_command(char* token_vector[], int token_count);
+int       prepare_status(struct response_struct response, char* status_msg);
 int       prepare_send_msg(struct response_struct response, char** send_msg);
+struct response_struct store_value(const char* key, char* buffer);
+struct response_struct fetch_value(const char* key);
+struct response_struct remove_value(const char* key);
+int       fetch_values(char** keys, int count, struct response_struct* responses);
+int       store_values(char** keys, char** buffers, int count, struct response_struct* responses);
+int       remove_values(char** keys, int count, struct response_struct* responses);
+struct response_struct mget_command(char* token_vector[], int token_count);
+struct response_struct mput_command(char* token_vector[], int token_count);
+struct response_struct mdelete_command(char* token_vector[], int token_count);
+struct response_struct snapshot_command(char* token_vector[], int token_count);
+struct response_struct stats_command(char* token_vector[], int token_count);
+int       run_binary(struct connection* conn, int start);
+int       finish_binary(struct connection* conn);
+int       queue_output(struct connection* conn, const void* data, int len);
+int       queue_value(struct connection* conn, struct block_ptr ptr, uint32_t len);
+int       queue_keys(struct connection* conn, struct key_scan* scan, int binary, uint64_t request_id);
+int       queue_snapshot(struct connection* conn, int64_t base_id, int binary, uint64_t request_id);
+int       queue_binary(struct connection* conn, uint64_t request_id, struct response_struct response);
+int       scan_init(struct key_scan* scan, const char* start, const char* end, int limit);
+int       scan_next(struct key_scan* scan, char (*keys)[KEY_LEN], int max);
+int       scan_cursor(const struct key_scan* scan, char* cursor);
+char*     read_obj(struct block_ptr obj);
+int       write_obj(struct block_ptr *ptr, const void *obj, const int s);
+int       write_blocks(struct block_ptr *ptr, const void *buffer, int blocks);
+char*     new_value_buffer(uint32_t len);
+int       write_value(struct block_ptr *ptr, const char *buffer);
+char*     read_value(struct block_ptr ptr, uint32_t *len);
+int       read_value_length(struct block_ptr ptr, uint32_t *len);
+int       read_values(const struct block_ptr *ptrs, char **values, uint32_t *lens, int count);
+int       write_values(char **buffers, struct block_ptr *ptrs, int count);
+int       delete_objs(const struct block_ptr *ptrs, int count);
+int       delete_obj(struct block_ptr obj);
+int       btree_open(void);
+int       btree_find(const char *key, struct block_ptr *ptr);
+int       btree_insert(const char *key, struct block_ptr ptr, struct block_ptr *old);
+int       btree_delete(const char *key, struct block_ptr *ptr);
+int       btree_scan(const char *from, int after, const char *end, char (*keys)[KEY_LEN], struct block_ptr *ptrs, int max);
+int       btree_swap(const char *key, struct block_ptr from, struct block_ptr to);
+int       btree_move_path(const char *key, int limit);
+int       btree_release_pages(int wait_ms);
+void      btree_read_begin(void);
+void      btree_read_end(void);
+int       btree_reading(void);
+int       btree_retire_values(const struct block_ptr *ptrs, int count);
+void      btree_free_values(void);
+void      btree_report(void);
+int       btree_root(struct btree_meta *meta);
+int       btree_walk(int64_t root, int (*visit)(struct block_ptr ptr, int page, void *arg), void *arg);
+int       btree_load_begin(void);
+int       btree_load_add(const char *key, struct block_ptr ptr);
+int       btree_load_end(void);
+int       bulk_load(const char *dump_file, int memory_mb);
+int       snapshot_init(void);
+int       snapshot_pinned(void);
+int       snapshot_defer(int block_offset, int blocks, int *pending, int reclaim);
+void      snapshot_touch(int64_t offset, int64_t len);
+int       snapshot_stream(int64_t base_id, int (*sink)(void *arg, const char *data, int len), void *arg, int64_t *id, char *error);
+int       snapshot_fetch(char *host, char *port, const char *file, int64_t base_id);
+int       snapshot_restore(const char *file);
+void      snapshot_report(void);
+int       stats_init(void);
+int64_t   stats_clock(void);
+void      stats_record(int command, int64_t start);
+void      stats_alloc(int64_t start, int probes, int busy, int64_t wait, int64_t scanned, int failed);
+void      stats_io(int write, int64_t bytes, int64_t start);
+int       stats_dump(int format, char** out);
+void      stats_report(void);
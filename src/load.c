@@ -0,0 +1,414 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Bulk loading.
+
+  emma -l dump_file loads a dump into an empty database, then exits. A
+  dump is a run of entries laid out as in a binary mput:
+
+    uint16_t key_len | key bytes | uint32_t value_len | value bytes
+
+  little-endian, with no padding. A key that turns up more than once
+  keeps its last value.
+
+  The dump is read into a buffer of LOAD_MB (or -l dump_file:mb)
+  megabytes at a time. Each buffer's worth is sorted and, unless the
+  whole dump fitted, written to a scratch file in DATA_HOME as a sorted
+  run. The runs are then merged through a heap, so memory stays bounded
+  however big the dump is.
+
+  Values come out of the merge in key order and are stored a batch at a
+  time with write_values(): small ones packed into slab pages, the rest
+  written with a few big pwritevs into one run of blocks each batch,
+  right after the last. The index is built bottom-up as they go (see
+  btree_load_add()), so nothing is ever split or read back.
+
+  Nothing is logged while loading, and the bitmap is only flushed at
+  the end. Then the db file is synced and the new root is put in the
+  meta block as a logged index change, so a load that fails part way
+  leaves the index empty. The blocks it took stay taken until the
+  database is made again.
+*/
+
+struct load_run { // A sorted run being merged: a scratch file, or the buffer itself.
+  FILE*     f;
+  int64_t   next;       // Entry of the buffer to take next, if it's in memory.
+  char      key[KEY_LEN];
+  char*     value;      // Made by new_value_buffer(), or NULL once the run is done.
+};
+
+static char*    BUFFER;     // Entries as they came in the dump.
+static int64_t* ENTRIES;    // Where each one starts.
+static int64_t  BUFFER_LEN, BUFFER_SIZE, ENTRY_COUNT, ENTRY_MAX;
+
+static char     HELD_KEY[KEY_LEN]; // An entry read up to its value that didn't fit.
+static uint16_t HELD_KEY_LEN;
+static uint32_t HELD_LEN;
+static int      HELD;
+
+static int64_t now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint16_t entry_key_len(int64_t at) {
+  uint16_t key_len;
+
+  memcpy(&key_len, BUFFER + at, sizeof(key_len));
+  return le16toh(key_len);
+}
+
+static uint32_t entry_value_len(int64_t at) {
+  uint32_t len;
+
+  memcpy(&len, BUFFER + at + sizeof(uint16_t) + entry_key_len(at), sizeof(len));
+  return le32toh(len);
+}
+
+static int64_t entry_size(int64_t at) {
+  return sizeof(uint16_t) + entry_key_len(at) + sizeof(uint32_t) + entry_value_len(at);
+}
+
+// Orders entries by key, then by where they were in the dump.
+static int cmp_entry(const void *a, const void *b) {
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  uint16_t x_len = entry_key_len(x), y_len = entry_key_len(y);
+  int rc = memcmp(BUFFER + x + sizeof(uint16_t), BUFFER + y + sizeof(uint16_t), x_len < y_len ? x_len : y_len);
+
+  if (rc != 0) return rc;
+  if (x_len != y_len) return (x_len > y_len) - (x_len < y_len);
+  return (x > y) - (x < y);
+}
+
+// Reads the key and value length of the next entry in the dump.
+// Returns 1 if it did, 0 at the end of the dump, and -1 if it's broken.
+static int read_header(FILE *in) {
+  uint16_t key_len;
+  uint32_t len;
+
+  if (fread(&key_len, sizeof(key_len), 1, in) != 1) return ferror(in) ? -1 : 0;
+  key_len = le16toh(key_len);
+  if (key_len == 0 || key_len >= KEY_LEN || fread(HELD_KEY, 1, key_len, in) != key_len ||
+      fread(&len, sizeof(len), 1, in) != 1 || memchr(HELD_KEY, '\0', key_len) != NULL ||
+      le32toh(len) > MAX_VALUE_LEN) {
+    fprintf(stderr, "Bad entry in the dump.\n");
+    return -1;
+  }
+  HELD_KEY_LEN = key_len;
+  HELD_LEN = le32toh(len);
+  HELD = 1;
+  return 1;
+}
+
+// Reads as much of the dump as fits into the buffer. Returns 1 if there
+// is more to come, 0 if that was the end of it, and -1 on error.
+static int fill_buffer(FILE *in) {
+  uint16_t key_len;
+  uint32_t len;
+  int64_t need;
+  char* bigger;
+  int rc;
+
+  BUFFER_LEN = 0;
+  ENTRY_COUNT = 0;
+
+  while (1) {
+    if (!HELD && (rc = read_header(in)) < 1) return rc;
+    need = sizeof(uint16_t) + HELD_KEY_LEN + sizeof(uint32_t) + HELD_LEN;
+    if (ENTRY_COUNT == ENTRY_MAX || BUFFER_LEN + need > BUFFER_SIZE) {
+      if (ENTRY_COUNT > 0) return 1;
+
+      // An entry bigger than the whole buffer gets a buffer to itself.
+      if ((bigger = realloc(BUFFER, need)) == NULL) {
+        perror("realloc failed in fill_buffer()");
+        return -1;
+      }
+      BUFFER = bigger;
+      BUFFER_SIZE = need;
+    }
+
+    key_len = htole16(HELD_KEY_LEN);
+    len = htole32(HELD_LEN);
+    memcpy(BUFFER + BUFFER_LEN, &key_len, sizeof(key_len));
+    memcpy(BUFFER + BUFFER_LEN + sizeof(key_len), HELD_KEY, HELD_KEY_LEN);
+    memcpy(BUFFER + BUFFER_LEN + sizeof(key_len) + HELD_KEY_LEN, &len, sizeof(len));
+    if (fread(BUFFER + BUFFER_LEN + need - HELD_LEN, 1, HELD_LEN, in) != HELD_LEN) {
+      fprintf(stderr, "The dump ends part way through a value.\n");
+      return -1;
+    }
+    ENTRIES[ENTRY_COUNT++] = BUFFER_LEN;
+    BUFFER_LEN += need;
+    HELD = 0;
+  }
+}
+
+// Sorts the buffer's entries, keeping only the last of any that share a
+// key.
+static void sort_buffer(void) {
+  int64_t i, kept = 0;
+
+  qsort(ENTRIES, ENTRY_COUNT, sizeof(int64_t), cmp_entry);
+  for (i = 0; i < ENTRY_COUNT; i++) {
+    if (i + 1 < ENTRY_COUNT && entry_key_len(ENTRIES[i]) == entry_key_len(ENTRIES[i + 1]) &&
+        memcmp(BUFFER + ENTRIES[i] + sizeof(uint16_t), BUFFER + ENTRIES[i + 1] + sizeof(uint16_t), entry_key_len(ENTRIES[i])) == 0)
+      continue;
+    ENTRIES[kept++] = ENTRIES[i];
+  }
+  ENTRY_COUNT = kept;
+}
+
+// Writes the sorted buffer out as a run. The scratch file is unlinked
+// straight away, so it goes when we do.
+static FILE* write_run(int n) {
+  char path[4096 + 32];
+  FILE* f;
+  int64_t i;
+
+  snprintf(path, sizeof(path), "%s/load.%d", DATA_HOME, n);
+  if ((f = fopen(path, "w+")) == NULL) {
+    fprintf(stderr, "Couldn't make the scratch file %s\n", path);
+    perror(NULL);
+    return NULL;
+  }
+  unlink(path);
+  for (i = 0; i < ENTRY_COUNT; i++) {
+    if (fwrite(BUFFER + ENTRIES[i], entry_size(ENTRIES[i]), 1, f) != 1) {
+      perror("Couldn't write a sorted run");
+      fclose(f);
+      return NULL;
+    }
+  }
+  if (fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0) {
+    perror("Couldn't write a sorted run");
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+// Moves a run on to its next entry, reading its value into a new value
+// buffer. Returns 1 if there was one, 0 at the end and -1 on error.
+static int next_entry(struct load_run *r) {
+  int64_t at;
+  uint16_t key_len;
+  uint32_t len;
+  int rc;
+
+  r->value = NULL;
+  if (r->f == NULL) { // The buffer, sorted in place.
+    if (r->next == ENTRY_COUNT) return 0;
+    at = ENTRIES[r->next++];
+    key_len = entry_key_len(at);
+    len = entry_value_len(at);
+    memcpy(r->key, BUFFER + at + sizeof(uint16_t), key_len);
+    r->key[key_len] = '\0';
+    if ((r->value = new_value_buffer(len)) == NULL) return -1;
+    memcpy(VALUE_DATA(r->value), BUFFER + at + sizeof(uint16_t) + key_len + sizeof(uint32_t), len);
+    return 1;
+  }
+
+  if ((rc = read_header(r->f)) < 1) return rc;
+  HELD = 0;
+  memcpy(r->key, HELD_KEY, HELD_KEY_LEN);
+  r->key[HELD_KEY_LEN] = '\0';
+  if ((r->value = new_value_buffer(HELD_LEN)) == NULL) return -1;
+  if (fread(VALUE_DATA(r->value), 1, HELD_LEN, r->f) != HELD_LEN) {
+    fprintf(stderr, "A sorted run ends part way through a value.\n");
+    return -1;
+  }
+  return 1;
+}
+
+
+// The merge heap holds the runs that aren't done, smallest key on top.
+// Of runs with the same key, the one made from later in the dump wins.
+static int run_before(struct load_run *runs, int a, int b) {
+  int rc = strcmp(runs[a].key, runs[b].key);
+  return rc < 0 || (rc == 0 && a > b);
+}
+
+static void sift_down(struct load_run *runs, int *heap, int count, int i) {
+  int child, top;
+
+  while ((child = 2 * i + 1) < count) {
+    if (child + 1 < count && run_before(runs, heap[child + 1], heap[child])) child++;
+    if (!run_before(runs, heap[child], heap[i])) break;
+    top = heap[i];
+    heap[i] = heap[child];
+    heap[child] = top;
+    i = child;
+  }
+}
+
+// Stores a batch of values and adds their keys to the index.
+static int load_batch(char (*keys)[KEY_LEN], char **values, struct block_ptr *ptrs, int count) {
+  int i, rc = 0;
+
+  if (count > 0 && write_values(values, ptrs, count) == -1) rc = -1;
+  for (i = 0; rc == 0 && i < count; i++)
+    if (btree_load_add(keys[i], ptrs[i]) == -1) rc = -1;
+  for (i = 0; i < count; i++) free(values[i]);
+  return rc;
+}
+
+// Merges the runs into the database. Returns how many keys it loaded,
+// or -1 on error.
+static int64_t merge_runs(struct load_run *runs, int run_count, int64_t *bytes) {
+  char (*keys)[KEY_LEN];
+  char** values;
+  struct block_ptr* ptrs;
+  int64_t batch_bytes = 0, loaded = 0;
+  int* heap;
+  int i, count = 0, heap_count = 0, winner, rc = 0;
+
+  keys = malloc(sizeof(*keys) * MAX_BATCH);
+  values = malloc(sizeof(char*) * MAX_BATCH);
+  ptrs = malloc(sizeof(struct block_ptr) * MAX_BATCH);
+  heap = malloc(sizeof(int) * run_count);
+  if (keys == NULL || values == NULL || ptrs == NULL || heap == NULL) {
+    perror("malloc failed in merge_runs()");
+    rc = -1;
+  }
+
+  for (i = 0; rc == 0 && i < run_count; i++) {
+    if ((rc = next_entry(&runs[i])) == 1) heap[heap_count++] = i;
+    rc = (rc == -1) ? -1 : 0;
+  }
+  for (i = heap_count / 2 - 1; i >= 0; i--) sift_down(runs, heap, heap_count, i);
+
+  while (rc == 0 && heap_count > 0) {
+    winner = heap[0];
+    strcpy(keys[count], runs[winner].key);
+    values[count] = runs[winner].value;
+    batch_bytes += ((struct value_header*)values[count])->length;
+    count++;
+
+    // Move every run on past this key, dropping older values for it.
+    while (rc == 0 && heap_count > 0 && strcmp(runs[heap[0]].key, keys[count - 1]) == 0) {
+      if (heap[0] != winner) free(runs[heap[0]].value);
+      if ((rc = next_entry(&runs[heap[0]])) == 0) heap[0] = heap[--heap_count];
+      if (rc != -1) rc = 0;
+      sift_down(runs, heap, heap_count, 0);
+    }
+
+    if (count == MAX_BATCH || batch_bytes >= LOAD_BATCH_BYTES || heap_count == 0) {
+      if (load_batch(keys, values, ptrs, count) == -1) rc = -1;
+      loaded += count;
+      *bytes += batch_bytes;
+      count = 0;
+      batch_bytes = 0;
+    }
+  }
+  for (i = 0; i < count; i++) free(values[i]);
+  for (i = 0; i < heap_count; i++) free(runs[heap[i]].value);
+
+  free(keys);
+  free(values);
+  free(ptrs);
+  free(heap);
+  return (rc == -1) ? -1 : loaded;
+}
+
+
+// Loads a dump into an empty database, using about memory_mb of memory
+// to sort it. "-" reads the dump from stdin.
+int bulk_load(const char *dump_file, int memory_mb) {
+  struct load_run* runs = NULL;
+  struct load_run* more;
+  FILE* in;
+  int64_t budget = (int64_t)(memory_mb > 0 ? memory_mb : LOAD_MB) * 1024 * 1024;
+  int64_t started = now_msec(), loaded = -1, bytes = 0, elapsed;
+  int run_count = 0, rc, i, wal_fd = WAL_FD, interval_ms = SHM_BITMAP_SYNC->interval_ms;
+
+  if (btree_load_begin() == -1) return -1;
+  if (strcmp(dump_file, "-") == 0) {
+    in = stdin;
+  } else if ((in = fopen(dump_file, "r")) == NULL) {
+    fprintf(stderr, "Couldn't open the dump %s\n", dump_file);
+    perror(NULL);
+    return -1;
+  }
+
+  // A quarter of the budget for finding entries, the rest for holding them.
+  ENTRY_MAX = budget / 4 / sizeof(int64_t);
+  BUFFER_SIZE = budget - ENTRY_MAX * sizeof(int64_t);
+  BUFFER = malloc(BUFFER_SIZE);
+  ENTRIES = malloc(ENTRY_MAX * sizeof(int64_t));
+  if (BUFFER == NULL || ENTRIES == NULL) {
+    perror("malloc failed in bulk_load()");
+    rc = -1;
+    goto done;
+  }
+
+  // Sorted runs, each a buffer's worth. If the whole dump fits in one,
+  // it's merged straight from memory.
+  do {
+    if ((rc = fill_buffer(in)) == -1) goto done;
+    sort_buffer();
+    if ((more = realloc(runs, sizeof(struct load_run) * (run_count + 1))) == NULL) {
+      perror("realloc failed in bulk_load()");
+      rc = -1;
+      goto done;
+    }
+    runs = more;
+    memset(&runs[run_count], '\0', sizeof(struct load_run));
+    if ((rc == 1 || run_count > 0) && (runs[run_count].f = write_run(run_count)) == NULL) {
+      rc = -1;
+      goto done;
+    }
+    run_count++;
+  } while (rc == 1);
+
+  // Nothing is logged or flushed until it's all in.
+  WAL_FD = -1;
+  SHM_BITMAP_SYNC->interval_ms = 1 << 30;
+  loaded = merge_runs(runs, run_count, &bytes);
+  bitmap_flush();
+  WAL_FD = wal_fd;
+  SHM_BITMAP_SYNC->interval_ms = interval_ms;
+
+  if (loaded == -1 || btree_load_end() == -1) {
+    fprintf(stderr, "Bulk load failed. Make the database again before loading it.\n");
+    rc = -1;
+    goto done;
+  }
+  if (WAL_FD != -1) wal_sync(SHM_WAL->write_lsn);
+  pool_flush();
+
+  elapsed = now_msec() - started;
+  fprintf(stderr, "Loaded %lld keys, %.1f MB of values, from %d sorted run%s in %.1f s (%.1f MB/s).\n",
+          (long long)loaded, bytes / 1048576.0, run_count, run_count == 1 ? "" : "s", elapsed / 1000.0,
+          elapsed > 0 ? bytes / 1048576.0 / (elapsed / 1000.0) : 0.0);
+  rc = 0;
+
+done:
+  for (i = 0; i < run_count; i++) if (runs[i].f != NULL) fclose(runs[i].f);
+  if (in != stdin) fclose(in);
+  free(runs);
+  free(BUFFER);
+  free(ENTRIES);
+  return rc;
+}
@@ -22,37 +22,146 @@ THE SOFTWARE.
 
 #include "emma.h"
 
-char DATA_HOME[4096] = "/var/emma";
-
 int main(int argc, char* argv[]) {
 
   struct sockaddr incoming;
   socklen_t addr_size = sizeof(incoming);
   int listen_fd, accept_fd;
+  struct pollfd waiting[2];
+  sigset_t stop_signals;
   char* port = "4080";
   char* host = "::1";
-  char db_file[4096];
-  char block_bitmap_file[4096];
+  char db_file[4096 + 16];
+  char block_bitmap_file[4096 + 16];
+  char wal_file[4096 + 16];
   int chld;
   int ch;
+  int alloc_policy = ALLOC_BEST_FIT;
+  int sync_mode = SYNC_PER_OP;
+  int sync_interval = 0;
+  int use_wal = 1;
+  int server_mode = SERVER_FORK;
+  int workers = 0;
+  int cache_mb = CACHE_MB;
+  int pool_mb = POOL_MB;
+  int resident_levels = 0;
+  int storage_backend = STORAGE_PREAD;
+  int delete_policy = DELETE_RELEASE;
+  int compact_budget = 0;
+  int compact_interval = COMPACT_INTERVAL_S;
+  char* load_file = NULL;
+  int load_mb = LOAD_MB;
+  char* backup_file = NULL;
+  int64_t backup_base = 0;
+  char* restore_file = NULL;
 
 
   // parse our cmd line args
-  while ((ch = getopt(argc, argv, "d:h:p:")) != -1) {
+  while ((ch = getopt(argc, argv, "a:b:c:d:e:h:i:k:l:m:p:r:s:u:w:z:")) != -1) {
     switch (ch) {
 
+      case 'a':
+        if (strcmp(optarg, "best") == 0) alloc_policy = ALLOC_BEST_FIT;
+        else if (strcmp(optarg, "next") == 0) alloc_policy = ALLOC_NEXT_FIT;
+        else usage(argv[0]);
+        break;
+
+      case 'b':
+        backup_file = optarg;
+        if (strrchr(optarg, ':') != NULL) {
+          backup_base = atoll(strrchr(optarg, ':') + 1);
+          *strrchr(optarg, ':') = '\0';
+        }
+        break;
+
+      case 'c':
+        cache_mb = atoi(optarg);
+        break;
+
       case 'd':
         sprintf(DATA_HOME, "%s", optarg);
         break;
 
+      case 'e':
+        if (strcmp(optarg, "release") == 0) delete_policy = DELETE_RELEASE;
+        else if (strcmp(optarg, "punch") == 0) delete_policy = DELETE_PUNCH;
+        else if (strcmp(optarg, "zero") == 0) delete_policy = DELETE_ZERO;
+        else usage(argv[0]);
+        break;
+
       case 'h':
         host = optarg;
         break;
 
+      case 'i':
+        if (strcmp(optarg, "pread") == 0) storage_backend = STORAGE_PREAD;
+        else if (strcmp(optarg, "uring") == 0) storage_backend = STORAGE_URING;
+        else usage(argv[0]);
+        break;
+
+      case 'k':
+        compact_budget = atoi(optarg);
+        compact_interval = (strchr(optarg, ':') != NULL) ? atoi(strchr(optarg, ':') + 1) : COMPACT_INTERVAL_S;
+        break;
+
+      case 'l':
+        load_file = optarg;
+        if (strrchr(optarg, ':') != NULL) {
+          load_mb = atoi(strrchr(optarg, ':') + 1);
+          *strrchr(optarg, ':') = '\0';
+        }
+        break;
+
+      case 'm':
+        pool_mb = atoi(optarg);
+        resident_levels = (strchr(optarg, ':') != NULL) ? atoi(strchr(optarg, ':') + 1) : 0;
+        break;
+
       case 'p':
         port = optarg;
         break;
 
+      case 'r':
+        if (strcmp(optarg, "fork") == 0) {
+          server_mode = SERVER_FORK;
+        } else if (strncmp(optarg, "epoll", 5) == 0) {
+          server_mode = SERVER_EPOLL;
+          workers = (optarg[5] == ':') ? atoi(optarg + 6) : 0;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+
+      case 's':
+        if (strcmp(optarg, "sync") == 0) {
+          sync_mode = SYNC_PER_OP;
+        } else if (strncmp(optarg, "group", 5) == 0) {
+          sync_mode = SYNC_GROUP;
+          sync_interval = (optarg[5] == ':') ? atoi(optarg + 6) : 2;
+        } else if (strncmp(optarg, "async", 5) == 0) {
+          sync_mode = SYNC_ASYNC;
+          sync_interval = (optarg[5] == ':') ? atoi(optarg + 6) : 1000;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+
+      case 'u':
+        restore_file = optarg;
+        break;
+
+      case 'w':
+        if (strcmp(optarg, "on") == 0) use_wal = 1;
+        else if (strcmp(optarg, "off") == 0) use_wal = 0;
+        else usage(argv[0]);
+        break;
+
+      case 'z':
+        if (strcmp(optarg, "lz") == 0) COMPRESS_VALUES = 1;
+        else if (strcmp(optarg, "off") == 0) COMPRESS_VALUES = 0;
+        else usage(argv[0]);
+        break;
+
      case '?':
 
      default:
@@ -62,48 +171,117 @@ int main(int argc, char* argv[]) {
   argc -= optind;
   argv += optind;
 
+  // A backup is taken from a server that's already running.
+  if (backup_file != NULL) exit(snapshot_fetch(host, port, backup_file, backup_base) == -1 ? -1 : 0);
+
   sprintf(db_file, "%s/db", DATA_HOME);
   sprintf(block_bitmap_file, "%s/block_bitmap", DATA_HOME);
+  sprintf(wal_file, "%s/wal", DATA_HOME);
 
 
-  // Coordinate exclusive access to the db block bitmap.
-  if ((BLOCK_BITMAP_LOCK = sem_open("block_bitmap_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+  // Coordinate access to the index across connections.
+  sem_unlink("index_lock");
+  if ((INDEX_LOCK = sem_open("index_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
     perror("semaphore init failed");
     exit(-1);
   }
-  sem_post(BLOCK_BITMAP_LOCK);
 
 
   // Memory-map our block bitmap file creating it if necessary.
-  // The block bitmap keeps track of free/busy blocks in the db file.
-  if ((BLOCK_BITMAP_FD = open(block_bitmap_file, O_RDWR | O_CREAT, 0666)) == -1) {
-    fprintf(stderr, "Couldn't open db block bitmap file %s\n", block_bitmap_file);
+  // The block bitmap keeps track of free/busy blocks in the db file,
+  // and grows along with it.
+  if (bitmap_open(block_bitmap_file) == -1) exit(-1);
+
+  // Open our database file
+  if ((DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
+    fprintf(stderr, "Couldn't open database file named %s\n", db_file);
     perror(NULL);
     exit(-1);
   }
-  if ((SHM_BLOCK_BITMAP = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, BLOCK_BITMAP_FD, 0)) == MAP_FAILED) {
-    perror("Problem mmapping the block bitmap");
-    exit(-1);
+
+  // Map all the room the db file could ever take up, so big values can be
+  // sent straight from it. Without the map they are read in first.
+  if ((DB_MAP = mmap((caddr_t)0, DB_MAP_BYTES, PROT_READ, MAP_SHARED, DB_FD, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the db file");
+    DB_MAP = NULL;
   }
 
+  // Read and write it with blocking calls or through io_uring.
+  if (storage_init(storage_backend) == -1) exit(-1);
+
+  // A restore runs in the foreground and exits when it's done.
+  if (restore_file != NULL) exit(snapshot_restore(restore_file) == -1 ? -1 : 0);
+
+  // Finish whatever the log says was in flight when we last stopped.
+  if (wal_replay(wal_file) == -1) exit(-1);
+
+  // Index the free space in the bitmap so allocations don't have to scan
+  // it. Each group is indexed the first time it's used.
+  if (extent_init(EXTENT_CAPACITY, alloc_policy) == -1) exit(-1);
+
+  // Decide how hard we work to get changes onto disk. With the log on,
+  // only the log is synced per command and the bitmap trails behind it.
+  if (use_wal) {
+    if (wal_init(wal_file, sync_mode, sync_interval) == -1) exit(-1);
+    if (bitmap_sync_init(SYNC_ASYNC, 1000) == -1) exit(-1);
+  } else {
+    WAL_FD = -1;
+    if (bitmap_sync_init(sync_mode, sync_interval) == -1) exit(-1);
+  }
+
+  // Decide what happens to the space deleted objects leave behind.
+  if (reclaim_init(delete_policy) == -1) exit(-1);
+
+  // Move values down and cut the file back in the background, if asked.
+  if (compact_init(compact_budget, compact_interval) == -1) exit(-1);
+
+  // Keep track of what a snapshot needs held back, and what the next
+  // incremental one needs to send.
+  if (snapshot_init() == -1) exit(-1);
+
+  // Pack small values together instead of giving each a block.
+  if (slab_init() == -1) exit(-1);
+
+  // Keep hot objects in memory every connection can read from.
+  if (cache_init((int64_t)cache_mb * 1024 * 1024) == -1) exit(-1);
+
+  // And the index pages in a pool of their own, keeping the top levels
+  // of the tree there for good if asked to.
+  if (pool_init((int64_t)pool_mb * 1024 * 1024, resident_levels) == -1) exit(-1);
+
+  // Count and time what every connection does.
+  if (stats_init() == -1) exit(-1);
+
 
   // register a function to reap our dead children
   signal(SIGCHLD, sigchld_handler);
 
-  // Register a function to kill our children.
-  // We'll unregister this function in our children.
-  signal(SIGTERM, sigterm_handler_parent);
 
-  // Open our database file
-  if ((DB_FD = open(db_file, O_RDWR | O_CREAT, 0666)) == -1) {
-    fprintf(stderr, "Couldn't open database file named %s\n", db_file);
-    perror(NULL);
+  // Find the root of our index, or start a new one.
+  if (btree_open() == -1) {
+    fprintf(stderr, "Couldn't open the index in %s\n", db_file);
     exit(-1);
   }
 
+  // A bulk load runs in the foreground and exits when it's done.
+  if (load_file != NULL) exit(bulk_load(load_file, load_mb) == -1 ? -1 : 0);
+
   // Demonize ourself.
   if ((chld = fork()) != 0 ) {printf("%d\n",chld); return(0);};
 
+  // Keep SIGTERM and SIGINT off the background threads, so they only
+  // arrive where we wait for them below.
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGTERM);
+  sigaddset(&stop_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  // Punch or zero deleted objects in the background.
+  if (reclaim_start() == -1) exit(-1);
+
+  // And keep the db file from getting holey.
+  if (compact_start() == -1) exit(-1);
+
   // Start listening
   if ((listen_fd = start_listening(host, port, BACKLOG)) == -1) {
     fprintf(stderr, "Call to start_listening failed\n");
@@ -113,16 +291,54 @@ int main(int argc, char* argv[]) {
 
   fprintf(stderr, "Started listening.\n");
 
+  // Serve every connection from a pool of threads, one per core unless
+  // we were told otherwise.
+  if (server_mode == SERVER_EPOLL) {
+    if (workers < 1) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    exit(run_reactor(listen_fd, workers));
+  }
+
+  // Register a function to stop the accept loop, and let the signals
+  // through on this thread. We'll unregister this function in our children.
+  if (pipe(STOP_PIPE) == -1) {
+    perror("Couldn't make the stop pipe");
+    exit(-1);
+  }
+  fcntl(STOP_PIPE[1], F_SETFL, O_NONBLOCK);
+  signal(SIGTERM, sigterm_handler_parent);
+  pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+
+  waiting[0].fd = listen_fd;
+  waiting[0].events = POLLIN;
+  waiting[1].fd = STOP_PIPE[0];
+  waiting[1].events = POLLIN;
+
   while (1) {
 
+    // Wait for a new connection, or for SIGTERM.
+    if (poll(waiting, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("Call to poll() failed");
+      return(-1);
+    }
+
+    // If we got a sigterm, write back the index and kill everyone.
+    if (waiting[1].revents) {
+      shutdown_server();
+      if ((killpg(0, SIGTERM)) == -1) {
+        perror("Can't kill off my children. Don't know why.");
+        exit(-1);
+      }
+      exit(0);
+    }
+
     // Accept new connection.
     if ((accept_fd = accept(listen_fd, (struct sockaddr *)&incoming, &addr_size)) == -1) {
+      if (errno == EINTR) continue;
       fprintf(stderr, "Call to accept() failed.\n");
       return(-1);
     }
 
-    fcntl(accept_fd, F_SETFD, O_NONBLOCK);
-
     // Start a child with the new connection.
     if ((chld = fork()) == 0 ){
       srv(accept_fd, listen_fd);
@@ -137,7 +353,8 @@ int main(int argc, char* argv[]) {
 } // end main
 
 void usage(char *argv) {
-  fprintf(stderr, "usage: %s [-h listen_addr] [-p listen_port] [-d /path/to/db/directory]\n", argv);
+  fprintf(stderr, "usage: %s [-h listen_addr] [-p listen_port] [-d /path/to/db/directory] [-a best|next] [-b backup_file[:base_id]] [-e release|punch|zero] [-c cache_mb] [-i pread|uring] [-k budget_percent[:seconds]] [-l dump_file[:mb]] [-m pool_mb[:resident_levels]] [-r fork|epoll[:workers]] [-s sync|group[:ms]|async[:ms]] [-u backup_file] [-w on|off] [-z lz|off]\n", argv);
+  fprintf(stderr, "  -i uring batches a command's reads and writes on io_uring, then waits for them before the command finishes.\n");
   exit(-1);
 }
 
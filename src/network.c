@@ -61,3 +61,29 @@ int start_listening(char* host, char* port, int backlog) {
 
 }
 
+
+// Connects to a server, for the client side of a backup.
+int connect_to(char* host, char* port) {
+  struct addrinfo hints, *res, *p;
+  int fd = -1, rc;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "The getaddrinfo() call failed with %d\n", rc);
+    return -1;
+  }
+
+  for (p = res; p != NULL; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd == -1) perror("Couldn't connect to the server");
+  return fd;
+}
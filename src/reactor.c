@@ -0,0 +1,178 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Event-driven server core, picked with -r epoll[:workers].
+
+  A fixed pool of worker threads shares the listening socket. Each worker
+  has its own epoll set and EPOLLEXCLUSIVE wakes just one of them for a
+  new connection, which then stays with the worker that accepted it.
+  Sockets are non-blocking and each connection buffers its input and
+  output (see connection.c), so a worker only ever waits on the index
+  and the disk, never on a client.
+
+  The main thread takes SIGTERM and SIGINT for the whole process and
+  flushes the bitmap on the way out.
+*/
+
+static void close_connection(int epoll_fd, struct connection* conn) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  free_connection(conn);
+}
+
+static void accept_connections(int epoll_fd, int listen_fd) {
+  struct epoll_event event;
+  struct connection* conn;
+  int accept_fd;
+
+  while ((accept_fd = accept(listen_fd, NULL, NULL)) != -1) {
+    fcntl(accept_fd, F_SETFL, fcntl(accept_fd, F_GETFL) | O_NONBLOCK);
+    if ((conn = calloc(1, sizeof(struct connection))) == NULL) {
+      perror("calloc failed in accept_connections()");
+      close(accept_fd);
+      continue;
+    }
+    conn->fd = accept_fd;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_fd, &event) == -1) {
+      perror("epoll_ctl failed in accept_connections()");
+      close(accept_fd);
+      free(conn);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Call to accept() failed");
+}
+
+// Reads and runs what a ready socket has sent us, for at most
+// EPOLL_READS recvs and until EPOLL_OUT_HIGH bytes of responses are
+// waiting, so one busy client can't hold up the worker's others or
+// queue without limit. Anything left wakes epoll again. Returns -1 if
+// the connection should be dropped on the spot.
+static int take_input(struct connection* conn, uint32_t events) {
+  int reads, rc = 0;
+
+  if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) return 0;
+
+  // Run commands as they come in, so a binary insert's value can be
+  // read straight into its own buffer.
+  for (reads = 0; reads < EPOLL_READS && conn->out_len - conn->out_sent < EPOLL_OUT_HIGH; reads++) {
+    if ((rc = read_input(conn, 0)) <= 0) break;
+    if (run_input(conn) == -1) return -1;
+  }
+  if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+  return 0;
+}
+
+// Sends a connection's responses and decides what to wait for next.
+static void give_output(int epoll_fd, struct connection* conn) {
+  struct epoll_event event;
+  int rc;
+
+  // Answer what a client sent before it hung up, then let it go.
+  if ((rc = send_output(conn)) == -1 || (rc == 0 && (conn->quit || conn->hung_up))) {
+    close_connection(epoll_fd, conn);
+    return;
+  }
+
+  // Stop reading while output is backed up, so a client that doesn't
+  // read its responses can't make us queue without limit.
+  event.events = (rc == 1) ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = conn;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static void* worker(void* arg) {
+  struct epoll_event events[EPOLL_EVENTS];
+  struct epoll_event event;
+  struct connection* conn;
+  int listen_fd = (int)(intptr_t)arg;
+  int epoll_fd, ready, i;
+
+  if ((epoll_fd = epoll_create1(0)) == -1) {
+    perror("epoll_create1 failed");
+    return NULL;
+  }
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = NULL; // The listener.
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+    perror("epoll_ctl failed on the listener");
+    return NULL;
+  }
+
+  while (1) {
+    if ((ready = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1)) == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      return NULL;
+    }
+
+    // Run every ready connection's commands, then make all of their
+    // changes durable with one commit before any of them is answered.
+    for (i = 0; i < ready; i++) {
+      if ((conn = events[i].data.ptr) == NULL) {
+        accept_connections(epoll_fd, listen_fd);
+      } else if (take_input(conn, events[i].events) == -1) {
+        close_connection(epoll_fd, conn);
+        events[i].data.ptr = NULL;
+      }
+    }
+
+    wal_commit();
+
+    for (i = 0; i < ready; i++)
+      if (events[i].data.ptr != NULL) give_output(epoll_fd, events[i].data.ptr);
+  }
+  return NULL;
+}
+
+int run_reactor(int listen_fd, int workers) {
+  pthread_t thread;
+  sigset_t signals;
+  int i, sig;
+
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  // Workers inherit this mask, so only sigwait below sees these.
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGCHLD, SIG_DFL);
+
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&thread, NULL, worker, (void*)(intptr_t)listen_fd) != 0) {
+      fprintf(stderr, "Couldn't start worker thread %d\n", i);
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  fprintf(stderr, "Serving with %d worker threads.\n", workers);
+
+  sigwait(&signals, &sig);
+  fprintf(stderr, "Got signal %d\n", sig);
+  shutdown_server();
+  cleanup_and_exit(0);
+  return 0;
+}
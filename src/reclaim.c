@@ -0,0 +1,195 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE // For fallocate().
+#include "emma.h"
+
+/*
+  Reclaiming deleted objects.
+
+  A delete takes the key out of the index and the blocks out of use. By
+  default (-e release) that's all: the blocks go straight back to the
+  allocator with their old contents left in place, so deleting a big
+  object costs no more than a small one.
+
+  With -e punch or -e zero, the blocks are queued here. A background
+  thread punches a hole over them, giving the space back to the
+  filesystem, or writes zeros over them. Only then are they handed back
+  to the allocator. Their WAL_FREE (and for zero, WAL_ZERO) is logged
+  at the delete. The thread waits for the log to reach disk before
+  touching the blocks, so a delete lost in a crash can't take the
+  object's data with it, and replay still frees and zeroes them if it
+  never got to them.
+
+  Queued blocks are logged as free but still set in the bitmap, so the
+  log isn't checkpointed while any are pending. If the queue fills up,
+  the deleting command does the work itself.
+
+  The queue lives in shared memory and is guarded by RECLAIM_LOCK.
+*/
+
+static struct reclaim_entry* RECLAIM_ENTRIES;
+static char ZEROS[RECLAIM_ZERO_CHUNK];
+
+
+// Punches or zeroes the blocks of one deleted object.
+static void reclaim_extent(struct reclaim_entry e) {
+  int64_t offset = (int64_t)e.block_offset * BLOCK_SIZE, len = (int64_t)e.blocks * BLOCK_SIZE, done, n;
+
+  if (SHM_RECLAIM->policy == DELETE_PUNCH) {
+    if (fallocate(DB_FD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == -1)
+      perror("fallocate failed in reclaim_extent");
+    return;
+  }
+  for (done = 0; done < len; done += n) {
+    n = (len - done < RECLAIM_ZERO_CHUNK) ? len - done : RECLAIM_ZERO_CHUNK;
+    if (storage_write(ZEROS, n, offset + done) != n) {
+      perror("Write failed in reclaim_extent");
+      return;
+    }
+  }
+}
+
+static void* reclaimer(void* arg) {
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = RECLAIM_INTERVAL_MS * 1000000L};
+
+  while (1) {
+    reclaim_run();
+    nanosleep(&nap, NULL);
+  }
+  return NULL;
+}
+
+
+int reclaim_init(int policy) {
+  if (policy == DELETE_RELEASE) return 0;
+
+  if ((SHM_RECLAIM = mmap((caddr_t)0, sizeof(struct reclaim_queue) + sizeof(struct reclaim_entry) * RECLAIM_QUEUE,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the reclaim queue");
+    SHM_RECLAIM = NULL;
+    return -1;
+  }
+  SHM_RECLAIM->policy = policy;
+  SHM_RECLAIM->capacity = RECLAIM_QUEUE;
+  RECLAIM_ENTRIES = (struct reclaim_entry*)(SHM_RECLAIM + 1);
+
+  sem_unlink("reclaim_lock");
+  if ((RECLAIM_LOCK = sem_open("reclaim_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    return -1;
+  }
+  return 0;
+}
+
+// Starts the thread that works through the queue. Signals are left to
+// the threads that were already handling them.
+int reclaim_start(void) {
+  pthread_t thread;
+  sigset_t all, old;
+
+  if (SHM_RECLAIM == NULL) return 0;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&thread, NULL, reclaimer, NULL) != 0) {
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fprintf(stderr, "Couldn't start the reclaim thread\n");
+    return -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_detach(thread);
+  return 0;
+}
+
+// Logs obj's blocks as free and queues them to be punched or zeroed.
+int reclaim_later(struct block_ptr obj) {
+  struct reclaim_entry e = {.block_offset = obj.block_offset, .blocks = obj.blocks};
+  int queued = 0;
+
+  // Count it before it's logged, so no checkpoint can drop the record.
+  __atomic_add_fetch(&SHM_RECLAIM->pending, 1, __ATOMIC_SEQ_CST);
+
+  sem_wait(RECLAIM_LOCK);
+  if (SHM_RECLAIM->policy == DELETE_ZERO)
+    wal_append(WAL_ZERO, (int64_t)obj.block_offset * BLOCK_SIZE, (int64_t)obj.blocks * BLOCK_SIZE, NULL, 0);
+  wal_append(WAL_FREE, obj.block_offset, obj.blocks, NULL, 0);
+  e.lsn = (WAL_FD == -1) ? 0 : SHM_WAL->write_lsn;
+  if (SHM_RECLAIM->count < SHM_RECLAIM->capacity) {
+    RECLAIM_ENTRIES[(SHM_RECLAIM->head + SHM_RECLAIM->count++) % SHM_RECLAIM->capacity] = e;
+    queued = 1;
+  } else {
+    SHM_RECLAIM->overflows++;
+  }
+  sem_post(RECLAIM_LOCK);
+
+  if (!queued) {
+    wal_commit();
+    reclaim_extent(e);
+    release_reclaimed_blocks(e.block_offset, e.blocks);
+  }
+  return 0;
+}
+
+// Reclaims everything queued whose delete is on disk. Syncs the log
+// first rather than wait for a command to do it.
+void reclaim_run(void) {
+  struct reclaim_entry e;
+  int64_t newest;
+
+  if (SHM_RECLAIM == NULL) return;
+
+  sem_wait(RECLAIM_LOCK);
+  if (SHM_RECLAIM->count == 0) {
+    sem_post(RECLAIM_LOCK);
+    return;
+  }
+  newest = RECLAIM_ENTRIES[(SHM_RECLAIM->head + SHM_RECLAIM->count - 1) % SHM_RECLAIM->capacity].lsn;
+  sem_post(RECLAIM_LOCK);
+  wal_sync(newest);
+
+  while (1) {
+    sem_wait(RECLAIM_LOCK);
+    if (SHM_RECLAIM->count == 0 ||
+        (WAL_FD != -1 && RECLAIM_ENTRIES[SHM_RECLAIM->head].lsn > __atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE))) {
+      sem_post(RECLAIM_LOCK);
+      return;
+    }
+    e = RECLAIM_ENTRIES[SHM_RECLAIM->head];
+    SHM_RECLAIM->head = (SHM_RECLAIM->head + 1) % SHM_RECLAIM->capacity;
+    SHM_RECLAIM->count--;
+    sem_post(RECLAIM_LOCK);
+
+    reclaim_extent(e);
+    release_reclaimed_blocks(e.block_offset, e.blocks);
+    __atomic_add_fetch(&SHM_RECLAIM->reclaimed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SHM_RECLAIM->reclaimed_blocks, e.blocks, __ATOMIC_RELAXED);
+  }
+}
+
+void reclaim_report(void) {
+  if (SHM_RECLAIM == NULL) return;
+  fprintf(stderr, "Reclaim: %lld objects (%lld blocks) %s, %d pending, %lld done inline.\n",
+          (long long)SHM_RECLAIM->reclaimed, (long long)SHM_RECLAIM->reclaimed_blocks,
+          SHM_RECLAIM->policy == DELETE_PUNCH ? "punched" : "zeroed",
+          __atomic_load_n(&SHM_RECLAIM->pending, __ATOMIC_RELAXED), (long long)SHM_RECLAIM->overflows);
+}
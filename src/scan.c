@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Ordered key scans, for the keys command.
+
+  A scan covers the keys that start with a prefix, or the keys from a
+  start key up to but not including an end key, and answers with at
+  most a limit of them. A prefix is turned into the range it covers, so
+  from here on every scan is a range.
+
+  Keys are read from the index KEYS_CHUNK at a time, each chunk from
+  whatever version of the tree is current when it starts, and sent on
+  as they are read (see queue_keys()). So however many keys there are,
+  a scan holds a chunk of them at a time, and it never holds up the
+  tree while it waits on a client. Keys added or deleted while a scan
+  runs may or may not be seen by it.
+
+  A scan that stops at its limit with keys left over answers with a
+  cursor: '@', then the last key sent and the end of the range, in hex
+  and separated by ':', so it can be longer than a key. Handed back in
+  place of the prefix, it picks up just after that key. The server
+  keeps nothing between the two.
+*/
+
+static const char HEX[] = "0123456789abcdef";
+
+static int unhex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Decodes len hex digits into a key. Returns -1 if they aren't hex, or
+// don't make a key.
+static int unhex(const char* hex, int len, char* key) {
+  int i, hi, lo;
+
+  if (len % 2 != 0 || len / 2 >= KEY_LEN) return -1;
+  for (i = 0; i < len / 2; i++) {
+    if ((hi = unhex_digit(hex[2 * i])) == -1 || (lo = unhex_digit(hex[2 * i + 1])) == -1) return -1;
+    if ((key[i] = hi << 4 | lo) == '\0') return -1;
+  }
+  key[i] = '\0';
+  return 0;
+}
+
+// Picks a scan back up from a cursor. Returns -1 if it isn't one.
+static int resume_scan(struct key_scan* scan, const char* cursor) {
+  const char* colon;
+
+  if (cursor[0] != '@' || (colon = strchr(cursor, ':')) == NULL) return -1;
+  if (unhex(cursor + 1, colon - cursor - 1, scan->next) == -1 || scan->next[0] == '\0') return -1;
+  if (unhex(colon + 1, strlen(colon + 1), scan->end) == -1) return -1;
+  scan->after = 1;
+  return 0;
+}
+
+// Sets up a scan of the keys from start up to end, or of the keys that
+// start with start if end is NULL. A start that is a cursor from an
+// earlier answer carries on from there. A limit of 0 means KEYS_LIMIT,
+// and more than KEYS_MAX_LIMIT means that. Returns -1 if the keys are
+// too long or the cursor doesn't decode.
+int scan_init(struct key_scan* scan, const char* start, const char* end, int limit) {
+  int len;
+
+  memset(scan, '\0', sizeof(struct key_scan));
+  scan->limit = (limit < 1) ? KEYS_LIMIT : (limit > KEYS_MAX_LIMIT) ? KEYS_MAX_LIMIT : limit;
+
+  if (end == NULL && start[0] == '@' && resume_scan(scan, start) == 0) return 0;
+  if ((len = strlen(start)) >= KEY_LEN || (end != NULL && strlen(end) >= KEY_LEN)) return -1;
+
+  strcpy(scan->next, start);
+  if (end != NULL) {
+    strcpy(scan->end, end);
+    return 0;
+  }
+
+  // The keys with a prefix are those below the prefix with its last
+  // byte bumped. Bytes that can't be bumped are dropped, and if none
+  // can, there is no end.
+  strcpy(scan->end, start);
+  while (len > 0 && (unsigned char)scan->end[len - 1] == 0xff) scan->end[--len] = '\0';
+  if (len > 0) scan->end[len - 1]++;
+  return 0;
+}
+
+// Copies the scan's next keys into keys, which has room for max + 1 of
+// them. Returns how many there are, 0 once the scan is over, or -1 on
+// error.
+int scan_next(struct key_scan* scan, char (*keys)[KEY_LEN], int max) {
+  int want, n;
+
+  if (scan->done) return 0;
+
+  // Ask for one past the limit, to find out whether there's more.
+  want = scan->limit - scan->sent;
+  if (want > max) want = max;
+  else want++;
+
+  if ((n = btree_scan(scan->next, scan->after, scan->end, keys, NULL, want)) == -1) return -1;
+  if (scan->sent + n > scan->limit) {
+    n = scan->limit - scan->sent;
+    scan->more = 1;
+  }
+  if (n > 0) {
+    strcpy(scan->next, keys[n - 1]);
+    scan->after = 1;
+  }
+  scan->sent += n;
+  if (n < want || scan->sent == scan->limit) scan->done = 1;
+  return n;
+}
+
+// Writes the cursor that picks up where the scan stopped into cursor,
+// which has room for KEYS_CURSOR_LEN bytes. Returns its length, which
+// is 0 if there's nothing left to pick up.
+int scan_cursor(const struct key_scan* scan, char* cursor) {
+  int len = 0, i;
+
+  if (!scan->more) return 0;
+  cursor[len++] = '@';
+  for (i = 0; scan->next[i] != '\0'; i++) {
+    cursor[len++] = HEX[(unsigned char)scan->next[i] >> 4];
+    cursor[len++] = HEX[(unsigned char)scan->next[i] & 0xf];
+  }
+  cursor[len++] = ':';
+  for (i = 0; scan->end[i] != '\0'; i++) {
+    cursor[len++] = HEX[(unsigned char)scan->end[i] >> 4];
+    cursor[len++] = HEX[(unsigned char)scan->end[i] & 0xf];
+  }
+  cursor[len] = '\0';
+  return len;
+}
@@ -30,13 +30,29 @@ void sigchld_handler(int s)
 
 void sigterm_handler_parent(int s)
 {
-  // If we get a sigterm, kill everyone.
-  if ((killpg(0, SIGTERM)) == -1) {
-    perror("Can't kill off my children. Don't know why.");
-    exit(-1);
-  } else {
-    exit(0);
-  };
+  // Just wake the accept loop. It does the flushing and reporting,
+  // which need locks and stdio a signal handler can't use.
+  int saved_errno = errno;
+  if (write(STOP_PIPE[1], "", 1) == -1) {} // Full means it's already awake.
+  errno = saved_errno;
+}
+
+void shutdown_server(void)
+{
+  // Write back the index and say what we did. Holds the index from
+  // here on, so nothing changes it behind the flush.
+  sem_wait(INDEX_LOCK);
+  btree_free_values();
+  reclaim_run();
+  if (WAL_FD == -1 || wal_sync(SHM_WAL->write_lsn) == 0) pool_flush();
+  pool_report();
+  btree_report();
+  snapshot_report();
+  cache_report();
+  slab_report();
+  reclaim_report();
+  compact_report();
+  stats_report();
 }
 
 void sigterm_handler_child(int s)
@@ -47,8 +63,7 @@ void sigterm_handler_child(int s)
 }
 
 void cleanup_and_exit(int retval) {
-  sem_post(BLOCK_BITMAP_LOCK);
-  msync(SHM_BLOCK_BITMAP, BLOCK_BITMAP_BYTES, MS_SYNC);
+  bitmap_flush();
   close(DB_FD);
   exit(retval);
 }
@@ -68,250 +83,749 @@ int tokenize_command(char* msg, char* token_vector[]) {
 
 int extract_command(char *token_vector[], int token_count) {
 
-  char* commands[5] = { "quit",   // 0
-                        "insert", // 1
-                        "find",   // 2
-                        "delete", // 3
-                        "keys"    // 4
-                      };
+  char* commands[10] = { "quit",     // 0
+                         "insert",   // 1
+                         "find",     // 2
+                         "delete",   // 3
+                         "keys",     // 4
+                         "mget",     // 5
+                         "mput",     // 6
+                         "mdelete",  // 7
+                         "snapshot", // 8
+                         "stats"     // 9
+                       };
   int i = 0;
   if (token_count < 1) return -1;
-  for (; i < 5; i++)
+  for (; i < 10; i++)
     if (strcmp(commands[i], token_vector[0]) == 0) return(i);
   return -1;
 }
 
 int srv(int accept_fd, int listen_fd) {
 
-  char buffer[RECV_WINDOW] = "";   // recv buffer
-  int msgbuflen = MSG_SIZE;
-  char *msg; // Incoming message.
-  char *send_msg; // Outgoing message.
-  char *tmp_msg;
-  void *msg_cursor;
-  struct response_struct response;
-  int msglen = 0; // length of the assembled message that we receive.
+  struct connection* conn;
   int recvlen = 0; // how many bytes recv call returns.
-  int responselen = 0;
-  int offset;
-  char* token_vector[MAX_ARGS] = {NULL};
-  int token_count = 0;
 
   // Re-register the sigterm handler to our cleanup function.
   signal(SIGTERM, sigterm_handler_child);
-  close(listen_fd); // Close this resource from our parent. We don't need it any more.
+  close(listen_fd); // Close these resources from our parent. We don't need them any more.
+  close(STOP_PIPE[0]);
+  close(STOP_PIPE[1]);
+
+  if ((conn = calloc(1, sizeof(struct connection))) == NULL) {
+    perror(NULL);
+    cleanup_and_exit(-1);
+  }
+  conn->fd = accept_fd;
 
   while (1) {
 
-    msglen = 0;
-    msgbuflen = MSG_SIZE;
-    msg = malloc(sizeof(char) * msgbuflen);
-    msg_cursor = (void*)msg;
-    bzero(msg, msgbuflen);
+    // Block until the client sends something, then take whatever else
+    // is already waiting.
+    if ((recvlen = read_input(conn, 0)) == -1) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Got error %d from recv.\n", errno);
+      free_connection(conn);
+      cleanup_and_exit(-1);
+    }
 
+    // Run every whole command as it arrives, then answer them all in
+    // one go.
+    do {
+      if (run_input(conn) == -1) {
+        free_connection(conn);
+        cleanup_and_exit(-1);
+      }
+    } while (recvlen > 0 && (recvlen = read_input(conn, MSG_DONTWAIT)) > 0);
+    wal_commit(); // Don't answer until any change is in the log.
+    if (send_output(conn) == -1) perror("Send failed");
 
-    // Wait for some data
-    while (((recvlen = recv(accept_fd, (void*)buffer, RECV_WINDOW, MSG_PEEK)) == -1) && (errno == EAGAIN));
-    if (recvlen == 0) {
+    if (conn->quit) {
+      free_connection(conn);
+      cleanup_and_exit(0);
+    }
+    if (conn->hung_up) {
       fprintf(stderr, "Client closed the connection.\n");
-      close(accept_fd);
+      free_connection(conn);
       cleanup_and_exit(0);
-    };
-
-    // Receive data from our buffered stream until we would block.
-    while ((recvlen = recv(accept_fd, (void*)buffer, RECV_WINDOW, 0)) != -1) {
-      if (recvlen == 0) {
-        fprintf(stderr, "Client closed the connection.\n");
-        close(accept_fd);
-        cleanup_and_exit(0);
-      };
-
-      if (recvlen == -1) {
-        fprintf(stderr, "Got error %d from recv.\n", errno);
-        close(accept_fd);
-        cleanup_and_exit(-1);
-      };
-
-      // Extend our message buffer if need be.
-      if ((msglen += recvlen) > (msgbuflen)) {
-        msgbuflen += msgbuflen;
-        offset = msg_cursor - (void*)msg;
-        tmp_msg = malloc(sizeof(char) * msgbuflen);
-        bzero(tmp_msg, msgbuflen);
-        memcpy(tmp_msg, msg, offset);
-        msg_cursor = tmp_msg + offset;
-        free(msg);
-        msg = tmp_msg;
-        fprintf(stderr, "msgbuflen expanded to %d\n", msgbuflen);
-      }
+    }
+  };
 
-      memcpy(msg_cursor, (void*)buffer, recvlen);
-      msg_cursor += recvlen;
-      if (memchr((void*)buffer, '\n', recvlen)) break; // Got a terminator character. Go process our message.
+  return(0);
+}
 
-    }
+static struct response_struct new_response(void) {
+  struct response_struct response = {.status = 0, .msg_len = -1};
+
+  if ((response.msg = malloc(sizeof(char) * MSG_SIZE)) == NULL) {
+    perror(NULL);
+    cleanup_and_exit(0);
+  }
+  response.msg[0] = '\0';
+  return response;
+}
+
+// Runs one command line and fills in its response. Returns the
+// command's number from extract_command(). Quit (0) gets no response.
+int run_command(char* msg, struct response_struct* response) {
+  char* token_vector[MAX_ARGS] = {NULL};
+  int token_count = 0;
+  int command;
 
-    tmp_msg = msg;
-    strsep(&tmp_msg, "\r\n");
+  token_count = tokenize_command(msg, token_vector);
 
-    token_count = tokenize_command(msg, token_vector);
+  switch ((command = extract_command(token_vector, token_count)))  {
 
-    switch (extract_command(token_vector, token_count))  {
+    case 0: // quit
+      break;
 
-      case 0: // quit
-        cleanup_and_exit(0);
-        break;
+    case 1: // insert
+      *response = insert_command(token_vector, token_count);
+      break;
 
-      case 1: // insert
-        response = insert_command(token_vector, token_count);
-        break;
+    case 2: // find
+      *response = find_command(token_vector, token_count);
+      break;
 
-      case 2: // find
-        response = find_command(token_vector, token_count);
-        break;
+    case 3: // delete
+      *response = delete_command(token_vector, token_count);
+      break;
 
-      case 3: // delete
-        response = delete_command(token_vector, token_count);
-        break;
+    case 4: // keys
+      *response = keys_command(token_vector, token_count);
+      break;
 
-      case 4: // keys
-        response = keys_command(token_vector, token_count);
-        break;
+    case 5: // mget
+      *response = mget_command(token_vector, token_count);
+      break;
 
-      default:
-        if ((response.msg = malloc(sizeof(char) * MSG_SIZE)) == NULL) {
-          perror(NULL);
-          cleanup_and_exit(0);
-        }
-        bzero(response.msg, MSG_SIZE);
-        sprintf(response.msg, "Unknown command.");
-        response.status = 1;
-    }
+    case 6: // mput
+      *response = mput_command(token_vector, token_count);
+      break;
 
-    responselen = prepare_send_msg(response, &send_msg);
+    case 7: // mdelete
+      *response = mdelete_command(token_vector, token_count);
+      break;
 
-    if((send(accept_fd, (void*)send_msg, responselen, 0) == -1)) perror("Send failed");
-    free(msg);
-    free(response.msg);
-    free(send_msg);
+    case 8: // snapshot
+      *response = snapshot_command(token_vector, token_count);
+      break;
 
-  };
+    case 9: // stats
+      *response = stats_command(token_vector, token_count);
+      break;
 
-  return(0);
+    default:
+      *response = new_response();
+      sprintf(response->msg, "Unknown command.");
+      response->status = 1;
+  }
+
+  return command;
+}
+
+// Writes the STATUS and SIZE lines that start a response into
+// status_msg, which has room for MSG_SIZE bytes. Returns their length.
+int prepare_status(struct response_struct response, char* status_msg) {
+  int msg_len = (response.msg_len == -1) ? strlen(response.msg) : response.msg_len;
+
+  return sprintf(status_msg, "STATUS: %s\nSIZE: %d\n",
+    STATUS_CODES[response.status],
+    msg_len);
 }
 
 int prepare_send_msg(struct response_struct response, char** send_msg) {
   char status_msg[MSG_SIZE] = { '\0' };
-  int responselen;
+  int msg_len = (response.msg_len == -1) ? strlen(response.msg) : response.msg_len;
+  int status_len, responselen;
 
-  sprintf(status_msg, "STATUS: %s\nSIZE: %d\n",
-    STATUS_CODES[response.status],
-    (int)strlen(response.msg));
-  responselen = strlen(response.msg) + strlen(status_msg) + 2;
+  status_len = prepare_status(response, status_msg);
+  responselen = status_len + msg_len + 2;
   if ((*send_msg = malloc(responselen)) == NULL) {
     perror(NULL);
     cleanup_and_exit(0);
   }
-  *send_msg[0] = '\0';
-  strcat(*send_msg, status_msg);
-  strcat(*send_msg, response.msg);
-  strcat(*send_msg, "\n\n");
+  memcpy(*send_msg, status_msg, status_len);
+  memcpy(*send_msg + status_len, response.msg, msg_len);
+  memcpy(*send_msg + status_len + msg_len, "\n\n", 2);
   return responselen;
 }
 
+// Checks the key argument of a text command and copies it into key.
+static int text_key(char* token_vector[], int token_count, int args, char* key, struct response_struct* response) {
+  if (token_count < args) {
+    sprintf(response->msg, "Arguments missing.");
+    response->status = 1;
+    return -1;
+  }
+
+  if (strlen(token_vector[1]) >= KEY_LEN) {
+    sprintf(response->msg, "Key too long.");
+    response->status = 1;
+    return -1;
+  }
+
+  strcpy(key, token_vector[1]);
+  return 0;
+}
+
 struct response_struct find_command(char* token_vector[], int token_count) {
 
   char key[KEY_LEN] = "";
-  struct block_ptr ptr = {.block_offset = 0, .blocks = 0};
-  struct response_struct response;
-  response.status = 0;
+  struct response_struct response = new_response();
 
-  response.msg = malloc(sizeof(char) * MSG_SIZE);
+  if (text_key(token_vector, token_count, 2, key, &response) == -1) return response;
 
-  if (token_count == 1) {
+  free(response.msg);
+  return fetch_value(key);
+}
+
+struct response_struct insert_command(char* token_vector[], int token_count) {
+
+  char key[KEY_LEN] = "";
+  char* buffer;
+  uint32_t len;
+  struct response_struct response = new_response();
+
+  if (text_key(token_vector, token_count, 3, key, &response) == -1) return response;
+
+  len = strlen(token_vector[2]);
+  if ((buffer = new_value_buffer(len)) == NULL) {
+    sprintf(response.msg, "Couldn't store the value.");
+    response.status = 1;
+    return response;
+  }
+  memcpy(VALUE_DATA(buffer), token_vector[2], len);
+
+  free(response.msg);
+  return store_value(key, buffer);
+}
+
+struct response_struct delete_command(char* token_vector[], int token_count) {
+
+  char key[KEY_LEN] = "";
+  struct response_struct response = new_response();
+
+  if (text_key(token_vector, token_count, 2, key, &response) == -1) return response;
+
+  free(response.msg);
+  return remove_value(key);
+}
+
+// Rolls the answers for each key of a batch into one response, each
+// in the usual STATUS/SIZE form. Fails if any of them did.
+static struct response_struct text_batch(struct response_struct* responses, int count) {
+  struct response_struct response = {.status = 0, .msg = NULL, .msg_len = 0};
+  char status_msg[MSG_SIZE];
+  int64_t total = 0;
+  int i, status_len, len;
+
+  for (i = 0; i < count; i++) {
+    len = (responses[i].msg_len == -1) ? strlen(responses[i].msg) : responses[i].msg_len;
+    total += prepare_status(responses[i], status_msg) + len + 2;
+  }
+  if (total > INT_MAX || (response.msg = malloc(total)) == NULL) {
+    perror("malloc failed in text_batch()");
+    for (i = 0; i < count; i++) free(responses[i].msg);
+    response = new_response();
+    sprintf(response.msg, "Out of memory.");
+    response.status = 1;
+    return response;
+  }
+
+  for (i = 0; i < count; i++) {
+    len = (responses[i].msg_len == -1) ? strlen(responses[i].msg) : responses[i].msg_len;
+    status_len = prepare_status(responses[i], status_msg);
+    memcpy(response.msg + response.msg_len, status_msg, status_len);
+    memcpy(response.msg + response.msg_len + status_len, responses[i].msg, len);
+    memcpy(response.msg + response.msg_len + status_len + len, "\n\n", 2);
+    response.msg_len += status_len + len + 2;
+    if (responses[i].status != 0) response.status = 1;
+    free(responses[i].msg);
+  }
+  return response;
+}
+
+// Runs a batch command given its keys (and values) as text.
+static struct response_struct text_batch_command(char* token_vector[], int token_count, int command) {
+  int stride = (command == 6) ? 2 : 1; // mput takes key/value pairs.
+  int count = (token_count - 1) / stride, i;
+  struct response_struct response = new_response();
+  struct response_struct* responses;
+  char** keys;
+  char** buffers;
+  uint32_t len;
+
+  if (count < 1 || (token_count - 1) % stride != 0) {
     sprintf(response.msg, "Arguments missing.");
     response.status = 1;
     return response;
   }
+  for (i = 0; i < count; i++) {
+    if (strlen(token_vector[1 + i * stride]) >= KEY_LEN) {
+      sprintf(response.msg, "Key too long.");
+      response.status = 1;
+      return response;
+    }
+  }
 
-  strcat(key, token_vector[1]);
+  keys = malloc(sizeof(char*) * count);
+  buffers = calloc(count, sizeof(char*));
+  responses = malloc(sizeof(struct response_struct) * count);
+  if (keys == NULL || buffers == NULL || responses == NULL) {
+    perror("malloc failed in text_batch_command()");
+    sprintf(response.msg, "Out of memory.");
+    response.status = 1;
+    free(keys);
+    free(buffers);
+    free(responses);
+    return response;
+  }
+  for (i = 0; i < count; i++) keys[i] = token_vector[1 + i * stride];
+
+  switch (command) {
+    case 5:
+      fetch_values(keys, count, responses);
+      break;
+
+    case 6:
+      for (i = 0; i < count; i++) {
+        len = strlen(token_vector[2 + i * 2]);
+        if ((buffers[i] = new_value_buffer(len)) == NULL) break;
+        memcpy(VALUE_DATA(buffers[i]), token_vector[2 + i * 2], len);
+      }
+      if (i < count) {
+        sprintf(response.msg, "Out of memory.");
+        response.status = 1;
+        while (i-- > 0) free(buffers[i]);
+        free(keys);
+        free(buffers);
+        free(responses);
+        return response;
+      }
+      store_values(keys, buffers, count, responses);
+      break;
 
-	// ptr = btree_find(key)
-	// response.msg = read_obj(ptr);
-  sprintf(response.msg, "Not working yet. block_offset is %lld.", ptr.block_offset);
-  response.status = 1;
+    case 7:
+      remove_values(keys, count, responses);
+      break;
+  }
 
+  free(response.msg);
+  response = text_batch(responses, count);
+  free(keys);
+  free(buffers);
+  free(responses);
   return response;
 }
 
-struct response_struct insert_command(char* token_vector[], int token_count) {
+struct response_struct mget_command(char* token_vector[], int token_count) {
+  return text_batch_command(token_vector, token_count, 5);
+}
+
+struct response_struct mput_command(char* token_vector[], int token_count) {
+  return text_batch_command(token_vector, token_count, 6);
+}
+
+struct response_struct mdelete_command(char* token_vector[], int token_count) {
+  return text_batch_command(token_vector, token_count, 7);
+}
+
+/*
+  The commands themselves, shared by the text and binary protocols.
+*/
+
+// Looks up key and hands back its value as the response. The value is
+// read inside btree_read_begin(), so a delete can't free it under us. A
+// value left in place to be sent keeps the read going: queueing the
+// response ends it.
+struct response_struct fetch_value(const char* key) {
 
-  char key[KEY_LEN] = "";
   struct block_ptr ptr = {.block_offset = 0, .blocks = 0};
-  struct response_struct response;
-  response.status = 0;
+  struct response_struct response = new_response();
+  char* value;
+  uint32_t len;
+
+  btree_read_begin();
+  switch (btree_find(key, &ptr)) {
+    case 0:
+      break;
+
+    case 1:
+      btree_read_end();
+      sprintf(response.msg, "Not found.");
+      response.status = 1;
+      return response;
+
+    default:
+      btree_read_end();
+      sprintf(response.msg, "Index lookup failed.");
+      response.status = 1;
+      return response;
+  }
 
-  response.msg = malloc(sizeof(char) * MSG_SIZE);
+  // Big values are left where they are, to be sent by queue_value(),
+  // unless they were compressed.
+  if (ptr.blocks * BLOCK_SIZE > DIRECT_SEND_MIN && read_value_length(ptr, &len) == 0 && len >= DIRECT_SEND_MIN) {
+    free(response.msg);
+    response.msg = NULL;
+    response.msg_len = len;
+    response.value = ptr;
+    return response;
+  }
 
-  if (token_count == 1) {
-    sprintf(response.msg, "Arguments missing.");
+  value = read_value(ptr, &len);
+  btree_read_end();
+  if (value == NULL) {
+    sprintf(response.msg, "Couldn't read the value.");
+    response.status = 1;
+    return response;
+  }
+
+  free(response.msg);
+  response.msg = value;
+  response.msg_len = len;
+  return response;
+}
+
+// Stores a buffer made by new_value_buffer() under key, and frees it.
+struct response_struct store_value(const char* key, char* buffer) {
+
+  struct block_ptr ptr = {.block_offset = 0, .blocks = 0};
+  struct block_ptr old = {.block_offset = 0, .blocks = 0};
+  struct response_struct response = new_response();
+  int rc;
+
+  rc = write_value(&ptr, buffer);
+  free(buffer);
+  if (rc == -1) {
+    sprintf(response.msg, "Couldn't store the value.");
     response.status = 1;
     return response;
   }
 
-  strcat(key, token_vector[1]);
-	// ptr = btree_find(key)
-	// response.msg = read_obj(ptr);
-  sprintf(response.msg, "Not working yet. block_offset is %lld.", ptr.block_offset);
-  response.status = 1;
+  switch (btree_insert(key, ptr, &old)) {
+    case 0:
+      break;
+
+    case 1: // Replaced an existing value. Get rid of the old one.
+      btree_retire_values(&old, 1);
+      break;
+
+    default:
+      delete_obj(ptr);
+      sprintf(response.msg, "Couldn't update the index.");
+      response.status = 1;
+  }
 
   return response;
 }
 
-struct response_struct delete_command(char* token_vector[], int token_count) {
+struct response_struct remove_value(const char* key) {
 
-  char key[KEY_LEN] = "";
   struct block_ptr ptr = {.block_offset = 0, .blocks = 0};
-  struct response_struct response;
-  response.status = 0;
+  struct response_struct response = new_response();
+
+  switch (btree_delete(key, &ptr)) {
+    case 0:
+      if (btree_retire_values(&ptr, 1) == -1) {
+        sprintf(response.msg, "Couldn't free the value.");
+        response.status = 1;
+      }
+      break;
 
-  response.msg = malloc(sizeof(char) * MSG_SIZE);
+    case 1:
+      sprintf(response.msg, "Not found.");
+      response.status = 1;
+      break;
 
-  if (token_count == 1) {
-    sprintf(response.msg, "Arguments missing.");
+    default:
+      sprintf(response.msg, "Couldn't update the index.");
+      response.status = 1;
+  }
+
+  return response;
+}
+
+/*
+  Batches. Index work is done key by key, in the order given so a later
+  key wins over an earlier copy of it. The values are read, written and
+  freed together, in block order (see read_values() and friends).
+  Each fills in a response per key and returns -1 if any failed. A
+  batch that can't get going fails every key, but not the server.
+*/
+
+static int fail_batch(int count, struct response_struct* responses, const char* why) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    responses[i] = new_response();
+    sprintf(responses[i].msg, "%s", why);
+    responses[i].status = 1;
+  }
+  return -1;
+}
+
+// An mget answers with at most MAX_BATCH_BYTES of values, counted in
+// whole blocks as they are read, or fails every key it found.
+int fetch_values(char** keys, int count, struct response_struct* responses) {
+
+  struct block_ptr* ptrs;
+  char** values;
+  uint32_t* lens;
+  int64_t bytes = 0;
+  int i, rc = 0;
+
+  ptrs = calloc(count, sizeof(struct block_ptr));
+  values = malloc(sizeof(char*) * count);
+  lens = malloc(sizeof(uint32_t) * count);
+  if (ptrs == NULL || values == NULL || lens == NULL) {
+    perror("malloc failed in fetch_values()");
+    free(ptrs);
+    free(values);
+    free(lens);
+    return fail_batch(count, responses, "Out of memory.");
+  }
+
+  btree_read_begin(); // Until the values are read.
+  for (i = 0; i < count; i++) {
+    responses[i] = new_response();
+    switch (btree_find(keys[i], &ptrs[i])) {
+      case 0:
+        break;
+
+      case 1:
+        sprintf(responses[i].msg, "Not found.");
+        responses[i].status = 1;
+        ptrs[i].blocks = 0;
+        break;
+
+      default:
+        sprintf(responses[i].msg, "Index lookup failed.");
+        responses[i].status = 1;
+        ptrs[i].blocks = 0;
+    }
+    bytes += (int64_t)ptrs[i].blocks * BLOCK_SIZE;
+  }
+
+  if (bytes > MAX_BATCH_BYTES) {
+    for (i = 0; i < count; i++) {
+      if (ptrs[i].blocks == 0) continue;
+      sprintf(responses[i].msg, "Batch too big.");
+      responses[i].status = 1;
+      ptrs[i].blocks = 0;
+    }
+  }
+  read_values(ptrs, values, lens, count);
+  btree_read_end();
+
+  for (i = 0; i < count; i++) {
+    if (ptrs[i].blocks == 0) continue;
+    if (values[i] == NULL) {
+      sprintf(responses[i].msg, "Couldn't read the value.");
+      responses[i].status = 1;
+      continue;
+    }
+    free(responses[i].msg);
+    responses[i].msg = values[i];
+    responses[i].msg_len = lens[i];
+  }
+
+  for (i = 0; i < count; i++) if (responses[i].status != 0) rc = -1;
+  free(ptrs);
+  free(values);
+  free(lens);
+  return rc;
+}
+
+// Stores buffers made by new_value_buffer() under keys, and frees them.
+int store_values(char** keys, char** buffers, int count, struct response_struct* responses) {
+
+  struct block_ptr* ptrs;
+  struct block_ptr* dead; // Values replaced, or written and then not indexed.
+  int i, dead_count = 0, rc;
+
+  ptrs = calloc(count, sizeof(struct block_ptr));
+  dead = calloc(count, sizeof(struct block_ptr));
+  if (ptrs == NULL || dead == NULL) {
+    perror("calloc failed in store_values()");
+    free(ptrs);
+    free(dead);
+    for (i = 0; i < count; i++) free(buffers[i]);
+    return fail_batch(count, responses, "Out of memory.");
+  }
+
+  rc = write_values(buffers, ptrs, count);
+  for (i = 0; i < count; i++) {
+    free(buffers[i]);
+    responses[i] = new_response();
+    if (rc == -1) {
+      sprintf(responses[i].msg, "Couldn't store the value.");
+      responses[i].status = 1;
+      continue;
+    }
+
+    switch (btree_insert(keys[i], ptrs[i], &dead[dead_count])) {
+      case 0:
+        break;
+
+      case 1: // Replaced an existing value. Get rid of the old one.
+        dead_count++;
+        break;
+
+      default:
+        dead[dead_count++] = ptrs[i];
+        sprintf(responses[i].msg, "Couldn't update the index.");
+        responses[i].status = 1;
+    }
+  }
+
+  btree_retire_values(dead, dead_count);
+
+  for (i = 0; i < count; i++) if (responses[i].status != 0) rc = -1;
+  free(ptrs);
+  free(dead);
+  return rc;
+}
+
+int remove_values(char** keys, int count, struct response_struct* responses) {
+
+  struct block_ptr* dead;
+  int i, dead_count = 0, rc = 0;
+
+  if ((dead = calloc(count, sizeof(struct block_ptr))) == NULL) {
+    perror("calloc failed in remove_values()");
+    return fail_batch(count, responses, "Out of memory.");
+  }
+
+  for (i = 0; i < count; i++) {
+    responses[i] = new_response();
+    switch (btree_delete(keys[i], &dead[dead_count])) {
+      case 0:
+        dead_count++;
+        break;
+
+      case 1:
+        sprintf(responses[i].msg, "Not found.");
+        responses[i].status = 1;
+        break;
+
+      default:
+        sprintf(responses[i].msg, "Couldn't update the index.");
+        responses[i].status = 1;
+    }
+  }
+
+  if (btree_retire_values(dead, dead_count) == -1) rc = -1;
+
+  for (i = 0; i < count; i++) if (responses[i].status != 0) rc = -1;
+  free(dead);
+  return rc;
+}
+
+// Whether a word is a number, and so a limit rather than a key.
+static int is_limit(const char* word) {
+  int i;
+
+  for (i = 0; word[i] != '\0'; i++) if (!isdigit((unsigned char)word[i])) return 0;
+  return i > 0 && i < 10;
+}
+
+// keys <prefix> [limit], or keys <start> <end> [limit], or keys
+// <cursor> [limit] to go on from where an earlier answer stopped. A
+// third word that is a number is taken as a limit, so a range that ends
+// at a number needs a limit after it. The keys are streamed by
+// queue_keys().
+struct response_struct keys_command(char* token_vector[], int token_count) {
+
+  struct response_struct response = new_response();
+  const char* end = NULL;
+  int limit = 0;
+
+  if (token_count < 2 || token_count > 4) {
+    sprintf(response.msg, token_count < 2 ? "Arguments missing." : "Too many arguments.");
     response.status = 1;
     return response;
   }
 
-  strcat(key, token_vector[1]);
-	// ptr = btree_find(key)
-	// response.msg = read_obj(ptr);
-  sprintf(response.msg, "Not working yet. block_offset is %lld.", ptr.block_offset);
-  response.status = 1;
+  if (token_count == 4 || (token_count == 3 && !is_limit(token_vector[2]))) end = token_vector[2];
+  if (token_count == 4 || (token_count == 3 && end == NULL)) {
+    if (!is_limit(token_vector[token_count - 1])) {
+      sprintf(response.msg, "Bad limit.");
+      response.status = 1;
+      return response;
+    }
+    limit = atoi(token_vector[token_count - 1]);
+  }
 
+  if ((response.scan = malloc(sizeof(struct key_scan))) == NULL) {
+    perror(NULL);
+    cleanup_and_exit(0);
+  }
+  if (scan_init(response.scan, token_vector[1], end, limit) == -1) {
+    free(response.scan);
+    response.scan = NULL;
+    sprintf(response.msg, "Key too long.");
+    response.status = 1;
+  }
   return response;
 }
 
-struct response_struct keys_command(char* token_vector[], int token_count) {
+// snapshot [base_id] takes a snapshot of the whole database, or of what
+// changed since the snapshot base_id. It's streamed by queue_snapshot().
+struct response_struct snapshot_command(char* token_vector[], int token_count) {
 
-  char key[KEY_LEN] = "";
-  struct block_ptr ptr = {.block_offset = 0, .blocks = 0};
-  struct response_struct response;
-  response.status = 0;
+  struct response_struct response = new_response();
 
-  response.msg = malloc(sizeof(char) * MSG_SIZE);
+  if (token_count > 2) {
+    sprintf(response.msg, "Too many arguments.");
+    response.status = 1;
+    return response;
+  }
 
-  if (token_count == 1) {
-    sprintf(response.msg, "Arguments missing.");
+  if (token_count == 2 && (strspn(token_vector[1], "0123456789") != strlen(token_vector[1]) ||
+      strlen(token_vector[1]) > 18 || (response.base_id = atoll(token_vector[1])) == 0)) {
+    sprintf(response.msg, "Bad snapshot id.");
     response.status = 1;
     return response;
   }
 
-  strcat(key, token_vector[1]);
-	// ptr = btree_find(key)
-	// response.msg = read_obj(ptr);
-  sprintf(response.msg, "Not working yet. block_offset is %lld.", ptr.block_offset);
-  response.status = 1;
+  response.snapshot = 1;
+  return response;
+}
+
+// stats [prometheus] answers with a summary of how long commands,
+// allocations and disk I/O take, or with every counter we keep as
+// Prometheus text. See stats.c.
+struct response_struct stats_command(char* token_vector[], int token_count) {
+
+  struct response_struct response = new_response();
+  char* text;
+  int format = STATS_SUMMARY, len;
+
+  if (token_count > 2) {
+    sprintf(response.msg, "Too many arguments.");
+    response.status = 1;
+    return response;
+  }
+
+  if (token_count == 2) {
+    if (strcmp(token_vector[1], "prometheus") != 0) {
+      sprintf(response.msg, "Unknown stats format.");
+      response.status = 1;
+      return response;
+    }
+    format = STATS_PROMETHEUS;
+  }
+
+  if ((len = stats_dump(format, &text)) == -1) {
+    sprintf(response.msg, "Couldn't gather the stats.");
+    response.status = 1;
+    return response;
+  }
 
+  free(response.msg);
+  response.msg = text;
+  response.msg_len = len;
   return response;
 }
@@ -0,0 +1,403 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Slabs for small values.
+
+  A value whose header and bytes fit in SLAB_MAX shares a block with
+  others of its size. Each slab page starts with a struct
+  slab_page_header saying which size class it holds and which of its
+  slots are in use, and the slots follow. A slot holds a value just as a
+  run of blocks does: a struct value_header recording the exact length,
+  then the bytes. The block_ptr of a slab value names its page and sets
+  offset and size to where its slot starts and how big it is.
+
+  The allocator only ever sees whole slab pages. A page is taken when no
+  page of the right class has a free slot, and handed back (through
+  delete_obj(), so -e applies) when its last slot is freed.
+
+  Pages with free slots are remembered per class in shared memory. That
+  list starts out empty after a restart, so older pages are only filled
+  again once one of their values is deleted. Pages the compactor is
+  emptying (see compact.c) are dropped from it.
+
+  Pages are changed under SLAB_LOCK. Only the header and the slots that
+  were filled are logged and written back, and every page a batch
+  touched is written in one go. A freed slot keeps its old bytes, as a
+  freed block does. While a snapshot is pinned (see snapshot.c), pages
+  that have slots freed are dropped from the list, so those slots
+  aren't filled again under it.
+
+  Readers don't take the lock. A value dropped from the index has its
+  slot freed through btree_retire_values(), only once no reader that
+  could have found it is still reading, so a slot isn't filled again
+  while a reader is on its old value.
+*/
+
+static const int SLAB_SIZES[SLAB_CLASSES] = {64, 96, 120, 192, 248, 336, 408, 504, 680, 816, 1016, 1360, 2040};
+
+struct slab_touch { // A page changed by the current batch.
+  int64_t   block;
+  char*     page;
+  int       class;
+  int       fresh;   // Never written, so all of it goes out.
+  uint64_t  dirty;   // Slots written to.
+};
+
+
+// Returns the class that fits a stored object of bytes bytes, or -1 if
+// it's too big for a slab.
+static int class_of(int64_t bytes) {
+  int c;
+
+  for (c = 0; c < SLAB_CLASSES; c++)
+    if (bytes <= SLAB_SIZES[c]) return c;
+  return -1;
+}
+
+static int slots_of(int class) {
+  return (BLOCK_SIZE - SLAB_HEADER_SIZE) / SLAB_SIZES[class];
+}
+
+static void forget_partial(int class, int64_t block) {
+  struct slab_class* sc = &SHM_SLABS->classes[class];
+  int i;
+
+  for (i = 0; i < sc->partial_count; i++) {
+    if (sc->partial[i] != block) continue;
+    sc->partial[i] = sc->partial[--sc->partial_count];
+    return;
+  }
+}
+
+static void remember_partial(int class, int64_t block) {
+  struct slab_class* sc = &SHM_SLABS->classes[class];
+  int i;
+
+  for (i = 0; i < sc->partial_count; i++)
+    if (sc->partial[i] == block) return;
+  if (sc->partial_count < SLAB_PARTIALS) sc->partial[sc->partial_count++] = block;
+}
+
+// Whether the compactor is emptying the part of the file block is in.
+static int above_ceiling(int64_t block) {
+  int ceiling = __atomic_load_n(&SHM_EXTENTS->ceiling, __ATOMIC_RELAXED);
+
+  return ceiling > 0 && block >= ceiling;
+}
+
+// Finds block among the pages this batch has touched, reading it in if
+// it isn't there yet. Returns NULL if it isn't a slab page.
+static struct slab_touch* touch_page(struct slab_touch* touched, int* count, int64_t block) {
+  struct block_ptr page_ptr = {.block_offset = block, .blocks = 1};
+  struct slab_page_header header;
+  char* page;
+  int i;
+
+  for (i = 0; i < *count; i++)
+    if (touched[i].block == block) return &touched[i];
+
+  if ((page = read_obj(page_ptr)) == NULL) return NULL;
+  memcpy(&header, page, sizeof(header));
+  if (header.magic != SLAB_MAGIC || class_of(header.size) == -1 || SLAB_SIZES[class_of(header.size)] != header.size) {
+    fprintf(stderr, "Block %lld isn't a slab page.\n", (long long)block);
+    free(page);
+    return NULL;
+  }
+  touched[*count].block = block;
+  touched[*count].page = page;
+  touched[*count].class = class_of(header.size);
+  touched[*count].fresh = 0;
+  touched[*count].dirty = 0;
+  return &touched[(*count)++];
+}
+
+// Takes a fresh page for class.
+static struct slab_touch* new_page(struct slab_touch* touched, int* count, int class) {
+  struct slab_page_header header;
+  void* page;
+  int block;
+
+  if ((block = create_block_reservation(1)) == -1) {
+    fprintf(stderr, "Failed to reserve space for a slab page.\n");
+    return NULL;
+  }
+  if (posix_memalign(&page, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+    perror("posix_memalign failed in new_page()");
+    release_block_reservation(block, 1);
+    return NULL;
+  }
+  memset(page, '\0', BLOCK_SIZE);
+  memset(&header, '\0', sizeof(header));
+  header.magic = SLAB_MAGIC;
+  header.size = SLAB_SIZES[class];
+  memcpy(page, &header, sizeof(header));
+  SHM_SLABS->classes[class].pages++;
+
+  touched[*count].block = block;
+  touched[*count].page = page;
+  touched[*count].class = class;
+  touched[*count].fresh = 1;
+  touched[*count].dirty = 0;
+  return &touched[(*count)++];
+}
+
+// Queues a write of len bytes at offset into block's page, logging it.
+static int add_write(struct storage_io* ios, struct iovec* iov, int* n, struct slab_touch* t, int offset, int len) {
+  int64_t byte_offset = t->block * BLOCK_SIZE + offset;
+
+  if (wal_append(WAL_WRITE, byte_offset, 0, t->page + offset, len) == -1) return -1;
+  iov[*n].iov_base = t->page + offset;
+  iov[*n].iov_len = len;
+  ios[*n].write = 1;
+  ios[*n].offset = byte_offset;
+  ios[*n].iov = &iov[*n];
+  ios[*n].iovcnt = 1;
+  (*n)++;
+  return 0;
+}
+
+// Logs and writes back what a batch changed in each page it touched:
+// the header and the slots it filled, or the whole page if it's new.
+// Pages it emptied are handed back instead. Slots freed while a
+// snapshot is pinned may still be in it, so their pages aren't filled
+// again until it's done.
+static int write_touched(struct slab_touch* touched, int count, int freed) {
+  struct storage_io* ios;
+  struct iovec* iov;
+  struct slab_page_header header;
+  struct block_ptr page_ptr = {.blocks = 1, .offset = 0, .size = 0};
+  int i, slot, writes = 0, n = 0, rc = 0;
+
+  wal_write_begin();
+  for (i = 0; i < count; i++) writes += 1 + __builtin_popcountll(touched[i].dirty);
+  ios = malloc(sizeof(struct storage_io) * writes);
+  iov = malloc(sizeof(struct iovec) * writes);
+  if (ios == NULL || iov == NULL) {
+    perror("malloc failed in write_touched()");
+    rc = -1;
+  }
+
+  for (i = 0; rc == 0 && i < count; i++) {
+    memcpy(&header, touched[i].page, sizeof(header));
+    page_ptr.block_offset = touched[i].block;
+
+    if (header.used == 0) {
+      forget_partial(touched[i].class, touched[i].block);
+      SHM_SLABS->classes[touched[i].class].pages--;
+      if (delete_obj(page_ptr) == -1) rc = -1;
+      continue;
+    }
+    if (header.used < slots_of(touched[i].class) && !(freed && snapshot_pinned())) remember_partial(touched[i].class, touched[i].block);
+    else forget_partial(touched[i].class, touched[i].block);
+
+    if (touched[i].fresh) {
+      if (add_write(ios, iov, &n, &touched[i], 0, BLOCK_SIZE) == -1) rc = -1;
+      continue;
+    }
+    if (add_write(ios, iov, &n, &touched[i], 0, SLAB_HEADER_SIZE) == -1) rc = -1;
+    for (slot = 0; rc == 0 && slot < slots_of(touched[i].class); slot++)
+      if ((touched[i].dirty & (1ULL << slot)) &&
+          add_write(ios, iov, &n, &touched[i], SLAB_HEADER_SIZE + slot * header.size, header.size) == -1) rc = -1;
+  }
+  if (rc == 0 && n > 0 && storage_submit(ios, n) == -1) {
+    perror("Write failed in write_touched");
+    rc = -1;
+  }
+  wal_write_done();
+
+  for (i = 0; i < count; i++) {
+    page_ptr.block_offset = touched[i].block;
+    memcpy(&header, touched[i].page, sizeof(header));
+    if (rc == 0 && header.used > 0) cache_write(page_ptr, touched[i].page);
+    free(touched[i].page);
+  }
+  free(ios);
+  free(iov);
+  return rc;
+}
+
+
+int slab_init(void) {
+  int c;
+
+  if ((SHM_SLABS = mmap((caddr_t)0, sizeof(struct slab_state), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the slab state");
+    SHM_SLABS = NULL;
+    return -1;
+  }
+  memset(SHM_SLABS, '\0', sizeof(struct slab_state));
+  for (c = 0; c < SLAB_CLASSES; c++) SHM_SLABS->classes[c].size = SLAB_SIZES[c];
+
+  sem_unlink("slab_lock");
+  if ((SLAB_LOCK = sem_open("slab_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    return -1;
+  }
+  return 0;
+}
+
+// Whether a value of len bytes goes in a slab.
+int slab_fits(uint32_t len) {
+  return SHM_SLABS != NULL && VALUE_HEADER_SIZE + len <= SLAB_MAX;
+}
+
+// Stores buffers made by new_value_buffer() for values that pass
+// slab_fits(), filling in ptrs. A batch fills the same pages where it
+// can and writes each of them once.
+int slab_store(char **buffers, struct block_ptr *ptrs, int count) {
+  struct slab_touch* touched;
+  struct slab_touch* t;
+  struct slab_page_header header;
+  int64_t bytes;
+  int i, j, class, slot, touched_count = 0, rc = 0;
+
+  if ((touched = malloc(sizeof(struct slab_touch) * (count > 0 ? count : 1))) == NULL) {
+    perror("malloc failed in slab_store()");
+    return -1;
+  }
+
+  sem_wait(SLAB_LOCK);
+  for (i = 0; i < count; i++) {
+    bytes = VALUE_HEADER_SIZE + ((struct value_header*)buffers[i])->length;
+    class = class_of(bytes);
+
+    // A page this batch already has open, then one we know has room,
+    // then a new one.
+    for (t = NULL, j = 0; t == NULL && j < touched_count; j++) {
+      memcpy(&header, touched[j].page, sizeof(header));
+      if (touched[j].class == class && header.used < slots_of(class)) t = &touched[j];
+    }
+    while (t == NULL && SHM_SLABS->classes[class].partial_count > 0) {
+      if (above_ceiling(SHM_SLABS->classes[class].partial[0])) { // Being compacted away.
+        forget_partial(class, SHM_SLABS->classes[class].partial[0]);
+        continue;
+      }
+      t = touch_page(touched, &touched_count, SHM_SLABS->classes[class].partial[0]);
+      if (t != NULL) memcpy(&header, t->page, sizeof(header));
+      if (t == NULL || t->class != class || header.used >= slots_of(class)) {
+        forget_partial(class, SHM_SLABS->classes[class].partial[0]);
+        t = NULL;
+      }
+    }
+    if (t == NULL && (t = new_page(touched, &touched_count, class)) == NULL) {
+      rc = -1;
+      break;
+    }
+
+    memcpy(&header, t->page, sizeof(header));
+    for (slot = 0; header.map & (1ULL << slot); slot++);
+    header.map |= 1ULL << slot;
+    header.used++;
+    memcpy(t->page, &header, sizeof(header));
+    t->dirty |= 1ULL << slot;
+
+    ptrs[i].block_offset = t->block;
+    ptrs[i].blocks = 1;
+    ptrs[i].offset = SLAB_HEADER_SIZE + slot * SLAB_SIZES[class];
+    ptrs[i].size = SLAB_SIZES[class];
+    memcpy(t->page + ptrs[i].offset, buffers[i], bytes);
+    memset(t->page + ptrs[i].offset + bytes, '\0', SLAB_SIZES[class] - bytes);
+    SHM_SLABS->classes[class].objects++;
+    SHM_SLABS->classes[class].bytes += bytes;
+  }
+  // Give back whatever slots we took if we couldn't take them all.
+  for (j = 0; rc == -1 && j < i; j++) {
+    t = touch_page(touched, &touched_count, ptrs[j].block_offset);
+    memcpy(&header, t->page, sizeof(header));
+    slot = (ptrs[j].offset - SLAB_HEADER_SIZE) / ptrs[j].size;
+    header.map &= ~(1ULL << slot);
+    t->dirty &= ~(1ULL << slot);
+    header.used--;
+    memcpy(t->page, &header, sizeof(header));
+    SHM_SLABS->classes[t->class].objects--;
+    SHM_SLABS->classes[t->class].bytes -= VALUE_HEADER_SIZE + ((struct value_header*)buffers[j])->length;
+  }
+  if (write_touched(touched, touched_count, 0) == -1) rc = -1;
+  sem_post(SLAB_LOCK);
+
+  free(touched);
+  return rc;
+}
+
+// Frees the slots of slab values. Pages left empty go back to the
+// allocator.
+int slab_free(const struct block_ptr *ptrs, int count) {
+  struct slab_touch* touched;
+  struct slab_touch* t;
+  struct slab_page_header header;
+  struct value_header value;
+  int i, slot, touched_count = 0, rc = 0;
+
+  if ((touched = malloc(sizeof(struct slab_touch) * (count > 0 ? count : 1))) == NULL) {
+    perror("malloc failed in slab_free()");
+    return -1;
+  }
+
+  sem_wait(SLAB_LOCK);
+  for (i = 0; i < count; i++) {
+    if ((t = touch_page(touched, &touched_count, ptrs[i].block_offset)) == NULL) {
+      rc = -1;
+      continue;
+    }
+    memcpy(&header, t->page, sizeof(header));
+    slot = (ptrs[i].offset - SLAB_HEADER_SIZE) / SLAB_SIZES[t->class];
+    if (ptrs[i].size != header.size || slot < 0 || slot >= slots_of(t->class) || !(header.map & (1ULL << slot))) {
+      fprintf(stderr, "No slab value at block %lld offset %d.\n", (long long)ptrs[i].block_offset, ptrs[i].offset);
+      rc = -1;
+      continue;
+    }
+    header.map &= ~(1ULL << slot);
+    header.used--;
+    memcpy(t->page, &header, sizeof(header));
+    memcpy(&value, t->page + ptrs[i].offset, sizeof(value));
+    SHM_SLABS->classes[t->class].objects--;
+    SHM_SLABS->classes[t->class].bytes -= VALUE_HEADER_SIZE + value.length;
+  }
+  if (write_touched(touched, touched_count, 1) == -1) rc = -1;
+  sem_post(SLAB_LOCK);
+
+  free(touched);
+  return rc;
+}
+
+// Space used by the values stored in slabs since we started, against
+// the whole blocks they'd have taken up on their own.
+void slab_report(void) {
+  int64_t objects = 0, bytes = 0, pages = 0, blocks = 0;
+  int c;
+
+  if (SHM_SLABS == NULL) return;
+  for (c = 0; c < SLAB_CLASSES; c++) {
+    objects += SHM_SLABS->classes[c].objects;
+    bytes += SHM_SLABS->classes[c].bytes;
+    pages += SHM_SLABS->classes[c].pages;
+    blocks += SHM_SLABS->classes[c].objects; // A block each, unpacked.
+  }
+  fprintf(stderr, "Slabs: %lld values, %lld bytes in %lld pages (%.2fx), %.2fx as whole blocks.\n",
+          (long long)objects, (long long)bytes, (long long)pages,
+          bytes > 0 ? (double)pages * BLOCK_SIZE / bytes : 0.0,
+          bytes > 0 ? (double)blocks * BLOCK_SIZE / bytes : 0.0);
+}
@@ -0,0 +1,653 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Online snapshots, for backups.
+
+  A snapshot is the database as it stood at one moment, taken while
+  writers carry on. The snapshot command pins the version of the index
+  that is current when it starts (see btree.c), walks it, and sends
+  every block that version uses: the meta block, the index pages, and
+  the blocks and slab pages of the values. Nothing else in the db file
+  goes in, so a snapshot is as big as the data however holey the file
+  is.
+
+  Nothing that version uses changes while it's walked. Index pages and
+  values are never written over, only freed, and while a snapshot is
+  pinned frees are held back: the blocks stay set in the bitmap and go
+  on a list in SHM_SNAPSHOT, logged as free so a crash still frees
+  them, and are given back once it's done. Until then the log isn't
+  checkpointed. Deleted values wait there to be punched or zeroed too,
+  slab pages with slots freed aren't filled again (see slab.c), and
+  compaction doesn't start a pass. A slab page can still have its other
+  slots filled, so the snapshot gives each one a header of its own that
+  marks just the slots that version uses. If more than
+  SNAPSHOT_DEFERRED frees come along, the rest go ahead and the
+  snapshot fails.
+
+  A snapshot file is a struct snapshot_header, then a struct
+  snapshot_extent for each run of blocks in use, followed by their bytes
+  if it has SNAPSHOT_DATA set, and then one with block -1.
+
+  An incremental snapshot names the one before it and only carries the
+  bytes of blocks that changed since. Two maps in shared memory, a bit
+  per block, keep track. The last snapshot's map has a bit set for each
+  block it holds, and every write to the db file (see storage.c) clears
+  the bits of the blocks it touches, so a block still set holds just
+  what the last snapshot has for it, and is only listed. The other map
+  is filled in as the next snapshot is taken, and takes over once it's
+  done. Slab pages and the meta block always go with their bytes. The
+  maps start out empty, so the first snapshot after a restart has to be
+  a full one.
+
+  emma -b file[:base_id] takes a snapshot from a running server into a
+  file. emma -u file restores one into DATA_HOME and exits: a full one
+  into an empty database, an incremental one over the one it builds on.
+  The id of the snapshot restored is kept in DATA_HOME/restored, which
+  the server removes when it starts, as from then on the database has
+  changes of its own.
+*/
+
+struct slab_ref { // A slab page and the slots the snapshot uses.
+  int64_t   block;           // -1 if the entry is free.
+  uint64_t  map;
+};
+
+struct snapshot_run { // A snapshot being taken.
+  int       (*sink)(void *arg, const char *data, int len);
+  void*     arg;
+  unsigned char* base;       // Blocks the one it builds on holds as they are now, or NULL.
+  unsigned char* kept;       // Blocks this one holds.
+  struct slab_ref* slabs;    // Open addressed on block.
+  int64_t   slab_count;
+  int64_t   slab_size;
+  char*     buf;             // SNAPSHOT_CHUNK bytes.
+  int64_t   blocks;
+  int64_t   data_blocks;
+};
+
+static unsigned char* KEPT[2]; // A bit per block of the db file. See above.
+
+
+static int64_t now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Only blocks the bitmap file covers can have been kept.
+static void clear_map(unsigned char* map) {
+  int64_t bytes = bitmap_bytes();
+
+  if (madvise(map, bytes, MADV_REMOVE) == -1) memset(map, '\0', bytes);
+}
+
+static int all_kept(const unsigned char* map, int64_t block, int64_t blocks) {
+  int64_t b;
+
+  for (b = block; b < block + blocks; b++)
+    if (!(__atomic_load_n(&map[b / 8], __ATOMIC_RELAXED) & (1 << (b % 8)))) return 0;
+  return 1;
+}
+
+
+int snapshot_init(void) {
+  char restored[4096 + 16];
+  int i;
+
+  if ((SHM_SNAPSHOT = mmap((caddr_t)0, sizeof(struct snapshot_state), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the snapshot state");
+    SHM_SNAPSHOT = NULL;
+    return -1;
+  }
+  SHM_SNAPSHOT->base = -1;
+
+  // Only pages a snapshot has touched take up memory.
+  for (i = 0; i < 2; i++) {
+    if ((KEPT[i] = mmap((caddr_t)0, BLOCK_BITMAP_BYTES, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANON | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+      perror("Problem mmapping a snapshot map");
+      return -1;
+    }
+  }
+
+  sem_unlink("snapshot_lock");
+  if ((SNAPSHOT_LOCK = sem_open("snapshot_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    return -1;
+  }
+
+  // What was restored here is about to change.
+  sprintf(restored, "%s/restored", DATA_HOME);
+  if (unlink(restored) == -1 && errno != ENOENT) perror("Couldn't remove the restored file");
+  return 0;
+}
+
+// Whether frees are being held back for a snapshot.
+int snapshot_pinned(void) {
+  return SHM_SNAPSHOT != NULL && __atomic_load_n(&SHM_SNAPSHOT->pid, __ATOMIC_SEQ_CST) > 0;
+}
+
+// Holds back a free while a snapshot is pinned. If pending is NULL the
+// blocks aren't logged as free yet, so they are now, and reclaim says
+// they are a deleted value for -e to punch or zero. Returns 1 if it
+// held them back, 0 if they should be freed now.
+int snapshot_defer(int block_offset, int blocks, int *pending, int reclaim) {
+  struct snapshot_state* s = SHM_SNAPSHOT;
+  struct deferred_free* d;
+
+  if (!snapshot_pinned()) return 0;
+
+  sem_wait(SNAPSHOT_LOCK);
+  if (s->pid <= 0 || s->deferred_count == SNAPSHOT_DEFERRED) {
+    if (s->pid > 0) s->overflowed = 1;
+    sem_post(SNAPSHOT_LOCK);
+    return 0;
+  }
+
+  // Count it before it's logged, so no checkpoint can drop the record.
+  __atomic_add_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+  if (pending == NULL) wal_append(WAL_FREE, block_offset, blocks, NULL, 0);
+  else __atomic_sub_fetch(pending, 1, __ATOMIC_SEQ_CST);
+
+  d = &s->deferred[s->deferred_count++];
+  d->block_offset = block_offset;
+  d->blocks = blocks;
+  d->reclaim = reclaim;
+  s->deferred_total++;
+  sem_post(SNAPSHOT_LOCK);
+  return 1;
+}
+
+// Notes a write of len bytes at offset in the db file, so the last
+// snapshot no longer holds those blocks as they are.
+void snapshot_touch(int64_t offset, int64_t len) {
+  int64_t b, end;
+  int base;
+
+  if (SHM_SNAPSHOT == NULL || len <= 0 || (base = __atomic_load_n(&SHM_SNAPSHOT->base, __ATOMIC_ACQUIRE)) == -1) return;
+  for (b = offset / BLOCK_SIZE, end = (offset + len - 1) / BLOCK_SIZE; b <= end; b++)
+    if (__atomic_load_n(&KEPT[base][b / 8], __ATOMIC_RELAXED) & (1 << (b % 8)))
+      __atomic_fetch_and(&KEPT[base][b / 8], (unsigned char)~(1 << (b % 8)), __ATOMIC_RELAXED);
+}
+
+// Gives back everything held back for a snapshot, once it's done or its
+// process has gone. The caller has set pid to minus its own, so nothing
+// more is held back and no other snapshot starts meanwhile. Each entry
+// is counted off before it's given back, so one taken over part way is
+// leaked rather than freed twice.
+static void release_deferred(void) {
+  struct snapshot_state* s = SHM_SNAPSHOT;
+  struct deferred_free d;
+  struct block_ptr obj = {.offset = 0, .size = 0};
+
+  while (s->released < s->deferred_count) {
+    d = s->deferred[s->released++];
+    if (d.reclaim && SHM_RECLAIM != NULL) {
+      obj.block_offset = d.block_offset;
+      obj.blocks = d.blocks;
+      reclaim_later(obj);
+      __atomic_sub_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+    } else {
+      release_deferred_blocks(d.block_offset, d.blocks);
+    }
+  }
+
+  sem_wait(SNAPSHOT_LOCK);
+  s->deferred_count = 0;
+  s->released = 0;
+  s->overflowed = 0;
+  __atomic_store_n(&s->pid, 0, __ATOMIC_SEQ_CST);
+  sem_post(SNAPSHOT_LOCK);
+}
+
+// Pins the version of the index current now and copies its meta block.
+// Returns -1 if another snapshot is being taken.
+static int pin(struct btree_meta *meta, char *error) {
+  struct snapshot_state* s = SHM_SNAPSHOT;
+  int owner, rc;
+
+  while (1) {
+    sem_wait(INDEX_LOCK);
+    sem_wait(SNAPSHOT_LOCK);
+    owner = s->pid;
+    if (owner == 0) {
+      if ((rc = btree_root(meta)) == 0) __atomic_store_n(&s->pid, getpid(), __ATOMIC_SEQ_CST);
+      else sprintf(error, "Couldn't read the index.");
+      sem_post(SNAPSHOT_LOCK);
+      sem_post(INDEX_LOCK);
+      return rc;
+    }
+    if (kill(owner > 0 ? owner : -owner, 0) == 0 || errno != ESRCH) {
+      sem_post(SNAPSHOT_LOCK);
+      sem_post(INDEX_LOCK);
+      sprintf(error, "A snapshot is already being taken.");
+      return -1;
+    }
+
+    // Its process has gone. Let go of what it held back, and try again.
+    __atomic_store_n(&s->pid, -getpid(), __ATOMIC_SEQ_CST);
+    sem_post(SNAPSHOT_LOCK);
+    sem_post(INDEX_LOCK);
+    release_deferred();
+  }
+}
+
+
+// Sends blocks of the db file as they are.
+static int send_blocks(struct snapshot_run* run, int64_t block, int64_t blocks) {
+  int64_t offset = block * BLOCK_SIZE, end = (block + blocks) * BLOCK_SIZE, n;
+
+  for (; offset < end; offset += n) {
+    n = (end - offset < SNAPSHOT_CHUNK) ? end - offset : SNAPSHOT_CHUNK;
+    if (DB_MAP != NULL) {
+      if (run->sink(run->arg, DB_MAP + offset, n) == -1) return -1;
+      continue;
+    }
+    if (storage_read(run->buf, n, offset) != n) {
+      perror("pread failed in send_blocks");
+      return -1;
+    }
+    if (run->sink(run->arg, run->buf, n) == -1) return -1;
+  }
+  return 0;
+}
+
+// Sends an extent of blocks, with their bytes unless the snapshot this
+// one builds on holds them as they are. bytes, if set, is what to send
+// for them instead of what's in the db file.
+static int send_extent(struct snapshot_run* run, int64_t block, int blocks, const char *bytes) {
+  struct snapshot_extent e;
+  int64_t b;
+  int data = (bytes != NULL || run->base == NULL || !all_kept(run->base, block, blocks));
+
+  e.block = htole64(block);
+  e.blocks = htole32(blocks);
+  e.flags = htole32(data ? SNAPSHOT_DATA : 0);
+  if (run->sink(run->arg, (const char*)&e, sizeof(e)) == -1) return -1;
+
+  for (b = block; b < block + blocks; b++) run->kept[b / 8] |= 1 << (b % 8);
+  run->blocks += blocks;
+  if (!data) return 0;
+
+  run->data_blocks += blocks;
+  if (bytes != NULL) return run->sink(run->arg, bytes, blocks * BLOCK_SIZE);
+  return send_blocks(run, block, blocks);
+}
+
+// Finds a slab page's entry, making one if it has none yet.
+static struct slab_ref* slab_ref(struct snapshot_run* run, int64_t block) {
+  struct slab_ref* old = run->slabs;
+  int64_t i, old_size = run->slab_size;
+
+  if (run->slab_count * 2 >= run->slab_size) {
+    run->slab_size = old_size ? old_size * 2 : 1024;
+    if ((run->slabs = malloc(sizeof(struct slab_ref) * run->slab_size)) == NULL) {
+      perror("malloc failed in slab_ref()");
+      run->slabs = old;
+      run->slab_size = old_size;
+      return NULL;
+    }
+    for (i = 0; i < run->slab_size; i++) run->slabs[i].block = -1;
+    run->slab_count = 0;
+    for (i = 0; i < old_size; i++) {
+      if (old[i].block == -1) continue;
+      *slab_ref(run, old[i].block) = old[i];
+    }
+    free(old);
+  }
+
+  for (i = (block * 0x9E3779B97F4A7C15ULL) % run->slab_size; run->slabs[i].block != -1; i = (i + 1) % run->slab_size)
+    if (run->slabs[i].block == block) return &run->slabs[i];
+  run->slabs[i].block = block;
+  run->slabs[i].map = 0;
+  run->slab_count++;
+  return &run->slabs[i];
+}
+
+static int visit(struct block_ptr ptr, int page, void *arg) {
+  struct snapshot_run* run = arg;
+  struct slab_ref* ref;
+  int slot;
+
+  if (ptr.blocks < 1) return 0;
+  if (page || ptr.size == 0) return send_extent(run, ptr.block_offset, ptr.blocks, NULL);
+
+  // Slab pages go once the walk is done, when we know every slot used.
+  slot = (ptr.offset - SLAB_HEADER_SIZE) / ptr.size;
+  if (slot < 0 || slot >= 64) {
+    fprintf(stderr, "Bad slab value at block %lld offset %d.\n", (long long)ptr.block_offset, ptr.offset);
+    return -1;
+  }
+  if ((ref = slab_ref(run, ptr.block_offset)) == NULL) return -1;
+  ref->map |= 1ULL << slot;
+  return 0;
+}
+
+static int cmp_slab_ref(const void *a, const void *b) {
+  int64_t x = ((const struct slab_ref*)a)->block, y = ((const struct slab_ref*)b)->block;
+  return (x > y) - (x < y);
+}
+
+// Sends the slab pages, in order, each with a header marking the slots
+// the snapshot uses.
+static int send_slabs(struct snapshot_run* run) {
+  struct slab_page_header header;
+  int64_t i, n = 0;
+
+  for (i = 0; i < run->slab_size; i++)
+    if (run->slabs[i].block != -1) run->slabs[n++] = run->slabs[i];
+  qsort(run->slabs, n, sizeof(struct slab_ref), cmp_slab_ref);
+
+  for (i = 0; i < n; i++) {
+    if (storage_read(run->buf, BLOCK_SIZE, run->slabs[i].block * BLOCK_SIZE) != BLOCK_SIZE) {
+      perror("pread failed in send_slabs");
+      return -1;
+    }
+    memcpy(&header, run->buf, sizeof(header));
+    if (header.magic != SLAB_MAGIC) {
+      fprintf(stderr, "Block %lld isn't a slab page.\n", (long long)run->slabs[i].block);
+      return -1;
+    }
+    header.map = run->slabs[i].map;
+    header.used = __builtin_popcountll(header.map);
+    memcpy(run->buf, &header, sizeof(header));
+    if (send_extent(run, run->slabs[i].block, 1, run->buf) == -1) return -1;
+  }
+  return 0;
+}
+
+// Takes a snapshot, handing it to sink a piece at a time: of everything
+// if base_id is 0, else of what's changed since the snapshot base_id,
+// which has to be the last one taken. Sets id to the new snapshot's.
+// Returns 0, or -1 with a reason in error, which has room for MSG_SIZE
+// bytes. If sink fails, it's given up.
+int snapshot_stream(int64_t base_id, int (*sink)(void *arg, const char *data, int len), void *arg, int64_t *id, char *error) {
+  struct snapshot_state* s = SHM_SNAPSHOT;
+  struct snapshot_run run = {.sink = sink, .arg = arg};
+  struct snapshot_header header;
+  struct snapshot_extent end;
+  struct btree_meta meta;
+  struct stat st;
+  int build, rc = 0;
+
+  error[0] = '\0';
+  if (s == NULL) {
+    sprintf(error, "Snapshots aren't set up.");
+    return -1;
+  }
+  if ((run.buf = malloc(SNAPSHOT_CHUNK)) == NULL) {
+    perror("malloc failed in snapshot_stream()");
+    sprintf(error, "Out of memory.");
+    return -1;
+  }
+  if (pin(&meta, error) == -1) {
+    free(run.buf);
+    return -1;
+  }
+
+  // Only we change base and base_id, so they hold still from here.
+  if (base_id != 0 && (s->base == -1 || s->base_id != base_id)) {
+    sprintf(error, "Changes aren't tracked since snapshot %lld. Take a full one.", (long long)base_id);
+    rc = -1;
+  }
+  *id = now_msec();
+  if (*id <= s->base_id) *id = s->base_id + 1;
+  build = (s->base == 0) ? 1 : 0;
+  run.base = (rc == 0 && base_id != 0) ? KEPT[s->base] : NULL;
+  run.kept = KEPT[build];
+  clear_map(run.kept);
+
+  memset(&header, '\0', sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = htole32(SNAPSHOT_VERSION);
+  header.id = htole64(*id);
+  header.base_id = htole64(base_id);
+  header.file_blocks = htole64(fstat(DB_FD, &st) == 0 ? (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE : 0);
+  if (rc == 0 && sink(arg, (const char*)&header, sizeof(header)) == -1) rc = -1;
+
+  // The meta block as it was when we pinned the tree.
+  memset(run.buf, '\0', BLOCK_SIZE);
+  memcpy(run.buf, &meta, sizeof(meta));
+  if (rc == 0 && send_extent(&run, BTREE_META_BLOCK, 1, run.buf) == -1) rc = -1;
+
+  if (rc == 0 && btree_walk(meta.root.block_offset, visit, &run) == -1) rc = -1;
+  if (rc == 0 && run.slab_size > 0 && send_slabs(&run) == -1) rc = -1;
+
+  end.block = htole64(-1);
+  end.blocks = 0;
+  end.flags = 0;
+  if (rc == 0 && sink(arg, (const char*)&end, sizeof(end)) == -1) rc = -1;
+  if (rc == -1 && error[0] == '\0') sprintf(error, "Snapshot failed.");
+
+  sem_wait(SNAPSHOT_LOCK);
+  if (rc == 0 && s->overflowed) {
+    sprintf(error, "More than %d frees came along while it was taken. Try again when it's quieter.", SNAPSHOT_DEFERRED);
+    rc = -1;
+  }
+  if (rc == 0) {
+    // From now on writes clear bits in the map we just filled in.
+    __atomic_store_n(&s->base, build, __ATOMIC_SEQ_CST);
+    s->base_id = *id;
+    s->taken++;
+    s->incremental += (base_id != 0);
+    s->blocks += run.blocks;
+    s->data_blocks += run.data_blocks;
+  }
+  __atomic_store_n(&s->pid, -getpid(), __ATOMIC_SEQ_CST);
+  sem_post(SNAPSHOT_LOCK);
+  release_deferred();
+
+  free(run.slabs);
+  free(run.buf);
+  return rc;
+}
+
+
+// Takes a snapshot from the server at host and port, and writes it to
+// file, or to stdout if it's "-". Prints the new snapshot's id.
+int snapshot_fetch(char *host, char *port, const char *file, int64_t base_id) {
+  char request[64], status[MSG_SIZE], line[MSG_SIZE];
+  char* buf;
+  FILE *net, *out;
+  long long size;
+  int fd, len, rc = -1;
+
+  if ((buf = malloc(SNAPSHOT_CHUNK + 1)) == NULL) {
+    perror("malloc failed in snapshot_fetch()");
+    return -1;
+  }
+  if ((fd = connect_to(host, port)) == -1) {
+    free(buf);
+    return -1;
+  }
+  if ((net = fdopen(fd, "r")) == NULL || (out = (strcmp(file, "-") == 0) ? stdout : fopen(file, "w")) == NULL) {
+    perror("Couldn't open the backup file");
+    if (net != NULL) fclose(net);
+    else close(fd);
+    free(buf);
+    return -1;
+  }
+
+  len = base_id ? sprintf(request, "snapshot %lld\n", (long long)base_id) : sprintf(request, "snapshot\n");
+  if (send(fd, request, len, MSG_NOSIGNAL) != len) {
+    perror("Couldn't send the snapshot command");
+    len = 0;
+  }
+
+  // MORE responses carry the snapshot. The last one says how it went.
+  while (len > 0) {
+    if (fgets(status, sizeof(status), net) == NULL || fgets(line, sizeof(line), net) == NULL ||
+        sscanf(line, "SIZE: %lld", &size) != 1 || size < 0 || size > SNAPSHOT_CHUNK ||
+        fread(buf, 1, size, net) != (size_t)size || fread(line, 1, 2, net) != 2) {
+      fprintf(stderr, "Lost the server part way through the snapshot.\n");
+      break;
+    }
+    buf[size] = '\0';
+    if (strcmp(status, "STATUS: MORE\n") == 0) {
+      if (fwrite(buf, 1, size, out) != (size_t)size) {
+        perror("Couldn't write the backup file");
+        break;
+      }
+      continue;
+    }
+    if (strcmp(status, "STATUS: OK\n") == 0 && fflush(out) == 0) {
+      printf("%s\n", buf);
+      rc = 0;
+    } else {
+      fprintf(stderr, "%s\n", buf);
+    }
+    break;
+  }
+
+  fclose(net);
+  if (out != stdout && fclose(out) != 0) rc = -1;
+  if (rc == -1 && out != stdout) unlink(file);
+  free(buf);
+  return rc;
+}
+
+// Restores a snapshot file, or stdin if it's "-", into DATA_HOME. The
+// bitmap is made over from the blocks it lists, and the log is dropped.
+int snapshot_restore(const char *file) {
+  struct snapshot_header header;
+  struct snapshot_extent e;
+  struct stat st;
+  char restored[4096 + 16], wal_file[4096 + 16], tmp[4096 + 32];
+  char* buf;
+  FILE *in, *f;
+  long long last = 0;
+  int64_t block, blocks, offset, n, b, listed = 0, copied = 0;
+  int rc = -1;
+
+  if ((in = (strcmp(file, "-") == 0) ? stdin : fopen(file, "r")) == NULL) {
+    perror("Couldn't open the snapshot");
+    return -1;
+  }
+  if ((buf = malloc(SNAPSHOT_CHUNK)) == NULL) {
+    perror("malloc failed in snapshot_restore()");
+    goto done;
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      le32toh(header.version) != SNAPSHOT_VERSION) {
+    fprintf(stderr, "%s isn't a snapshot.\n", file);
+    goto done;
+  }
+  header.id = le64toh(header.id);
+  header.base_id = le64toh(header.base_id);
+  header.file_blocks = le64toh(header.file_blocks);
+
+  // A full one goes into an empty database, an incremental one on top of
+  // the one it builds on.
+  sprintf(restored, "%s/restored", DATA_HOME);
+  if (fstat(DB_FD, &st) == -1) {
+    perror("fstat failed in snapshot_restore");
+    goto done;
+  }
+  if (header.base_id == 0 && st.st_size != 0) {
+    fprintf(stderr, "A full snapshot only goes into an empty database.\n");
+    goto done;
+  }
+  if (header.base_id != 0 && ((f = fopen(restored, "r")) == NULL || fscanf(f, "%lld", &last) != 1 || fclose(f) != 0 ||
+      last != header.base_id)) {
+    fprintf(stderr, "Snapshot %lld builds on %lld, which was not the last one restored here.\n",
+            (long long)header.id, (long long)header.base_id);
+    goto done;
+  }
+
+  // Grow the bitmap to hold whichever file is bigger, then start over.
+  blocks = (header.file_blocks > st.st_size / BLOCK_SIZE) ? header.file_blocks : st.st_size / BLOCK_SIZE;
+  if (blocks > MAX_BLOCKS || bitmap_cover(blocks) == -1) {
+    fprintf(stderr, "The bitmap can't hold a database of %lld blocks.\n", (long long)blocks);
+    goto done;
+  }
+  memset(SHM_BLOCK_BITMAP, '\0', (blocks + 7) / 8);
+
+  while (1) {
+    if (fread(&e, sizeof(e), 1, in) != 1) {
+      fprintf(stderr, "The snapshot is cut short.\n");
+      goto done;
+    }
+    if ((block = (int64_t)le64toh(e.block)) == -1) break;
+    blocks = le32toh(e.blocks);
+    if (block < 0 || blocks < 1 || block + blocks > header.file_blocks || block + blocks > MAX_BLOCKS) {
+      fprintf(stderr, "Bad extent in the snapshot.\n");
+      goto done;
+    }
+    for (b = block; b < block + blocks; b++) bit_array_set(SHM_BLOCK_BITMAP, b);
+    listed += blocks;
+    if (!(le32toh(e.flags) & SNAPSHOT_DATA)) continue;
+
+    for (offset = block * BLOCK_SIZE; offset < (block + blocks) * BLOCK_SIZE; offset += n) {
+      n = ((block + blocks) * BLOCK_SIZE - offset < SNAPSHOT_CHUNK) ? (block + blocks) * BLOCK_SIZE - offset : SNAPSHOT_CHUNK;
+      if (fread(buf, 1, n, in) != (size_t)n) {
+        fprintf(stderr, "The snapshot is cut short.\n");
+        goto done;
+      }
+      if (storage_write(buf, n, offset) != n) {
+        perror("Write failed in snapshot_restore");
+        goto done;
+      }
+    }
+    copied += blocks;
+  }
+
+  if (ftruncate(DB_FD, header.file_blocks * BLOCK_SIZE) == -1 || fsync(DB_FD) == -1 ||
+      msync(SHM_BLOCK_BITMAP, bitmap_bytes(), MS_SYNC) == -1) {
+    perror("Couldn't sync the restored database");
+    goto done;
+  }
+
+  // Nothing in the log applies any more.
+  sprintf(wal_file, "%s/wal", DATA_HOME);
+  if (unlink(wal_file) == -1 && errno != ENOENT) {
+    perror("Couldn't remove the log");
+    goto done;
+  }
+
+  sprintf(tmp, "%s.tmp", restored);
+  if ((f = fopen(tmp, "w")) == NULL || fprintf(f, "%lld\n", (long long)header.id) < 0 || fclose(f) != 0 ||
+      rename(tmp, restored) == -1) {
+    perror("Couldn't write the restored file");
+    goto done;
+  }
+
+  fprintf(stderr, "Restored snapshot %lld: %lld blocks, %lld of them from the file.\n",
+          (long long)header.id, (long long)listed, (long long)copied);
+  rc = 0;
+
+done:
+  if (in != stdin) fclose(in);
+  free(buf);
+  return rc;
+}
+
+void snapshot_report(void) {
+  if (SHM_SNAPSHOT == NULL) return;
+  fprintf(stderr, "Snapshots: %lld taken (%lld incremental), %lld blocks in them (%lld sent with their bytes), %lld frees held back, %d still waiting.\n",
+          (long long)SHM_SNAPSHOT->taken, (long long)SHM_SNAPSHOT->incremental,
+          (long long)SHM_SNAPSHOT->blocks, (long long)SHM_SNAPSHOT->data_blocks,
+          (long long)SHM_SNAPSHOT->deferred_total, __atomic_load_n(&SHM_SNAPSHOT->pending, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,375 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+#include <stdarg.h>
+
+/*
+  Counters and latency histograms, kept in shared memory so every forked
+  connection and every worker thread adds to the same ones.
+
+  A histogram has STATS_BUCKETS buckets, HDR style: values under 8 get
+  a bucket each, and every power of two above that is split into 8, so
+  a bucket is never more than 12.5% wide and any int64 fits. Adding a
+  value is a few relaxed atomic adds, with no lock. Percentiles are read
+  off the buckets, so they're as good as a bucket is narrow.
+
+  What's timed:
+
+  - each command, from the time it is parsed to the time its answer is
+    queued. A streamed answer (keys, snapshot) counts until its last
+    chunk is queued. A binary insert or batch counts from the time the
+    whole of its value has arrived.
+  - each allocation in group_alloc(), with the time it spent waiting for
+    group locks, the groups it looked in, and the bitmap words it
+    scanned in groups without treaps.
+  - each read and write of the db file through storage.c, and the bytes
+    it moved. Values sent straight from DB_MAP aren't reads, and the
+    log has its own file, so neither counts.
+
+  The stats command answers with a summary of these, or with everything
+  here and the other modules' counters as Prometheus text (stats
+  prometheus). The summary is also written out at shutdown.
+*/
+
+#define STATS_SUB (1 << STATS_SUB_BITS)
+
+static const char* COMMAND_NAMES[STATS_COMMANDS] = {
+  "quit", "insert", "find", "delete", "keys", "mget", "mput", "mdelete", "snapshot", "stats"
+};
+
+struct dump { // Text being gathered for the stats command.
+  char*   buf;
+  int     len;
+  int     size;
+  int     failed;
+};
+
+
+static int bucket_of(int64_t value) {
+  int msb;
+
+  if (value < STATS_SUB) return value < 0 ? 0 : value;
+  msb = 63 - __builtin_clzll(value);
+  return (msb - STATS_SUB_BITS + 1) * STATS_SUB + ((value >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+// The biggest value that lands in bucket i.
+static int64_t bucket_top(int i) {
+  int shift;
+
+  if (i < STATS_SUB) return i;
+  shift = i / STATS_SUB - 1;
+  return ((int64_t)(STATS_SUB + i % STATS_SUB + 1) << shift) - 1;
+}
+
+static void add_value(struct stats_histogram* h, int64_t value) {
+  int64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&h->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// The value a share q of those in h are no bigger than.
+static int64_t percentile(const struct stats_histogram* h, double q) {
+  int64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED), seen = 0, want, top;
+  int i;
+
+  if (count == 0) return 0;
+  want = (int64_t)(q * count + 0.999999);
+  if (want < 1) want = 1;
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if ((seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED)) >= want) {
+      top = bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+
+int stats_init(void) {
+  if ((SHM_STATS = mmap((caddr_t)0, sizeof(struct stats_state), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the stats");
+    SHM_STATS = NULL;
+    return -1;
+  }
+  SHM_STATS->started = time(NULL);
+  return 0;
+}
+
+// Nanoseconds on a clock that only goes forward.
+int64_t stats_clock(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Notes a command, numbered as in extract_command(), that started at
+// start.
+void stats_record(int command, int64_t start) {
+  if (SHM_STATS == NULL || command < 1 || command >= STATS_COMMANDS) return;
+  add_value(&SHM_STATS->commands[command], stats_clock() - start);
+}
+
+// Notes an allocation that started at start, looked in probes groups,
+// found busy of them locked, waited wait ns for locks and scanned
+// scanned words of the bitmap.
+void stats_alloc(int64_t start, int probes, int busy, int64_t wait, int64_t scanned, int failed) {
+  if (SHM_STATS == NULL) return;
+  add_value(&SHM_STATS->alloc, stats_clock() - start);
+  add_value(&SHM_STATS->alloc_wait, wait);
+  add_value(&SHM_STATS->alloc_probes, probes);
+  if (busy > 0) __atomic_fetch_add(&SHM_STATS->alloc_busy, busy, __ATOMIC_RELAXED);
+  if (scanned > 0) __atomic_fetch_add(&SHM_STATS->bitmap_words, scanned, __ATOMIC_RELAXED);
+  if (failed) __atomic_fetch_add(&SHM_STATS->alloc_failures, 1, __ATOMIC_RELAXED);
+}
+
+// Notes a read or write of the db file that started at start.
+void stats_io(int write, int64_t bytes, int64_t start) {
+  if (SHM_STATS == NULL) return;
+  add_value(&SHM_STATS->io[write != 0], stats_clock() - start);
+  if (bytes > 0) __atomic_fetch_add(&SHM_STATS->io_bytes[write != 0], bytes, __ATOMIC_RELAXED);
+}
+
+
+static void appendf(struct dump* d, const char* fmt, ...) {
+  va_list args;
+  char* tmp;
+  int n;
+
+  while (!d->failed) {
+    va_start(args, fmt);
+    n = vsnprintf(d->buf + d->len, d->size - d->len, fmt, args);
+    va_end(args);
+    if (n < d->size - d->len) {
+      d->len += n;
+      return;
+    }
+    if ((tmp = realloc(d->buf, d->size * 2 + n)) == NULL) {
+      perror("realloc failed in appendf()");
+      d->failed = 1;
+      return;
+    }
+    d->buf = tmp;
+    d->size = d->size * 2 + n;
+  }
+}
+
+// Writes ns the way a person would read it.
+static char* show_ns(char* out, int64_t ns) {
+  if (ns < 1000) sprintf(out, "%lldns", (long long)ns);
+  else if (ns < 1000000) sprintf(out, "%.1fus", ns / 1e3);
+  else if (ns < 1000000000) sprintf(out, "%.2fms", ns / 1e6);
+  else sprintf(out, "%.2fs", ns / 1e9);
+  return out;
+}
+
+static void summarize(struct dump* d, const char* name, const struct stats_histogram* h) {
+  char p50[32], p99[32], p999[32], max[32];
+
+  appendf(d, "%s: %lld, p50 %s, p99 %s, p99.9 %s, max %s.\n", name, (long long)h->count,
+          show_ns(p50, percentile(h, 0.5)), show_ns(p99, percentile(h, 0.99)),
+          show_ns(p999, percentile(h, 0.999)), show_ns(max, h->max));
+}
+
+static void summary(struct dump* d) {
+  struct stats_state* s = SHM_STATS;
+  char name[64];
+  int i;
+
+  appendf(d, "Up %lld seconds.\n", (long long)(time(NULL) - s->started));
+  for (i = 1; i < STATS_COMMANDS; i++) {
+    if (s->commands[i].count == 0) continue;
+    sprintf(name, "Command %s", COMMAND_NAMES[i]);
+    summarize(d, name, &s->commands[i]);
+  }
+  if (s->alloc.count > 0) {
+    summarize(d, "Allocations", &s->alloc);
+    summarize(d, "Allocation lock waits", &s->alloc_wait);
+    appendf(d, "Allocations looked in %.2f groups each (most %lld), skipped %lld busy ones, scanned %lld bitmap words and failed %lld times.\n",
+            (double)s->alloc_probes.sum / s->alloc_probes.count, (long long)s->alloc_probes.max,
+            (long long)s->alloc_busy, (long long)s->bitmap_words, (long long)s->alloc_failures);
+  }
+  for (i = 0; i < 2; i++) {
+    if (s->io[i].count == 0) continue;
+    sprintf(name, "Disk %s of %.1f MB", i ? "writes" : "reads", s->io_bytes[i] / 1048576.0);
+    summarize(d, name, &s->io[i]);
+  }
+}
+
+
+// One family of Prometheus samples.
+static void family(struct dump* d, const char* name, const char* type, const char* help) {
+  appendf(d, "# HELP emma_%s %s\n# TYPE emma_%s %s\n", name, help, name, type);
+}
+
+static void sample(struct dump* d, const char* name, const char* labels, double value) {
+  appendf(d, "emma_%s%s%s%s %.17g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", value);
+}
+
+static void metric(struct dump* d, const char* name, const char* type, const char* help, double value) {
+  family(d, name, type, help);
+  sample(d, name, "", value);
+}
+
+// A histogram's buckets, leaving out those nothing landed in. scale
+// turns its values into the unit it's reported in.
+static void histogram(struct dump* d, const char* name, const char* labels, const struct stats_histogram* h, double scale) {
+  int64_t seen = 0, n;
+  int i;
+
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if ((n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED)) == 0) continue;
+    seen += n;
+    appendf(d, "emma_%s_bucket{%s%sle=\"%.9g\"} %lld\n", name, labels, *labels ? "," : "",
+            bucket_top(i) * scale, (long long)seen);
+  }
+  appendf(d, "emma_%s_bucket{%s%sle=\"+Inf\"} %lld\n", name, labels, *labels ? "," : "", (long long)seen);
+  appendf(d, "emma_%s_sum%s%s%s %.9g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", h->sum * scale);
+  appendf(d, "emma_%s_count%s%s%s %lld\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", (long long)seen);
+}
+
+static void prometheus(struct dump* d) {
+  struct stats_state* s = SHM_STATS;
+  char labels[64];
+  int64_t values = 0, bytes = 0, pages = 0;
+  int i;
+
+  metric(d, "uptime_seconds", "gauge", "Seconds since the server started.", time(NULL) - s->started);
+
+  family(d, "command_duration_seconds", "histogram", "Time to run a command and queue its answer.");
+  for (i = 1; i < STATS_COMMANDS; i++) {
+    sprintf(labels, "command=\"%s\"", COMMAND_NAMES[i]);
+    histogram(d, "command_duration_seconds", labels, &s->commands[i], 1e-9);
+  }
+
+  family(d, "alloc_duration_seconds", "histogram", "Time to find and claim blocks in the db file.");
+  histogram(d, "alloc_duration_seconds", "", &s->alloc, 1e-9);
+  family(d, "alloc_lock_wait_seconds", "histogram", "Time an allocation spent waiting for group locks.");
+  histogram(d, "alloc_lock_wait_seconds", "", &s->alloc_wait, 1e-9);
+  family(d, "alloc_groups_probed", "histogram", "Allocation groups an allocation looked in.");
+  histogram(d, "alloc_groups_probed", "", &s->alloc_probes, 1);
+  metric(d, "alloc_busy_groups_total", "counter", "Groups an allocation passed over because they were locked.", s->alloc_busy);
+  metric(d, "alloc_bitmap_words_scanned_total", "counter", "Bitmap words scanned in groups without treaps.", s->bitmap_words);
+  metric(d, "alloc_failures_total", "counter", "Allocations that found no room.", s->alloc_failures);
+
+  family(d, "io_duration_seconds", "histogram", "Time a read or write of the db file took.");
+  histogram(d, "io_duration_seconds", "op=\"read\"", &s->io[0], 1e-9);
+  histogram(d, "io_duration_seconds", "op=\"write\"", &s->io[1], 1e-9);
+  family(d, "io_bytes_total", "counter", "Bytes read from and written to the db file.");
+  sample(d, "io_bytes_total", "op=\"read\"", s->io_bytes[0]);
+  sample(d, "io_bytes_total", "op=\"write\"", s->io_bytes[1]);
+
+  if (SHM_CACHE != NULL) {
+    metric(d, "cache_hits_total", "counter", "Object cache lookups that found the object.", SHM_CACHE->hits);
+    metric(d, "cache_misses_total", "counter", "Object cache lookups that didn't.", SHM_CACHE->misses);
+    metric(d, "cache_evictions_total", "counter", "Blocks the object cache made room by dropping.", SHM_CACHE->evictions);
+    metric(d, "cache_used_blocks", "gauge", "Blocks held in the object cache.", SHM_CACHE->used);
+  }
+  if (SHM_POOL != NULL) {
+    metric(d, "pool_hits_total", "counter", "Index page lookups the buffer pool answered.", SHM_POOL->hits);
+    metric(d, "pool_misses_total", "counter", "Index page lookups that had to read the page.", SHM_POOL->misses);
+    metric(d, "pool_evictions_total", "counter", "Index pages the buffer pool dropped.", SHM_POOL->evictions);
+    metric(d, "pool_writebacks_total", "counter", "Dirty index pages written back.", SHM_POOL->writebacks);
+  }
+  if (SHM_INDEX != NULL) {
+    metric(d, "index_generation", "counter", "Index changes published.", SHM_INDEX->generation);
+    metric(d, "index_lock_reads_total", "counter", "Index reads that had to take the index lock.", SHM_INDEX->lock_reads);
+    metric(d, "index_writer_waits_total", "counter", "Times a writer waited for readers to move on.", SHM_INDEX->waits);
+    metric(d, "index_retired_pages", "gauge", "Replaced index pages readers may still be on.", SHM_INDEX->retired_count);
+  }
+  if (SHM_WAL != NULL && WAL_FD != -1) {
+    metric(d, "wal_written_bytes_total", "counter", "Bytes appended to the log.", SHM_WAL->write_lsn);
+    metric(d, "wal_flushed_bytes_total", "counter", "Bytes of the log known to be on disk.", SHM_WAL->flushed_lsn);
+  }
+  if (SHM_SLABS != NULL) {
+    for (i = 0; i < SLAB_CLASSES; i++) {
+      values += SHM_SLABS->classes[i].objects;
+      bytes += SHM_SLABS->classes[i].bytes;
+      pages += SHM_SLABS->classes[i].pages;
+    }
+    metric(d, "slab_values", "gauge", "Small values packed into slab pages.", values);
+    metric(d, "slab_bytes", "gauge", "Bytes they take up, headers included.", bytes);
+    metric(d, "slab_pages", "gauge", "Slab pages in use.", pages);
+  }
+  if (SHM_RECLAIM != NULL) {
+    metric(d, "reclaimed_total", "counter", "Deleted objects punched or zeroed.", SHM_RECLAIM->reclaimed);
+    metric(d, "reclaimed_blocks_total", "counter", "Blocks they took up.", SHM_RECLAIM->reclaimed_blocks);
+    metric(d, "reclaim_pending", "gauge", "Deleted objects still waiting.", SHM_RECLAIM->pending);
+  }
+  if (SHM_COMPACT != NULL) {
+    metric(d, "compact_passes_total", "counter", "Compaction passes.", SHM_COMPACT->passes);
+    metric(d, "compact_moved_total", "counter", "Values compaction moved.", SHM_COMPACT->moved);
+    metric(d, "compact_moved_blocks_total", "counter", "Blocks they took up.", SHM_COMPACT->moved_blocks);
+    metric(d, "compact_raced_total", "counter", "Moves given up because the key changed.", SHM_COMPACT->raced);
+    metric(d, "compact_truncated_blocks_total", "counter", "Blocks cut off the end of the db file.", SHM_COMPACT->truncated_blocks);
+    metric(d, "file_blocks", "gauge", "Blocks in the db file, as of the last look.", SHM_COMPACT->file_blocks);
+    metric(d, "file_used_blocks", "gauge", "Of those, blocks in use.", SHM_COMPACT->used_blocks);
+    metric(d, "file_holes", "gauge", "Runs of free blocks before the last one in use.", SHM_COMPACT->holes);
+    metric(d, "file_largest_hole_blocks", "gauge", "The longest of them.", SHM_COMPACT->largest_hole);
+  }
+  if (SHM_BITMAP_FILE != NULL) {
+    metric(d, "bitmap_bytes", "gauge", "Size of the block bitmap file, which grows with the db file.", bitmap_bytes());
+  }
+  if (SHM_SNAPSHOT != NULL) {
+    metric(d, "snapshots_total", "counter", "Snapshots taken.", SHM_SNAPSHOT->taken);
+    metric(d, "snapshots_incremental_total", "counter", "Of those, incremental ones.", SHM_SNAPSHOT->incremental);
+    metric(d, "snapshot_blocks_total", "counter", "Blocks in every snapshot taken.", SHM_SNAPSHOT->blocks);
+    metric(d, "snapshot_data_blocks_total", "counter", "Of those, blocks sent with their bytes.", SHM_SNAPSHOT->data_blocks);
+    metric(d, "snapshot_deferred_frees_total", "counter", "Frees held back while a snapshot was pinned.", SHM_SNAPSHOT->deferred_total);
+    metric(d, "snapshot_pinned", "gauge", "Whether a snapshot is being taken.", snapshot_pinned());
+  }
+}
+
+// Gathers the stats as a summary or as Prometheus text into a buffer
+// for the caller to free. Returns its length, or -1.
+int stats_dump(int format, char** out) {
+  struct dump d = {.size = 4096};
+
+  if (SHM_STATS == NULL) return -1;
+  if ((d.buf = malloc(d.size)) == NULL) {
+    perror("malloc failed in stats_dump()");
+    return -1;
+  }
+  d.buf[0] = '\0';
+  if (format == STATS_PROMETHEUS) prometheus(&d);
+  else summary(&d);
+  if (d.failed) {
+    free(d.buf);
+    return -1;
+  }
+  *out = d.buf;
+  return d.len;
+}
+
+void stats_report(void) {
+  char* text;
+
+  if (stats_dump(STATS_SUMMARY, &text) == -1) return;
+  fputs(text, stderr);
+  free(text);
+}
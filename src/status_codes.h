@@ -1,5 +1,6 @@
 char* STATUS_CODES[] = {
   "OK",
-  "FAIL"
+  "FAIL",
+  "MORE"
 };
 
@@ -0,0 +1,332 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+#include <linux/io_uring.h>
+
+/*
+  Storage backends. Every read and write of the db file goes through
+  here, so -i picks how it is done:
+
+  STORAGE_PREAD  blocking pread/pwrite/preadv/pwritev, one at a time.
+  STORAGE_URING  io_uring. storage_submit() puts a whole batch on the
+                 ring with one io_uring_enter and waits for all of it,
+                 so a batch keeps up to STORAGE_QUEUE_DEPTH requests in
+                 flight instead of one. That all happens inside the
+                 command that asked: it saves syscalls and overlaps one
+                 command's I/O, but a connection still waits for each
+                 command's disk work the same as with pread.
+
+  Each thread, and each forked process, sets up its own ring the first
+  time it needs one. The db file is registered with it as fixed file 0.
+  Memory handed to storage_register() before then, such as the buffer
+  pool's pages, is registered as fixed buffers, and I/O that lands
+  wholly inside it uses READ_FIXED/WRITE_FIXED. Anything else uses plain
+  READ/WRITE, or READV/WRITEV for more than one buffer.
+
+  The ring is set up with raw syscalls, as liburing isn't assumed.
+
+  Every write is noted with snapshot_touch(), so the next incremental
+  snapshot knows which blocks changed, and every read and write is
+  timed for stats.c. A request in a batch on the ring is counted as
+  taking as long as the whole batch.
+*/
+
+#define MAX_REGIONS 4
+
+struct ring {
+  int                   fd;
+  pid_t                 pid;        // A forked child can't use its parent's ring.
+  unsigned              entries;
+  unsigned              *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned              *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe*  sqes;
+  struct io_uring_cqe*  cqes;
+  void*                 sq_ptr;
+  void*                 cq_ptr;
+  size_t                sq_size;
+  size_t                cq_size;
+  int                   fixed_buffers; // The regions are registered.
+};
+
+static __thread struct ring RING = {.fd = -1};
+static struct iovec REGIONS[MAX_REGIONS];
+static int REGION_COUNT = 0;
+
+static void ring_close(void) {
+  if (RING.sqes != NULL) munmap(RING.sqes, RING.entries * sizeof(struct io_uring_sqe));
+  if (RING.cq_ptr != NULL && RING.cq_ptr != RING.sq_ptr) munmap(RING.cq_ptr, RING.cq_size);
+  if (RING.sq_ptr != NULL) munmap(RING.sq_ptr, RING.sq_size);
+  if (RING.fd != -1) close(RING.fd);
+  memset(&RING, '\0', sizeof(RING));
+  RING.fd = -1;
+}
+
+static int ring_open(void) {
+  struct io_uring_params p;
+  char* sq;
+  char* cq;
+
+  memset(&p, '\0', sizeof(p));
+  memset(&RING, '\0', sizeof(RING));
+  if ((RING.fd = syscall(__NR_io_uring_setup, STORAGE_QUEUE_DEPTH, &p)) == -1) {
+    perror("io_uring_setup failed");
+    return -1;
+  }
+  RING.pid = getpid();
+  RING.entries = p.sq_entries;
+
+  RING.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  RING.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (RING.cq_size > RING.sq_size) RING.sq_size = RING.cq_size;
+    RING.cq_size = RING.sq_size;
+  }
+  if ((RING.sq_ptr = mmap((caddr_t)0, RING.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      RING.fd, IORING_OFF_SQ_RING)) == MAP_FAILED) RING.sq_ptr = NULL;
+  if (RING.sq_ptr != NULL && (p.features & IORING_FEAT_SINGLE_MMAP)) RING.cq_ptr = RING.sq_ptr;
+  else if ((RING.cq_ptr = mmap((caddr_t)0, RING.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      RING.fd, IORING_OFF_CQ_RING)) == MAP_FAILED) RING.cq_ptr = NULL;
+  if ((RING.sqes = mmap((caddr_t)0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, RING.fd, IORING_OFF_SQES)) == MAP_FAILED) RING.sqes = NULL;
+  if (RING.sq_ptr == NULL || RING.cq_ptr == NULL || RING.sqes == NULL) {
+    perror("Problem mmapping the io_uring rings");
+    ring_close();
+    return -1;
+  }
+
+  sq = RING.sq_ptr;
+  cq = RING.cq_ptr;
+  RING.sq_head = (unsigned*)(sq + p.sq_off.head);
+  RING.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  RING.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  RING.sq_array = (unsigned*)(sq + p.sq_off.array);
+  RING.cq_head = (unsigned*)(cq + p.cq_off.head);
+  RING.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  RING.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  RING.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  if (syscall(__NR_io_uring_register, RING.fd, IORING_REGISTER_FILES, &DB_FD, 1) == -1) {
+    perror("Couldn't register the db file with io_uring");
+    ring_close();
+    return -1;
+  }
+  // Without fixed buffers everything still works, just with a page
+  // lookup per request.
+  RING.fixed_buffers = REGION_COUNT > 0 &&
+      syscall(__NR_io_uring_register, RING.fd, IORING_REGISTER_BUFFERS, REGIONS, REGION_COUNT) == 0;
+  return 0;
+}
+
+// Returns which registered region holds all of [base, base + len), or -1.
+static int region_of(const void* base, size_t len) {
+  int i;
+
+  for (i = 0; RING.fixed_buffers && i < REGION_COUNT; i++)
+    if ((char*)base >= (char*)REGIONS[i].iov_base &&
+        (char*)base + len <= (char*)REGIONS[i].iov_base + REGIONS[i].iov_len) return i;
+  return -1;
+}
+
+static void prep_sqe(struct io_uring_sqe* sqe, const struct storage_io* io, uint64_t user_data) {
+  int region = (io->iovcnt == 1) ? region_of(io->iov[0].iov_base, io->iov[0].iov_len) : -1;
+
+  memset(sqe, '\0', sizeof(*sqe));
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->off = io->offset;
+  sqe->user_data = user_data;
+  if (io->iovcnt == 1) {
+    sqe->opcode = (region != -1) ? (io->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED)
+                                 : (io->write ? IORING_OP_WRITE : IORING_OP_READ);
+    sqe->addr = (uint64_t)(uintptr_t)io->iov[0].iov_base;
+    sqe->len = io->iov[0].iov_len;
+    if (region != -1) sqe->buf_index = region;
+  } else {
+    sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (uint64_t)(uintptr_t)io->iov;
+    sqe->len = io->iovcnt;
+  }
+}
+
+// Puts count requests on the ring, a ring's worth at a time, and waits
+// for every one of them. If io_uring_enter fails, whatever the kernel
+// hasn't taken yet is taken back off the ring and what it has is still
+// waited for, as it may yet land in the caller's buffers. Those not
+// done get -errno and we return -1.
+static int ring_submit(struct storage_io* ios, int count) {
+  unsigned first, tail, head, mask;
+  int done, n, i, submitted, reaped, rc, failed = 0;
+  struct io_uring_cqe* cqe;
+
+  if (RING.fd != -1 && RING.pid != getpid()) ring_close();
+  if (RING.fd == -1 && ring_open() == -1) return -1;
+
+  for (i = 0; i < count; i++) ios[i].result = -ECANCELED;
+  for (done = 0; done < count && !failed; done += n) {
+    n = (count - done < (int)RING.entries) ? count - done : (int)RING.entries;
+    mask = *RING.sq_mask;
+    first = tail = *RING.sq_tail;
+    for (i = 0; i < n; i++, tail++) {
+      prep_sqe(&RING.sqes[tail & mask], &ios[done + i], i);
+      RING.sq_array[tail & mask] = tail & mask;
+    }
+    __atomic_store_n(RING.sq_tail, tail, __ATOMIC_RELEASE);
+
+    for (submitted = 0, reaped = 0; reaped < (failed ? submitted : n); ) {
+      rc = syscall(__NR_io_uring_enter, RING.fd, failed ? 0 : n - submitted,
+                   (failed ? submitted : n) - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (rc == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter failed");
+        if (failed) {
+          // Can't even wait. Closing the ring cancels what's left.
+          ring_close();
+          break;
+        }
+        failed = errno;
+        submitted = __atomic_load_n(RING.sq_head, __ATOMIC_ACQUIRE) - first;
+        __atomic_store_n(RING.sq_tail, first + submitted, __ATOMIC_RELEASE);
+        continue;
+      }
+      if (rc > 0 && !failed) submitted += rc;
+
+      mask = *RING.cq_mask;
+      head = *RING.cq_head;
+      while (head != __atomic_load_n(RING.cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &RING.cqes[head & mask];
+        ios[done + cqe->user_data].result = cqe->res;
+        head++;
+        reaped++;
+      }
+      __atomic_store_n(RING.cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  if (!failed) return 0;
+  for (i = 0; i < count; i++)
+    if (ios[i].result == -ECANCELED) ios[i].result = -failed;
+  errno = failed;
+  return -1;
+}
+
+static int64_t io_bytes(const struct storage_io* io) {
+  int64_t bytes = 0;
+  int i;
+
+  for (i = 0; i < io->iovcnt; i++) bytes += io->iov[i].iov_len;
+  return bytes;
+}
+
+
+// Picks a backend. Falls back to STORAGE_PREAD if io_uring can't be had.
+int storage_init(int backend) {
+  STORAGE_BACKEND = STORAGE_PREAD;
+  if (backend != STORAGE_URING) return 0;
+
+  if (ring_open() == -1) {
+    fprintf(stderr, "io_uring isn't available. Using pread/pwrite.\n");
+    return 0;
+  }
+  ring_close(); // Just checking. Rings are set up where they're used.
+  STORAGE_BACKEND = STORAGE_URING;
+  return 0;
+}
+
+// Tells rings set up from now on to register len bytes at base as a
+// fixed buffer. Regions must stay mapped for good.
+void storage_register(void* base, size_t len) {
+  if (REGION_COUNT == MAX_REGIONS) return;
+  REGIONS[REGION_COUNT].iov_base = base;
+  REGIONS[REGION_COUNT++].iov_len = len;
+}
+
+// Runs a batch of reads and writes. Each one's result is what
+// preadv/pwritev would have returned, or -errno. Returns -1 if any of
+// them moved fewer bytes than asked.
+int storage_submit(struct storage_io* ios, int count) {
+  int64_t start = stats_clock();
+  int i, rc = 0;
+
+  for (i = 0; i < count; i++)
+    if (ios[i].write) snapshot_touch(ios[i].offset, io_bytes(&ios[i]));
+
+  if (STORAGE_BACKEND == STORAGE_URING) {
+    if (ring_submit(ios, count) == -1) return -1;
+    for (i = 0; i < count; i++) stats_io(ios[i].write, ios[i].result, start);
+  } else {
+    for (i = 0; i < count; i++, start = stats_clock()) {
+      ios[i].result = ios[i].write ? pwritev(DB_FD, ios[i].iov, ios[i].iovcnt, ios[i].offset)
+                                   : preadv(DB_FD, ios[i].iov, ios[i].iovcnt, ios[i].offset);
+      if (ios[i].result == -1) ios[i].result = -errno;
+      stats_io(ios[i].write, ios[i].result, start);
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (ios[i].result < 0) {
+      errno = -ios[i].result;
+      rc = -1;
+    } else if (ios[i].result != io_bytes(&ios[i])) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+ssize_t storage_read(void* buf, size_t len, int64_t offset) {
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct storage_io io = {.write = 0, .offset = offset, .iov = &iov, .iovcnt = 1};
+  int64_t start = stats_clock();
+  ssize_t rc;
+
+  if (STORAGE_BACKEND == STORAGE_PREAD) {
+    rc = pread(DB_FD, buf, len, offset);
+    stats_io(0, rc, start);
+    return rc;
+  }
+  storage_submit(&io, 1);
+  if (io.result < 0) {
+    errno = -io.result;
+    return -1;
+  }
+  return io.result;
+}
+
+ssize_t storage_write(const void* buf, size_t len, int64_t offset) {
+  struct iovec iov = {.iov_base = (void*)buf, .iov_len = len};
+  struct storage_io io = {.write = 1, .offset = offset, .iov = &iov, .iovcnt = 1};
+  int64_t start = stats_clock();
+  ssize_t rc;
+
+  if (STORAGE_BACKEND == STORAGE_PREAD) {
+    snapshot_touch(offset, len);
+    rc = pwrite(DB_FD, buf, len, offset);
+    stats_io(1, rc, start);
+    return rc;
+  }
+  storage_submit(&io, 1);
+  if (io.result < 0) {
+    errno = -io.result;
+    return -1;
+  }
+  return io.result;
+}
@@ -0,0 +1,424 @@
+/*
+Copyright (c) 2019 Joseph Rothrock (rothrock@rothrock.org)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "emma.h"
+
+/*
+  Write-ahead log.
+
+  Every change to the db file or the block bitmap is appended to
+  DATA_HOME/wal before it is made, while the caller still holds the lock
+  that orders it (the allocation group's lock for the bitmap, INDEX_LOCK
+  for index pages). So the log holds changes in the order they really
+  happened, across every process. Single blocks are claimed with a
+  compare-and-swap instead, and logged as soon as the claim succeeds;
+  nobody else can touch the block until then.
+
+  Nothing but the log is synced while we run. A command calls
+  wal_commit() before it answers the client, and waits until the log is
+  on disk past its last record. One waiter leads each batch and pays for
+  a single fdatasync on behalf of everyone waiting with it.
+
+  Index changes span several pages, so they are wrapped in WAL_INDEX_BEGIN
+  and WAL_INDEX_END. At startup wal_replay() re-applies every complete
+  record and drops an index change that never finished. Blocks an index
+  change frees are only given back after its WAL_INDEX_END, so nothing
+  later in the log can depend on a change that gets dropped.
+
+  Once the log passes WAL_CHECKPOINT_BYTES, a checkpoint syncs the db file
+  and the bitmap and starts the log over. A write is logged first and
+  made after, with no lock held in between, so writers count themselves
+  in with wal_write_begin() before they log and out with
+  wal_write_done() once the write is made. A checkpoint that finds any
+  still in flight, or anything else that needs the log kept, gives up
+  and tries again WAL_CHECKPOINT_RETRY_MS later.
+*/
+
+struct wal_record {
+  uint32_t  crc;      // Covers the rest of the header and the data.
+  uint32_t  type;
+  uint32_t  data_len; // Bytes of data following the header.
+  uint32_t  owner;    // Who appended it, so an index change can be picked out.
+  int64_t   offset;   // Byte offset for writes, block offset for the allocator.
+  int64_t   count;    // Bytes to zero, or blocks to allocate or free.
+};
+
+static uint32_t CRC_TABLE[256];
+static __thread int64_t LAST_LSN = 0; // End of the last record this thread appended.
+
+
+static void crc_init(void) {
+  uint32_t c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    CRC_TABLE[i] = c;
+  }
+}
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char* p = buf;
+
+  crc = ~crc;
+  while (len--) crc = CRC_TABLE[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t record_crc(struct wal_record *rec, const void *data) {
+  uint32_t crc;
+
+  crc = crc32(0, (char*)rec + sizeof(uint32_t), sizeof(struct wal_record) - sizeof(uint32_t));
+  if (rec->data_len > 0) crc = crc32(crc, data, rec->data_len);
+  return crc;
+}
+
+static int64_t now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Adds a record to the end of the log.
+int wal_append(int type, int64_t offset, int64_t count, const void *data, uint32_t data_len) {
+
+  struct wal_record rec;
+  struct iovec iov[2];
+  ssize_t rc, expected = sizeof(rec) + data_len;
+
+  if (WAL_FD == -1) return 0;
+
+  memset(&rec, '\0', sizeof(rec));
+  rec.type = type;
+  rec.data_len = data_len;
+  rec.offset = offset;
+  rec.count = count;
+  rec.owner = syscall(SYS_gettid);
+  rec.crc = record_crc(&rec, data);
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = data_len;
+
+  sem_wait(WAL_LOCK);
+  rc = pwritev(WAL_FD, iov, data_len > 0 ? 2 : 1, SHM_WAL->write_lsn - SHM_WAL->base_lsn);
+  if (rc != expected) {
+    sem_post(WAL_LOCK);
+    perror("pwritev failed in wal_append");
+    return -1;
+  }
+  SHM_WAL->write_lsn += expected;
+  LAST_LSN = SHM_WAL->write_lsn;
+  sem_post(WAL_LOCK);
+
+  return 0;
+}
+
+// Whether anything still needs what's in the log. Blocks waiting to be
+// reclaimed, the old copies of values being compacted, index pages
+// readers may still be on, and blocks a snapshot is holding back, are
+// only free in the log, and writes in flight are only in it.
+static int log_needed(void) {
+  return __atomic_load_n(&SHM_WAL->writing, __ATOMIC_SEQ_CST) != 0 ||
+      (SHM_INDEX != NULL && __atomic_load_n(&SHM_INDEX->pending, __ATOMIC_SEQ_CST) != 0) ||
+      (SHM_RECLAIM != NULL && __atomic_load_n(&SHM_RECLAIM->pending, __ATOMIC_SEQ_CST) != 0) ||
+      (SHM_COMPACT != NULL && __atomic_load_n(&SHM_COMPACT->pending, __ATOMIC_SEQ_CST) != 0) ||
+      (SHM_SNAPSHOT != NULL && __atomic_load_n(&SHM_SNAPSHOT->pending, __ATOMIC_SEQ_CST) != 0);
+}
+
+// Syncs the db file, with the index pages still in the buffer pool, and
+// the bitmap, then empties the log. Only one process tries at a time,
+// and none for WAL_CHECKPOINT_RETRY_MS after a try that was held off.
+static void wal_checkpoint(void) {
+  int64_t now = now_msec(), next = __atomic_load_n(&SHM_WAL->next_checkpoint_ms, __ATOMIC_SEQ_CST);
+
+  if (now < next || !__atomic_compare_exchange_n(&SHM_WAL->next_checkpoint_ms, &next, now + WAL_CHECKPOINT_RETRY_MS,
+      0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+
+  // Don't take every lock just to find out it has to wait.
+  if (log_needed()) return;
+
+  sem_wait(INDEX_LOCK);
+  btree_release_pages(INDEX_WAIT_MS);
+  alloc_lock_all();
+  sem_wait(WAL_LOCK);
+
+  // With WAL_LOCK held nothing new can be logged, so a writer that
+  // hasn't counted itself in yet will log after the log starts over. A
+  // meta block still in the pool waits on the log, so sync that first.
+  if (SHM_WAL->write_lsn - SHM_WAL->base_lsn >= WAL_CHECKPOINT_BYTES && !log_needed() &&
+      fdatasync(WAL_FD) == 0 && pool_flush() == 0) {
+    fsync(DB_FD);
+    msync(SHM_BLOCK_BITMAP, bitmap_bytes(), MS_SYNC);
+    if (ftruncate(WAL_FD, 0) == -1) perror("ftruncate failed in wal_checkpoint");
+    fdatasync(WAL_FD);
+    SHM_WAL->base_lsn = SHM_WAL->write_lsn;
+    __atomic_store_n(&SHM_WAL->flushed_lsn, SHM_WAL->write_lsn, __ATOMIC_RELEASE);
+    __atomic_store_n(&SHM_WAL->next_checkpoint_ms, 0, __ATOMIC_SEQ_CST);
+  }
+
+  sem_post(WAL_LOCK);
+  alloc_unlock_all();
+  sem_post(INDEX_LOCK);
+}
+
+// Syncs the log up to whatever has been appended so far. Called with
+// WAL_SYNC_LOCK held.
+static void sync_log(void) {
+  int64_t target;
+
+  sem_wait(WAL_LOCK);
+  target = SHM_WAL->write_lsn;
+  sem_post(WAL_LOCK);
+
+  if (target > __atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE)) {
+    if (fdatasync(WAL_FD) == -1) {
+      perror("fdatasync failed on the log");
+      return;
+    }
+    __atomic_store_n(&SHM_WAL->flushed_lsn, target, __ATOMIC_RELEASE);
+  }
+  SHM_WAL->last_sync_ms = now_msec();
+}
+
+// Counts in a write about to be logged, before its record is appended.
+// Pairs with wal_write_done() once the write itself is made.
+void wal_write_begin(void) {
+  if (SHM_WAL != NULL) __atomic_add_fetch(&SHM_WAL->writing, 1, __ATOMIC_SEQ_CST);
+}
+
+void wal_write_done(void) {
+  if (SHM_WAL != NULL) __atomic_sub_fetch(&SHM_WAL->writing, 1, __ATOMIC_SEQ_CST);
+}
+
+// Makes sure the log is on disk up to lsn, for work that can't wait for
+// a command to sync it. Returns -1 if it couldn't be.
+int wal_sync(int64_t lsn) {
+  if (WAL_FD == -1 || __atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE) >= lsn) return 0;
+
+  sem_wait(WAL_SYNC_LOCK);
+  if (__atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE) < lsn) sync_log();
+  sem_post(WAL_SYNC_LOCK);
+  return (__atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE) >= lsn) ? 0 : -1;
+}
+
+// Waits until everything this thread has logged is on disk, as far
+// as the sync mode asks for.
+void wal_commit(void) {
+
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 50000};
+  struct timespec batch;
+
+  if (WAL_FD == -1) return;
+
+  batch.tv_sec = SHM_WAL->interval_ms / 1000;
+  batch.tv_nsec = (SHM_WAL->interval_ms % 1000) * 1000000L;
+
+  if (SHM_WAL->mode == SYNC_ASYNC) {
+    if (now_msec() - SHM_WAL->last_sync_ms >= SHM_WAL->interval_ms && sem_trywait(WAL_SYNC_LOCK) == 0) {
+      sync_log();
+      sem_post(WAL_SYNC_LOCK);
+    }
+  } else {
+    while (__atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE) < LAST_LSN) {
+      if (sem_trywait(WAL_SYNC_LOCK) == 0) { // Lead this batch.
+        if (SHM_WAL->mode == SYNC_GROUP && __atomic_load_n(&SHM_WAL->flushed_lsn, __ATOMIC_ACQUIRE) < LAST_LSN)
+          nanosleep(&batch, NULL);
+        sync_log();
+        sem_post(WAL_SYNC_LOCK);
+      } else {
+        nanosleep(&nap, NULL);
+      }
+    }
+  }
+
+  // A checkpoint waits for index readers, so one can't be done from
+  // inside a read. The next commit will get to it.
+  if (SHM_WAL->write_lsn - SHM_WAL->base_lsn >= WAL_CHECKPOINT_BYTES && !btree_reading()) wal_checkpoint();
+}
+
+
+static int apply_record(struct wal_record *rec, const char *data) {
+  char zeros[BLOCK_SIZE];
+  int64_t done, n;
+  int i;
+
+  switch (rec->type) {
+
+    case WAL_WRITE:
+      if (pwrite(DB_FD, data, rec->data_len, rec->offset) != rec->data_len) return -1;
+      break;
+
+    case WAL_ZERO:
+      memset(zeros, '\0', BLOCK_SIZE);
+      for (done = 0; done < rec->count; done += n) {
+        n = (rec->count - done < BLOCK_SIZE) ? rec->count - done : BLOCK_SIZE;
+        if (pwrite(DB_FD, zeros, n, rec->offset + done) != n) return -1;
+      }
+      break;
+
+    case WAL_ALLOC:
+      if (bitmap_cover(rec->offset + rec->count) == -1) return -1;
+      for (i = 0; i < rec->count; i++) bit_array_set(SHM_BLOCK_BITMAP, rec->offset + i);
+      break;
+
+    case WAL_FREE:
+      if (bitmap_cover(rec->offset + rec->count) == -1) return -1;
+      for (i = 0; i < rec->count; i++) bit_array_clear(SHM_BLOCK_BITMAP, rec->offset + i);
+      break;
+  }
+  return 0;
+}
+
+// Re-applies the log to the db file and the bitmap after a crash. Must
+// run before anything else touches either of them.
+int wal_replay(const char *wal_file) {
+
+  struct wal_record rec;
+  struct wal_record* held = NULL; // Records of an index change waiting for its end.
+  char** held_data = NULL;
+  int held_count = 0, held_size = 0, in_index = 0;
+  uint32_t index_owner = 0;
+  int64_t pos = 0, applied = 0;
+  char* data;
+  int fd, i, rc = 0;
+
+  crc_init();
+
+  if ((fd = open(wal_file, O_RDONLY)) == -1) return (errno == ENOENT) ? 0 : -1;
+
+  while (pread(fd, &rec, sizeof(rec), pos) == sizeof(rec)) {
+    data = NULL;
+    if (rec.data_len > 0) {
+      if ((data = malloc(rec.data_len)) == NULL) {
+        perror("malloc failed in wal_replay()");
+        rc = -1;
+        break;
+      }
+      if (pread(fd, data, rec.data_len, pos + sizeof(rec)) != rec.data_len) {
+        free(data);
+        break;
+      }
+    }
+    if (rec.crc != record_crc(&rec, data)) { // A torn write at the tail.
+      free(data);
+      break;
+    }
+    pos += sizeof(rec) + rec.data_len;
+
+    // Changes take INDEX_LOCK, so a new one starting means any still
+    // held never finished. Drop it.
+    if (rec.type == WAL_INDEX_BEGIN) {
+      for (i = 0; i < held_count; i++) free(held_data[i]);
+      held_count = 0;
+      in_index = 1;
+      index_owner = rec.owner;
+      free(data);
+      continue;
+    }
+
+    if (rec.type == WAL_INDEX_END) {
+      if (!in_index || rec.owner != index_owner) { // Not the end of the change being held.
+        free(data);
+        continue;
+      }
+      for (i = 0; i < held_count; i++) {
+        if (apply_record(&held[i], held_data[i]) == -1) rc = -1;
+        free(held_data[i]);
+      }
+      applied += held_count;
+      held_count = 0;
+      in_index = 0;
+      free(data);
+      continue;
+    }
+
+    if (in_index && rec.owner == index_owner) {
+      if (held_count == held_size) {
+        held_size = held_size ? held_size * 2 : 16;
+        held = realloc(held, held_size * sizeof(struct wal_record));
+        held_data = realloc(held_data, held_size * sizeof(char*));
+        if (held == NULL || held_data == NULL) {
+          perror("realloc failed in wal_replay()");
+          rc = -1;
+          break;
+        }
+      }
+      held[held_count] = rec;
+      held_data[held_count++] = data;
+      continue;
+    }
+
+    if (apply_record(&rec, data) == -1) rc = -1;
+    applied++;
+    free(data);
+  }
+
+  // Whatever index change is still held never finished. Drop it.
+  for (i = 0; i < held_count; i++) free(held_data[i]);
+  free(held);
+  free(held_data);
+  close(fd);
+
+  if (applied > 0) fprintf(stderr, "Replayed %lld log records.\n", (long long)applied);
+  if (rc == -1) {
+    perror("Problem replaying the log");
+    return -1;
+  }
+
+  fsync(DB_FD);
+  msync(SHM_BLOCK_BITMAP, bitmap_bytes(), MS_SYNC);
+  return 0;
+}
+
+// Opens a fresh log. Runs after wal_replay().
+int wal_init(const char *wal_file, int mode, int interval_ms) {
+
+  if ((SHM_WAL = mmap((caddr_t)0, sizeof(struct wal_state), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+    perror("Problem mmapping the log state");
+    return -1;
+  }
+  memset(SHM_WAL, '\0', sizeof(struct wal_state));
+  SHM_WAL->mode = mode;
+  SHM_WAL->interval_ms = interval_ms;
+
+  crc_init();
+
+  if ((WAL_FD = open(wal_file, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1) {
+    fprintf(stderr, "Couldn't open log file %s\n", wal_file);
+    perror(NULL);
+    return -1;
+  }
+  fdatasync(WAL_FD);
+
+  sem_unlink("wal_lock");
+  sem_unlink("wal_sync_lock");
+  if ((WAL_LOCK = sem_open("wal_lock", O_CREAT, 0666, 1)) == SEM_FAILED ||
+      (WAL_SYNC_LOCK = sem_open("wal_sync_lock", O_CREAT, 0666, 1)) == SEM_FAILED) {
+    perror("semaphore init failed");
+    return -1;
+  }
+  return 0;
+}